@@ -0,0 +1,28 @@
+#!/bin/bash
+# Compare http::Server throughput and p99 latency on epoll and io_uring.
+# Builds http_bench twice (build-bench-epoll, build-bench-uring) and runs
+# each build alternately so both see the same machine state.
+#
+# usage: bench/compare_io_backends.sh [runs] [http_bench options...]
+#   e.g. bench/compare_io_backends.sh 3 --connections 256 --threads 4
+
+set -e
+
+RUNS="${1:-3}"
+shift || true
+
+for backend in epoll uring; do
+    if [ "$backend" = "uring" ]; then
+        URING=ON
+    else
+        URING=OFF
+    fi
+    cmake -S . -B "build-bench-$backend" -DCMAKE_BUILD_TYPE=Release -DASCIIMMO_USE_IO_URING=$URING > /dev/null
+    cmake --build "build-bench-$backend" --target http_bench -j"$(nproc)" > /dev/null
+done
+
+for run in $(seq 1 "$RUNS"); do
+    for backend in epoll uring; do
+        "build-bench-$backend/http_bench" "$@"
+    done
+done
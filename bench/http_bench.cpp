@@ -0,0 +1,195 @@
+// Throughput and latency benchmark for http::Server.
+//
+// Runs a server in-process on the Asio backend this build was configured
+// with, and drives it from blocking keep-alive client connections, one thread
+// each. Blocking sockets bypass the reactor, so only the server side differs
+// between an epoll build and an ASCIIMMO_USE_IO_URING build.
+//
+// usage: http_bench [--connections N] [--threads N] [--seconds N]
+//                   [--warmup N] [--body BYTES]
+//
+// Prints one line of key=value pairs so runs are easy to compare.
+
+#include "shared/http_server.hpp"
+#include "shared/metrics.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace asciimmo::http;
+using asciimmo::metrics::LatencyHistogram;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    int connections = 64;
+    int threads = 1;
+    int seconds = 10;
+    int warmup = 2;
+    std::size_t body = 64;
+};
+
+void print_usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n";
+    std::cerr << "  --connections N  Keep-alive client connections (default: 64)\n";
+    std::cerr << "  --threads N      Server io_context threads (default: 1)\n";
+    std::cerr << "  --seconds N      Measured duration (default: 10)\n";
+    std::cerr << "  --warmup N       Unmeasured seconds before that (default: 2)\n";
+    std::cerr << "  --body BYTES     Response body size (default: 64)\n";
+}
+
+struct ClientResult {
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+};
+
+// One connection sending GET /bench back to back until stop
+void run_client(unsigned short port, const std::atomic<bool>& measuring, const std::atomic<bool>& stop,
+                LatencyHistogram& latency, ClientResult& result) {
+    try {
+        net::io_context ioc;
+        tcp::socket socket(ioc);
+        socket.connect(tcp::endpoint(net::ip::address_v4::loopback(), port));
+        socket.set_option(tcp::no_delay(true));
+
+        beast::http::request<beast::http::empty_body> req{ beast::http::verb::get, "/bench", 11 };
+        req.set(beast::http::field::host, "localhost");
+        req.keep_alive(true);
+
+        beast::flat_buffer buffer;
+        while (!stop.load(std::memory_order_relaxed)) {
+            const auto start = Clock::now();
+            beast::http::write(socket, req);
+            beast::http::response<beast::http::string_body> res;
+            beast::http::read(socket, buffer, res);
+            const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+
+            if (!measuring.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            if (res.result() != beast::http::status::ok) {
+                ++result.errors;
+                continue;
+            }
+            ++result.requests;
+            latency.record(static_cast<uint64_t>(elapsed.count()));
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "client: " << e.what() << "\n";
+        ++result.errors;
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--connections") {
+            opts.connections = std::atoi(argv[++i]);
+        }
+        else if (arg == "--threads") {
+            opts.threads = std::atoi(argv[++i]);
+        }
+        else if (arg == "--seconds") {
+            opts.seconds = std::atoi(argv[++i]);
+        }
+        else if (arg == "--warmup") {
+            opts.warmup = std::atoi(argv[++i]);
+        }
+        else if (arg == "--body") {
+            opts.body = static_cast<std::size_t>(std::atoll(argv[++i]));
+        }
+        else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.connections < 1 || opts.threads < 1 || opts.seconds < 1 || opts.warmup < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Admission control would skew a saturation benchmark, so turn it off
+    ServerOptions server_opts;
+    server_opts.max_connections = static_cast<std::size_t>(opts.connections) + 16;
+    server_opts.max_queue_delay = std::chrono::hours(1);
+
+    net::io_context ioc{ opts.threads };
+    Server svr(ioc, 0, server_opts);
+    const std::string body(opts.body, 'x');
+    svr.get("/bench", [&body](const Request&, Response& res, const std::smatch&) {
+        res.result(beast::http::status::ok);
+        res.set(beast::http::field::content_type, "text/plain");
+        res.body() = body;
+        res.prepare_payload();
+    });
+    svr.run();
+
+    std::vector<std::thread> server_threads;
+    for (int i = 0; i < opts.threads; ++i) {
+        server_threads.emplace_back([&ioc]() { ioc.run(); });
+    }
+
+    std::atomic<bool> measuring{ false };
+    std::atomic<bool> stop{ false };
+    std::vector<LatencyHistogram> latencies(static_cast<std::size_t>(opts.connections));
+    std::vector<ClientResult> results(static_cast<std::size_t>(opts.connections));
+    std::vector<std::thread> clients;
+    for (int i = 0; i < opts.connections; ++i) {
+        clients.emplace_back(run_client, svr.port(), std::cref(measuring), std::cref(stop),
+                             std::ref(latencies[i]), std::ref(results[i]));
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(opts.warmup));
+    const auto start = Clock::now();
+    measuring = true;
+    std::this_thread::sleep_for(std::chrono::seconds(opts.seconds));
+    measuring = false;
+    const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    stop = true;
+    for (auto& client : clients) {
+        client.join();
+    }
+    svr.stop();
+    ioc.stop();
+    for (auto& thread : server_threads) {
+        thread.join();
+    }
+
+    LatencyHistogram::Snapshot merged{};
+    ClientResult total;
+    for (std::size_t i = 0; i < latencies.size(); ++i) {
+        latencies[i].add_to(merged);
+        total.requests += results[i].requests;
+        total.errors += results[i].errors;
+    }
+
+    std::cout << "backend=" << kIoBackend
+              << " connections=" << opts.connections
+              << " threads=" << opts.threads
+              << " body=" << opts.body
+              << " requests=" << total.requests
+              << " errors=" << total.errors
+              << " rps=" << static_cast<uint64_t>(static_cast<double>(total.requests) / elapsed)
+              << " p50_us=" << LatencyHistogram::quantile(merged, 0.5)
+              << " p99_us=" << LatencyHistogram::quantile(merged, 0.99)
+              << " p999_us=" << LatencyHistogram::quantile(merged, 0.999)
+              << "\n";
+    return total.errors == 0 ? 0 : 1;
+}
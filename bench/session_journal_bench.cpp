@@ -0,0 +1,143 @@
+// How long session-service takes to restore its sessions from a journal.
+//
+// Writes --sessions sessions through SessionJournal in the store's batches,
+// compacts all but the last --tail of them into a snapshot, touches a slice
+// of the rest, then times opening the journal and replaying it into a
+// SessionStore, as session-service does at startup. Run it twice to see the
+// difference the page cache makes.
+//
+// usage: session_journal_bench [--sessions N] [--tail N] [--data BYTES] [--dir PATH]
+//
+// Prints one line of key=value pairs.
+
+#include "shared/session_journal.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace asciimmo::session;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    std::size_t sessions = 1000000;
+    std::size_t tail = 100000;
+    std::size_t data = 64;
+    std::string dir = "/tmp/session_journal_bench";
+};
+
+void print_usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n";
+    std::cerr << "  --sessions N  Live sessions to restore (default: 1000000)\n";
+    std::cerr << "  --tail N      Of those, how many are only in the journal (default: 100000)\n";
+    std::cerr << "  --data BYTES  Session data size (default: 64)\n";
+    std::cerr << "  --dir PATH    Where to write the journal (default: /tmp/session_journal_bench)\n";
+}
+
+double ms_since(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--sessions") {
+            opts.sessions = static_cast<std::size_t>(std::atoll(argv[++i]));
+        }
+        else if (arg == "--tail") {
+            opts.tail = static_cast<std::size_t>(std::atoll(argv[++i]));
+        }
+        else if (arg == "--data") {
+            opts.data = static_cast<std::size_t>(std::atoll(argv[++i]));
+        }
+        else if (arg == "--dir") {
+            opts.dir = argv[++i];
+        }
+        else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.sessions < 1 || opts.tail > opts.sessions) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::filesystem::remove_all(opts.dir);
+    JournalOptions journal_options;
+    journal_options.directory = opts.dir;
+    journal_options.fsync = FsyncPolicy::never;
+
+    const auto write_start = Clock::now();
+    {
+        SessionJournal journal(journal_options);
+        std::mt19937_64 rng(42);
+        const std::string data(opts.data, 'x');
+        const auto expires = std::chrono::system_clock::now() + std::chrono::minutes(15);
+        std::vector<SessionWrite> batch;
+        std::vector<uint64_t> touched;
+        for (std::size_t i = 0; i < opts.sessions; ++i) {
+            const uint64_t token = rng() >> 1;
+            batch.push_back({ SessionWrite::Kind::upsert, SessionRecord{ token, i, data, expires }, std::to_string(token) });
+            if (i >= opts.sessions - opts.tail && i % 4 == 0) {
+                touched.push_back(token);
+            }
+            if (batch.size() == 512 || i + 1 == opts.sessions) {
+                journal.write(batch);
+                batch.clear();
+            }
+            if (i + 1 == opts.sessions - opts.tail) {
+                journal.compact();
+            }
+        }
+        for (std::size_t done = 0; done < touched.size(); done += 512) {
+            const std::size_t count = std::min<std::size_t>(512, touched.size() - done);
+            journal.touch(std::span<const uint64_t>(touched).subspan(done, count), std::chrono::system_clock::now(),
+                          expires + std::chrono::minutes(5));
+        }
+    }
+    const double write_ms = ms_since(write_start);
+
+    const auto open_start = Clock::now();
+    SessionJournal journal(journal_options);
+    const double open_ms = ms_since(open_start);
+    const auto stats = journal.stats();
+
+    SessionStore store(StoreOptions{}, &journal);
+    const auto replay_start = Clock::now();
+    store.reserve(journal.expected_sessions());
+    SessionStore::Restorer restorer(store);
+    const std::size_t restored = journal.replay([&restorer](const JournaledSession& session) {
+        restorer.add(session.token, session.token_id, session.data, session.expires_at);
+    });
+    restorer.commit();
+    const double replay_ms = ms_since(replay_start);
+
+    std::cout << "sessions=" << opts.sessions
+              << " restored=" << restored
+              << " snapshot_bytes=" << stats.snapshot_bytes
+              << " journal_bytes=" << stats.journal_bytes
+              << " write_ms=" << write_ms
+              << " open_ms=" << open_ms
+              << " replay_ms=" << replay_ms
+              << " total_ms=" << open_ms + replay_ms
+              << "\n";
+    std::filesystem::remove_all(opts.dir);
+    return restored == opts.sessions ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+// Contention benchmark for auth::TokenCache.
+//
+// Preloads the cache, then has 1, 2, 4 ... up to --max-threads threads
+// validate random live tokens as fast as they can, with a share of the
+// operations re-registering a token instead. The same run against a single
+// mutex-guarded map shows what sharding buys.
+//
+// usage: token_cache_bench [--tokens N] [--max-threads N] [--millis N]
+//                          [--write-percent N]
+//
+// Prints one line of key=value pairs per cache and thread count.
+
+#include "shared/token_cache.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace asciimmo::auth;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    std::size_t tokens = 100000;
+    int max_threads = 32;
+    int millis = 500;
+    int write_percent = 1;
+};
+
+void print_usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n";
+    std::cerr << "  --tokens N         Live tokens in the cache (default: 100000)\n";
+    std::cerr << "  --max-threads N    Largest thread count to run (default: 32)\n";
+    std::cerr << "  --millis N         Measured time per run (default: 500)\n";
+    std::cerr << "  --write-percent N  Operations that add a token (default: 1)\n";
+}
+
+// The cache as it was before sharding: one map behind one mutex
+class SingleLockCache {
+public:
+    void add_token(uint64_t token, int expirationMinutes) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        cache_[token] = TokenInfo{ Clock::now() + std::chrono::minutes(expirationMinutes), false };
+    }
+
+    bool validate_token(uint64_t token) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = cache_.find(token);
+        return it != cache_.end() && it->second.is_valid();
+    }
+
+private:
+    std::unordered_map<uint64_t, TokenInfo> cache_;
+    std::mutex mtx_;
+};
+
+template <class Cache>
+void run(const char* name, Cache& cache, const std::vector<uint64_t>& tokens, const Options& opts) {
+    for (int threads = 1; threads <= opts.max_threads; threads *= 2) {
+        std::atomic<bool> stop{ false };
+        std::atomic<uint64_t> ops{ 0 };
+        std::atomic<uint64_t> misses{ 0 };
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                std::mt19937_64 rng(static_cast<uint64_t>(t) + 1);
+                uint64_t local_ops = 0;
+                uint64_t local_misses = 0;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    const uint64_t token = tokens[rng() % tokens.size()];
+                    if (static_cast<int>(rng() % 100) < opts.write_percent) {
+                        cache.add_token(token, 15);
+                    }
+                    else if (!cache.validate_token(token)) {
+                        ++local_misses;
+                    }
+                    ++local_ops;
+                }
+                ops += local_ops;
+                misses += local_misses;
+            });
+        }
+
+        const auto start = Clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(opts.millis));
+        stop = true;
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::cout << "cache=" << name
+                  << " threads=" << threads
+                  << " ops=" << ops.load()
+                  << " misses=" << misses.load()
+                  << " ops_per_sec=" << static_cast<uint64_t>(static_cast<double>(ops.load()) / elapsed)
+                  << "\n";
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--tokens") {
+            opts.tokens = static_cast<std::size_t>(std::atoll(argv[++i]));
+        }
+        else if (arg == "--max-threads") {
+            opts.max_threads = std::atoi(argv[++i]);
+        }
+        else if (arg == "--millis") {
+            opts.millis = std::atoi(argv[++i]);
+        }
+        else if (arg == "--write-percent") {
+            opts.write_percent = std::atoi(argv[++i]);
+        }
+        else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.tokens < 1 || opts.max_threads < 1 || opts.millis < 1 || opts.write_percent < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> tokens(opts.tokens);
+    for (auto& token : tokens) {
+        token = rng();
+    }
+
+    SingleLockCache single;
+    TokenCache sharded;
+    for (uint64_t token : tokens) {
+        single.add_token(token, 15);
+    }
+    sharded.add_tokens(tokens);
+
+    run("single_lock", single, tokens, opts);
+    run("sharded", sharded, tokens, opts);
+    return 0;
+}
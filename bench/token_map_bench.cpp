@@ -0,0 +1,148 @@
+// Lookup latency and memory of FlatTokenMap against std::unordered_map.
+//
+// Fills each map with --tokens random tokens, then looks up a shuffled mix
+// of present and absent tokens. Memory is what each map holds on the heap:
+// counted through an allocator for std::unordered_map, and reported by
+// FlatTokenMap itself.
+//
+// usage: token_map_bench [--tokens N] [--lookups N]
+//
+// Prints one line of key=value pairs per map.
+
+#include "shared/flat_token_map.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace asciimmo::auth;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    std::size_t tokens = 1000000;
+    std::size_t lookups = 10000000;
+};
+
+void print_usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n";
+    std::cerr << "  --tokens N   Live tokens in each map (default: 1000000)\n";
+    std::cerr << "  --lookups N  Timed lookups, half of absent tokens (default: 10000000)\n";
+}
+
+std::size_t allocated = 0;
+
+// Counts the bytes a container holds
+template <class T>
+struct CountingAllocator {
+    using value_type = T;
+
+    CountingAllocator() = default;
+    template <class U>
+    CountingAllocator(const CountingAllocator<U>&) {}
+
+    T* allocate(std::size_t n) {
+        allocated += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) {
+        allocated -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <class U>
+    bool operator==(const CountingAllocator<U>&) const { return true; }
+};
+
+// The value TokenCache stores: expiry and admin flag
+struct Info {
+    Clock::time_point expires_at;
+    bool isAdmin;
+};
+
+using NodeMap = std::unordered_map<uint64_t, Info, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                                   CountingAllocator<std::pair<const uint64_t, Info>>>;
+
+template <class Find>
+void report(const char* name, std::size_t bytes, std::size_t tokens, const std::vector<uint64_t>& probes, Find&& find) {
+    uint64_t found = 0;
+    const auto start = Clock::now();
+    for (uint64_t token : probes) {
+        found += find(token) ? 1 : 0;
+    }
+    const auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+    std::cout << "map=" << name
+              << " tokens=" << tokens
+              << " lookups=" << probes.size()
+              << " found=" << found
+              << " ns_per_lookup=" << elapsed / static_cast<double>(probes.size())
+              << " bytes=" << bytes
+              << " bytes_per_entry=" << static_cast<double>(bytes) / static_cast<double>(tokens)
+              << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--tokens") {
+            opts.tokens = static_cast<std::size_t>(std::atoll(argv[++i]));
+        }
+        else if (arg == "--lookups") {
+            opts.lookups = static_cast<std::size_t>(std::atoll(argv[++i]));
+        }
+        else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.tokens < 1 || opts.lookups < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> tokens(opts.tokens);
+    for (auto& token : tokens) {
+        token = rng();
+    }
+    std::vector<uint64_t> probes(opts.lookups);
+    for (std::size_t i = 0; i < probes.size(); ++i) {
+        probes[i] = i % 2 == 0 ? tokens[rng() % tokens.size()] : rng();
+    }
+
+    const auto expires = Clock::now() + std::chrono::minutes(15);
+    {
+        NodeMap map;
+        for (uint64_t token : tokens) {
+            map[token] = Info{ expires, false };
+        }
+        report("unordered_map", allocated, map.size(), probes,
+               [&map](uint64_t token) { return map.find(token) != map.end(); });
+    }
+
+    FlatTokenMap flat;
+    for (uint64_t token : tokens) {
+        flat.try_emplace(token, expires.time_since_epoch().count() * 2);
+    }
+    report("flat", flat.memory_bytes(), flat.size(), probes,
+           [&flat](uint64_t token) { return flat.find(token) != nullptr; });
+    return 0;
+}
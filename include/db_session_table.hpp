@@ -0,0 +1,18 @@
+#pragma once
+#include <memory>
+#include "db_config.hpp"
+#include "shared/session_store.hpp"
+
+namespace asciimmo {
+namespace db {
+
+// The sessions table as a SessionStore backend. Session data is kept as a
+// JSON string, so any body a client stored round-trips unchanged, and a
+// user_id that doesn't name a user is stored as NULL rather than failing
+// the batch it is in.
+//
+// Opens its own connection pool; throws if the database can't be reached.
+std::unique_ptr<session::SessionBackend> open_session_table(const Config& config);
+
+} // namespace db
+} // namespace asciimmo
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace asciimmo
+{
+namespace auth
+{
+
+// Open-addressing hash map from a 64-bit token to a 64-bit value, laid out
+// for TokenCache: entries are 16 bytes, stored inline in one array, with a
+// parallel array of one control byte per slot.
+//
+// A control byte is either kEmpty or 7 bits of the key's hash. Lookups
+// probe linearly from the key's home slot, comparing 16 control bytes at a
+// time (one SSE2 compare where available), and only read an entry whose
+// hash bits match. The first 16 control bytes are mirrored past the end so
+// a group read never has to wrap.
+//
+// Erasing shifts later entries of the probe run back into the hole instead
+// of leaving a tombstone, so lookups never slow down as tokens come and go.
+// The table doubles once it is three quarters full.
+//
+// One writer at a time; TokenCache guards each map with its shard's lock.
+// find_racing() may run alongside that writer, for a caller that checks
+// afterwards whether a write overlapped it (TokenCache's shard sequence).
+// Slots are written with atomic stores for it, and tables the map outgrew
+// are kept, since a reader may still be probing one. Together they never
+// take more than the current table does.
+class FlatTokenMap
+    {
+    public:
+        struct Entry
+            {
+            uint64_t key;
+            int64_t value;
+            };
+
+        FlatTokenMap() = default;
+
+        FlatTokenMap(FlatTokenMap&& other) noexcept
+            : tables_(std::move(other.tables_))
+            , current_(other.current_.exchange(nullptr, std::memory_order_relaxed))
+            , entries_(std::exchange(other.entries_, nullptr))
+            , ctrl_(std::exchange(other.ctrl_, nullptr))
+            , mask_(std::exchange(other.mask_, 0))
+            , size_(std::exchange(other.size_, 0))
+            {}
+
+        FlatTokenMap& operator=(FlatTokenMap&& other) noexcept
+            {
+            tables_ = std::move(other.tables_);
+            current_.store(other.current_.exchange(nullptr, std::memory_order_relaxed), std::memory_order_release);
+            entries_ = std::exchange(other.entries_, nullptr);
+            ctrl_ = std::exchange(other.ctrl_, nullptr);
+            mask_ = std::exchange(other.mask_, 0);
+            size_ = std::exchange(other.size_, 0);
+            return *this;
+            }
+
+        // The value stored for key, or null. Invalidated by any insert or
+        // erase.
+        int64_t* find(uint64_t key)
+            {
+            const std::size_t slot = find_slot(key, hash(key));
+            return slot == npos ? nullptr : &entries_[slot].value;
+            }
+
+        const int64_t* find(uint64_t key) const
+            {
+            return const_cast<FlatTokenMap*>(this)->find(key);
+            }
+
+        // Lookup that may race the writer. The answer is only good if no
+        // write overlapped the call; it may be stale or torn otherwise, and
+        // the caller must check and retry.
+        bool find_racing(uint64_t key, int64_t& value) const
+            {
+            const Table* table = current_.load(std::memory_order_acquire);
+            if (table == nullptr)
+                {
+                return false;
+                }
+            const uint64_t h = hash(key);
+            const uint8_t fp = fingerprint(h);
+            // Bounded, as a torn read could otherwise miss every empty slot
+            for (std::size_t i = 0, slot = h & table->mask; i <= table->mask; ++i, slot = (slot + 1) & table->mask)
+                {
+                const uint8_t ctrl = load(table->ctrl[slot]);
+                if (ctrl == kEmpty)
+                    {
+                    return false;
+                    }
+                if (ctrl == fp && load(table->entries[slot].key) == key)
+                    {
+                    value = load(table->entries[slot].value);
+                    return true;
+                    }
+                }
+            return false;
+            }
+
+        // Update the value find() returned, safely for find_racing()
+        static void assign(int64_t* stored, int64_t value)
+            {
+            std::atomic_ref<int64_t>(*stored).store(value, std::memory_order_relaxed);
+            }
+
+        // Inserts key with value unless it is present. Returns the stored
+        // value and whether it was inserted, like std::unordered_map.
+        std::pair<int64_t*, bool> try_emplace(uint64_t key, int64_t value)
+            {
+            const uint64_t h = hash(key);
+            const std::size_t found = find_slot(key, h);
+            if (found != npos)
+                {
+                return { &entries_[found].value, false };
+                }
+
+            if ((size_ + 1) * 4 > capacity() * 3)
+                {
+                rehash(capacity() == 0 ? kGroup : capacity() * 2);
+                }
+            const std::size_t slot = first_empty(h);
+            set_entry(slot, { key, value });
+            set_ctrl(slot, fingerprint(h));
+            ++size_;
+            return { &entries_[slot].value, true };
+            }
+
+        bool erase(uint64_t key)
+            {
+            std::size_t hole = find_slot(key, hash(key));
+            if (hole == npos)
+                {
+                return false;
+                }
+
+            // Pull back each following entry that may live at the hole,
+            // i.e. whose home slot is not between the hole and where it sits
+            for (std::size_t next = (hole + 1) & mask_; ctrl_[next] != kEmpty; next = (next + 1) & mask_)
+                {
+                const std::size_t home = hash(entries_[next].key) & mask_;
+                if (((next - home) & mask_) >= ((next - hole) & mask_))
+                    {
+                    set_entry(hole, entries_[next]);
+                    set_ctrl(hole, ctrl_[next]);
+                    hole = next;
+                    }
+                }
+            set_ctrl(hole, kEmpty);
+            --size_;
+            return true;
+            }
+
+        // Make room for n entries without rehashing
+        void reserve(std::size_t n)
+            {
+            std::size_t wanted = kGroup;
+            while (n * 4 > wanted * 3)
+                {
+                wanted *= 2;
+                }
+            if (wanted > capacity())
+                {
+                rehash(wanted);
+                }
+            }
+
+        // Calls fn(key, value) for every entry
+        template <class Fn>
+        void for_each(Fn&& fn) const
+            {
+            for (std::size_t slot = 0; slot < capacity(); ++slot)
+                {
+                if (ctrl_[slot] != kEmpty)
+                    {
+                    fn(entries_[slot].key, entries_[slot].value);
+                    }
+                }
+            }
+
+        std::size_t size() const
+            {
+            return size_;
+            }
+
+        std::size_t capacity() const
+            {
+            return entries_ != nullptr ? mask_ + 1 : 0;
+            }
+
+        // Heap bytes held, entries and control bytes together, counting the
+        // tables kept after growing
+        std::size_t memory_bytes() const
+            {
+            std::size_t total = 0;
+            for (const auto& table : tables_)
+                {
+                total += table_bytes(table->mask + 1);
+                }
+            return total;
+            }
+
+        // What one table of capacity slots takes
+        static constexpr std::size_t table_bytes(std::size_t capacity)
+            {
+            return capacity * sizeof(Entry) + capacity + kGroup;
+            }
+
+    private:
+        static constexpr std::size_t kGroup = 16;
+        static constexpr uint8_t kEmpty = 0x80;
+        static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+        // Home slot from the low bits, fingerprint from the top 7
+        static uint64_t hash(uint64_t key)
+            {
+            key ^= key >> 32;
+            key *= 0x9e3779b97f4a7c15ull;
+            return key ^ (key >> 29);
+            }
+
+        static uint8_t fingerprint(uint64_t h)
+            {
+            return static_cast<uint8_t>(h >> 57);
+            }
+
+        // Bit i set where control byte i of the group at pos equals byte
+        uint32_t match(std::size_t pos, uint8_t byte) const
+            {
+#if defined(__SSE2__)
+            const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl_ + pos));
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(static_cast<char>(byte)))));
+#else
+            uint32_t bits = 0;
+            for (std::size_t i = 0; i < kGroup; ++i)
+                {
+                bits |= static_cast<uint32_t>(ctrl_[pos + i] == byte) << i;
+                }
+            return bits;
+#endif
+            }
+
+        std::size_t find_slot(uint64_t key, uint64_t h) const
+            {
+            if (size_ == 0)
+                {
+                return npos;
+                }
+            const uint8_t fp = fingerprint(h);
+            for (std::size_t pos = h & mask_; ; pos = (pos + kGroup) & mask_)
+                {
+                // A probe run ends at its first empty slot
+                const uint32_t empty = match(pos, kEmpty);
+                uint32_t hits = match(pos, fp);
+                if (empty != 0)
+                    {
+                    hits &= (1u << std::countr_zero(empty)) - 1;
+                    }
+                for (; hits != 0; hits &= hits - 1)
+                    {
+                    const std::size_t slot = (pos + std::countr_zero(hits)) & mask_;
+                    if (entries_[slot].key == key)
+                        {
+                        return slot;
+                        }
+                    }
+                if (empty != 0)
+                    {
+                    return npos;
+                    }
+                }
+            }
+
+        std::size_t first_empty(uint64_t h) const
+            {
+            for (std::size_t pos = h & mask_; ; pos = (pos + kGroup) & mask_)
+                {
+                const uint32_t empty = match(pos, kEmpty);
+                if (empty != 0)
+                    {
+                    return (pos + std::countr_zero(empty)) & mask_;
+                    }
+                }
+            }
+
+        template <class T>
+        static T load(const T& stored)
+            {
+            return std::atomic_ref<T>(const_cast<T&>(stored)).load(std::memory_order_relaxed);
+            }
+
+        template <class T>
+        static void store(T& stored, T value)
+            {
+            std::atomic_ref<T>(stored).store(value, std::memory_order_relaxed);
+            }
+
+        void set_entry(std::size_t slot, Entry entry)
+            {
+            store(entries_[slot].key, entry.key);
+            store(entries_[slot].value, entry.value);
+            }
+
+        void set_ctrl(std::size_t slot, uint8_t byte)
+            {
+            store(ctrl_[slot], byte);
+            if (slot < kGroup)
+                {
+                store(ctrl_[mask_ + 1 + slot], byte);
+                }
+            }
+
+        void rehash(std::size_t capacity)
+            {
+            const Entry* old_entries = entries_;
+            const uint8_t* old_ctrl = ctrl_;
+            const std::size_t old_capacity = this->capacity();
+
+            auto table = std::make_unique<Table>();
+            table->entries = std::make_unique_for_overwrite<Entry[]>(capacity);
+            table->ctrl = std::make_unique_for_overwrite<uint8_t[]>(capacity + kGroup);
+            table->mask = capacity - 1;
+            entries_ = table->entries.get();
+            ctrl_ = table->ctrl.get();
+            std::memset(ctrl_, kEmpty, capacity + kGroup);
+            mask_ = capacity - 1;
+
+            for (std::size_t slot = 0; slot < old_capacity; ++slot)
+                {
+                if (old_ctrl[slot] != kEmpty)
+                    {
+                    const uint64_t h = hash(old_entries[slot].key);
+                    const std::size_t to = first_empty(h);
+                    entries_[to] = old_entries[slot];
+                    set_ctrl(to, fingerprint(h));
+                    }
+                }
+
+            // Filled before readers can see it
+            current_.store(table.get(), std::memory_order_release);
+            tables_.push_back(std::move(table));
+            }
+
+        struct Table
+            {
+            std::unique_ptr<Entry[]> entries;
+            std::unique_ptr<uint8_t[]> ctrl;
+            std::size_t mask;
+            };
+
+        // Every table the map has had; the last is current
+        std::vector<std::unique_ptr<Table>> tables_;
+        std::atomic<const Table*> current_{ nullptr };
+        // The current table, for the writer
+        Entry* entries_ = nullptr;
+        uint8_t* ctrl_ = nullptr;
+        std::size_t mask_ = 0;
+        std::size_t size_ = 0;
+    };
+
+} // namespace auth
+} // namespace asciimmo
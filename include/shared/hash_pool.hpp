@@ -0,0 +1,66 @@
+#pragma once
+
+// Boost 1.74's awaitable.hpp uses std::exchange without including it
+#include <utility>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+namespace net = boost::asio;
+
+struct HashPoolOptions
+    {
+    std::size_t threads = 2;
+    // Hashes waiting or running before more are turned away
+    std::size_t max_queue = 64;
+    };
+
+// Threads of their own for password hashing, which is slow on purpose and
+// would otherwise hold up every connection on the io thread that ran it.
+//
+// The pool takes at most max_queue jobs at a time, counting those running.
+// Past that, run refuses at once rather than queueing, so a burst of logins
+// gets fast 503s instead of waits that grow with the queue, and the memory
+// a hash allocates is bounded by threads.
+class HashPool
+    {
+    public:
+        explicit HashPool(HashPoolOptions options);
+        // Waits for the jobs already taken
+        ~HashPool();
+
+        HashPool(const HashPool&) = delete;
+        HashPool& operator=(const HashPool&) = delete;
+
+        // Runs work on the pool and resumes the caller on its own executor
+        // once it is done. Returns false without running it if the pool is
+        // full. An exception from work is rethrown to the caller.
+        net::awaitable<bool> run(std::function<void()> work);
+
+        struct Stats
+            {
+            std::size_t queued;  // waiting or running now
+            uint64_t completed;
+            uint64_t rejected;
+            };
+
+        Stats stats() const;
+
+    private:
+        const HashPoolOptions options_;
+        std::atomic<std::size_t> queued_{ 0 };
+        std::atomic<uint64_t> completed_{ 0 };
+        std::atomic<uint64_t> rejected_{ 0 };
+        net::thread_pool threads_;
+    };
+
+} // namespace auth
+} // namespace asciimmo
@@ -1,62 +1,118 @@
 #pragma once
 
-#include <string>
-#include <boost/asio.hpp>
-#include <boost/asio/ssl.hpp>
-#include <boost/beast.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
 #include <boost/beast/ssl.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/ssl.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace asciimmo {
 namespace http {
 
+namespace beast = boost::beast;
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+using ClientRequest = beast::http::request<beast::http::string_body>;
+using ClientResponse = beast::http::response<beast::http::string_body>;
+
+struct ClientOptions {
+    // Resolve, connect and TLS handshake
+    std::chrono::milliseconds connect_timeout{ 5000 };
+    // Writing the request and reading the response
+    std::chrono::milliseconds request_timeout{ 10000 };
+    // Idle connections older than this are not reused. Keep it below the
+    // server's keep-alive timeout (header_timeout) so reused connections
+    // are rarely already closed.
+    std::chrono::milliseconds idle_timeout{ 5000 };
+    std::size_t max_idle_per_host = 8;
+    std::chrono::seconds dns_ttl{ 60 };
+    // Services use self-signed certificates in development
+    bool verify_peer = false;
+};
+
+struct Endpoint {
+    std::string host;
+    unsigned short port;
+};
+
+struct FanOutResult {
+    Endpoint endpoint;
+    beast::error_code ec;
+    ClientResponse response;
+};
+
+// Outbound HTTPS client for service-to-service calls. Connections are kept
+// alive in a pool per host:port and reused; new connections resume the
+// host's last TLS session, so only the first pays for a full handshake.
+// Pooled connections the server has since closed are dropped before use. If
+// one is closed while a request goes out, the request is retried once on a
+// new connection, unless it was written and is not idempotent (a POST).
+//
+// Safe to use from several threads. The client must outlive its requests.
 class Client {
 public:
-    // POST request to HTTPS endpoint
-    static bool post(const std::string& host, int port, const std::string& target, const std::string& body) {
-        try {
-            boost::asio::io_context ioc;
-            boost::asio::ssl::context ssl_ctx(boost::asio::ssl::context::tlsv12_client);
-            
-            // Allow self-signed certificates for development
-            ssl_ctx.set_verify_mode(boost::asio::ssl::verify_none);
-            
-            boost::beast::ssl_stream<boost::beast::tcp_stream> stream(ioc, ssl_ctx);
-            
-            // Resolve and connect
-            boost::asio::ip::tcp::resolver resolver(ioc);
-            auto const results = resolver.resolve(host, std::to_string(port));
-            boost::beast::get_lowest_layer(stream).connect(results);
-            
-            // Perform SSL handshake
-            stream.handshake(boost::asio::ssl::stream_base::client);
-            
-            // Build HTTP POST request
-            boost::beast::http::request<boost::beast::http::string_body> req{
-                boost::beast::http::verb::post, target, 11
-            };
-            req.set(boost::beast::http::field::host, host);
-            req.set(boost::beast::http::field::content_type, "application/json");
-            req.body() = body;
-            req.prepare_payload();
-            
-            // Send request
-            boost::beast::http::write(stream, req);
-            
-            // Read response
-            boost::beast::flat_buffer buffer;
-            boost::beast::http::response<boost::beast::http::string_body> res;
-            boost::beast::http::read(stream, buffer, res);
-            
-            // Graceful shutdown
-            boost::beast::error_code ec;
-            stream.shutdown(ec);
-            // Ignore shutdown errors (common with self-signed certs)
-            
-            return res.result() == boost::beast::http::status::ok;
-        } catch (const std::exception&) {
-            return false;
-        }
-    }
+    explicit Client(net::any_io_executor executor, ClientOptions options = {});
+    ~Client();
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    // Sends req to host:port and returns the response. Sets Host and
+    // keep-alive on req. Throws beast::system_error on failure.
+    net::awaitable<ClientResponse> request(std::string host, unsigned short port, ClientRequest req);
+
+    // JSON POST
+    net::awaitable<ClientResponse> post(std::string host, unsigned short port, std::string target, std::string body);
+
+    // Sends req to every endpoint concurrently. on_done runs once all have
+    // finished, with one result per endpoint in the same order.
+    void fan_out(std::vector<Endpoint> endpoints, ClientRequest req,
+                 std::function<void(std::vector<FanOutResult>)> on_done);
+
+    struct Stats {
+        uint64_t connections_opened;
+        uint64_t sessions_resumed;
+        uint64_t requests_on_reused;
+    };
+    Stats stats() const;
+
+    std::size_t idle_connections() const;
+
+private:
+    struct Connection;
+    struct Pool;
+
+    Pool& pool_for(const std::string& host, unsigned short port);
+    std::unique_ptr<Connection> take_idle(Pool& pool);
+    void give_back(Pool& pool, std::unique_ptr<Connection> conn);
+    // Drop a healthy connection without spoiling its TLS session
+    static void discard(std::unique_ptr<Connection> conn);
+    static bool closed_while_idle(Connection& conn);
+    net::awaitable<tcp::resolver::results_type> resolve(Pool& pool, const std::string& host, unsigned short port);
+    net::awaitable<std::unique_ptr<Connection>> connect(Pool& pool, const std::string& host, unsigned short port);
+    void remember_session(Pool& pool, Connection& conn);
+
+    net::any_io_executor executor_;
+    ClientOptions options_;
+    net::ssl::context ssl_ctx_;
+    mutable std::mutex mtx_; // guards pools_ and every pool's idle list and cached state
+    std::unordered_map<std::string, std::unique_ptr<Pool>> pools_;
+    std::atomic<uint64_t> connections_opened_{ 0 };
+    std::atomic<uint64_t> sessions_resumed_{ 0 };
+    std::atomic<uint64_t> requests_on_reused_{ 0 };
 };
 
 } // namespace http
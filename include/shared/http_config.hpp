@@ -0,0 +1,71 @@
+#pragma once
+
+#include "shared/http_client.hpp"
+#include "shared/http_server.hpp"
+#include "shared/rate_limiter.hpp"
+#include "shared/service_config.hpp"
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace asciimmo::http
+{
+
+// Server options from services.yaml. Each key is looked up under
+// <service>.http first, then global.http, then the ServerOptions default.
+inline ServerOptions server_options(const config::ServiceConfig& config, const std::string& service)
+    {
+    ServerOptions options;
+
+    auto get_int = [&](const std::string& key, long long default_val)
+        {
+        auto global_val = config.get_ulonglong("global.http." + key, static_cast<unsigned long long>(default_val));
+        return static_cast<long long>(config.get_ulonglong(service + ".http." + key, global_val));
+        };
+
+    options.max_connections = get_int("max_connections", options.max_connections);
+    options.priority_connections = get_int("priority_connections", options.priority_connections);
+    options.header_timeout = std::chrono::milliseconds(get_int("header_timeout_ms", options.header_timeout.count()));
+    options.body_timeout = std::chrono::milliseconds(get_int("body_timeout_ms", options.body_timeout.count()));
+    options.write_timeout = std::chrono::milliseconds(get_int("write_timeout_ms", options.write_timeout.count()));
+    options.max_queue_delay = std::chrono::milliseconds(get_int("max_queue_delay_ms", options.max_queue_delay.count()));
+    options.retry_after = std::chrono::seconds(get_int("retry_after_s", options.retry_after.count()));
+    options.ktls = config.get_bool(service + ".http.ktls", config.get_bool("global.http.ktls", options.ktls));
+
+    return options;
+    }
+
+// Outbound client options, from <service>.http_client then global.http_client
+inline ClientOptions client_options(const config::ServiceConfig& config, const std::string& service)
+    {
+    ClientOptions options;
+
+    auto get_int = [&](const std::string& key, long long default_val)
+        {
+        auto global_val = config.get_ulonglong("global.http_client." + key, static_cast<unsigned long long>(default_val));
+        return static_cast<long long>(config.get_ulonglong(service + ".http_client." + key, global_val));
+        };
+
+    options.connect_timeout = std::chrono::milliseconds(get_int("connect_timeout_ms", options.connect_timeout.count()));
+    options.request_timeout = std::chrono::milliseconds(get_int("request_timeout_ms", options.request_timeout.count()));
+    options.idle_timeout = std::chrono::milliseconds(get_int("idle_timeout_ms", options.idle_timeout.count()));
+    options.max_idle_per_host = get_int("max_idle_per_host", options.max_idle_per_host);
+    options.verify_peer = config.get_bool(service + ".http_client.verify_peer",
+        config.get_bool("global.http_client.verify_peer", options.verify_peer));
+
+    return options;
+    }
+
+// Rate limit rules from <service>.rate_limits in services.yaml
+inline std::vector<RateLimitRule> rate_limit_rules(const config::ServiceConfig& config, const std::string& service)
+    {
+    std::vector<RateLimitRule> rules;
+    for (const auto& limit : config.get_rate_limits(service))
+        {
+        rules.push_back({ limit.method, limit.route, { limit.ip_rate, limit.ip_burst },
+            { limit.token_rate, limit.token_burst } });
+        }
+    return rules;
+    }
+
+} // namespace asciimmo::http
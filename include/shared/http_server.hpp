@@ -1,16 +1,31 @@
 #pragma once
 
+#include "shared/metrics.hpp"
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/ssl.hpp>
+#include <boost/asio/awaitable.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/optional.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <regex>
+#include <utility>
 #include <vector>
 
 namespace asciimmo {
@@ -20,25 +35,385 @@ namespace beast = boost::beast;
 namespace net = boost::asio;
 using tcp = net::ip::tcp;
 
-// HTTP request and response types
-using Request = beast::http::request<beast::http::string_body>;
-using Response = beast::http::response<beast::http::string_body>;
+// Asio backend this build runs on; ASCIIMMO_USE_IO_URING selects io_uring
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+inline constexpr std::string_view kIoBackend = "io_uring";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+inline constexpr std::string_view kIoBackend = "epoll";
+#else
+inline constexpr std::string_view kIoBackend = "default";
+#endif
+
+// Allocator over a std::pmr::memory_resource. Unlike std::pmr::polymorphic_allocator
+// it is assignable, which Beast's basic_fields requires.
+template <class T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    ArenaAllocator() noexcept
+        : resource_(std::pmr::get_default_resource()) {}
+    explicit ArenaAllocator(std::pmr::memory_resource* resource) noexcept
+        : resource_(resource) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+        : resource_(other.resource()) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(resource_->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T* p, std::size_t n) noexcept {
+        resource_->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    std::pmr::memory_resource* resource() const noexcept { return resource_; }
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept {
+        return *resource_ == *other.resource();
+    }
+
+private:
+    std::pmr::memory_resource* resource_;
+};
+
+// Response body: a string, optionally followed by shared, immutable pieces
+// that are written from where they live, gathered into the same write as
+// the string, rather than copied into it. The response keeps each piece
+// alive until it has been sent.
+//
+// Everything done through the std::string base applies to the text before
+// the first piece; append_after adds text after the last one. Assigning
+// or clearing the body drops its pieces.
+struct ResponseBody {
+    class value_type : public std::string {
+    public:
+        struct Piece {
+            std::shared_ptr<const void> owner; // keeps text alive
+            std::string_view text;
+            std::string after;
+        };
+
+        value_type() = default;
+        value_type(std::string&& text) : std::string(std::move(text)) {}
+
+        template <class T>
+        value_type& operator=(T&& text) {
+            std::string::operator=(std::forward<T>(text));
+            pieces_.clear();
+            return *this;
+        }
+
+        void clear() noexcept {
+            std::string::clear();
+            pieces_.clear();
+        }
+
+        void append_shared(std::shared_ptr<const std::string> piece) {
+            const std::string_view text = *piece;
+            pieces_.push_back({ std::move(piece), text, {} });
+        }
+
+        void append_shared(std::shared_ptr<const std::string_view> piece) {
+            const std::string_view text = *piece;
+            pieces_.push_back({ std::move(piece), text, {} });
+        }
+
+        void append_after(std::string_view text) {
+            if (pieces_.empty()) {
+                std::string::append(text);
+            }
+            else {
+                pieces_.back().after.append(text);
+            }
+        }
+
+        const std::vector<Piece>& pieces() const { return pieces_; }
+
+        // Bytes sent, pieces included
+        std::size_t payload_size() const {
+            std::size_t total = size();
+            for (const auto& piece : pieces_) {
+                total += piece.text.size() + piece.after.size();
+            }
+            return total;
+        }
+
+    private:
+        std::vector<Piece> pieces_;
+    };
+
+    static std::uint64_t size(const value_type& body) {
+        return body.payload_size();
+    }
+
+    class writer {
+    public:
+        using const_buffers_type = std::span<const net::const_buffer>;
+
+        template <bool isRequest, class Fields>
+        writer(const beast::http::header<isRequest, Fields>&, const value_type& body)
+            : body_(body) {}
+
+        void init(beast::error_code& ec) {
+            ec = {};
+        }
+
+        // One call: the string and every piece, for a single gathered write
+        boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+            ec = {};
+            buffers_.clear();
+            buffers_.push_back(net::buffer(body_.data(), body_.size()));
+            for (const auto& piece : body_.pieces()) {
+                buffers_.push_back(net::buffer(piece.text.data(), piece.text.size()));
+                if (!piece.after.empty()) {
+                    buffers_.push_back(net::buffer(piece.after.data(), piece.after.size()));
+                }
+            }
+            return { { const_buffers_type(buffers_.data(), buffers_.size()), false } };
+        }
+
+    private:
+        const value_type& body_;
+        // Outlives the write; the serializer holds the writer
+        boost::container::small_vector<net::const_buffer, 4> buffers_;
+    };
+
+    // Reads into the string, as string_body does; for clients and tests
+    class reader {
+    public:
+        template <bool isRequest, class Fields>
+        reader(beast::http::header<isRequest, Fields>&, value_type& body)
+            : body_(body) {}
+
+        void init(const boost::optional<std::uint64_t>&, beast::error_code& ec) {
+            body_.clear();
+            ec = {};
+        }
+
+        template <class ConstBufferSequence>
+        std::size_t put(const ConstBufferSequence& buffers, beast::error_code& ec) {
+            const std::size_t at = body_.size();
+            body_.resize(at + net::buffer_size(buffers));
+            ec = {};
+            return net::buffer_copy(net::buffer(body_.data() + at, body_.size() - at), buffers);
+        }
+
+        void finish(beast::error_code& ec) {
+            ec = {};
+        }
+
+    private:
+        value_type& body_;
+    };
+};
+
+// HTTP request and response types. Header fields are allocated from the
+// session's per-connection arena.
+using Fields = beast::http::basic_fields<ArenaAllocator<char>>;
+using Request = beast::http::request<beast::http::string_body, Fields>;
+using Response = beast::http::response<ResponseBody, Fields>;
+
+// Scratch memory for the request being handled, released after its response
+// is written. Handlers can build temporary strings and containers here, e.g.
+// std::pmr::string json(scratch(req)). Not valid across co_await.
+inline std::pmr::memory_resource* scratch(const Request& req) {
+    return req.get_allocator().resource();
+}
+
+// Value of a query parameter, as-is (no percent-decoding); empty if absent
+inline std::string_view query_param(std::string_view query, std::string_view name) {
+    while (!query.empty()) {
+        auto end = query.find('&');
+        auto pair = query.substr(0, end);
+        auto eq = pair.find('=');
+        if (pair.substr(0, eq) == name) {
+            return eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1);
+        }
+        if (end == std::string_view::npos) {
+            break;
+        }
+        query.remove_prefix(end + 1);
+    }
+    return {};
+}
+
+struct Route;
+
+// Per-request facts gathered before routing and shared with middleware and
+// context handlers. Views point into the request and stay valid until its
+// response is written.
+struct RequestContext {
+    static constexpr std::size_t kMaxParams = 16;
+    
+    net::ip::address client_ip;
+    std::string_view path;  // target without the query
+    std::string_view query; // text after '?', empty if there is none
+    const Route* route = nullptr;
+    
+    // Query split once per request, without decoding or allocating.
+    // Parameters past kMaxParams are ignored.
+    std::array<std::pair<std::string_view, std::string_view>, kMaxParams> params{};
+    std::size_t param_count = 0;
+    
+    // Set by the auth stage (auth::use_session_auth) on protected routes
+    bool authenticated = false;
+    uint64_t session_token = 0;
+    uint64_t user_id = 0; // carried by signed tokens, 0 otherwise
+    
+    void parse_query(std::string_view text) {
+        query = text;
+        param_count = 0;
+        while (!text.empty() && param_count < kMaxParams) {
+            auto end = text.find('&');
+            auto pair = text.substr(0, end);
+            auto eq = pair.find('=');
+            params[param_count++] = { pair.substr(0, eq),
+                eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1) };
+            if (end == std::string_view::npos) {
+                break;
+            }
+            text.remove_prefix(end + 1);
+        }
+    }
+    
+    // Value of a query parameter; empty if absent
+    std::string_view param(std::string_view name) const {
+        for (std::size_t i = 0; i < param_count; ++i) {
+            if (params[i].first == name) {
+                return params[i].second;
+            }
+        }
+        return {};
+    }
+};
 
 // Route handler function type
 using Handler = std::function<void(const Request&, Response&, const std::smatch&)>;
 
-// Route pattern with regex and handler
+// Coroutine route handler; may co_await I/O (DB, outbound HTTP, timers)
+// before filling in the response, without holding up the io thread
+using AsyncHandler = std::function<net::awaitable<void>(const Request&, Response&, const std::smatch&)>;
+
+// Handlers that also receive the request context (parsed query, auth result)
+using ContextHandler = std::function<void(const Request&, Response&, const std::smatch&, const RequestContext&)>;
+using AsyncContextHandler =
+    std::function<net::awaitable<void>(const Request&, Response&, const std::smatch&, const RequestContext&)>;
+
+// Protected routes only run for requests the auth stage accepted
+enum class Access { Public, Protected };
+
+// Route pattern with regex and handler (exactly one of handler/async_handler is set)
 struct Route {
     beast::http::verb method;
+    std::string pattern_string; // as registered; per-route config refers to it
     std::regex pattern;
-    Handler handler;
+    std::string literal_prefix; // every match starts with this; checked before the regex
+    Access access = Access::Public;
+    ContextHandler handler;
+    AsyncContextHandler async_handler;
+    std::size_t metrics_id = 0;
+    bool upgrade = false; // WebSocket route: the stream is handed over instead of calling a handler
+};
+
+// Stage run after a request is routed and before its handler. Returning
+// false means the stage filled in the response and the handler is skipped.
+using Middleware = std::function<bool(const Request&, Response&, RequestContext&)>;
+
+// Stage that may wait on I/O, such as a lookup on another service. It runs
+// only for requests its predicate accepts, and only those move to a
+// coroutine, so a stage that is rarely needed costs nothing otherwise.
+using AsyncMiddleware = std::function<net::awaitable<bool>(const Request&, Response&, RequestContext&)>;
+using StagePredicate = std::function<bool(const Request&, const RequestContext&)>;
+
+// Server-push connection created by a WebSocket upgrade. Outbound messages
+// go through a bounded per-connection queue; send() may be called from any thread.
+class WebSocketConnection {
+public:
+    virtual ~WebSocketConnection() = default;
+    
+    // Queue a text frame. Returns false if the connection is closed or its
+    // queue limit was hit, in which case the slow consumer is disconnected.
+    virtual bool send(std::shared_ptr<const std::string> message) = 0;
+    bool send(std::string message) {
+        return send(std::make_shared<const std::string>(std::move(message)));
+    }
+    
+    // Start a normal close handshake
+    virtual void close() = 0;
+    
+    // Bytes accepted by send() that have not been written yet
+    virtual std::size_t queued_bytes() const = 0;
+};
+
+using WebSocketPtr = std::shared_ptr<WebSocketConnection>;
+
+// Callbacks and limits for a WebSocket route
+struct WebSocketHandler {
+    std::function<void(const WebSocketPtr&, const Request&, const std::smatch&)> on_open;
+    std::function<void(const WebSocketPtr&, std::string_view)> on_message;
+    std::function<void(const WebSocketPtr&)> on_close;
+    std::size_t max_queued_messages = 256;
+    std::size_t max_queued_bytes = 1024 * 1024;
+};
+
+// Upgrades are routed like any other GET, so shedding, rate limits and the
+// auth stage apply before the handshake
+struct WebSocketRoute {
+    Route route;
+    WebSocketHandler handler;
+};
+
+// Group of connections that receive the same pushed messages (e.g. a chat channel)
+class WebSocketChannel {
+public:
+    void join(const WebSocketPtr& conn);
+    void leave(const WebSocketPtr& conn);
+    
+    // Queue the message on every member; closed or overflowing members are dropped.
+    // Returns the number of members that accepted it.
+    std::size_t broadcast(std::string message);
+    
+    std::size_t size() const;
+    
+private:
+    mutable std::mutex mtx_;
+    std::vector<std::weak_ptr<WebSocketConnection>> members_;
+};
+
+// Admission control and timeouts. Under overload the server answers
+// quickly with 503 + Retry-After rather than letting every request time out.
+struct ServerOptions {
+    // Connections past max_connections are only served priority paths; past
+    // max_connections + priority_connections they are refused outright
+    std::size_t max_connections = 4096;
+    std::size_t priority_connections = 16;
+    
+    // Deadline for a request's headers (also the keep-alive idle timeout),
+    // for its body, and for writing the response
+    std::chrono::milliseconds header_timeout{ 10000 };
+    std::chrono::milliseconds body_timeout{ 30000 };
+    std::chrono::milliseconds write_timeout{ 30000 };
+    
+    // Requests are shed while the event loop runs this far behind
+    std::chrono::milliseconds max_queue_delay{ 250 };
+    std::chrono::seconds retry_after{ 1 };
+    
+    // Paths served even while shedding or over the connection limit
+    std::vector<std::string> priority_paths{ "/health", "/shutdown" };
+    
+    // HTTPS only: let the kernel encrypt records (Linux kTLS) when it and
+    // the negotiated cipher support it. Without kernel support the server
+    // keeps the user-space TLS stream.
+    bool ktls = false;
 };
 
 class Server {
 public:
-    Server(net::io_context& ioc, unsigned short port);
+    Server(net::io_context& ioc, unsigned short port, ServerOptions options = {});
     Server(net::io_context& ioc, unsigned short port, 
-           const std::string& cert_file, const std::string& key_file);
+           const std::string& cert_file, const std::string& key_file,
+           ServerOptions options = {});
     
     // Register route handlers
     void get(const std::string& pattern, Handler handler);
@@ -46,24 +421,107 @@ public:
     void put(const std::string& pattern, Handler handler);
     void del(const std::string& pattern, Handler handler);
     
+    // Register route handlers that receive the request context
+    void get(const std::string& pattern, Access access, ContextHandler handler);
+    void post(const std::string& pattern, Access access, ContextHandler handler);
+    void put(const std::string& pattern, Access access, ContextHandler handler);
+    void del(const std::string& pattern, Access access, ContextHandler handler);
+    
+    // Register coroutine route handlers
+    void get_async(const std::string& pattern, AsyncHandler handler);
+    void post_async(const std::string& pattern, AsyncHandler handler);
+    void put_async(const std::string& pattern, AsyncHandler handler);
+    void del_async(const std::string& pattern, AsyncHandler handler);
+    void get_async(const std::string& pattern, Access access, AsyncContextHandler handler);
+    void post_async(const std::string& pattern, Access access, AsyncContextHandler handler);
+    void put_async(const std::string& pattern, Access access, AsyncContextHandler handler);
+    void del_async(const std::string& pattern, Access access, AsyncContextHandler handler);
+    
+    // Accept WebSocket upgrades on paths matching pattern
+    void websocket(const std::string& pattern, WebSocketHandler handler);
+    void websocket(const std::string& pattern, Access access, WebSocketHandler handler);
+    
+    // Add a middleware stage; stages run in the order they were added
+    void use(Middleware middleware);
+    void use_async(StagePredicate when, AsyncMiddleware middleware);
+    
     // Start accepting connections
     void run();
     
     // Stop the server
     void stop();
     
+    // Port the acceptor is bound to (useful when constructed with port 0)
+    unsigned short port() const;
+    
+    // Per-route request metrics, served at GET /metrics. Services register
+    // their own gauges (DB pool, token cache, ...) here.
+    metrics::Registry& metrics();
+    
+    const ServerOptions& options() const;
+    
+    // How far the event loop is running behind, as seen by the last probes
+    std::chrono::microseconds queue_delay() const;
+    
 private:
+    template <class Derived> class SessionBase;
+    static constexpr std::size_t kArenaBytes = 8192;
     class Session;
     class SSLSession;
+    class KtlsSession;
+    template <class Stream> class WebSocketSession;
     
+    void add_route(beast::http::verb method, const std::string& pattern, Access access,
+                   ContextHandler handler, AsyncContextHandler async_handler);
     void do_accept();
-    void handle_request(const Request& req, Response& res);
+    // Turn away a connection over the hard limit
+    void refuse(tcp::socket socket);
+    // Periodic timer whose lateness measures the event loop's queue delay
+    void probe_queue_delay();
+    bool is_priority(const std::string& path) const;
+    // Hand an upgrade request that passed every stage over to a WebSocket
+    // session for route
+    template <class Stream>
+    void upgrade(Stream& stream, const Request& req, const Route& route);
+    // Route the request; on_complete runs once the response is ready to send
+    // and receives the metrics id of the route that produced it. An accepted
+    // upgrade is left as 101 Switching Protocols for the session to hand over. ctx, target
+    // and matches are session-owned scratch reused between requests.
+    // Connections that were not admitted (over max_connections) only get
+    // priority paths.
+    template <class Completion>
+    void handle_request(const Request& req, Response& res, RequestContext& ctx, std::string& target,
+                        std::smatch& matches, bool admitted, const net::any_io_executor& ex,
+                        Completion&& on_complete);
+    // Finish a routed request in a coroutine, from middleware stage `first`
+    // on, for async stages and handlers
+    template <class Completion>
+    void finish_async(const Request& req, Response& res, RequestContext& ctx, const std::string& target,
+                      std::size_t first, const net::any_io_executor& ex, Completion&& on_complete);
+    
+    struct Stage {
+        Middleware sync;
+        AsyncMiddleware async;
+        StagePredicate when;
+    };
     
     net::io_context& ioc_;
     tcp::acceptor acceptor_;
     std::vector<Route> routes_;
+    std::vector<WebSocketRoute> ws_routes_;
+    std::vector<Stage> middleware_;
+    metrics::Registry metrics_;
+    std::size_t unmatched_metrics_id_;
+    std::size_t shed_metrics_id_;
+    ServerOptions options_;
+    std::atomic<std::size_t> connections_{ 0 };
+    std::atomic<uint64_t> refused_connections_{ 0 };
+    std::atomic<uint64_t> ktls_connections_{ 0 };
+    std::atomic<int64_t> queue_delay_us_{ 0 };
+    net::steady_timer probe_timer_;
     bool running_;
     bool use_ssl_;
+    bool use_ktls_ = false;
     std::unique_ptr<boost::asio::ssl::context> ssl_ctx_;
 };
 
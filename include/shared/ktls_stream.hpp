@@ -0,0 +1,366 @@
+#pragma once
+
+#include <boost/asio/compose.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/asio/ssl/error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/core/role.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace asciimmo
+{
+namespace http
+{
+
+namespace beast = boost::beast;
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+// True when OpenSSL was built with kTLS and the kernel has (or can load) the
+// tls ULP. The cipher is only known per connection, after the handshake.
+inline bool ktls_available()
+    {
+#if defined(__linux__) && !defined(OPENSSL_NO_KTLS)
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        {
+        return false;
+        }
+    // The ULP only attaches to connected sockets, so ENOTCONN means it exists
+    const int rc = ::setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+    const int err = errno;
+    ::close(fd);
+    return rc == 0 || err == ENOTCONN;
+#else
+    return false;
+#endif
+    }
+
+// Server-side TLS stream where OpenSSL reads and writes the socket itself,
+// rather than going through memory BIOs as ssl::stream does. That lets
+// OpenSSL hand the record layer to the kernel once the handshake is done
+// (SSL_OP_ENABLE_KTLS on the context), after which SSL_write and SSL_read
+// pass plaintext straight to the socket. When the kernel can't take the
+// negotiated cipher, OpenSSL keeps encrypting in user space.
+//
+// Models Beast's AsyncStream and is its own lowest layer, with tcp_stream
+// style expires_after() / expires_never() deadlines. Like tcp_stream it
+// allows one read and one write in flight at a time.
+class KtlsStream
+    {
+    public:
+        using executor_type = tcp::socket::executor_type;
+
+        KtlsStream(tcp::socket socket, net::ssl::context& ctx)
+            : impl_(std::make_shared<Impl>(std::move(socket), ctx))
+            {}
+
+        executor_type get_executor()
+            {
+            return impl_->socket.get_executor();
+            }
+
+        tcp::socket& socket()
+            {
+            return impl_->socket;
+            }
+
+        SSL* native_handle()
+            {
+            return impl_->ssl.get();
+            }
+
+        // Whether the kernel took over each direction; known after the handshake
+        bool ktls_send() const
+            {
+            return BIO_get_ktls_send(SSL_get_wbio(impl_->ssl.get()));
+            }
+
+        bool ktls_recv() const
+            {
+            return BIO_get_ktls_recv(SSL_get_rbio(impl_->ssl.get()));
+            }
+
+        // Operations pending when the deadline passes fail with beast::error::timeout
+        void expires_after(std::chrono::steady_clock::duration timeout)
+            {
+            impl_->timed_out = false;
+            impl_->timer.expires_after(timeout);
+            impl_->timer.async_wait(
+                [weak = std::weak_ptr<Impl>(impl_)](beast::error_code ec)
+                {
+                auto impl = weak.lock();
+                if (ec || !impl || impl->pending == 0)
+                    {
+                    return;
+                    }
+                impl->timed_out = true;
+                impl->socket.cancel(ec);
+                });
+            }
+
+        void expires_never()
+            {
+            impl_->timer.cancel();
+            }
+
+        void close()
+            {
+            beast::error_code ec;
+            impl_->timer.cancel();
+            impl_->socket.close(ec);
+            }
+
+        template <class HandshakeHandler>
+        auto async_handshake(HandshakeHandler&& handler)
+            {
+            return start<void(beast::error_code)>(Handshake{}, handler);
+            }
+
+        // Sends close_notify without waiting for the peer's
+        template <class ShutdownHandler>
+        auto async_shutdown(ShutdownHandler&& handler)
+            {
+            return start<void(beast::error_code)>(Shutdown{}, handler);
+            }
+
+        template <class MutableBufferSequence, class ReadHandler>
+        auto async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler)
+            {
+            net::mutable_buffer buffer;
+            for (auto it = net::buffer_sequence_begin(buffers); it != net::buffer_sequence_end(buffers); ++it)
+                {
+                if (net::mutable_buffer(*it).size() != 0)
+                    {
+                    buffer = *it;
+                    break;
+                    }
+                }
+            return start<void(beast::error_code, std::size_t)>(Read{ buffer }, handler);
+            }
+
+        template <class ConstBufferSequence, class WriteHandler>
+        auto async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler)
+            {
+            net::const_buffer buffer;
+            for (auto it = net::buffer_sequence_begin(buffers); it != net::buffer_sequence_end(buffers); ++it)
+                {
+                if (net::const_buffer(*it).size() != 0)
+                    {
+                    buffer = *it;
+                    break;
+                    }
+                }
+
+            // Beast writes a response as header and body buffers; send them
+            // as one record (and one syscall) rather than one per buffer
+            const std::size_t total = std::min(net::buffer_size(buffers), kMaxRecord);
+            if (buffer.size() < total)
+                {
+                impl_->coalesced.resize(total);
+                net::buffer_copy(net::buffer(impl_->coalesced), buffers);
+                buffer = net::buffer(impl_->coalesced);
+                }
+            return start<void(beast::error_code, std::size_t)>(Write{ buffer }, handler);
+            }
+
+    private:
+        static constexpr std::size_t kMaxRecord = 16 * 1024; // TLS record payload limit
+
+        struct Impl
+            {
+            Impl(tcp::socket s, net::ssl::context& ctx)
+                : socket(std::move(s))
+                , timer(socket.get_executor())
+                , ssl(SSL_new(ctx.native_handle()), &SSL_free)
+                {
+                if (!ssl)
+                    {
+                    throw beast::system_error(beast::error_code(static_cast<int>(ERR_get_error()),
+                        net::error::get_ssl_category()), "SSL_new");
+                    }
+                socket.non_blocking(true);
+                SSL_set_fd(ssl.get(), static_cast<int>(socket.native_handle()));
+                SSL_set_mode(ssl.get(), SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+                SSL_set_accept_state(ssl.get());
+                }
+
+            tcp::socket socket;
+            net::steady_timer timer;
+            std::unique_ptr<SSL, decltype(&SSL_free)> ssl;
+            std::string coalesced;
+            int pending = 0;
+            bool timed_out = false;
+            };
+
+        struct Handshake
+            {
+            int operator()(SSL* ssl, std::size_t&) const
+                {
+                return SSL_do_handshake(ssl);
+                }
+            };
+
+        struct Shutdown
+            {
+            int operator()(SSL* ssl, std::size_t&) const
+                {
+                // 0 means our close_notify went out and the peer's hasn't arrived
+                const int ret = SSL_shutdown(ssl);
+                return ret == 0 ? 1 : ret;
+                }
+            };
+
+        struct Read
+            {
+            net::mutable_buffer buffer;
+
+            int operator()(SSL* ssl, std::size_t& bytes) const
+                {
+                return buffer.size() == 0 ? 1 : SSL_read_ex(ssl, buffer.data(), buffer.size(), &bytes);
+                }
+            };
+
+        struct Write
+            {
+            net::const_buffer buffer;
+
+            int operator()(SSL* ssl, std::size_t& bytes) const
+                {
+                return buffer.size() == 0 ? 1 : SSL_write_ex(ssl, buffer.data(), buffer.size(), &bytes);
+                }
+            };
+
+        static beast::error_code ssl_error(int err, int saved_errno)
+            {
+            if (err == SSL_ERROR_ZERO_RETURN)
+                {
+                return net::error::eof;
+                }
+            const unsigned long code = ERR_get_error();
+            if (err == SSL_ERROR_SYSCALL && code == 0)
+                {
+                return saved_errno != 0 ? beast::error_code(saved_errno, beast::system_category())
+                                        : beast::error_code(net::error::eof);
+                }
+            if (ERR_GET_REASON(code) == SSL_R_UNEXPECTED_EOF_WHILE_READING)
+                {
+                return net::ssl::error::stream_truncated;
+                }
+            return beast::error_code(static_cast<int>(code), net::error::get_ssl_category());
+            }
+
+        // Runs an OpenSSL call until it stops asking for the socket to be
+        // readable or writable
+        template <class Action>
+        struct Op
+            {
+            Impl* impl;
+            Action action;
+            std::size_t bytes = 0;
+            beast::error_code result{};
+            bool waited = false;
+            bool done = false;
+
+            template <class Self>
+            void operator()(Self& self, beast::error_code ec = {})
+                {
+                if (!done)
+                    {
+                    if (ec)
+                        {
+                        result = (ec == net::error::operation_aborted && impl->timed_out)
+                            ? beast::error_code(beast::error::timeout) : ec;
+                        }
+                    else
+                        {
+                        ERR_clear_error();
+                        const int ret = action(impl->ssl.get(), bytes);
+                        const int saved_errno = errno;
+                        if (ret <= 0)
+                            {
+                            const int err = SSL_get_error(impl->ssl.get(), ret);
+                            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                                {
+                                waited = true;
+                                impl->socket.async_wait(
+                                    err == SSL_ERROR_WANT_READ ? tcp::socket::wait_read : tcp::socket::wait_write,
+                                    std::move(self));
+                                return;
+                                }
+                            result = ssl_error(err, saved_errno);
+                            }
+                        }
+
+                    // Handlers must not run inside the initiating function
+                    if (!waited)
+                        {
+                        done = true;
+                        net::post(impl->socket.get_executor(), std::move(self));
+                        return;
+                        }
+                    }
+
+                --impl->pending;
+                if constexpr (std::is_same_v<Action, Read> || std::is_same_v<Action, Write>)
+                    {
+                    self.complete(result, result ? 0 : bytes);
+                    }
+                else
+                    {
+                    self.complete(result);
+                    }
+                }
+            };
+
+        template <class Signature, class Action, class Handler>
+        auto start(Action action, Handler& handler)
+            {
+            ++impl_->pending;
+            return net::async_compose<Handler, Signature>(
+                Op<Action>{ impl_.get(), std::move(action) }, handler, impl_->socket);
+            }
+
+        std::shared_ptr<Impl> impl_;
+    };
+
+// Used by websocket::stream to close a timed out connection
+inline void beast_close_socket(KtlsStream& stream)
+    {
+    stream.close();
+    }
+
+// WebSocket teardown sends close_notify, as it does for ssl::stream
+inline void teardown(beast::role_type, KtlsStream& stream, beast::error_code& ec)
+    {
+    ERR_clear_error();
+    SSL_shutdown(stream.native_handle());
+    stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+    }
+
+template <class TeardownHandler>
+void async_teardown(beast::role_type, KtlsStream& stream, TeardownHandler&& handler)
+    {
+    stream.async_shutdown(std::forward<TeardownHandler>(handler));
+    }
+
+} // namespace http
+} // namespace asciimmo
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace asciimmo {
+namespace metrics {
+
+// Log-linear latency histogram in the spirit of HdrHistogram. Values are in
+// microseconds; every power-of-two range is split into kSubBuckets linear
+// buckets, so any recorded value is known to within ~12%.
+class LatencyHistogram {
+public:
+    static constexpr int kSubBucketBits = 3;
+    static constexpr int kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kMaxBit = 31; // values are clamped below 2^31 us (~35 min)
+    static constexpr int kBuckets = (kMaxBit - kSubBucketBits + 1) * kSubBuckets;
+
+    using Snapshot = std::array<uint64_t, kBuckets>;
+
+    void record(uint64_t micros);
+    void add_to(Snapshot& counts) const;
+
+    static int bucket_index(uint64_t micros);
+    // Exclusive upper edge of a bucket, in microseconds
+    static uint64_t bucket_upper_bound(int index);
+    // Value at quantile q (0..1) of a merged snapshot, in microseconds
+    static uint64_t quantile(const Snapshot& counts, double q);
+
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> counts_{};
+};
+
+// Counters for one route within one shard
+struct RouteCounters {
+    std::array<std::atomic<uint64_t>, 5> status_classes{}; // 1xx..5xx
+    std::atomic<uint64_t> bytes_in{ 0 };
+    std::atomic<uint64_t> bytes_out{ 0 };
+    std::atomic<uint64_t> latency_sum_us{ 0 };
+    LatencyHistogram latency;
+};
+
+// Per-route request metrics and service gauges, rendered in Prometheus text
+// format. Recording threads write to their own shard so they don't share
+// cache lines; render() merges the shards. Routes must be added before
+// requests are recorded (i.e. before the server runs).
+class Registry {
+public:
+    explicit Registry(std::size_t shards = default_shards());
+
+    std::size_t add_route(const std::string& method, const std::string& route);
+    void record(std::size_t route, unsigned status, uint64_t bytes_in, uint64_t bytes_out,
+                std::chrono::microseconds latency);
+
+    // Gauge sampled whenever metrics are rendered
+    void add_gauge(const std::string& name, const std::string& help, std::function<double()> read);
+
+    std::string render() const;
+
+    static std::size_t default_shards();
+
+private:
+    struct RouteLabel {
+        std::string method;
+        std::string route;
+    };
+
+    struct Gauge {
+        std::string name;
+        std::string help;
+        std::function<double()> read;
+    };
+
+    struct alignas(64) Shard {
+        std::vector<std::unique_ptr<RouteCounters>> routes;
+    };
+
+    Shard& local_shard();
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<RouteLabel> labels_;
+    std::vector<Gauge> gauges_;
+    mutable std::mutex mtx_; // guards registration and gauges, never record()
+};
+
+} // namespace metrics
+} // namespace asciimmo
@@ -3,6 +3,11 @@
 #include <string>
 #include <random>
 #include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <openssl/sha.h>
 
 namespace asciimmo
@@ -10,6 +15,17 @@ namespace asciimmo
 namespace auth
 {
 
+// Cost of a scrypt hash: N = 2^log2_n, block size r, parallelism p. A hash
+// needs about 128 * N * r bytes while it runs; the defaults take 32 MiB and
+// tens of milliseconds. Each record keeps the parameters it was hashed with,
+// so these can be raised without invalidating stored passwords.
+struct ScryptParams
+    {
+    unsigned log2_n = 15;
+    unsigned r = 8;
+    unsigned p = 1;
+    };
+
 class PasswordHash
     {
     public:
@@ -52,6 +68,153 @@ class PasswordHash
             {
             return hash_password(password, salt) == hash;
             }
+
+        // Whether params are within what this class will hash or verify with:
+        // log2_n 10-20, r 1-32, p 1-16, and at most 1 GiB of memory
+        static bool scrypt_params_valid(const ScryptParams& params)
+            {
+            return params.log2_n >= 10 && params.log2_n <= 20 && params.r >= 1 && params.r <= 32 &&
+                params.p >= 1 && params.p <= 16 && scrypt_memory(params) <= (uint64_t(1) << 30);
+            }
+
+        // Hash password with scrypt and a random 128-bit salt. The result
+        // carries its parameters and salt:
+        //
+        //     $scrypt$ln=15,r=8,p=1$<salt hex>$<hash hex>
+        //
+        // Slow by design; call it off the io threads. Throws
+        // std::invalid_argument if params aren't valid.
+        static std::string hash_scrypt(const std::string& password, const ScryptParams& params)
+            {
+            if (!scrypt_params_valid(params))
+                {
+                throw std::invalid_argument("scrypt parameters out of range");
+                }
+            unsigned char salt[kScryptSaltBytes];
+            if (RAND_bytes(salt, sizeof(salt)) != 1)
+                {
+                throw std::runtime_error("RAND_bytes failed");
+                }
+            unsigned char key[kScryptKeyBytes];
+            scrypt(password, salt, sizeof(salt), params, key);
+            return "$scrypt$ln=" + std::to_string(params.log2_n) + ",r=" + std::to_string(params.r) +
+                ",p=" + std::to_string(params.p) + "$" + to_hex(salt, sizeof(salt)) + "$" + to_hex(key, sizeof(key));
+            }
+
+        // Verify password against a hash from hash_scrypt, with the
+        // parameters it was made with. False if encoded isn't one.
+        static bool verify_scrypt(const std::string& password, const std::string& encoded)
+            {
+            ScryptParams params;
+            std::string salt;
+            std::string key;
+            if (!parse_scrypt(encoded, params, salt, key))
+                {
+                return false;
+                }
+            unsigned char computed[kScryptKeyBytes];
+            scrypt(password, reinterpret_cast<const unsigned char*>(salt.data()), salt.size(), params, computed);
+            return CRYPTO_memcmp(computed, key.data(), sizeof(computed)) == 0;
+            }
+
+        // Whether encoded should be replaced by a hash with params: it isn't
+        // a scrypt hash, or one cheaper than params in any parameter
+        static bool needs_rehash(const std::string& encoded, const ScryptParams& params)
+            {
+            ScryptParams stored;
+            std::string salt;
+            std::string key;
+            if (!parse_scrypt(encoded, stored, salt, key))
+                {
+                return true;
+                }
+            return stored.log2_n < params.log2_n || stored.r < params.r || stored.p < params.p;
+            }
+
+    private:
+        static constexpr std::size_t kScryptSaltBytes = 16;
+        static constexpr std::size_t kScryptKeyBytes = 32;
+
+        static uint64_t scrypt_memory(const ScryptParams& params)
+            {
+            // What OpenSSL allocates: B is 128 * r * p, V is 128 * r * (N + 2)
+            return uint64_t(128) * params.r * ((uint64_t(1) << params.log2_n) + 2 + params.p);
+            }
+
+        static void scrypt(const std::string& password, const unsigned char* salt, std::size_t salt_len,
+            const ScryptParams& params, unsigned char* key)
+            {
+            if (EVP_PBE_scrypt(password.data(), password.size(), salt, salt_len, uint64_t(1) << params.log2_n,
+                    params.r, params.p, scrypt_memory(params), key, kScryptKeyBytes) != 1)
+                {
+                throw std::runtime_error("scrypt failed");
+                }
+            }
+
+        static std::string to_hex(const unsigned char* bytes, std::size_t len)
+            {
+            static constexpr char digits[] = "0123456789abcdef";
+            std::string hex;
+            hex.reserve(len * 2);
+            for (std::size_t i = 0; i < len; ++i)
+                {
+                hex += digits[bytes[i] >> 4];
+                hex += digits[bytes[i] & 0xf];
+                }
+            return hex;
+            }
+
+        static bool from_hex(const std::string& hex, std::size_t begin, std::size_t end, std::string& bytes)
+            {
+            auto nibble = [](char c) -> int
+                {
+                if (c >= '0' && c <= '9') return c - '0';
+                if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+                return -1;
+                };
+            if (end < begin || (end - begin) % 2 != 0)
+                {
+                return false;
+                }
+            bytes.clear();
+            for (std::size_t i = begin; i < end; i += 2)
+                {
+                const int high = nibble(hex[i]);
+                const int low = nibble(hex[i + 1]);
+                if (high < 0 || low < 0)
+                    {
+                    return false;
+                    }
+                bytes += static_cast<char>(high << 4 | low);
+                }
+            return true;
+            }
+
+        // Parameters from the database are checked like any others, so a
+        // bad row can't make a login allocate without bound
+        static bool parse_scrypt(const std::string& encoded, ScryptParams& params, std::string& salt, std::string& key)
+            {
+            const std::string prefix = "$scrypt$";
+            if (encoded.compare(0, prefix.size(), prefix) != 0)
+                {
+                return false;
+                }
+            const auto salt_start = encoded.find('$', prefix.size());
+            const auto key_start = salt_start == std::string::npos ? salt_start : encoded.find('$', salt_start + 1);
+            if (key_start == std::string::npos)
+                {
+                return false;
+                }
+            const std::string fields = encoded.substr(prefix.size(), salt_start - prefix.size());
+            char tail = 0;
+            if (std::sscanf(fields.c_str(), "ln=%u,r=%u,p=%u%c", &params.log2_n, &params.r, &params.p, &tail) != 3 ||
+                !scrypt_params_valid(params))
+                {
+                return false;
+                }
+            return from_hex(encoded, salt_start + 1, key_start, salt) && salt.size() == kScryptSaltBytes &&
+                from_hex(encoded, key_start + 1, encoded.size(), key) && key.size() == kScryptKeyBytes;
+            }
     };
 
 } // namespace auth
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "shared/http_server.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace asciimmo
+{
+namespace http
+{
+
+// Token bucket parameters: refill rate in tokens per second, holding at most
+// burst tokens. A rate of 0 means unlimited.
+struct RateLimit
+    {
+    double rate = 0;
+    double burst = 0;
+    };
+
+// Limits for one route (or "*" for every route without its own rule)
+struct RateLimitRule
+    {
+    std::string method; // empty matches any method
+    std::string route;  // route pattern exactly as registered
+    RateLimit per_ip;
+    RateLimit per_token; // keyed by the session_token query parameter
+    };
+
+// Lock-free table of token buckets keyed by 64-bit hashes.
+//
+// Each bucket is one atomic word holding its last refill time (milliseconds)
+// and its token count (1/256 token fixed point), updated with CAS. Slots are
+// never deleted: a bucket idle for longer than idle_expiry has refilled, so
+// the next key that probes into its slot takes it over. A request racing
+// with a takeover may be charged to the new key; the error is one token.
+class RateLimiter
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        struct Decision
+            {
+            bool allowed;
+            std::chrono::milliseconds retry_after; // time until a token is available
+            };
+
+        explicit RateLimiter(std::size_t capacity = 1 << 16, std::size_t shards = 16,
+            std::chrono::seconds idle_expiry = std::chrono::seconds(60))
+            : epoch_(Clock::now())
+            , idle_expiry_ms_(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(idle_expiry).count()))
+            {
+            shards = std::max<std::size_t>(shards, 1);
+            slots_per_shard_ = std::bit_ceil(std::max<std::size_t>(capacity / shards, kMaxProbe));
+            for (std::size_t i = 0; i < shards; ++i)
+                {
+                shards_.push_back(std::make_unique<Slot[]>(slots_per_shard_));
+                }
+            }
+
+        // Take a token from key's bucket
+        Decision try_acquire(uint64_t key, const RateLimit& limit, Clock::time_point now = Clock::now())
+            {
+            if (limit.rate <= 0)
+                {
+                return { true, std::chrono::milliseconds(0) };
+                }
+
+            const uint64_t now_ms = to_ms(now);
+            Slot* slot = find_or_claim(key == 0 ? 1 : key, now_ms);
+            if (slot == nullptr)
+                {
+                // No free slot nearby; fail open rather than limit innocent keys
+                overflowed_.fetch_add(1, std::memory_order_relaxed);
+                return { true, std::chrono::milliseconds(0) };
+                }
+
+            const uint64_t capacity = std::clamp<uint64_t>(
+                static_cast<uint64_t>(std::max(limit.burst, 1.0) * kOne), kOne, kTokenMask);
+            uint64_t old = slot->state.load(std::memory_order_relaxed);
+            for (;;)
+                {
+                uint64_t stamp = old >> kTokenBits;
+                uint64_t tokens = old & kTokenMask;
+                if (old == 0)
+                    {
+                    stamp = now_ms;
+                    tokens = capacity;
+                    }
+                else if (now_ms > stamp)
+                    {
+                    const double credit = static_cast<double>(now_ms - stamp) * limit.rate * kOne / 1000.0;
+                    if (credit >= 1.0)
+                        {
+                        tokens = static_cast<uint64_t>(std::min<double>(static_cast<double>(tokens) + credit,
+                            static_cast<double>(capacity)));
+                        stamp = now_ms;
+                        }
+                    }
+                tokens = std::min(tokens, capacity);
+
+                if (tokens < kOne)
+                    {
+                    rejected_.fetch_add(1, std::memory_order_relaxed);
+                    const double wait_ms = static_cast<double>(kOne - tokens) * 1000.0 / (limit.rate * kOne);
+                    return { false, std::chrono::milliseconds(static_cast<int64_t>(std::ceil(wait_ms))) };
+                    }
+
+                const uint64_t desired = (stamp << kTokenBits) | (tokens - kOne);
+                if (slot->state.compare_exchange_weak(old, desired, std::memory_order_relaxed))
+                    {
+                    return { true, std::chrono::milliseconds(0) };
+                    }
+                }
+            }
+
+        // Slots holding a bucket, including idle ones waiting to be taken over
+        std::size_t size() const
+            {
+            std::size_t used = 0;
+            for (const auto& shard : shards_)
+                {
+                for (std::size_t i = 0; i < slots_per_shard_; ++i)
+                    {
+                    used += shard[i].key.load(std::memory_order_relaxed) != 0;
+                    }
+                }
+            return used;
+            }
+
+        uint64_t rejected() const
+            {
+            return rejected_.load(std::memory_order_relaxed);
+            }
+
+        // Requests let through because the table had no room for their key
+        uint64_t overflowed() const
+            {
+            return overflowed_.load(std::memory_order_relaxed);
+            }
+
+    private:
+        struct alignas(16) Slot
+            {
+            std::atomic<uint64_t> key{ 0 };
+            std::atomic<uint64_t> state{ 0 }; // 0 = new bucket, treated as full
+            };
+
+        static constexpr int kTokenBits = 24;
+        static constexpr uint64_t kTokenMask = (uint64_t{ 1 } << kTokenBits) - 1;
+        static constexpr uint64_t kOne = 256; // one token in fixed point
+        static constexpr std::size_t kMaxProbe = 16;
+
+        uint64_t to_ms(Clock::time_point now) const
+            {
+            // Offset by one so that no real state word is 0
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - epoch_).count();
+            return static_cast<uint64_t>(std::max<int64_t>(ms, 0)) + 1;
+            }
+
+        Slot* find_or_claim(uint64_t key, uint64_t now_ms)
+            {
+            auto& shard = shards_[(key >> 48) % shards_.size()];
+            const std::size_t mask = slots_per_shard_ - 1;
+            Slot* idle = nullptr;
+            uint64_t idle_key = 0;
+
+            for (std::size_t i = 0; i < kMaxProbe; ++i)
+                {
+                Slot& slot = shard[(key + i) & mask];
+                uint64_t current = slot.key.load(std::memory_order_acquire);
+                if (current == key)
+                    {
+                    return &slot;
+                    }
+                if (current == 0)
+                    {
+                    if (slot.key.compare_exchange_strong(current, key, std::memory_order_acq_rel) || current == key)
+                        {
+                        return &slot;
+                        }
+                    continue;
+                    }
+                if (idle == nullptr)
+                    {
+                    const uint64_t state = slot.state.load(std::memory_order_relaxed);
+                    if (state == 0 || now_ms - std::min(now_ms, state >> kTokenBits) > idle_expiry_ms_)
+                        {
+                        idle = &slot;
+                        idle_key = current;
+                        }
+                    }
+                }
+
+            if (idle != nullptr && idle->key.compare_exchange_strong(idle_key, key, std::memory_order_acq_rel))
+                {
+                idle->state.store(0, std::memory_order_relaxed);
+                return idle;
+                }
+            return nullptr;
+            }
+
+        Clock::time_point epoch_;
+        uint64_t idle_expiry_ms_;
+        std::size_t slots_per_shard_;
+        std::vector<std::unique_ptr<Slot[]>> shards_;
+        std::atomic<uint64_t> rejected_{ 0 };
+        std::atomic<uint64_t> overflowed_{ 0 };
+    };
+
+namespace detail
+{
+
+inline uint64_t mix_key(uint64_t value, uint64_t scope)
+    {
+    // splitmix64 finalizer, so nearby IPs and scopes spread across the table
+    uint64_t x = value ^ (scope * 0x9E3779B97F4A7C15ULL);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+    }
+
+inline uint64_t address_key(const net::ip::address& address)
+    {
+    if (address.is_v4())
+        {
+        return address.to_v4().to_uint();
+        }
+    const auto bytes = address.to_v6().to_bytes();
+    return std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+    }
+
+} // namespace detail
+
+// The client a request came from. Public traffic reaches the services
+// through the tunnel, which connects from loopback, so for a loopback peer
+// the address the tunnel forwards is used: Cf-Connecting-Ip, else the last
+// hop of X-Forwarded-For. Anything else, or a header that isn't an address,
+// is the peer itself. Other peers are never taken at their word.
+inline net::ip::address client_address(const Request& req, const RequestContext& ctx)
+    {
+    if (!ctx.client_ip.is_loopback())
+        {
+        return ctx.client_ip;
+        }
+
+    std::string_view forwarded;
+    if (auto it = req.find("Cf-Connecting-Ip"); it != req.end())
+        {
+        forwarded = std::string_view(it->value().data(), it->value().size());
+        }
+    else if (auto it = req.find("X-Forwarded-For"); it != req.end())
+        {
+        forwarded = std::string_view(it->value().data(), it->value().size());
+        const auto comma = forwarded.rfind(',');
+        if (comma != std::string_view::npos)
+            {
+            forwarded.remove_prefix(comma + 1);
+            }
+        }
+    while (!forwarded.empty() && forwarded.front() == ' ')
+        {
+        forwarded.remove_prefix(1);
+        }
+    while (!forwarded.empty() && forwarded.back() == ' ')
+        {
+        forwarded.remove_suffix(1);
+        }
+    if (forwarded.empty())
+        {
+        return ctx.client_ip;
+        }
+
+    boost::system::error_code ec;
+    const auto address = net::ip::make_address(std::string(forwarded), ec);
+    return ec ? ctx.client_ip : address;
+    }
+
+// Rate limit svr's routes per client IP, as client_address finds it, and per
+// session token. Requests over a limit get 429 with Retry-After. Each rule
+// has its own buckets.
+inline void use_rate_limits(Server& svr, std::vector<RateLimitRule> rules,
+    std::shared_ptr<RateLimiter> limiter = std::make_shared<RateLimiter>())
+    {
+    if (rules.empty())
+        {
+        return;
+        }
+
+    svr.metrics().add_gauge("asciimmo_rate_limit_buckets", "Rate limiter buckets in use",
+        [limiter] { return static_cast<double>(limiter->size()); });
+    svr.metrics().add_gauge("asciimmo_rate_limited_requests", "Requests rejected by rate limits since start",
+        [limiter] { return static_cast<double>(limiter->rejected()); });
+
+    svr.use([limiter, rules = std::move(rules)](const Request& req, Response& res, RequestContext& ctx)
+        {
+        const RateLimitRule* fallback = nullptr;
+        const RateLimitRule* rule = nullptr;
+        const auto method = beast::http::to_string(req.method());
+        for (const auto& candidate : rules)
+            {
+            if (!candidate.method.empty() && candidate.method != std::string_view(method.data(), method.size()))
+                {
+                continue;
+                }
+            if (candidate.route == ctx.route->pattern_string)
+                {
+                rule = &candidate;
+                break;
+                }
+            if (candidate.route == "*" && fallback == nullptr)
+                {
+                fallback = &candidate;
+                }
+            }
+        rule = rule != nullptr ? rule : fallback;
+        if (rule == nullptr)
+            {
+            return true;
+            }
+
+        const auto scope = static_cast<uint64_t>(rule - rules.data()) * 2;
+        auto decision = limiter->try_acquire(detail::mix_key(detail::address_key(client_address(req, ctx)), scope), rule->per_ip);
+        if (decision.allowed && rule->per_token.rate > 0)
+            {
+            auto token = ctx.param("session_token");
+            if (!token.empty())
+                {
+                decision = limiter->try_acquire(
+                    detail::mix_key(std::hash<std::string_view>{}(token), scope + 1), rule->per_token);
+                }
+            }
+        if (decision.allowed)
+            {
+            return true;
+            }
+
+        const auto retry_after = std::max<int64_t>(1, (decision.retry_after.count() + 999) / 1000);
+        res.result(beast::http::status::too_many_requests);
+        res.set(beast::http::field::retry_after, std::to_string(retry_after));
+        res.body() = R"({"error":"rate limit exceeded"})";
+        res.prepare_payload();
+        return false;
+        });
+    }
+
+} // namespace http
+} // namespace asciimmo
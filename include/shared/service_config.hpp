@@ -4,6 +4,7 @@
 #include <vector>
 #include <map>
 #include <stdexcept>
+#include <utility>
 #include <yaml-cpp/yaml.h>
 
 namespace asciimmo::config
@@ -20,6 +21,17 @@ class ServiceConfig
             std::string name;
             };
 
+        // One entry of <service>.rate_limits; a rate of 0 leaves that key unlimited
+        struct RateLimitConfig
+            {
+            std::string route;
+            std::string method;
+            double ip_rate = 0;
+            double ip_burst = 0;
+            double token_rate = 0;
+            double token_burst = 0;
+            };
+
         static ServiceConfig& instance()
             {
             static ServiceConfig config;
@@ -161,12 +173,47 @@ class ServiceConfig
                 return targets;
             }
 
+        // Get per-route rate limits for a service
+        std::vector<RateLimitConfig> get_rate_limits(const std::string& service) const
+            {
+            std::vector<RateLimitConfig> limits;
+
+            if (!loaded_) return limits;
+
+            try
+                {
+                YAML::Node limits_node = navigate_to_key(service + ".rate_limits");
+                if (limits_node && limits_node.IsSequence())
+                    {
+                    for (const auto& entry : limits_node)
+                        {
+                        RateLimitConfig limit;
+                        limit.route = entry["route"].as<std::string>("*");
+                        limit.method = entry["method"].as<std::string>("");
+                        limit.ip_rate = entry["ip_rate"].as<double>(0);
+                        limit.ip_burst = entry["ip_burst"].as<double>(limit.ip_rate);
+                        limit.token_rate = entry["token_rate"].as<double>(0);
+                        limit.token_burst = entry["token_burst"].as<double>(limit.token_rate);
+                        limits.push_back(limit);
+                        }
+                    }
+                }
+                catch (...)
+                    {
+                    // If parsing fails, return what was read so far
+                    }
+
+                return limits;
+            }
+
     private:
         ServiceConfig() = default;
 
         // Navigate to a key using dot notation (e.g., "section.subsection.key")
         YAML::Node navigate_to_key(const std::string& key) const
             {
+            // Lookups go through const nodes so missing keys aren't created,
+            // and reset() rebinds; assigning a Node would overwrite the tree
             YAML::Node node = root_;
 
             size_t start = 0;
@@ -175,14 +222,15 @@ class ServiceConfig
             while (end != std::string::npos)
                 {
                 std::string part = key.substr(start, end - start);
-                if (!node[part]) return YAML::Node();
-                node = node[part];
+                const YAML::Node child = std::as_const(node)[part];
+                if (!child) return YAML::Node();
+                node.reset(child);
                 start = end + 1;
                 end = key.find('.', start);
                 }
 
             std::string last_part = key.substr(start);
-            return node[last_part];
+            return std::as_const(node)[last_part];
             }
 
         YAML::Node root_;
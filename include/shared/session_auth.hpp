@@ -0,0 +1,475 @@
+#pragma once
+
+#include "shared/http_server.hpp"
+#include "shared/http_client.hpp"
+#include "shared/logger.hpp"
+#include "shared/service_config.hpp"
+#include "shared/shared_token_table.hpp"
+#include "shared/token_cache.hpp"
+#include "shared/token_lookup.hpp"
+#include "shared/token_snapshot.hpp"
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/use_future.hpp>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+// Check a session token, signed or numeric, against the cache. False if it
+// is missing, malformed or not valid; claims.token_id is set when it parses.
+inline bool validate_session_token(std::string_view token_str, TokenCache& cache, TokenClaims& claims)
+    {
+    return cache.validate_token(token_str, claims);
+    }
+
+inline bool validate_session_token(std::string_view token_str, TokenCache& cache)
+    {
+    TokenClaims claims;
+    return validate_session_token(token_str, cache, claims);
+    }
+
+// The token endpoints are for services on this host. The tunnel connects
+// from loopback too, but marks what it forwards. Answers 403 and returns
+// false for anyone else.
+inline bool local_only(const http::Request& req, http::Response& res, const http::RequestContext& ctx)
+    {
+    if (!ctx.client_ip.is_loopback() || req.count("X-Forwarded-For") != 0
+        || req.count("Cf-Connecting-Ip") != 0)
+        {
+        res.result(boost::beast::http::status::forbidden);
+        res.body() = R"({"status":"error","message":"forbidden"})";
+        res.prepare_payload();
+        return false;
+        }
+    return true;
+    }
+
+// Auth stage for a Server: requests to protected routes need a valid
+// session_token query parameter, checked once before routing reaches the
+// handler. Handlers read the result from RequestContext.
+//
+// With a fallback, a numeric token the cache doesn't know is checked with
+// session-service before the request is refused. Only those requests wait;
+// the rest never leave the synchronous path.
+inline void use_session_auth(http::Server& svr, TokenCache& cache, TokenLookup* fallback = nullptr)
+    {
+    svr.use([&cache, fallback](const http::Request&, http::Response& res, http::RequestContext& ctx)
+        {
+        if (ctx.route->access == http::Access::Public)
+            {
+            return true;
+            }
+
+        TokenClaims claims;
+        const std::string_view token = ctx.param("session_token");
+        if (!validate_session_token(token, cache, claims))
+            {
+            if (fallback != nullptr && claims.token_id != 0 && !TokenSigner::is_signed(token)
+                && !cache.is_revoked(claims.token_id))
+                {
+                // Left unauthenticated for the lookup stage below
+                ctx.session_token = claims.token_id;
+                return true;
+                }
+            res.result(boost::beast::http::status::unauthorized);
+            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
+            res.prepare_payload();
+            return false;
+            }
+        ctx.authenticated = true;
+        ctx.session_token = claims.token_id;
+        ctx.user_id = claims.user_id;
+        return true;
+        });
+
+    if (fallback == nullptr)
+        {
+        return;
+        }
+
+    svr.use_async(
+        [](const http::Request&, const http::RequestContext& ctx)
+        {
+        return ctx.route->access != http::Access::Public && !ctx.authenticated;
+        },
+        [fallback](const http::Request&, http::Response& res, http::RequestContext& ctx) -> net::awaitable<bool>
+        {
+        bool isAdmin = false;
+        if (!co_await fallback->lookup(ctx.session_token, isAdmin))
+            {
+            ctx.session_token = 0;
+            res.result(boost::beast::http::status::unauthorized);
+            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
+            res.prepare_payload();
+            co_return false;
+            }
+        ctx.authenticated = true;
+        co_return true;
+        });
+    }
+
+// Token cache limits from services.yaml, under <service>.token_cache then
+// global.token_cache. Unset keys leave that limit off, except max_revoked,
+// which keeps its default.
+inline TokenCacheLimits token_cache_limits(const config::ServiceConfig& config, const std::string& service)
+    {
+    auto get = [&](const std::string& key)
+        {
+        auto global_val = config.get_ulonglong("global.token_cache." + key, 0);
+        return static_cast<std::size_t>(config.get_ulonglong(service + ".token_cache." + key, global_val));
+        };
+
+    TokenCacheLimits limits;
+    limits.max_entries = get("max_entries");
+    limits.max_bytes = get("max_bytes");
+    limits.max_revoked = get("max_revoked");
+    return limits;
+    }
+
+// Lookup options for a service, from <service>.token_fallback in
+// services.yaml. False if the fallback is disabled.
+inline bool token_lookup_options(const config::ServiceConfig& config, const std::string& service, LookupOptions& options)
+    {
+    const std::string prefix = service + ".token_fallback.";
+    if (!config.get_bool(prefix + "enabled", false))
+        {
+        return false;
+        }
+    options.negative_ttl = std::chrono::milliseconds(
+        config.get_int(prefix + "negative_ttl_ms", static_cast<int>(options.negative_ttl.count())));
+    options.max_negative = static_cast<std::size_t>(
+        config.get_ulonglong(prefix + "max_negative", options.max_negative));
+    return true;
+    }
+
+// Parse a batch registration body, {"ttl":900,"tokens":[1,2,3]}, as sent by
+// TokenBroadcaster. False if either field is missing or malformed.
+inline bool parse_token_batch(std::string_view body, std::vector<uint64_t>& tokens, std::chrono::seconds& ttl)
+    {
+    constexpr std::string_view ttl_key = "\"ttl\":";
+    constexpr std::string_view tokens_key = "\"tokens\":[";
+
+    auto ttl_pos = body.find(ttl_key);
+    auto tokens_pos = body.find(tokens_key);
+    if (ttl_pos == std::string_view::npos || tokens_pos == std::string_view::npos)
+        {
+        return false;
+        }
+
+    const char* end = body.data() + body.size();
+    int ttl_seconds = 0;
+    auto [ttl_end, ttl_ec] = std::from_chars(body.data() + ttl_pos + ttl_key.size(), end, ttl_seconds);
+    if (ttl_ec != std::errc() || ttl_seconds <= 0)
+        {
+        return false;
+        }
+    ttl = std::chrono::seconds(ttl_seconds);
+
+    const char* p = body.data() + tokens_pos + tokens_key.size();
+    while (p != end && *p != ']')
+        {
+        uint64_t token = 0;
+        auto [next, ec] = std::from_chars(p, end, token);
+        if (ec != std::errc())
+            {
+            return false;
+            }
+        tokens.push_back(token);
+        p = next;
+        if (p != end && *p == ',')
+            {
+            ++p;
+            }
+        }
+    return p != end;
+    }
+
+// Registers POST /token/register/batch, where session-service's
+// TokenBroadcaster delivers new session tokens, and POST /token/revoke for
+// logouts. A batch goes into the cache under one lock. A registered token
+// is a valid session and a revoked one a logout, so only local callers may
+// send either. A revocation is held for at most max_ttl, the longest a
+// token lives.
+inline void use_token_registration(http::Server& svr, TokenCache& cache,
+    std::chrono::seconds max_ttl = std::chrono::minutes(15))
+    {
+    svr.post("/token/register/batch", http::Access::Public,
+        [&cache](const http::Request& req, http::Response& res, const std::smatch&, const http::RequestContext& ctx)
+        {
+        if (!local_only(req, res, ctx))
+            {
+            return;
+            }
+        std::vector<uint64_t> tokens;
+        std::chrono::seconds ttl{ 0 };
+        if (!parse_token_batch(req.body(), tokens, ttl))
+            {
+            res.result(boost::beast::http::status::bad_request);
+            res.body() = R"({"status":"error","message":"invalid token batch"})";
+            res.prepare_payload();
+            return;
+            }
+        cache.add_tokens(tokens, ttl);
+        res.result(boost::beast::http::status::ok);
+        res.body() = R"({"status":"ok","registered":)" + std::to_string(tokens.size()) + "}";
+        res.prepare_payload();
+        });
+
+    // Logouts, in the same format; ttl covers the tokens' remaining lifetime
+    svr.post("/token/revoke", http::Access::Public,
+        [&cache, max_ttl](const http::Request& req, http::Response& res, const std::smatch&, const http::RequestContext& ctx)
+        {
+        if (!local_only(req, res, ctx))
+            {
+            return;
+            }
+        std::vector<uint64_t> tokens;
+        std::chrono::seconds ttl{ 0 };
+        if (!parse_token_batch(req.body(), tokens, ttl))
+            {
+            res.result(boost::beast::http::status::bad_request);
+            res.body() = R"({"status":"error","message":"invalid token batch"})";
+            res.prepare_payload();
+            return;
+            }
+        cache.revoke_tokens(tokens, std::min(ttl, max_ttl));
+        res.result(boost::beast::http::status::ok);
+        res.body() = R"({"status":"ok","revoked":)" + std::to_string(tokens.size()) + "}";
+        res.prepare_payload();
+        });
+    }
+
+// The host's shared-memory token table, from global.shared_tokens in
+// services.yaml. Null when it is disabled or can't be mapped. A consumer
+// left without it has to ask session-service for broadcasts
+// (request_token_broadcasts); session-service broadcasts whatever it
+// can't write to the table anyway.
+inline std::unique_ptr<SharedTokenTable> shared_token_table(const config::ServiceConfig& config, log::Logger& logger)
+    {
+    if (!config.get_bool("global.shared_tokens.enabled", false))
+        {
+        return nullptr;
+        }
+
+    const std::string name = config.get_string("global.shared_tokens.name", "/asciimmo_tokens");
+    const auto capacity = static_cast<std::size_t>(config.get_ulonglong("global.shared_tokens.capacity", 65536));
+    try
+        {
+        auto table = SharedTokenTable::open(name, capacity);
+        logger.info("Using shared token table " + name + " (" + std::to_string(table->capacity()) + " slots)");
+        return table;
+        }
+        catch (const std::system_error& e)
+            {
+            logger.warning("Shared token table unavailable: " + std::string(e.what()));
+            return nullptr;
+            }
+    }
+
+// How long session-service keeps broadcasting after a request for it
+constexpr std::chrono::seconds kBroadcastRequestTtl{ 30 };
+
+// For a service that couldn't map the shared token table session-service
+// writes to: asks session-service at host:port to broadcast new tokens as
+// well, now and every interval after for as long as the io_context runs.
+// session-service broadcasts until kBroadcastRequestTtl after the last
+// request, so it picks the request up again after a restart.
+inline void request_token_broadcasts(net::any_io_executor executor, http::Client& client, std::string host,
+    unsigned short port, log::Logger& logger, std::chrono::seconds interval = std::chrono::seconds(10))
+    {
+    logger.warning("Asking session-service to broadcast tokens to this service");
+    net::co_spawn(executor, [&client, host = std::move(host), port, &logger, interval]() -> net::awaitable<void>
+        {
+        net::steady_timer timer(co_await net::this_coro::executor);
+        bool failing = false;
+        for (;;)
+            {
+            bool ok = false;
+            try
+                {
+                auto res = co_await client.post(host, port, "/token/subscribe", "{}");
+                ok = res.result() == boost::beast::http::status::ok;
+                }
+                catch (const std::exception&)
+                    {
+                    }
+            // Once per outage, not once per attempt
+            if (ok == failing)
+                {
+                failing = !ok;
+                if (failing)
+                    {
+                    logger.error("session-service at " + host + ":" + std::to_string(port)
+                        + " didn't take the broadcast request; new sessions may be refused here");
+                    }
+                else
+                    {
+                    logger.info("session-service is broadcasting tokens to this service again");
+                    }
+                }
+            timer.expires_after(interval);
+            co_await timer.async_wait(net::use_awaitable);
+            }
+        },
+        net::detached);
+    }
+
+// Runs cache.cleanup_expired() every interval on the executor, for as long
+// as its io_context runs
+inline void reap_expired_tokens(net::any_io_executor executor, TokenCache& cache, std::chrono::milliseconds interval)
+    {
+    net::co_spawn(executor, [&cache, interval]() -> net::awaitable<void>
+        {
+        net::steady_timer timer(co_await net::this_coro::executor);
+        for (;;)
+            {
+            timer.expires_after(interval);
+            co_await timer.async_wait(net::use_awaitable);
+            cache.cleanup_expired();
+            }
+        },
+        net::detached);
+    }
+
+// Loads session-service's snapshot of live tokens into cache, so a service
+// that (re)starts after players logged in accepts their sessions from its
+// first request. Runs ioc until the fetch is done, so call it before
+// Server::run(). Returns the number of tokens loaded; 0, with a warning, if
+// session-service couldn't be reached.
+inline std::size_t warm_token_cache(boost::asio::io_context& ioc, http::Client& client, const std::string& host,
+    unsigned short port, TokenCache& cache, log::Logger& logger)
+    {
+    http::ClientRequest req{ boost::beast::http::verb::get, "/token/snapshot", 11 };
+    auto result = boost::asio::co_spawn(ioc, client.request(host, port, std::move(req)), boost::asio::use_future);
+    while (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+        if (ioc.run_one() == 0)
+            {
+            ioc.restart();
+            }
+        }
+
+    try
+        {
+        auto res = result.get();
+        std::vector<TokenSnapshotEntry> entries;
+        if (res.result() != boost::beast::http::status::ok || !decode_token_snapshot(res.body(), entries))
+            {
+            logger.warning("Token snapshot from " + host + ":" + std::to_string(port) + " was refused or malformed");
+            return 0;
+            }
+        cache.bulk_load(entries);
+        logger.info("Loaded " + std::to_string(entries.size()) + " session tokens from snapshot");
+        return entries.size();
+        }
+        catch (const std::exception& e)
+            {
+            logger.warning("Could not fetch token snapshot: " + std::string(e.what()));
+            return 0;
+            }
+    }
+
+// What use_token_validation sets up; keep it for as long as the server runs
+struct TokenValidation
+    {
+    std::unique_ptr<TokenCache> cache;
+    std::unique_ptr<TokenLookup> lookup; // null unless token_fallback is enabled
+    std::unique_ptr<SharedTokenTable> shared_table; // null unless mapped
+    };
+
+// Everything a service that accepts session tokens needs, configured from
+// the <service> section of services.yaml: the token cache and its limits,
+// the session-service fallback, the shared token table, the signing key,
+// the snapshot at startup, broadcasts when the table can't be mapped, the
+// expiry reaper, /token/register/batch and /token/revoke, and their gauges.
+// Runs ioc for the snapshot, so call it before Server::run().
+inline TokenValidation use_token_validation(http::Server& svr, boost::asio::io_context& ioc, http::Client& client,
+    const config::ServiceConfig& config, const std::string& service, log::Logger& logger)
+    {
+    TokenValidation validation;
+    validation.cache = std::make_unique<TokenCache>();
+    TokenCache& cache = *validation.cache;
+    cache.set_limits(token_cache_limits(config, service));
+    const auto session_port = static_cast<unsigned short>(config.get_int("session_service.port", 8082));
+
+    // Tokens the cache missed are checked with session-service before refusing
+    LookupOptions lookup_options;
+    if (token_lookup_options(config, service, lookup_options))
+        {
+        validation.lookup = std::make_unique<TokenLookup>(client, ioc.get_executor(),
+            http::Endpoint{ "localhost", session_port }, cache, lookup_options, logger);
+        }
+    use_session_auth(svr, cache, validation.lookup.get());
+
+    // Tokens written by session-service on this host are valid here at once
+    validation.shared_table = shared_token_table(config, logger);
+    cache.use_shared_table(validation.shared_table.get());
+
+    // Signed tokens are verified here without being registered first
+    const std::string signing_key = config.get_string("global.token_signing_key", "");
+    if (!signing_key.empty())
+        {
+        cache.use_signing_key(signing_key);
+        }
+
+    // Pick up sessions created while this service was down
+    const bool needs_tokens = config.get_bool(service + ".needs_session", false) && signing_key.empty();
+    if (needs_tokens)
+        {
+        warm_token_cache(ioc, client, "localhost", session_port, cache, logger);
+        }
+
+    // Without the table session-service writes to, tokens have to be pushed
+    if (needs_tokens && !validation.shared_table && config.get_bool("global.shared_tokens.enabled", false))
+        {
+        request_token_broadcasts(ioc.get_executor(), client, "localhost", session_port, logger);
+        }
+
+    svr.metrics().add_gauge("asciimmo_token_cache_entries", "Session tokens held in the token cache",
+        [&cache]() { return static_cast<double>(cache.size()); });
+    svr.metrics().add_gauge("asciimmo_token_cache_bytes", "Heap bytes held by the token cache",
+        [&cache]() { return static_cast<double>(cache.memory_bytes()); });
+    svr.metrics().add_gauge("asciimmo_token_cache_evictions", "Session tokens evicted to keep the token cache within its limits",
+        [&cache]() { return static_cast<double>(cache.evictions()); });
+    svr.metrics().add_gauge("asciimmo_token_cache_revoked", "Logged out session tokens the token cache refuses",
+        [&cache]() { return static_cast<double>(cache.revoked()); });
+    svr.metrics().add_gauge("asciimmo_token_cache_reclaimed", "Expired session tokens removed from the token cache",
+        [&cache]() { return static_cast<double>(cache.reclaimed()); });
+    if (validation.lookup)
+        {
+        TokenLookup& lookup = *validation.lookup;
+        svr.metrics().add_gauge("asciimmo_token_lookups", "Cache misses checked with session-service",
+            [&lookup]() { return static_cast<double>(lookup.stats().lookups); });
+        svr.metrics().add_gauge("asciimmo_token_lookup_negative_hits", "Cache misses refused without asking session-service",
+            [&lookup]() { return static_cast<double>(lookup.stats().negative_hits); });
+        svr.metrics().add_gauge("asciimmo_token_lookup_failures", "Token lookups that failed or got a server error",
+            [&lookup]() { return static_cast<double>(lookup.stats().failures); });
+        }
+
+    // Expired tokens are dropped as their minute passes
+    reap_expired_tokens(ioc.get_executor(), cache,
+        std::chrono::milliseconds(config.get_int("global.token_reap_interval_ms", 30000)));
+
+    // Batched registration and logouts, from session-service's broadcaster
+    use_token_registration(svr, cache, std::chrono::seconds(config.get_int("session_service.token_ttl", 900)));
+    return validation;
+    }
+
+} // namespace auth
+} // namespace asciimmo
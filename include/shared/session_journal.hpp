@@ -0,0 +1,143 @@
+#pragma once
+
+#include "shared/session_store.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace asciimmo
+{
+namespace session
+{
+
+enum class FsyncPolicy
+    {
+    never,    // leave it to the OS; a crash of the host loses what it hadn't written
+    interval, // sync at most fsync_interval after a write, at the store's next flush
+    always    // sync every batch before the store counts it written
+    };
+
+struct JournalOptions
+    {
+    // Holds sessions.snapshot and sessions.journal; created if missing
+    std::string directory;
+    FsyncPolicy fsync = FsyncPolicy::interval;
+    std::chrono::milliseconds fsync_interval{ 1000 };
+    // The journal is compacted into a new snapshot once it is larger than
+    // both this and the snapshot
+    std::size_t compact_bytes = 64 << 20;
+    };
+
+// A session as replay hands it over. The views point into the journal's
+// mapping and are only valid during the call.
+struct JournaledSession
+    {
+    uint64_t token_id;
+    uint64_t user_id;
+    std::chrono::system_clock::time_point expires_at;
+    std::string_view token;
+    std::string_view data;
+    };
+
+// "never", "interval" or "always"; throws std::invalid_argument otherwise
+FsyncPolicy parse_fsync_policy(std::string_view name);
+
+// A SessionBackend on local disk, for session-service without a database.
+//
+// Every batch the store writes is appended to sessions.journal with one
+// write(2): creates with their token and data, logouts, and activity as one
+// record per touch batch. Each record carries its length and a checksum, so
+// a record torn by a crash is found and cut off when the journal is next
+// opened. The journal only grows; cleanup folds it and the last snapshot
+// into a new sessions.snapshot of the sessions still live, renamed into
+// place once it is synced, and empties the journal.
+//
+// Opening maps both files and indexes what the journal changed since the
+// snapshot; replay then streams the snapshot past that index and hands every
+// live session to the store. Nothing is copied out of the mappings on the
+// way. For a million sessions, 100k of them in the journal, opening takes
+// about 25 ms, and replay through a SessionStore::Restorer 0.45-0.5 s on
+// one core (bench/session_journal_bench.cpp). Reading and holding the
+// sessions is about 90 ms of that; the rest is building the store's maps,
+// a key, a node and one block of JSON per session. With spare cores, the
+// store's workers fill its shards side by side.
+//
+// load always misses: every session the journal has is in the store from
+// startup. Calls come from the store's workers and are serialized.
+class SessionJournal : public SessionBackend
+    {
+    public:
+        // Throws std::runtime_error if the files can't be opened or read, or
+        // aren't a session journal
+        explicit SessionJournal(JournalOptions options);
+        ~SessionJournal() override;
+
+        SessionJournal(const SessionJournal&) = delete;
+        SessionJournal& operator=(const SessionJournal&) = delete;
+
+        using Restore = std::function<void(const JournaledSession&)>;
+
+        // Calls restore with every session that was live when the journal was
+        // opened, then releases what opening read. Returns how many there
+        // were. Call once, before the store starts.
+        std::size_t replay(const Restore& restore);
+
+        // About how many sessions replay will hand over, to size the store
+        // before it does; 0 once replayed
+        std::size_t expected_sessions() const;
+
+        void write(std::span<const SessionWrite> writes) override;
+        void touch(std::span<const uint64_t> tokens, std::chrono::system_clock::time_point when,
+            std::chrono::system_clock::time_point expires_at) override;
+        bool load(uint64_t token, SessionRecord& record) override;
+        // Compacts once the journal is large enough, dropping expired
+        // sessions whatever limit is; returns how many were dropped
+        std::size_t cleanup(std::size_t limit) override;
+        // With FsyncPolicy::interval, syncs writes that have waited
+        // fsync_interval, so a journal that has gone quiet is synced too
+        void tick() override;
+
+        // Write a snapshot of the live sessions and empty the journal.
+        // Returns how many expired sessions were dropped.
+        std::size_t compact();
+
+        struct Stats
+            {
+            uint64_t journal_bytes;  // appended since the last compaction
+            uint64_t snapshot_bytes;
+            uint64_t syncs;
+            uint64_t compactions;
+            };
+
+        Stats stats() const;
+
+    private:
+        struct Fold;
+
+        // Called with mtx_ held
+        void append(const std::string& records);
+        void sync_locked(std::chrono::steady_clock::time_point now);
+        std::size_t compact_locked();
+
+        const JournalOptions options_;
+        const std::string journal_path_;
+        const std::string snapshot_path_;
+        mutable std::mutex mtx_;
+        int fd_ = -1;
+        uint64_t journal_bytes_ = 0;
+        uint64_t snapshot_bytes_ = 0;
+        uint64_t syncs_ = 0;
+        uint64_t compactions_ = 0;
+        bool dirty_ = false; // written since the last sync
+        std::chrono::steady_clock::time_point last_sync_;
+        std::unique_ptr<Fold> opened_; // until replay
+    };
+
+} // namespace session
+} // namespace asciimmo
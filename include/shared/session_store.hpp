@@ -0,0 +1,366 @@
+#pragma once
+
+// Boost 1.74's awaitable.hpp uses std::exchange without including it
+#include <utility>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace asciimmo
+{
+namespace session
+{
+
+namespace net = boost::asio;
+
+// A session as the sessions table holds it
+struct SessionRecord
+    {
+    uint64_t token_id = 0;
+    uint64_t user_id = 0; // 0 when unknown
+    std::string data;
+    std::chrono::system_clock::time_point expires_at;
+    };
+
+struct SessionWrite
+    {
+    enum class Kind
+        {
+        upsert,
+        remove
+        };
+
+    Kind kind;
+    SessionRecord record; // only token_id is used for remove
+    // The token the client holds, for backends that key by it; upserts only
+    std::string token;
+    };
+
+// Durable storage behind a SessionStore. Calls are blocking and come from
+// the store's worker threads, never from the io_context.
+class SessionBackend
+    {
+    public:
+        virtual ~SessionBackend() = default;
+
+        // Apply writes in order, all or none; throws if they weren't applied
+        virtual void write(std::span<const SessionWrite> writes) = 0;
+        // Set the last activity of each token's session to when, and its
+        // expiry to expires_at
+        virtual void touch(std::span<const uint64_t> tokens, std::chrono::system_clock::time_point when,
+            std::chrono::system_clock::time_point expires_at) = 0;
+        // The unexpired session stored under token, if there is one
+        virtual bool load(uint64_t token, SessionRecord& record) = 0;
+        // Delete up to limit expired sessions; returns how many were deleted
+        virtual std::size_t cleanup(std::size_t limit) = 0;
+        // Called at the end of every flush, whether or not it had anything
+        // to write, for work a backend does on its own schedule
+        virtual void tick() {}
+    };
+
+struct StoreOptions
+    {
+    // Rounded up to a power of two, at most 1024
+    std::size_t shards = 16;
+    // How often queued writes and activity go to the backend
+    std::chrono::milliseconds flush_interval{ 1000 };
+    // Writes per backend call
+    std::size_t max_batch = 512;
+    // Writes queued at once; past this, new ones are dropped
+    std::size_t max_pending = 100000;
+    // Threads that call the backend, for flushes and loads on a miss
+    std::size_t workers = 2;
+    // A session unused this long expires; each use moves its expiry to
+    // this far from then
+    std::chrono::seconds idle_ttl{ 900 };
+    // How often expired sessions are removed from memory
+    std::chrono::milliseconds reap_interval{ 30000 };
+    // How often expired sessions are deleted from the backend, and how
+    // many at a time
+    std::chrono::milliseconds cleanup_interval{ 300000 };
+    std::size_t cleanup_batch = 1000;
+    // A token the backend had no session for is answered as missing this
+    // long without asking again; at most max_negative are remembered
+    std::chrono::milliseconds negative_ttl{ 5000 };
+    std::size_t max_negative = 65536;
+    };
+
+// A session's data as a JSON string, quotes included, escaped once when the
+// session is stored. Immutable, so lookups and responses share it instead
+// of copying it; the text lives in the same allocation as the view.
+using SessionJson = std::shared_ptr<const std::string_view>;
+
+SessionJson to_session_json(std::string_view data);
+
+// Numeric tokens are their own id; anything else has none
+uint64_t numeric_token_id(std::string_view token);
+
+// session-service's sessions, keyed by the token string handed to the
+// client. The map is split into shards, each behind its own mutex, and
+// looked up by string_view so a request's token is never copied to find
+// its session. A lookup holds the shard lock only to take a reference to
+// the session's SessionJson.
+//
+// With a backend, every create and logout is queued and written behind in
+// batches, one transaction per batch, and a session the map doesn't have
+// is loaded from the backend on first use, and one it doesn't have either
+// isn't asked about again for negative_ttl. A lookup marks its session
+// active; the marks are collected per shard and written as one update per
+// flush, so a busy session costs at most one write per interval however
+// often it is read. Without a backend the store is memory only.
+//
+// Expiry slides: each lookup gives a session another idle_ttl, in memory
+// and, with the next flush, in the backend. An expired session is never
+// returned. Sessions are filed by the minute they expire in, and a reaper
+// on the io_context drops each minute's sessions as it passes, filing any
+// that were used since under their new minute, so it never scans live
+// ones. A filing points at the session's node in the map; a session
+// removed any other way keeps its node, without its data, until the
+// reaper reaches the last filing of it. The backend's expired rows are
+// deleted in batches of cleanup_batch, each its own transaction, every
+// cleanup_interval. The
+// same activity marks go to the on_activity handler, if one is set, so
+// whatever else holds a session's token can extend it too.
+//
+// Safe to use from several threads. Destroying the store waits for its
+// workers and flushes whatever is still queued.
+class SessionStore
+    {
+    public:
+        // The backend id of a token, or 0 if it doesn't name one
+        using TokenResolver = std::function<uint64_t(std::string_view)>;
+        // Receives the backend ids of sessions used since the last flush
+        using ActivityHandler = std::function<void(std::span<const uint64_t>)>;
+
+        explicit SessionStore(StoreOptions options, SessionBackend* backend = nullptr,
+            TokenResolver resolve = numeric_token_id);
+        ~SessionStore();
+
+        SessionStore(const SessionStore&) = delete;
+        SessionStore& operator=(const SessionStore&) = delete;
+
+        // Add or replace the session for token
+        void put(std::string token, SessionRecord record);
+
+        // Called by every flush, on a worker thread, with the sessions whose
+        // expiry slid since the one before. Set before start().
+        void on_activity(ActivityHandler handler);
+
+        // Make room for this many sessions, so restoring them doesn't rehash
+        void reserve(std::size_t sessions);
+
+        // Add a session read back from the backend, without writing it there
+        void restore(std::string_view token, uint64_t token_id, std::string_view data,
+            std::chrono::system_clock::time_point expires_at);
+
+        class Restorer;
+
+        // The data of token's session, from memory only; null if there is
+        // none
+        SessionJson find(std::string_view token);
+
+        // Like find, but asks the backend on a miss and keeps what it
+        // returns. The backend is called on a worker thread; the caller
+        // resumes on its own executor. token must outlive the call.
+        net::awaitable<SessionJson> load(std::string_view token);
+
+        // Remove token's session, from the backend too. Only sessions in
+        // memory are removed; load one first to remove it wherever it is.
+        bool erase(std::string_view token);
+
+        // Write out what is queued now. Blocking; returns the writes applied.
+        // Failed writes stay queued for the next flush.
+        std::size_t flush();
+
+        // Remove expired sessions from memory. Returns how many were removed.
+        std::size_t reap_expired();
+
+        // Delete expired sessions from the backend. Blocking; returns how
+        // many were deleted.
+        std::size_t cleanup_backend();
+
+        // Until the io_context stops: reap every reap_interval, and flush
+        // every flush_interval (with a backend or an on_activity handler)
+        // and clean up the backend every cleanup_interval, both on the
+        // worker threads
+        void start(net::any_io_executor executor);
+
+        std::size_t size() const;
+        std::size_t pending() const;
+
+        struct Stats
+            {
+            uint64_t writes;   // writes applied by the backend
+            uint64_t touches;  // sessions whose activity was written
+            uint64_t loads;    // misses asked of the backend
+            uint64_t loaded;   // of those, sessions it had
+            uint64_t failures; // backend calls that threw
+            uint64_t dropped;  // writes dropped with the queue full
+            uint64_t expired;  // sessions reaped from memory
+            uint64_t cleaned;  // expired sessions deleted from the backend
+            uint64_t negative_hits; // misses answered without asking the backend
+            };
+
+        Stats stats() const;
+
+    private:
+        // Accepts std::string and std::string_view alike. Not noexcept, so
+        // libstdc++ keeps each node's hash and walking a bucket doesn't
+        // hash every key in it again.
+        struct TokenHash
+            {
+            using is_transparent = void;
+
+            std::size_t operator()(std::string_view token) const
+                {
+                return std::hash<std::string_view>{}(token);
+                }
+            };
+
+        using Clock = std::chrono::system_clock;
+
+        struct Entry
+            {
+            uint64_t token_id;
+            SessionJson json;
+            Clock::time_point expires_at;
+            // The expiry minute it is filed under; earlier filings are stale
+            int64_t filed = 0;
+            // Filings pointing at this node; it stays in the map until the
+            // reaper has passed them all
+            uint32_t filings = 0;
+            // The shard generation this session was last marked active in
+            uint64_t touched = 0;
+            };
+
+        using Sessions = std::unordered_map<std::string, Entry, TokenHash, std::equal_to<>>;
+        // Nodes never move, so filings can point at them
+        using Node = Sessions::value_type;
+
+        struct alignas(64) Shard
+            {
+            std::mutex mtx;
+            // Removed sessions stay, with a null json, while they are filed
+            Sessions sessions;
+            std::size_t live = 0;
+            // Backend ids of sessions used since the last flush
+            std::vector<uint64_t> touched;
+            // Bumped by each flush, so a session is marked once per flush
+            uint64_t generation = 1;
+            // Sessions by the minute they were due to expire in when filed.
+            // Sessions used since are refiled when their minute comes up;
+            // stale filings, and those of removed sessions, are skipped.
+            std::map<int64_t, std::vector<Node*>> expiry;
+
+            // These are called with mtx held
+            void file(Node& node);
+            // Add or replace token's session
+            void assign(std::string token, Entry entry);
+            // Drop a session's data; its node goes once it isn't filed
+            void remove(Node& node);
+            };
+
+        Shard& shard_for(std::string_view token);
+        // Runs task every interval, on the worker threads if on_workers
+        net::awaitable<void> every(std::chrono::milliseconds interval, std::function<void()> task, bool on_workers);
+        void enqueue(SessionWrite write);
+        void insert(std::string_view token, Entry entry);
+        void assign(std::string token, Entry entry);
+        // Whether the backend recently had no session for id
+        bool known_missing(uint64_t id);
+        void remember_missing(uint64_t id);
+
+        const StoreOptions options_;
+        SessionBackend* const backend_;
+        const TokenResolver resolve_;
+        ActivityHandler on_activity_;
+        std::size_t shard_mask_;
+        std::unique_ptr<Shard[]> shards_;
+        mutable std::mutex pending_mtx_;
+        std::vector<SessionWrite> pending_;
+        std::mutex flush_mtx_; // one flush at a time
+        net::thread_pool workers_;
+        std::atomic<uint64_t> writes_{ 0 };
+        std::atomic<uint64_t> touches_{ 0 };
+        std::atomic<uint64_t> loads_{ 0 };
+        std::atomic<uint64_t> loaded_{ 0 };
+        std::atomic<uint64_t> failures_{ 0 };
+        std::atomic<uint64_t> dropped_{ 0 };
+        std::atomic<uint64_t> expired_{ 0 };
+        std::atomic<uint64_t> cleaned_{ 0 };
+        std::atomic<uint64_t> negative_hits_{ 0 };
+        std::mutex negative_mtx_;
+        // Backend ids with no session, until when that is trusted
+        std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> negative_;
+        std::atomic<std::size_t> negative_count_{ 0 }; // lets put skip the lock when there are none
+    };
+
+// Restores sessions in bulk, as from a journal at startup. add only copies
+// the token and data into blocks held per shard; commit then sizes each
+// shard for what it holds and fills it on the store's workers, under one
+// lock per shard, freeing the blocks as it goes. Each token may be added
+// once. The destructor waits for whatever is still being added,
+// but only commit adds what is held and reports failures.
+class SessionStore::Restorer
+    {
+    public:
+        explicit Restorer(SessionStore& store);
+        ~Restorer();
+
+        Restorer(const Restorer&) = delete;
+        Restorer& operator=(const Restorer&) = delete;
+
+        // Like SessionStore::restore, but the session may not be found
+        // until commit returns
+        void add(std::string_view token, uint64_t token_id, std::string_view data,
+            std::chrono::system_clock::time_point expires_at);
+
+        // Add everything held and wait until it is all in the store.
+        // Rethrows what adding threw.
+        void commit();
+
+    private:
+        static constexpr std::size_t kBlock = 64 * 1024;
+
+        // A session as added: its token, then its data, at text
+        struct Held
+            {
+            const char* text;
+            std::size_t token_size;
+            std::size_t data_size;
+            uint64_t token_id;
+            Clock::time_point expires_at;
+            };
+
+        struct HeldShard
+            {
+            std::vector<Held> sessions;
+            std::vector<std::unique_ptr<char[]>> blocks;
+            char* free = nullptr;
+            std::size_t left = 0;
+            };
+
+        // Add shard's held sessions to it; runs on a worker
+        void fill(std::size_t shard);
+
+        SessionStore& store_;
+        std::vector<HeldShard> held_;
+        std::vector<std::future<void>> sent_;
+    };
+
+} // namespace session
+} // namespace asciimmo
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+// Numeric session tokens that say where they live. From the high bit down:
+//
+//     0 | instance (8) | random (55)
+//
+// The top bit stays clear so a token fits the signed 64-bit columns and
+// parsers the other services use. instance is the session-service that
+// issued the token, so a load balancer or another instance can route a
+// lookup with token >> 55 and no directory. Everything below it is
+// random: the token is the bearer credential, and with a million live
+// sessions a guess still has about a 2^-35 chance of naming one.
+//
+// The random bits come from OpenSSL's CSPRNG, drawn batch words at a time
+// so issuing a token rarely calls into it. A token is never 0, which means
+// "no token" everywhere.
+class SessionTokenGenerator
+    {
+    public:
+        static constexpr int kInstanceBits = 8;
+        static constexpr int kRandomBits = 55;
+        static constexpr unsigned kMaxInstance = (1u << kInstanceBits) - 1;
+
+        // Throws std::invalid_argument if instance is above kMaxInstance
+        explicit SessionTokenGenerator(unsigned instance, std::size_t batch = 512);
+
+        SessionTokenGenerator(const SessionTokenGenerator&) = delete;
+        SessionTokenGenerator& operator=(const SessionTokenGenerator&) = delete;
+
+        // A new token. Safe to call from several threads; throws
+        // std::runtime_error if the CSPRNG fails.
+        uint64_t generate();
+
+        unsigned instance() const
+            {
+            return instance_;
+            }
+
+        // The instance that issued token
+        static unsigned instance_of(uint64_t token)
+            {
+            return static_cast<unsigned>(token >> kRandomBits) & kMaxInstance;
+            }
+
+    private:
+        uint64_t next_random();
+
+        const unsigned instance_;
+        std::mutex mtx_;
+        std::vector<uint64_t> pool_;
+        std::size_t next_;
+    };
+
+} // namespace auth
+} // namespace asciimmo
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+// Session tokens in POSIX shared memory, for services on one host. The
+// writer (session-service) stores a token once and every process that has
+// the table mapped sees it on its next lookup: no broadcast, no syscalls and
+// no locks on the read path.
+//
+// The table is an open-addressing hash of fixed-size slots, each guarded by
+// a sequence lock. A writer makes the slot's sequence odd, updates it and
+// makes it even again; a reader retries if the sequence was odd or changed
+// while it read. A slot that stays busy, as one left odd by a writer that
+// died partway through would, reads as a miss until it is written again.
+// Expiry stamps are steady_clock (CLOCK_MONOTONIC) times, which all
+// processes on the host share. Expired slots are reused by later inserts,
+// and tokens are never removed otherwise, so probe chains stay intact. A
+// token lives within a fixed number of slots of its hash, so a lookup reads
+// at most that many however full the table is.
+//
+// Token 0 marks an empty slot and can't be stored.
+class SharedTokenTable
+    {
+    public:
+        // Maps the named table, creating it with room for capacity tokens
+        // (rounded up to a power of two) if it doesn't exist yet. An existing
+        // table keeps its own capacity. Throws std::system_error on failure.
+        static std::unique_ptr<SharedTokenTable> open(const std::string& name, std::size_t capacity);
+
+        // Unlinks the name; processes that already mapped it keep their mapping
+        static void remove(const std::string& name);
+
+        ~SharedTokenTable();
+
+        SharedTokenTable(const SharedTokenTable&) = delete;
+        SharedTokenTable& operator=(const SharedTokenTable&) = delete;
+
+        // Add or update a token. False if the slots near its hash are all
+        // taken by live tokens, as they will be once the table is full.
+        // Only one process should write; threads within it may share.
+        bool add_token(uint64_t token, std::chrono::seconds ttl, bool isAdmin = false);
+
+        // Whether token is present and unexpired; isAdmin is set when it is
+        bool find(uint64_t token, bool& isAdmin) const;
+
+        bool validate_token(uint64_t token) const
+            {
+            bool isAdmin = false;
+            return find(token, isAdmin);
+            }
+
+        std::size_t capacity() const
+            {
+            return mask_ + 1;
+            }
+
+        // Occupied slots, including expired tokens awaiting reuse
+        std::size_t size() const;
+
+    private:
+        struct Header;
+        struct Slot;
+
+        SharedTokenTable(void* base, std::size_t bytes);
+
+        void* base_;
+        std::size_t bytes_;
+        Header* header_;
+        Slot* slots_;
+        std::size_t mask_;
+    };
+
+} // namespace auth
+} // namespace asciimmo
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+struct TokenClaims
+    {
+    uint64_t token_id = 0; // random per session; what revocations name
+    uint64_t user_id = 0;
+    bool isAdmin = false;
+    int64_t expires_at = 0; // unix seconds
+    };
+
+// Self-describing session tokens, signed with a key every service shares:
+//
+//     s1.<token_id>.<user_id>.<admin>.<expires_at>.<mac>
+//
+// where mac is the first 128 bits of HMAC-SHA256 over everything before it,
+// in hex. Any service holding the key can check a token without having been
+// told about it. Expiry is wall-clock time so it means the same on every
+// host.
+//
+// Every service trusts the user id in a token it verifies, so only
+// session-service signs. It takes the id from callers on its own host,
+// which is auth-service once a login has checked the password; the id never
+// comes from the client.
+class TokenSigner
+    {
+    public:
+        explicit TokenSigner(std::string key)
+            : key_(std::move(key))
+            {}
+
+        std::string issue(const TokenClaims& claims) const;
+
+        std::string issue(uint64_t token_id, uint64_t user_id, bool isAdmin, std::chrono::seconds ttl) const;
+
+        // True if the token is well formed, carries a valid MAC and hasn't
+        // expired. The MAC comparison takes the same time wherever it differs.
+        bool verify(std::string_view token, TokenClaims& claims) const;
+
+        static bool is_signed(std::string_view token)
+            {
+            return token.substr(0, 3) == "s1.";
+            }
+
+    private:
+        std::string key_;
+    };
+
+} // namespace auth
+} // namespace asciimmo
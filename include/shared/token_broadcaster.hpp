@@ -0,0 +1,332 @@
+#pragma once
+
+#include "shared/http_client.hpp"
+#include "shared/logger.hpp"
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+namespace net = boost::asio;
+
+struct BroadcastOptions
+    {
+    // How long the first queued token waits for others to share its request
+    std::chrono::milliseconds max_delay{ 10 };
+    // A batch this large is sent at once
+    std::size_t max_batch = 256;
+    std::chrono::seconds ttl{ 900 };
+    // A revocation a target didn't take is sent to it again after this,
+    // doubling up to max_retry_delay while it keeps failing
+    std::chrono::milliseconds retry_delay{ 500 };
+    std::chrono::milliseconds max_retry_delay{ 30000 };
+    };
+
+// Pushes new session tokens to the services that validate them. Tokens are
+// queued and sent in batches to each target's /token/register/batch, all
+// targets concurrently, so a burst of logins costs one request per target
+// instead of one per token. A lost registration is covered by the token
+// fallback, but a lost revocation would leave a logged out token working, so
+// revocations a target doesn't take are retried until it does or the token
+// expires.
+//
+// Safe to use from several threads. Must outlive the io_context run, like
+// the Client it sends through.
+class TokenBroadcaster
+    {
+    public:
+        TokenBroadcaster(http::Client& client, net::any_io_executor executor, std::vector<http::Endpoint> targets,
+            BroadcastOptions options, log::Logger& logger)
+            : client_(client)
+            , timer_(executor)
+            , targets_(std::move(targets))
+            , options_(options)
+            , logger_(logger)
+            {
+            retries_.reserve(targets_.size());
+            for (std::size_t i = 0; i < targets_.size(); ++i)
+                {
+                everyone_.push_back(i);
+                retries_.push_back(std::make_unique<Retries>(executor, options_.retry_delay));
+                }
+            }
+
+        TokenBroadcaster(const TokenBroadcaster&) = delete;
+        TokenBroadcaster& operator=(const TokenBroadcaster&) = delete;
+
+        // Queue a token for the next batch
+        void enqueue(uint64_t token)
+            {
+            if (targets_.empty())
+                {
+                return;
+                }
+
+            std::vector<uint64_t> batch;
+            {
+            std::lock_guard<std::mutex> lock(mtx_);
+            pending_.push_back(token);
+            if (pending_.size() < options_.max_batch)
+                {
+                if (pending_.size() == 1)
+                    {
+                    arm_timer();
+                    }
+                return;
+                }
+            batch.swap(pending_);
+            timer_.cancel();
+            }
+            send("/token/register/batch", batch, options_.ttl, everyone_);
+            }
+
+        // Tell every target a token was logged out. Sent at once rather than
+        // batched; ttl should cover the token's remaining lifetime.
+        void revoke(uint64_t token, std::chrono::seconds ttl)
+            {
+            if (targets_.empty())
+                {
+                return;
+                }
+            const Revocation revocation{ token, std::chrono::steady_clock::now() + ttl };
+            send("/token/revoke", { token }, ttl, everyone_,
+                [this, revocation](std::size_t target, bool delivered)
+                {
+                if (!delivered)
+                    {
+                    retry_later(target, { revocation });
+                    }
+                });
+            }
+
+        // Send whatever is queued now
+        void flush()
+            {
+            std::vector<uint64_t> batch;
+            {
+            std::lock_guard<std::mutex> lock(mtx_);
+            batch.swap(pending_);
+            timer_.cancel();
+            }
+            if (!batch.empty())
+                {
+                send("/token/register/batch", batch, options_.ttl, everyone_);
+                }
+            }
+
+        struct Stats
+            {
+            uint64_t batches_sent;
+            uint64_t tokens_sent;
+            uint64_t failed_deliveries; // per target
+            uint64_t abandoned_revocations; // per target, expired before a retry got through
+            };
+
+        Stats stats() const
+            {
+            return {
+                batches_sent_.load(std::memory_order_relaxed),
+                tokens_sent_.load(std::memory_order_relaxed),
+                failed_deliveries_.load(std::memory_order_relaxed),
+                abandoned_revocations_.load(std::memory_order_relaxed)
+                };
+            }
+
+        std::size_t pending() const
+            {
+            std::lock_guard<std::mutex> lock(mtx_);
+            return pending_.size();
+            }
+
+    private:
+        // Called with mtx_ held
+        void arm_timer()
+            {
+            timer_.expires_after(options_.max_delay);
+            timer_.async_wait([this](const boost::system::error_code& ec)
+                {
+                if (!ec)
+                    {
+                    flush();
+                    }
+                });
+            }
+
+        struct Revocation
+            {
+            uint64_t token;
+            std::chrono::steady_clock::time_point expires;
+            };
+
+        // Revocations waiting to be sent to one target again
+        struct Retries
+            {
+            Retries(const net::any_io_executor& executor, std::chrono::milliseconds delay)
+                : timer(executor)
+                , delay(delay)
+                {}
+
+            net::steady_timer timer;
+            std::vector<Revocation> pending;
+            std::chrono::milliseconds delay;
+            bool armed = false;
+            };
+
+        void retry_later(std::size_t target, std::vector<Revocation> revocations)
+            {
+            auto& retries = *retries_[target];
+            std::lock_guard<std::mutex> lock(mtx_);
+            retries.pending.insert(retries.pending.end(), revocations.begin(), revocations.end());
+            if (retries.armed)
+                {
+                return;
+                }
+            retries.armed = true;
+            retries.timer.expires_after(retries.delay);
+            retries.timer.async_wait([this, target](const boost::system::error_code& ec)
+                {
+                if (!ec)
+                    {
+                    retry(target);
+                    }
+                });
+            }
+
+        void retry(std::size_t target)
+            {
+            auto& retries = *retries_[target];
+            std::vector<Revocation> due;
+            {
+            std::lock_guard<std::mutex> lock(mtx_);
+            due.swap(retries.pending);
+            retries.armed = false;
+            }
+
+            // Once a token has expired the target refuses it anyway
+            const auto now = std::chrono::steady_clock::now();
+            const auto expired = std::erase_if(due, [now](const Revocation& r) { return r.expires <= now; });
+            if (expired > 0)
+                {
+                abandoned_revocations_.fetch_add(expired, std::memory_order_relaxed);
+                logger_.warning("Gave up revoking " + std::to_string(expired) + " expired tokens at "
+                    + targets_[target].host + ":" + std::to_string(targets_[target].port));
+                }
+            if (due.empty())
+                {
+                return;
+                }
+
+            std::vector<uint64_t> tokens;
+            auto latest = now;
+            for (const auto& revocation : due)
+                {
+                tokens.push_back(revocation.token);
+                latest = std::max(latest, revocation.expires);
+                }
+            const auto ttl = std::chrono::ceil<std::chrono::seconds>(latest - now);
+            send("/token/revoke", tokens, ttl, { target },
+                [this, target, due = std::move(due)](std::size_t, bool delivered)
+                {
+                auto& retries = *retries_[target];
+                {
+                std::lock_guard<std::mutex> lock(mtx_);
+                retries.delay = delivered ? options_.retry_delay : std::min(retries.delay * 2, options_.max_retry_delay);
+                }
+                if (!delivered)
+                    {
+                    retry_later(target, due);
+                    }
+                });
+            }
+
+        // Sends batch to the targets at the given indices; on_result hears
+        // whether each one took it
+        void send(const char* path, const std::vector<uint64_t>& batch, std::chrono::seconds ttl,
+            const std::vector<std::size_t>& to, std::function<void(std::size_t, bool)> on_result = {})
+            {
+            std::string body = R"({"ttl":)" + std::to_string(ttl.count()) + R"(,"tokens":[)";
+            body.reserve(body.size() + batch.size() * 21 + 2);
+            for (std::size_t i = 0; i < batch.size(); ++i)
+                {
+                if (i > 0)
+                    {
+                    body += ',';
+                    }
+                body += std::to_string(batch[i]);
+                }
+            body += "]}";
+
+            http::ClientRequest req{ boost::beast::http::verb::post, path, 11 };
+            req.set(boost::beast::http::field::content_type, "application/json");
+            req.body() = std::move(body);
+
+            std::vector<http::Endpoint> endpoints;
+            for (std::size_t target : to)
+                {
+                endpoints.push_back(targets_[target]);
+                }
+
+            batches_sent_.fetch_add(1, std::memory_order_relaxed);
+            tokens_sent_.fetch_add(batch.size(), std::memory_order_relaxed);
+            const std::size_t count = batch.size();
+            client_.fan_out(std::move(endpoints), std::move(req),
+                [this, count, to, on_result = std::move(on_result)](std::vector<http::FanOutResult> results)
+                {
+                for (std::size_t i = 0; i < results.size(); ++i)
+                    {
+                    const auto& result = results[i];
+                    const auto address = result.endpoint.host + ":" + std::to_string(result.endpoint.port);
+                    const bool delivered = !result.ec && result.response.result() == boost::beast::http::status::ok;
+                    if (result.ec)
+                        {
+                        logger_.error("Exception broadcasting to " + address + " - " + result.ec.message());
+                        }
+                    else if (!delivered)
+                        {
+                        logger_.warning("Failed to broadcast " + std::to_string(count) + " tokens to " + address);
+                        }
+                    else
+                        {
+                        logger_.debug("Broadcasted " + std::to_string(count) + " tokens to " + address);
+                        }
+                    if (!delivered)
+                        {
+                        failed_deliveries_.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    if (on_result)
+                        {
+                        on_result(to[i], delivered);
+                        }
+                    }
+                });
+            }
+
+        http::Client& client_;
+        net::steady_timer timer_;
+        const std::vector<http::Endpoint> targets_;
+        const BroadcastOptions options_;
+        log::Logger& logger_;
+        std::vector<std::size_t> everyone_; // indices of all targets
+        mutable std::mutex mtx_; // guards pending_, timer_ and the retries
+        std::vector<uint64_t> pending_;
+        std::vector<std::unique_ptr<Retries>> retries_; // one per target
+        std::atomic<uint64_t> batches_sent_{ 0 };
+        std::atomic<uint64_t> tokens_sent_{ 0 };
+        std::atomic<uint64_t> failed_deliveries_{ 0 };
+        std::atomic<uint64_t> abandoned_revocations_{ 0 };
+    };
+
+} // namespace auth
+} // namespace asciimmo
@@ -1,9 +1,24 @@
 #pragma once
 
+#include "shared/flat_token_map.hpp"
 #include "shared/logger.hpp"
+#include "shared/shared_token_table.hpp"
+#include "shared/signed_token.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstddef>
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include <mutex>
+#include <shared_mutex>
 #include <chrono>
 
 namespace asciimmo
@@ -22,34 +37,169 @@ struct TokenInfo
         }
     };
 
+// One live token in a snapshot, with the time it has left
+struct TokenSnapshotEntry
+    {
+    uint64_t token;
+    std::chrono::seconds ttl;
+    bool isAdmin;
+    };
+
+// Limits on what a TokenCache holds; 0 leaves a limit off
+struct TokenCacheLimits
+    {
+    std::size_t max_entries = 0;
+    std::size_t max_bytes = 0; // as memory_bytes() counts them
+    // Revocations held at once. These are always bounded; 0 keeps
+    // TokenCache::kDefaultMaxRevoked.
+    std::size_t max_revoked = 0;
+    };
+
+// Tokens are spread over kShards shards, each with its own lock for writers.
+// Lookups take no lock: each shard has a sequence that a writer makes odd
+// while it changes the shard, and a lookup retries if the sequence was odd
+// or moved while it read, so readers never write shared memory. A lookup
+// that keeps losing to writers waits on the lock instead. Revocations are
+// rare and kept in one list beside the shards. It holds at most
+// max_revoked; past that the revocation due to lapse first is dropped.
+//
+// Shards keep tokens in a FlatTokenMap, expiry and admin flag packed into
+// one 16-byte entry. Each shard also files its tokens by the minute they
+// expire in, so cleanup_expired() only visits tokens whose minute has passed
+// instead of the whole cache. A refreshed token stays filed under its old
+// minute too and is skipped when that minute comes round.
+//
+// With limits set, a shard that is full makes room for a new token by
+// evicting the token nearest to expiry, by minute, so memory stays fixed
+// however many tokens are registered.
 class TokenCache
     {
     public:
-        // Add or update a token with 15 minute expiration
+        static constexpr std::size_t kShards = 64;
+        static constexpr std::size_t kDefaultMaxRevoked = 65536;
+
+        // Bound the cache. Limits are split evenly over the shards. Call
+        // before the cache is shared between threads.
+        void set_limits(TokenCacheLimits limits)
+            {
+            std::size_t per_shard = limits.max_entries == 0 ? 0 : (limits.max_entries + kShards - 1) / kShards;
+            if (limits.max_bytes != 0)
+                {
+                const std::size_t fit = entries_within(limits.max_bytes / kShards);
+                per_shard = per_shard == 0 ? fit : std::min(per_shard, fit);
+                }
+            shard_limit_ = per_shard == 0 ? 0 : std::max<std::size_t>(per_shard, 1);
+            max_revoked_ = limits.max_revoked == 0 ? kDefaultMaxRevoked : limits.max_revoked;
+            }
+
+        // Also accept tokens from a shared-memory table written by
+        // session-service. It is checked first, without taking a lock.
+        void use_shared_table(const SharedTokenTable* table)
+            {
+            shared_ = table;
+            }
+
+        // Accept signed tokens (TokenSigner) carrying their own expiry and
+        // admin flag. They are checked against the key and the revocation
+        // list only, never the cache.
+        void use_signing_key(std::string key)
+            {
+            signer_ = std::make_unique<TokenSigner>(std::move(key));
+            }
+
+        // Add or update a token with 15 minute expiration. A token still
+        // revoked isn't added: a registration that arrives after its logout
+        // must not bring it back.
         void add_token(uint64_t token, int expirationMinutes = 15, bool isAdmin = false)
             {
-            std::lock_guard<std::mutex> lock(mtx_);
-            auto expires = std::chrono::steady_clock::now() + std::chrono::minutes(expirationMinutes);
-            cache_[token] = TokenInfo{ expires, isAdmin };
+            auto now = std::chrono::steady_clock::now();
+            auto expires = now + std::chrono::minutes(expirationMinutes);
+            std::lock_guard<std::mutex> revoked_lock(revoked_mtx_);
+            if (revoked_locked(token, now))
+                {
+                return;
+                }
+            Shard& shard = shard_for(token);
+            Shard::Writing writing(shard);
+            count_evictions(shard.put(token, TokenInfo{ expires, isAdmin }, shard_limit_));
+            }
+
+        // Add or update a batch of tokens, taking each shard's lock once.
+        // Tokens still revoked are skipped, as in add_token.
+        void add_tokens(const std::vector<uint64_t>& tokens, std::chrono::seconds ttl = std::chrono::minutes(15),
+            bool isAdmin = false)
+            {
+            auto now = std::chrono::steady_clock::now();
+            auto expires = now + ttl;
+            std::size_t evicted = 0;
+            // Held throughout, so a revocation can't land between the check
+            // and the insert
+            std::lock_guard<std::mutex> revoked_lock(revoked_mtx_);
+            for_each_shard(tokens, [this, expires, isAdmin, now, &evicted](Shard& shard, uint64_t token)
+                {
+                if (!revoked_locked(token, now))
+                    {
+                    evicted += shard.put(token, TokenInfo{ expires, isAdmin }, shard_limit_);
+                    }
+                });
+            count_evictions(evicted);
+            }
+
+        // Validate a token as a client sends it: signed, when a signing key
+        // is set, or numeric. claims.token_id is set when the token parses;
+        // the other claims only come with signed tokens.
+        bool validate_token(std::string_view token, TokenClaims& claims)
+            {
+            if (signer_ != nullptr && TokenSigner::is_signed(token))
+                {
+                return signer_->verify(token, claims) && !is_revoked(claims.token_id);
+                }
+
+            const char* end = token.data() + token.size();
+            auto [ptr, ec] = std::from_chars(token.data(), end, claims.token_id);
+            if (token.empty() || ec != std::errc() || ptr != end)
+                {
+                return false;
+                }
+            return validate_token(claims.token_id);
+            }
+
+        bool validate_admin(std::string_view token)
+            {
+            if (signer_ != nullptr && TokenSigner::is_signed(token))
+                {
+                TokenClaims claims;
+                return signer_->verify(token, claims) && !is_revoked(claims.token_id) && claims.isAdmin;
+                }
+
+            uint64_t id = 0;
+            const char* end = token.data() + token.size();
+            auto [ptr, ec] = std::from_chars(token.data(), end, id);
+            return !token.empty() && ec == std::errc() && ptr == end && validate_admin(id);
             }
 
         // Check if token is valid and return user data
         bool validate_token(uint64_t token)
             {
-            std::lock_guard<std::mutex> lock(mtx_);
-            auto it = cache_.find(token);
+            if (shared_ != nullptr && !is_revoked(token) && shared_->validate_token(token))
+                {
+                return true;
+                }
+
+            TokenInfo info;
+            const bool found = find(token, info);
 
 #ifdef NDEBUG
             // Release build: enforce token validation
-            return (it != cache_.end() && it->second.is_valid());
+            return found && info.is_valid();
 #else
             // Debug build: always return true, but log when token is invalid
-            if (it == cache_.end())
+            if (!found)
                 {
                 logger_.info("Token validation bypassed (debug mode): token not found - " + std::to_string(token));
                 return true;
                 }
-            if (!it->second.is_valid())
+            if (!info.is_valid())
                 {
                 logger_.info("Token validation bypassed (debug mode): token expired - " + std::to_string(token));
                 return true;
@@ -60,36 +210,452 @@ class TokenCache
 
         bool validate_admin(uint64_t token)
             {
-            std::lock_guard<std::mutex> lock(mtx_);
-            auto it = cache_.find(token);
-            if (it == cache_.end() || !it->second.is_valid())
+            bool isAdmin = false;
+            if (shared_ != nullptr && !is_revoked(token) && shared_->find(token, isAdmin))
+                {
+                return isAdmin;
+                }
+
+            TokenInfo info;
+            return find(token, info) && info.is_valid() && info.isAdmin;
+            }
+
+        // A cached token's remaining lifetime and admin flag, with no debug
+        // bypass; for answering other services' lookups
+        bool find_token(uint64_t token, TokenSnapshotEntry& entry)
+            {
+            TokenInfo info;
+            auto now = std::chrono::steady_clock::now();
+            if (!find(token, info) || now >= info.expires_at)
                 {
                 return false;
                 }
-            return it->second.isAdmin;
+            entry = { token, std::chrono::ceil<std::chrono::seconds>(info.expires_at - now), info.isAdmin };
+            return true;
             }
 
-        // Remove expired tokens (periodic cleanup)
-        void cleanup_expired()
+        // Logged out tokens. They are dropped from the cache and refused
+        // until ttl passes, which should cover their remaining lifetime.
+        void revoke_tokens(const std::vector<uint64_t>& tokens, std::chrono::seconds ttl)
+            {
+            std::lock_guard<std::mutex> lock(revoked_mtx_);
+            const auto now = std::chrono::steady_clock::now();
+            const auto until = now + ttl;
+            for (uint64_t token : tokens)
+                {
+                auto [it, added] = revoked_.try_emplace(token);
+                if (!added)
+                    {
+                    revoked_by_expiry_.erase(it->second);
+                    }
+                it->second = revoked_by_expiry_.emplace(until, token);
+                }
+            trim_revoked(now);
+            revoked_count_.store(revoked_.size(), std::memory_order_relaxed);
+            for_each_shard(tokens, [](Shard& shard, uint64_t token)
+                {
+                shard.tokens.erase(token);
+                });
+            }
+
+        bool is_revoked(uint64_t token)
+            {
+            if (revoked_count_.load(std::memory_order_relaxed) == 0)
+                {
+                return false;
+                }
+            std::lock_guard<std::mutex> lock(revoked_mtx_);
+            return revoked_locked(token, std::chrono::steady_clock::now());
+            }
+
+        // Remove expired tokens and revocations (periodic cleanup). Tokens go
+        // once the minute they expired in is over. Returns how many were
+        // removed.
+        std::size_t cleanup_expired()
             {
-            std::lock_guard<std::mutex> lock(mtx_);
             auto now = std::chrono::steady_clock::now();
-            for (auto it = cache_.begin(); it != cache_.end(); )
+            {
+            std::lock_guard<std::mutex> lock(revoked_mtx_);
+            trim_revoked(now);
+            revoked_count_.store(revoked_.size(), std::memory_order_relaxed);
+            }
+
+            std::size_t reclaimed = 0;
+            const int64_t current = expiry_minute(now);
+            for (Shard& shard : shards_)
                 {
-                if (now >= it->second.expires_at)
+                Shard::Writing writing(shard);
+                while (!shard.expiry.empty() && shard.expiry.begin()->first < current)
                     {
-                    it = cache_.erase(it);
+                    for (uint64_t token : shard.expiry.begin()->second)
+                        {
+                        const int64_t* stamp = shard.tokens.find(token);
+                        if (stamp != nullptr && now >= unpack(*stamp).expires_at)
+                            {
+                            shard.tokens.erase(token);
+                            ++reclaimed;
+                            }
+                        }
+                    shard.expiry.erase(shard.expiry.begin());
                     }
-                else
+                }
+            reclaimed_.fetch_add(reclaimed, std::memory_order_relaxed);
+            return reclaimed;
+            }
+
+        // Tokens removed by cleanup_expired() so far
+        uint64_t reclaimed() const
+            {
+            return reclaimed_.load(std::memory_order_relaxed);
+            }
+
+        // Live tokens and their remaining lifetimes, for warming up another cache
+        std::vector<TokenSnapshotEntry> snapshot()
+            {
+            auto now = std::chrono::steady_clock::now();
+            std::vector<TokenSnapshotEntry> entries;
+            entries.reserve(size());
+            for (Shard& shard : shards_)
+                {
+                std::shared_lock lock(shard.mtx);
+                shard.tokens.for_each([&entries, now](uint64_t token, int64_t stamp)
+                    {
+                    const TokenInfo info = unpack(stamp);
+                    if (now < info.expires_at)
+                        {
+                        // Rounded up so a token never expires early on the receiving side
+                        auto ttl = std::chrono::ceil<std::chrono::seconds>(info.expires_at - now);
+                        entries.push_back({ token, ttl, info.isAdmin });
+                        }
+                    });
+                }
+            return entries;
+            }
+
+        // Load a snapshot, taking each shard's lock once. Tokens already
+        // present keep the later of the two expiries; revoked tokens are
+        // skipped.
+        void bulk_load(const std::vector<TokenSnapshotEntry>& entries)
+            {
+            auto now = std::chrono::steady_clock::now();
+            std::vector<uint64_t> tokens;
+            std::unordered_map<uint64_t, TokenInfo> loaded;
+            std::lock_guard<std::mutex> revoked_lock(revoked_mtx_);
+            tokens.reserve(entries.size());
+            loaded.reserve(entries.size());
+            for (const auto& entry : entries)
+                {
+                if (!revoked_locked(entry.token, now) && loaded.emplace(entry.token, TokenInfo{ now + entry.ttl, entry.isAdmin }).second)
+                    {
+                    tokens.push_back(entry.token);
+                    }
+                }
+
+            std::size_t evicted = 0;
+            for_each_shard(tokens, [this, &loaded, &evicted](Shard& shard, uint64_t token)
+                {
+                const TokenInfo& info = loaded[token];
+                const int64_t* stamp = shard.tokens.find(token);
+                if (stamp == nullptr || unpack(*stamp).expires_at < info.expires_at)
                     {
-                    ++it;
+                    evicted += shard.put(token, info, shard_limit_);
                     }
+                });
+            count_evictions(evicted);
+            }
+
+        // Number of cached tokens, including expired ones not yet cleaned up
+        std::size_t size()
+            {
+            std::size_t total = 0;
+            for (Shard& shard : shards_)
+                {
+                std::shared_lock lock(shard.mtx);
+                total += shard.tokens.size();
                 }
+            return total;
+            }
+
+        // Heap bytes held by the token maps and their expiry index
+        std::size_t memory_bytes()
+            {
+            std::size_t total = 0;
+            for (Shard& shard : shards_)
+                {
+                std::shared_lock lock(shard.mtx);
+                total += shard.tokens.memory_bytes();
+                for (const auto& [minute, filed] : shard.expiry)
+                    {
+                    total += kBucketBytes + filed.capacity() * sizeof(uint64_t);
+                    }
+                }
+            return total;
+            }
+
+        // Tokens evicted to stay within the limits so far
+        uint64_t evictions() const
+            {
+            return evictions_.load(std::memory_order_relaxed);
+            }
+
+        // Revocations held now
+        std::size_t revoked() const
+            {
+            return revoked_count_.load(std::memory_order_relaxed);
             }
 
     private:
-        std::unordered_map<uint64_t, TokenInfo> cache_;
-        std::mutex mtx_;
+        // Rough cost of one expiry minute: its tree node and vector
+        static constexpr std::size_t kBucketBytes = 64;
+
+        // Reads of a shard before a lookup waits for its lock instead
+        static constexpr int kMaxReadAttempts = 64;
+
+        // Own cache line each, so shards written on different cores don't
+        // share one
+        struct alignas(64) Shard
+            {
+            std::shared_mutex mtx;
+            std::atomic<uint32_t> seq{ 0 }; // odd while a writer holds mtx
+            FlatTokenMap tokens; // token -> pack(TokenInfo)
+            // Tokens by the steady_clock minute they expire in
+            std::map<int64_t, std::vector<uint64_t>> expiry;
+
+            // Add or update a token, first evicting as needed to keep a new
+            // one within limit (0 for none). Returns the number evicted.
+            // Called with mtx held for writing.
+            std::size_t put(uint64_t token, TokenInfo info, std::size_t limit)
+                {
+                const int64_t minute = expiry_minute(info.expires_at);
+                if (int64_t* stamp = tokens.find(token))
+                    {
+                    // Refreshed within the same minute: already filed there
+                    const bool filed = expiry_minute(unpack(*stamp).expires_at) == minute;
+                    FlatTokenMap::assign(stamp, pack(info));
+                    if (!filed)
+                        {
+                        expiry[minute].push_back(token);
+                        }
+                    return 0;
+                    }
+
+                std::size_t evicted = 0;
+                while (limit != 0 && tokens.size() >= limit && evict_one())
+                    {
+                    ++evicted;
+                    }
+                tokens.try_emplace(token, pack(info));
+                expiry[minute].push_back(token);
+                return evicted;
+                }
+
+            // Drop a token from the earliest expiry minute, skipping stale
+            // filings. False if the shard is empty.
+            bool evict_one()
+                {
+                while (!expiry.empty())
+                    {
+                    auto bucket = expiry.begin();
+                    while (!bucket->second.empty())
+                        {
+                        const uint64_t token = bucket->second.back();
+                        bucket->second.pop_back();
+                        const int64_t* stamp = tokens.find(token);
+                        if (stamp != nullptr && expiry_minute(unpack(*stamp).expires_at) == bucket->first)
+                            {
+                            tokens.erase(token);
+                            return true;
+                            }
+                        }
+                    expiry.erase(bucket);
+                    }
+                return false;
+                }
+
+            // Holds mtx for writing, with seq odd throughout
+            class Writing
+                {
+                public:
+                    explicit Writing(Shard& shard)
+                        : shard_(shard)
+                        , lock_(shard.mtx)
+                        {
+                        shard_.seq.store(shard_.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                        std::atomic_thread_fence(std::memory_order_release);
+                        }
+
+                    ~Writing()
+                        {
+                        shard_.seq.store(shard_.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+                        }
+
+                    Writing(const Writing&) = delete;
+                    Writing& operator=(const Writing&) = delete;
+
+                private:
+                    Shard& shard_;
+                    std::unique_lock<std::shared_mutex> lock_;
+                };
+            };
+
+        // Most tokens one shard can hold within bytes, counting the map at
+        // the capacity it grows to and one filing per token
+        static std::size_t entries_within(std::size_t bytes)
+            {
+            std::size_t fit = 0;
+            std::size_t tables = 0; // the map keeps the tables it outgrew
+            for (std::size_t capacity = 16; ; capacity *= 2)
+                {
+                const std::size_t entries = capacity * 3 / 4;
+                tables += FlatTokenMap::table_bytes(capacity);
+                const std::size_t cost = tables + entries * sizeof(uint64_t);
+                if (cost > bytes)
+                    {
+                    return fit;
+                    }
+                fit = entries;
+                }
+            }
+
+        // Called with revoked_mtx_ held
+        bool revoked_locked(uint64_t token, std::chrono::steady_clock::time_point now) const
+            {
+            auto it = revoked_.find(token);
+            return it != revoked_.end() && now < it->second->first;
+            }
+
+        // Drops lapsed revocations, then the earliest to lapse while there
+        // are more than max_revoked_. Called with revoked_mtx_ held.
+        void trim_revoked(std::chrono::steady_clock::time_point now)
+            {
+            while (!revoked_by_expiry_.empty()
+                && (revoked_by_expiry_.begin()->first <= now || revoked_.size() > max_revoked_))
+                {
+                revoked_.erase(revoked_by_expiry_.begin()->second);
+                revoked_by_expiry_.erase(revoked_by_expiry_.begin());
+                }
+            }
+
+        void count_evictions(std::size_t evicted)
+            {
+            if (evicted != 0)
+                {
+                evictions_.fetch_add(evicted, std::memory_order_relaxed);
+                }
+            }
+
+        // Expiry in steady_clock ticks, doubled, with the admin flag in bit 0
+        static int64_t pack(const TokenInfo& info)
+            {
+            return info.expires_at.time_since_epoch().count() * 2 + (info.isAdmin ? 1 : 0);
+            }
+
+        static TokenInfo unpack(int64_t stamp)
+            {
+            return TokenInfo{
+                std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(stamp >> 1)),
+                (stamp & 1) != 0
+                };
+            }
+
+        static int64_t expiry_minute(std::chrono::steady_clock::time_point when)
+            {
+            return std::chrono::floor<std::chrono::minutes>(when.time_since_epoch()).count();
+            }
+
+        static std::size_t shard_index(uint64_t token)
+            {
+            // Tokens are random in production, but mix anyway so sequential
+            // ones (tests, benchmarks) spread out too
+            token ^= token >> 33;
+            token *= 0xff51afd7ed558ccdull;
+            token ^= token >> 33;
+            return static_cast<std::size_t>(token & (kShards - 1));
+            }
+
+        Shard& shard_for(uint64_t token)
+            {
+            return shards_[shard_index(token)];
+            }
+
+        bool find(uint64_t token, TokenInfo& info)
+            {
+            Shard& shard = shard_for(token);
+            for (int attempt = 0; attempt < kMaxReadAttempts; ++attempt)
+                {
+                const uint32_t before = shard.seq.load(std::memory_order_acquire);
+                if (before & 1)
+                    {
+                    continue;
+                    }
+                int64_t stamp = 0;
+                const bool found = shard.tokens.find_racing(token, stamp);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (shard.seq.load(std::memory_order_relaxed) == before)
+                    {
+                    if (found)
+                        {
+                        info = unpack(stamp);
+                        }
+                    return found;
+                    }
+                }
+
+            std::shared_lock lock(shard.mtx);
+            const int64_t* stamp = shard.tokens.find(token);
+            if (stamp == nullptr)
+                {
+                return false;
+                }
+            info = unpack(*stamp);
+            return true;
+            }
+
+        // Calls fn(shard, token) for every token with its shard locked for
+        // writing, visiting the shards in order so each is locked only once
+        template <class Fn>
+        void for_each_shard(const std::vector<uint64_t>& tokens, Fn&& fn)
+            {
+            if (tokens.size() == 1)
+                {
+                Shard& shard = shard_for(tokens.front());
+                Shard::Writing writing(shard);
+                fn(shard, tokens.front());
+                return;
+                }
+
+            std::vector<std::pair<std::size_t, uint64_t>> order;
+            order.reserve(tokens.size());
+            for (uint64_t token : tokens)
+                {
+                order.emplace_back(shard_index(token), token);
+                }
+            std::sort(order.begin(), order.end());
+
+            for (std::size_t i = 0; i < order.size(); )
+                {
+                Shard& shard = shards_[order[i].first];
+                Shard::Writing writing(shard);
+                for (const std::size_t index = order[i].first; i < order.size() && order[i].first == index; ++i)
+                    {
+                    fn(shard, order[i].second);
+                    }
+                }
+            }
+
+        std::array<Shard, kShards> shards_;
+        std::mutex revoked_mtx_; // guards the revocations; taken before any shard's lock
+        // Revoked tokens by when their revocation lapses, and each token's
+        // place there
+        std::multimap<std::chrono::steady_clock::time_point, uint64_t> revoked_by_expiry_;
+        std::unordered_map<uint64_t, std::multimap<std::chrono::steady_clock::time_point, uint64_t>::iterator> revoked_;
+        std::size_t max_revoked_ = kDefaultMaxRevoked;
+        std::atomic<std::size_t> revoked_count_{ 0 }; // lets validation skip the lock when nothing is revoked
+        std::atomic<uint64_t> reclaimed_{ 0 };
+        std::atomic<uint64_t> evictions_{ 0 };
+        std::size_t shard_limit_ = 0; // entries per shard, 0 for no limit
+        const SharedTokenTable* shared_ = nullptr;
+        std::unique_ptr<TokenSigner> signer_;
         log::Logger logger_{ "TokenCache" };
     };
 
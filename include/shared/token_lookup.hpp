@@ -0,0 +1,243 @@
+#pragma once
+
+#include "shared/http_client.hpp"
+#include "shared/logger.hpp"
+#include "shared/token_cache.hpp"
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+namespace net = boost::asio;
+
+struct LookupOptions
+    {
+    // How long a token session-service refused is refused here without asking
+    std::chrono::milliseconds negative_ttl{ 5000 };
+    // Refused tokens remembered at once; past this they are all forgotten
+    std::size_t max_negative = 65536;
+    };
+
+// Parse session-service's /token/check answer, {"valid":true,"ttl":900,"admin":false}.
+// True only for a valid token with a positive ttl.
+inline bool parse_token_check(std::string_view body, std::chrono::seconds& ttl, bool& isAdmin)
+    {
+    constexpr std::string_view ttl_key = "\"ttl\":";
+    if (body.find(R"("valid":true)") == std::string_view::npos)
+        {
+        return false;
+        }
+    auto ttl_pos = body.find(ttl_key);
+    if (ttl_pos == std::string_view::npos)
+        {
+        return false;
+        }
+    int ttl_seconds = 0;
+    auto [ptr, ec] = std::from_chars(body.data() + ttl_pos + ttl_key.size(), body.data() + body.size(), ttl_seconds);
+    if (ec != std::errc() || ttl_seconds <= 0)
+        {
+        return false;
+        }
+    ttl = std::chrono::seconds(ttl_seconds);
+    isAdmin = body.find(R"("admin":true)") != std::string_view::npos;
+    return true;
+    }
+
+// Asks session-service about numeric tokens the cache doesn't know, for
+// when a broadcast was lost or this service restarted. Valid tokens are
+// added to the cache, so each is asked about once.
+//
+// Concurrent lookups of one token share a single request, and refusals are
+// remembered for negative_ttl, so clients retrying a bogus token can't turn
+// into load on session-service. A request that fails, or that
+// session-service answers with a server error, refuses only the lookups
+// waiting on it; the next one asks again, so a blip doesn't lock valid
+// users out.
+//
+// Safe to use from several threads. Must outlive the io_context run, like
+// the Client it sends through.
+class TokenLookup
+    {
+    public:
+        TokenLookup(http::Client& client, net::any_io_executor executor, http::Endpoint session, TokenCache& cache,
+            LookupOptions options, log::Logger& logger)
+            : client_(client)
+            , executor_(std::move(executor))
+            , session_(std::move(session))
+            , cache_(cache)
+            , options_(options)
+            , logger_(logger)
+            {}
+
+        TokenLookup(const TokenLookup&) = delete;
+        TokenLookup& operator=(const TokenLookup&) = delete;
+
+        // Whether session-service considers token valid; isAdmin is set when
+        // it is
+        net::awaitable<bool> lookup(uint64_t token, bool& isAdmin)
+            {
+            auto [valid, admin] = co_await net::async_initiate<const net::use_awaitable_t<>&, void(bool, bool)>(
+                [this, token](auto handler)
+                {
+                join(token, std::move(handler));
+                },
+                net::use_awaitable);
+            isAdmin = admin;
+            co_return valid;
+            }
+
+        struct Stats
+            {
+            uint64_t lookups;       // requests sent to session-service
+            uint64_t coalesced;     // lookups that joined one already in flight
+            uint64_t negative_hits; // lookups answered by a remembered refusal
+            uint64_t failures;      // requests that failed or got a server error
+            };
+
+        Stats stats() const
+            {
+            return {
+                lookups_.load(std::memory_order_relaxed),
+                coalesced_.load(std::memory_order_relaxed),
+                negative_hits_.load(std::memory_order_relaxed),
+                failures_.load(std::memory_order_relaxed)
+                };
+            }
+
+    private:
+        using Waiter = std::function<void(bool, bool)>;
+
+        template <class Handler>
+        void join(uint64_t token, Handler handler)
+            {
+            // Completion handlers are move-only; the waiter list needs copies
+            auto shared = std::make_shared<Handler>(std::move(handler));
+            Waiter waiter = [shared](bool valid, bool isAdmin)
+                {
+                auto ex = net::get_associated_executor(*shared);
+                net::post(ex, [shared, valid, isAdmin]() { std::move(*shared)(valid, isAdmin); });
+                };
+
+            bool first = false;
+            {
+            std::lock_guard<std::mutex> lock(mtx_);
+            auto refused = negative_.find(token);
+            if (refused != negative_.end() && std::chrono::steady_clock::now() < refused->second)
+                {
+                negative_hits_.fetch_add(1, std::memory_order_relaxed);
+                waiter(false, false);
+                return;
+                }
+            auto [flight, inserted] = flights_.try_emplace(token);
+            flight->second.push_back(std::move(waiter));
+            first = inserted;
+            }
+
+            if (first)
+                {
+                net::co_spawn(executor_, fetch(token), net::detached);
+                }
+            else
+                {
+                coalesced_.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+        net::awaitable<void> fetch(uint64_t token)
+            {
+            lookups_.fetch_add(1, std::memory_order_relaxed);
+            bool valid = false;
+            bool answered = false;
+            bool isAdmin = false;
+            std::chrono::seconds ttl{ 0 };
+            try
+                {
+                http::ClientRequest req{ boost::beast::http::verb::get, "/token/check?token=" + std::to_string(token), 11 };
+                auto res = co_await client_.request(session_.host, session_.port, std::move(req));
+                answered = boost::beast::http::to_status_class(res.result()) != boost::beast::http::status_class::server_error;
+                valid = res.result() == boost::beast::http::status::ok && parse_token_check(res.body(), ttl, isAdmin);
+                if (!answered)
+                    {
+                    failures_.fetch_add(1, std::memory_order_relaxed);
+                    logger_.warning("Token lookup failed: session-service answered " + std::to_string(res.result_int()));
+                    }
+                }
+                catch (const std::exception& e)
+                    {
+                    failures_.fetch_add(1, std::memory_order_relaxed);
+                    logger_.warning("Token lookup failed: " + std::string(e.what()));
+                    }
+
+            // Cached before the flight ends, so later requests find it there
+            if (valid)
+                {
+                cache_.add_tokens({ token }, ttl, isAdmin);
+                }
+
+            std::vector<Waiter> waiters;
+            {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (answered && !valid)
+                {
+                remember_refusal(token);
+                }
+            auto flight = flights_.find(token);
+            waiters.swap(flight->second);
+            flights_.erase(flight);
+            }
+            for (auto& waiter : waiters)
+                {
+                waiter(valid, isAdmin);
+                }
+            }
+
+        // Called with mtx_ held
+        void remember_refusal(uint64_t token)
+            {
+            auto now = std::chrono::steady_clock::now();
+            if (negative_.size() >= options_.max_negative)
+                {
+                std::erase_if(negative_, [now](const auto& entry) { return now >= entry.second; });
+                if (negative_.size() >= options_.max_negative)
+                    {
+                    negative_.clear();
+                    }
+                }
+            negative_[token] = now + options_.negative_ttl;
+            }
+
+        http::Client& client_;
+        net::any_io_executor executor_;
+        const http::Endpoint session_;
+        TokenCache& cache_;
+        const LookupOptions options_;
+        log::Logger& logger_;
+        std::mutex mtx_; // guards flights_ and negative_
+        std::unordered_map<uint64_t, std::vector<Waiter>> flights_;
+        std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> negative_;
+        std::atomic<uint64_t> lookups_{ 0 };
+        std::atomic<uint64_t> coalesced_{ 0 };
+        std::atomic<uint64_t> negative_hits_{ 0 };
+        std::atomic<uint64_t> failures_{ 0 };
+    };
+
+} // namespace auth
+} // namespace asciimmo
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "shared/token_cache.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+// Binary form of a token snapshot, as served by session-service's
+// /token/snapshot. Little-endian throughout:
+//
+//     "ATS1" | u32 count | count x (u64 token | u32 ttl_seconds | u8 flags)
+//
+// 13 bytes per token, so 100k sessions is about 1.3 MB.
+namespace snapshot_detail
+{
+
+constexpr std::string_view kMagic = "ATS1";
+constexpr std::size_t kEntryBytes = 13;
+constexpr uint8_t kAdminFlag = 1;
+
+inline void put(std::string& out, uint64_t value, int bytes)
+    {
+    for (int i = 0; i < bytes; ++i)
+        {
+        out += static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+    }
+
+inline uint64_t get(const char* in, int bytes)
+    {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i)
+        {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+        }
+    return value;
+    }
+
+} // namespace snapshot_detail
+
+inline std::string encode_token_snapshot(const std::vector<TokenSnapshotEntry>& entries)
+    {
+    using namespace snapshot_detail;
+    std::string out;
+    out.reserve(kMagic.size() + 4 + entries.size() * kEntryBytes);
+    out += kMagic;
+    put(out, entries.size(), 4);
+    for (const auto& entry : entries)
+        {
+        put(out, entry.token, 8);
+        put(out, static_cast<uint64_t>(entry.ttl.count()), 4);
+        put(out, entry.isAdmin ? kAdminFlag : 0, 1);
+        }
+    return out;
+    }
+
+// False if data is truncated or not a snapshot
+inline bool decode_token_snapshot(std::string_view data, std::vector<TokenSnapshotEntry>& entries)
+    {
+    using namespace snapshot_detail;
+    if (data.size() < kMagic.size() + 4 || data.substr(0, kMagic.size()) != kMagic)
+        {
+        return false;
+        }
+    const auto count = static_cast<std::size_t>(get(data.data() + kMagic.size(), 4));
+    if (data.size() != kMagic.size() + 4 + count * kEntryBytes)
+        {
+        return false;
+        }
+
+    entries.reserve(entries.size() + count);
+    const char* p = data.data() + kMagic.size() + 4;
+    for (std::size_t i = 0; i < count; ++i, p += kEntryBytes)
+        {
+        entries.push_back({
+            get(p, 8),
+            std::chrono::seconds(get(p + 8, 4)),
+            (get(p + 12, 1) & kAdminFlag) != 0
+            });
+        }
+    return true;
+    }
+
+} // namespace auth
+} // namespace asciimmo
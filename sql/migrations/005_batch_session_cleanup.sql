@@ -0,0 +1,28 @@
+-- Migration 005: Let cleanup_expired_sessions delete in batches
+-- session-service calls it with a limit, repeatedly, so expired sessions
+-- are removed in short transactions instead of one long one
+
+BEGIN;
+
+-- The new signature would otherwise sit beside the old one, and a call
+-- without arguments would be ambiguous
+DROP FUNCTION IF EXISTS cleanup_expired_sessions();
+
+CREATE OR REPLACE FUNCTION cleanup_expired_sessions(batch_limit INTEGER DEFAULT NULL)
+RETURNS INTEGER AS $$
+DECLARE
+    deleted_count INTEGER;
+BEGIN
+    DELETE FROM sessions
+    WHERE id IN (
+        SELECT id FROM sessions
+        WHERE expires_at < CURRENT_TIMESTAMP
+        ORDER BY expires_at
+        LIMIT batch_limit
+    );
+    GET DIAGNOSTICS deleted_count = ROW_COUNT;
+    RETURN deleted_count;
+END;
+$$ LANGUAGE plpgsql;
+
+COMMIT;
@@ -0,0 +1,12 @@
+-- Migration 006: Store scrypt password hashes with their parameters
+-- auth-service writes new passwords to password_kdf and moves each legacy
+-- SHA256 hash there the next time its user logs in, clearing the old
+-- columns, so password_hash and salt may now be NULL
+
+BEGIN;
+
+ALTER TABLE users ADD COLUMN IF NOT EXISTS password_kdf TEXT;
+ALTER TABLE users ALTER COLUMN password_hash DROP NOT NULL;
+ALTER TABLE users ALTER COLUMN salt DROP NOT NULL;
+
+COMMIT;
@@ -4,8 +4,11 @@
 CREATE TABLE IF NOT EXISTS users (
     id SERIAL PRIMARY KEY,
     username VARCHAR(50) UNIQUE NOT NULL,
-    password_hash BIGINT NOT NULL,
-    salt BIGINT NOT NULL,
+    -- Legacy SHA256 hash and salt; NULL once password_kdf is set
+    password_hash BIGINT,
+    salt BIGINT,
+    -- scrypt hash with its parameters and salt, "$scrypt$ln=..,r=..,p=..$salt$hash"
+    password_kdf TEXT,
     email VARCHAR(255),
     created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
     last_login TIMESTAMP,
@@ -111,13 +114,21 @@ CREATE INDEX idx_email_tokens_token ON email_confirmation_tokens(token);
 CREATE INDEX idx_email_tokens_user ON email_confirmation_tokens(user_id);
 CREATE INDEX idx_email_tokens_expires ON email_confirmation_tokens(expires_at);
 
--- Session cleanup function (call periodically)
-CREATE OR REPLACE FUNCTION cleanup_expired_sessions()
+-- Session cleanup function (session-service calls it periodically).
+-- Deletes at most batch_limit expired sessions, oldest first; all of them
+-- when it is NULL.
+CREATE OR REPLACE FUNCTION cleanup_expired_sessions(batch_limit INTEGER DEFAULT NULL)
 RETURNS INTEGER AS $$
 DECLARE
     deleted_count INTEGER;
 BEGIN
-    DELETE FROM sessions WHERE expires_at < CURRENT_TIMESTAMP;
+    DELETE FROM sessions
+    WHERE id IN (
+        SELECT id FROM sessions
+        WHERE expires_at < CURRENT_TIMESTAMP
+        ORDER BY expires_at
+        LIMIT batch_limit
+    );
     GET DIAGNOSTICS deleted_count = ROW_COUNT;
     RETURN deleted_count;
 END;
@@ -1,7 +1,10 @@
 #include "shared/http_server.hpp"
+#include "shared/http_client.hpp"
+#include "shared/http_config.hpp"
 #include "shared/logger.hpp"
 #include "shared/service_config.hpp"
 #include "shared/password_hash.hpp"
+#include "shared/hash_pool.hpp"
 #include "shared/email_sender.hpp"
 #include "db_pool.hpp"
 #include "db_config.hpp"
@@ -19,6 +22,15 @@ static void print_usage(const char* prog)
     std::cerr << "  Command line options override config file values\n";
     }
 
+// Every hashing thread is busy and the queue is full
+static void hashing_busy(asciimmo::http::Response& res)
+    {
+    res.result(boost::beast::http::status::service_unavailable);
+    res.set(boost::beast::http::field::retry_after, "1");
+    res.body() = R"({"status":"error","message":"server busy, try again shortly"})";
+    res.prepare_payload();
+    }
+
 int main(int argc, char** argv)
     {
     // Load configuration
@@ -77,6 +89,30 @@ int main(int argc, char** argv)
 
     asciimmo::log::Logger logger("auth-service");
 
+    // Passwords are hashed on threads of their own, never the io thread
+    asciimmo::auth::HashPoolOptions hash_options;
+    hash_options.threads = static_cast<std::size_t>(
+        config.get_int("auth_service.password_hashing.threads", static_cast<int>(hash_options.threads)));
+    hash_options.max_queue = static_cast<std::size_t>(
+        config.get_int("auth_service.password_hashing.max_queue", static_cast<int>(hash_options.max_queue)));
+    asciimmo::auth::ScryptParams scrypt_params;
+    scrypt_params.log2_n = static_cast<unsigned>(
+        config.get_int("auth_service.password_hashing.scrypt_log2_n", static_cast<int>(scrypt_params.log2_n)));
+    scrypt_params.r = static_cast<unsigned>(
+        config.get_int("auth_service.password_hashing.scrypt_r", static_cast<int>(scrypt_params.r)));
+    scrypt_params.p = static_cast<unsigned>(
+        config.get_int("auth_service.password_hashing.scrypt_p", static_cast<int>(scrypt_params.p)));
+    if (!asciimmo::auth::PasswordHash::scrypt_params_valid(scrypt_params))
+        {
+        logger.error("auth_service.password_hashing: scrypt parameters out of range");
+        return 1;
+        }
+    asciimmo::auth::HashPool hashes(hash_options);
+    // Verified against when the username is unknown, so a miss costs as
+    // much as a wrong password and response times don't reveal which
+    // usernames exist
+    const std::string dummy_kdf = asciimmo::auth::PasswordHash::hash_scrypt("no such user", scrypt_params);
+
     // Initialize database connection pool
     auto db_config = asciimmo::db::Config::from_env();
     asciimmo::db::ConnectionPool db_pool(db_config);
@@ -87,13 +123,25 @@ int main(int argc, char** argv)
         "ASCIIMMO");
 
     boost::asio::io_context ioc;
-    asciimmo::http::Server svr(ioc, port, cert_file, key_file);
-
-    logger.info("Starting auth-service on port " + std::to_string(port));
+    asciimmo::http::Server svr(ioc, port, cert_file, key_file, asciimmo::http::server_options(config, "auth_service"));
+    asciimmo::http::use_rate_limits(svr, asciimmo::http::rate_limit_rules(config, "auth_service"));
+    asciimmo::http::Client client(ioc.get_executor(), asciimmo::http::client_options(config, "auth_service"));
+    const auto session_port = static_cast<unsigned short>(config.get_int("session_service.port", 8082));
+
+    logger.info("Starting auth-service on port " + std::to_string(port) + " (" + std::string(asciimmo::http::kIoBackend) + ")");
+
+    svr.metrics().add_gauge("asciimmo_db_pool_size", "Connections owned by the database pool",
+        [&db_pool]() { return static_cast<double>(db_pool.size()); });
+    svr.metrics().add_gauge("asciimmo_db_pool_available", "Idle connections in the database pool",
+        [&db_pool]() { return static_cast<double>(db_pool.available()); });
+    svr.metrics().add_gauge("asciimmo_password_hash_queued", "Password hashes waiting or running",
+        [&hashes]() { return static_cast<double>(hashes.stats().queued); });
+    svr.metrics().add_gauge("asciimmo_password_hash_rejected", "Password hashes refused because the pool was full",
+        [&hashes]() { return static_cast<double>(hashes.stats().rejected); });
 
     // POST /auth/register - Register new user
-    svr.post("/auth/register", [&db_pool, &email_sender, &logger, &base_url](
-        const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
+    svr.post_async("/auth/register", [&db_pool, &email_sender, &logger, &base_url, &hashes, &scrypt_params](
+        const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&) -> boost::asio::awaitable<void>
         {
 
         try
@@ -135,7 +183,7 @@ int main(int argc, char** argv)
                 res.result(boost::beast::http::status::bad_request);
                 res.body() = R"({"status":"error","message":"username, password, and email are required"})";
                 res.prepare_payload();
-                return;
+                co_return;
                 }
 
             if (username.length() < 3 || username.length() > 50)
@@ -143,7 +191,7 @@ int main(int argc, char** argv)
                 res.result(boost::beast::http::status::bad_request);
                 res.body() = R"({"status":"error","message":"username must be 3-50 characters"})";
                 res.prepare_payload();
-                return;
+                co_return;
                 }
 
             if (password.length() < 8)
@@ -151,12 +199,19 @@ int main(int argc, char** argv)
                 res.result(boost::beast::http::status::bad_request);
                 res.body() = R"({"status":"error","message":"password must be at least 8 characters"})";
                 res.prepare_payload();
-                return;
+                co_return;
                 }
 
-            // Generate salt and hash password
-            uint64_t salt = asciimmo::auth::PasswordHash::generate_salt();
-            uint64_t password_hash = asciimmo::auth::PasswordHash::hash_password(password, salt);
+            // Hash password off the io thread, at the current cost
+            std::string password_kdf;
+            if (!co_await hashes.run([&password, &password_kdf, &scrypt_params]()
+                {
+                password_kdf = asciimmo::auth::PasswordHash::hash_scrypt(password, scrypt_params);
+                }))
+                {
+                hashing_busy(res);
+                co_return;
+                }
 
             // Create user in database
             auto conn = db_pool.acquire();
@@ -173,15 +228,14 @@ int main(int argc, char** argv)
                 res.result(boost::beast::http::status::conflict);
                 res.body() = R"({"status":"error","message":"username already exists"})";
                 res.prepare_payload();
-                return;
+                co_return;
                 }
 
             // Insert user
             auto user_result = txn.exec_params(
-                "INSERT INTO users (username, password_hash, salt, email, is_active, email_confirmed) "
-                "VALUES ($1, $2, $3, $4, true, false) RETURNING id",
-                username, static_cast<int64_t>(password_hash), static_cast<int64_t>(salt), email
-
+                "INSERT INTO users (username, password_kdf, email, is_active, email_confirmed) "
+                "VALUES ($1, $2, $3, true, false) RETURNING id",
+                username, password_kdf, email
             );
 
             int user_id = user_result[0][0].as<int>();
@@ -343,134 +397,6 @@ int main(int argc, char** argv)
                 }
         });
 
-    // POST /auth/register - Register new user
-    svr.post("/auth/register", [&db_pool, &email_sender, &logger, &base_url](
-        const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
-        {
-
-        try
-            {
-            std::string body = req.body();
-            std::string username, password, email;
-
-            // Simple JSON parsing
-            auto user_pos = body.find("\"username\":\"");
-            if (user_pos != std::string::npos)
-                {
-                auto start = user_pos + 12;
-                auto end = body.find("\"", start);
-                username = body.substr(start, end - start);
-                }
-
-            auto pass_pos = body.find("\"password\":\"");
-            if (pass_pos != std::string::npos)
-                {
-                auto start = pass_pos + 12;
-                auto end = body.find("\"", start);
-                password = body.substr(start, end - start);
-                }
-
-            auto email_pos = body.find("\"email\":\"");
-            if (email_pos != std::string::npos)
-                {
-                auto start = email_pos + 9;
-                auto end = body.find("\"", start);
-                email = body.substr(start, end - start);
-                }
-
-            if (username.empty() || password.empty() || email.empty())
-                {
-                res.result(boost::beast::http::status::bad_request);
-                res.body() = R"({"status":"error","message":"username, password, and email are required"})";
-                res.prepare_payload();
-                return;
-                }
-
-            if (username.length() < 3 || username.length() > 50)
-                {
-                res.result(boost::beast::http::status::bad_request);
-                res.body() = R"({"status":"error","message":"username must be 3-50 characters"})";
-                res.prepare_payload();
-                return;
-                }
-
-            if (password.length() < 8)
-                {
-                res.result(boost::beast::http::status::bad_request);
-                res.body() = R"({"status":"error","message":"password must be at least 8 characters"})";
-                res.prepare_payload();
-                return;
-                }
-
-            uint64_t salt = asciimmo::auth::PasswordHash::generate_salt();
-            uint64_t password_hash = asciimmo::auth::PasswordHash::hash_password(password, salt);
-
-            auto conn = db_pool.acquire();
-            pqxx::work txn(conn.get());
-
-            auto check_result = txn.exec("SELECT id FROM users WHERE username = " + txn.quote(username));
-
-            if (!check_result.empty())
-                {
-                res.result(boost::beast::http::status::conflict);
-                res.body() = R"({"status":"error","message":"username already exists"})";
-                res.prepare_payload();
-                return;
-                }
-
-            auto user_result = txn.exec(
-                "INSERT INTO users (username, password_hash, salt, email, is_active, email_confirmed) "
-                "VALUES (" + txn.quote(username) + ", " + txn.quote(password_hash) + ", " +
-                txn.quote(salt) + ", " + txn.quote(email) + ", true, false) RETURNING id"
-            );
-
-            int user_id = user_result[0][0].as<int>();
-
-            uint64_t confirmation_token = asciimmo::auth::PasswordHash::generate_token();
-            auto expires_at = std::chrono::system_clock::now() + std::chrono::hours(24);
-            auto expires_timestamp = std::chrono::system_clock::to_time_t(expires_at);
-
-            txn.exec(
-                "INSERT INTO email_confirmation_tokens (user_id, token, expires_at) "
-                "VALUES (" + txn.quote(user_id) + ", " + std::to_string(confirmation_token) + ", "
-                "TO_TIMESTAMP(" + txn.quote(expires_timestamp) + "))"
-            );            txn.commit();
-
-            bool email_sent = email_sender.send_confirmation_email(
-                email, username, confirmation_token, base_url
-            );
-
-            if (email_sent)
-                {
-                logger.info("User registered: " + username + " (ID: " + std::to_string(user_id) + ")");
-                res.result(boost::beast::http::status::created);
-                res.body() = R"({"status":"ok","message":"registration successful, please check your email to confirm your account","user_id":)" + std::to_string(user_id) + "}";
-                }
-            else
-                {
-                logger.warning("User registered but email failed: " + username);
-                res.result(boost::beast::http::status::created);
-                res.body() = R"({"status":"ok","message":"registration successful, but email failed to send","user_id":)" + std::to_string(user_id) + "}";
-                }
-            res.prepare_payload();
-
-            }
-            catch (const pqxx::sql_error& e)
-                {
-                logger.error("Database error during registration: " + std::string(e.what()));
-                res.result(boost::beast::http::status::internal_server_error);
-                res.body() = R"({"status":"error","message":"database error"})";
-                res.prepare_payload();
-                }
-            catch (const std::exception& e)
-                {
-                logger.error("Error during registration: " + std::string(e.what()));
-                res.result(boost::beast::http::status::internal_server_error);
-                res.body() = R"({"status":"error","message":"internal server error"})";
-                res.prepare_payload();
-                }
-        });
-
     // GET /auth/confirm?token=xxx
     svr.get("/auth/confirm", [&db_pool, &logger](
         const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
@@ -563,8 +489,8 @@ int main(int argc, char** argv)
         });
 
     // POST /auth/login
-    svr.post("/auth/login", [&db_pool, &logger](
-        const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
+    svr.post_async("/auth/login", [&db_pool, &logger, &hashes, &scrypt_params, &dummy_kdf, &client, session_port](
+        const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&) -> boost::asio::awaitable<void>
         {
 
         try
@@ -593,36 +519,76 @@ int main(int argc, char** argv)
                 res.result(boost::beast::http::status::bad_request);
                 res.body() = R"({"status":"error","message":"username and password required"})";
                 res.prepare_payload();
-                return;
+                co_return;
                 }
 
-            auto conn = db_pool.acquire();
-            pqxx::work txn(conn.get());
+            int user_id = 0;
+            bool known = false;
+            uint64_t stored_hash = 0;
+            uint64_t salt = 0;
+            std::string password_kdf;
+            bool is_active = false;
+            bool email_confirmed = false;
+                {
+                // Not held while the password is hashed
+                auto conn = db_pool.acquire();
+                pqxx::work txn(conn.get());
 
-            auto user_result = txn.exec(
-                "SELECT id, password_hash, salt, is_active, email_confirmed FROM users WHERE username = " + txn.quote(username)
-            );
+                auto user_result = txn.exec(
+                    "SELECT id, password_hash, salt, password_kdf, is_active, email_confirmed FROM users WHERE username = " + txn.quote(username)
+                );
 
-            if (user_result.empty())
-                {
-                res.result(boost::beast::http::status::unauthorized);
-                res.body() = R"({"status":"error","message":"invalid username or password"})";
-                res.prepare_payload();
-                return;
+                if (user_result.empty())
+                    {
+                    // Still hashed below, then refused like a wrong password
+                    password_kdf = dummy_kdf;
+                    }
+                else
+                    {
+                    const auto row = user_result[0];
+                    known = true;
+                    user_id = row["id"].as<int>();
+                    // Users from before scrypt have only the SHA256 hash and salt
+                    if (row["password_kdf"].is_null())
+                        {
+                        stored_hash = static_cast<uint64_t>(row["password_hash"].as<int64_t>());
+                        salt = static_cast<uint64_t>(row["salt"].as<int64_t>());
+                        }
+                    else
+                        {
+                        password_kdf = row["password_kdf"].as<std::string>();
+                        }
+                    is_active = row["is_active"].as<bool>();
+                    email_confirmed = row["email_confirmed"].as<bool>();
+                    }
                 }
 
-            int user_id = user_result[0]["id"].as<int>();
-            uint64_t stored_hash = static_cast<uint64_t>(user_result[0]["password_hash"].as<int64_t>());
-            uint64_t salt = static_cast<uint64_t>(user_result[0]["salt"].as<int64_t>());
-            bool is_active = user_result[0]["is_active"].as<bool>();
-            bool email_confirmed = user_result[0]["email_confirmed"].as<bool>();
+            // A hash older or cheaper than the current one is replaced while
+            // the password is at hand
+            bool verified = false;
+            std::string rehashed;
+            if (!co_await hashes.run([&]()
+                {
+                const bool matched = password_kdf.empty()
+                    ? asciimmo::auth::PasswordHash::verify_password(password, salt, stored_hash)
+                    : asciimmo::auth::PasswordHash::verify_scrypt(password, password_kdf);
+                verified = matched && known;
+                if (verified && asciimmo::auth::PasswordHash::needs_rehash(password_kdf, scrypt_params))
+                    {
+                    rehashed = asciimmo::auth::PasswordHash::hash_scrypt(password, scrypt_params);
+                    }
+                }))
+                {
+                hashing_busy(res);
+                co_return;
+                }
 
-            if (!asciimmo::auth::PasswordHash::verify_password(password, salt, stored_hash))
+            if (!verified)
                 {
                 res.result(boost::beast::http::status::unauthorized);
                 res.body() = R"({"status":"error","message":"invalid username or password"})";
                 res.prepare_payload();
-                return;
+                co_return;
                 }
 
             if (!is_active)
@@ -630,7 +596,7 @@ int main(int argc, char** argv)
                 res.result(boost::beast::http::status::forbidden);
                 res.body() = R"({"status":"error","message":"account is not active"})";
                 res.prepare_payload();
-                return;
+                co_return;
                 }
 
             if (!email_confirmed)
@@ -638,15 +604,53 @@ int main(int argc, char** argv)
                 res.result(boost::beast::http::status::forbidden);
                 res.body() = R"({"status":"error","message":"please confirm your email before logging in"})";
                 res.prepare_payload();
-                return;
+                co_return;
                 }
 
-            txn.exec("UPDATE users SET last_login = CURRENT_TIMESTAMP WHERE id = " + std::to_string(user_id));
-            txn.commit();
+                {
+                auto conn = db_pool.acquire();
+                pqxx::work txn(conn.get());
+                if (!rehashed.empty())
+                    {
+                    txn.exec_params(
+                        "UPDATE users SET password_kdf = $1, password_hash = NULL, salt = NULL WHERE id = $2",
+                        rehashed, user_id
+                    );
+                    }
+                txn.exec("UPDATE users SET last_login = CURRENT_TIMESTAMP WHERE id = " + std::to_string(user_id));
+                txn.commit();
+                }
+
+            // session-service issues the token every other service accepts;
+            // it takes the user id on trust from callers on its own host
+            asciimmo::http::ClientResponse session;
+            try
+                {
+                session = co_await client.post("localhost", session_port, "/session",
+                    R"({"user_id":)" + std::to_string(user_id) + "}");
+                }
+                catch (const boost::beast::system_error& e)
+                    {
+                    logger.error("Could not reach session-service: " + std::string(e.what()));
+                    session.result(boost::beast::http::status::service_unavailable);
+                    }
+            const std::string& session_body = session.body();
+            const auto token_pos = session_body.find("\"token\":\"");
+            const auto token_end = token_pos == std::string::npos ? token_pos : session_body.find('"', token_pos + 9);
+            if (session.result() != boost::beast::http::status::ok || token_end == std::string::npos)
+                {
+                logger.error("session-service refused a session for user ID " + std::to_string(user_id)
+                    + ": " + std::to_string(session.result_int()));
+                res.result(boost::beast::http::status::service_unavailable);
+                res.body() = R"({"status":"error","message":"could not start a session, try again"})";
+                res.prepare_payload();
+                co_return;
+                }
+            const std::string token = session_body.substr(token_pos + 9, token_end - token_pos - 9);
 
             logger.info("User logged in: " + username + " (ID: " + std::to_string(user_id) + ")");
             res.result(boost::beast::http::status::ok);
-            res.body() = R"({"status":"ok","token":"stub-token-12345","user_id":)" + std::to_string(user_id) + R"(,"message":"login successful, token generation pending"})";
+            res.body() = R"({"status":"ok","token":")" + token + R"(","user_id":)" + std::to_string(user_id) + R"(,"message":"login successful"})";
             res.prepare_payload();
 
             }
@@ -0,0 +1,121 @@
+#include "db_session_table.hpp"
+#include "db_pool.hpp"
+#include <pqxx/pqxx>
+#include <string>
+
+namespace asciimmo
+{
+namespace db
+{
+
+namespace
+{
+
+int64_t epoch_seconds(std::chrono::system_clock::time_point when)
+    {
+    return std::chrono::duration_cast<std::chrono::seconds>(when.time_since_epoch()).count();
+    }
+
+// A bigint[] literal, "{1,2,3}"
+std::string token_array(std::span<const uint64_t> tokens)
+    {
+    std::string out = "{";
+    for (uint64_t token : tokens)
+        {
+        if (out.size() > 1)
+            {
+            out += ',';
+            }
+        out += std::to_string(static_cast<int64_t>(token));
+        }
+    out += '}';
+    return out;
+    }
+
+class SessionTable : public session::SessionBackend
+    {
+    public:
+        explicit SessionTable(const Config& config)
+            : pool_(config)
+            {}
+
+        // One transaction, so a batch costs a single commit
+        void write(std::span<const session::SessionWrite> writes) override
+            {
+            auto conn = pool_.acquire();
+            pqxx::work txn(conn.get());
+            for (const auto& write : writes)
+                {
+                const auto token = static_cast<int64_t>(write.record.token_id);
+                if (write.kind == session::SessionWrite::Kind::remove)
+                    {
+                    txn.exec(pqxx::zview("DELETE FROM sessions WHERE token = $1"), pqxx::params{ token });
+                    continue;
+                    }
+                txn.exec(pqxx::zview(
+                    "INSERT INTO sessions (token, user_id, data, expires_at) "
+                    "VALUES ($1, (SELECT id FROM users WHERE id = $2), to_jsonb($3::text), to_timestamp($4)) "
+                    "ON CONFLICT (token) DO UPDATE SET user_id = EXCLUDED.user_id, data = EXCLUDED.data, "
+                    "expires_at = EXCLUDED.expires_at, last_activity = CURRENT_TIMESTAMP"),
+                    pqxx::params{ token, static_cast<int64_t>(write.record.user_id), write.record.data,
+                        epoch_seconds(write.record.expires_at) });
+                }
+            txn.commit();
+            }
+
+        void touch(std::span<const uint64_t> tokens, std::chrono::system_clock::time_point when,
+            std::chrono::system_clock::time_point expires_at) override
+            {
+            auto conn = pool_.acquire();
+            pqxx::work txn(conn.get());
+            txn.exec(pqxx::zview(
+                "UPDATE sessions SET last_activity = to_timestamp($2), expires_at = to_timestamp($3) "
+                "WHERE token = ANY($1::bigint[])"),
+                pqxx::params{ token_array(tokens), epoch_seconds(when), epoch_seconds(expires_at) });
+            txn.commit();
+            }
+
+        bool load(uint64_t token, session::SessionRecord& record) override
+            {
+            auto conn = pool_.acquire();
+            pqxx::nontransaction txn(conn.get());
+            auto result = txn.exec(pqxx::zview(
+                "SELECT COALESCE(user_id, 0), COALESCE(data #>> '{}', ''), "
+                "EXTRACT(EPOCH FROM expires_at)::BIGINT FROM sessions "
+                "WHERE token = $1 AND expires_at > CURRENT_TIMESTAMP"),
+                pqxx::params{ static_cast<int64_t>(token) });
+            if (result.empty())
+                {
+                return false;
+                }
+            record.token_id = token;
+            record.user_id = static_cast<uint64_t>(result[0][0].as<int64_t>());
+            record.data = result[0][1].as<std::string>();
+            record.expires_at = std::chrono::system_clock::time_point(std::chrono::seconds(result[0][2].as<int64_t>()));
+            return true;
+            }
+
+        // cleanup_expired_sessions(limit), from migration 005
+        std::size_t cleanup(std::size_t limit) override
+            {
+            auto conn = pool_.acquire();
+            pqxx::work txn(conn.get());
+            auto result = txn.exec(pqxx::zview("SELECT cleanup_expired_sessions($1)"),
+                pqxx::params{ static_cast<int>(limit) });
+            txn.commit();
+            return static_cast<std::size_t>(result[0][0].as<int>());
+            }
+
+    private:
+        ConnectionPool pool_;
+    };
+
+} // namespace
+
+std::unique_ptr<session::SessionBackend> open_session_table(const Config& config)
+    {
+    return std::make_unique<SessionTable>(config);
+    }
+
+} // namespace db
+} // namespace asciimmo
@@ -1,13 +1,25 @@
 #include "shared/http_server.hpp"
+#include "shared/http_config.hpp"
+#include "db_session_table.hpp"
 #include "shared/logger.hpp"
 #include "shared/http_client.hpp"
 #include "shared/service_config.hpp"
+#include "shared/session_auth.hpp"
+#include "shared/session_journal.hpp"
+#include "shared/session_store.hpp"
+#include "shared/session_token.hpp"
+#include "shared/token_broadcaster.hpp"
+#include "shared/token_cache.hpp"
+#include "shared/token_snapshot.hpp"
+#include <atomic>
+#include <charconv>
 #include <iostream>
+#include <memory>
+#include <span>
 #include <string>
-#include <unordered_map>
-#include <mutex>
-#include <thread>
+#include <vector>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/signal_set.hpp>
 
 static void print_usage(const char* prog)
@@ -17,12 +29,27 @@ static void print_usage(const char* prog)
     std::cerr << "  Command line options override config file values\n";
     }
 
-// In-memory session store (ephemeral; replace with Redis/DB for production)
-static std::unordered_map<std::string, std::string> sessions;
-static std::mutex sessions_mtx;
+// Live numeric tokens and their expiries, served to services warming up
+static asciimmo::auth::TokenCache issued_tokens;
 
-// Broadcast token to services that need session validation
-static void broadcast_token(const std::string& token, const std::string& user_data, asciimmo::log::Logger& logger)
+// With routing on, a session another instance issued is answered with that
+// instance's id instead of being looked up here
+static bool owned_elsewhere(const asciimmo::auth::SessionTokenGenerator& tokens, bool routing, uint64_t token_id, asciimmo::http::Response& res)
+    {
+    const unsigned owner = asciimmo::auth::SessionTokenGenerator::instance_of(token_id);
+    if (!routing || token_id == 0 || owner == tokens.instance())
+        {
+        return false;
+        }
+    res.result(boost::beast::http::status::misdirected_request);
+    res.body() = R"({"status":"error","message":"session belongs to another instance","instance":)"
+        + std::to_string(owner) + "}";
+    res.prepare_payload();
+    return true;
+    }
+
+// Services that need session tokens pushed to them
+static std::vector<asciimmo::http::Endpoint> broadcast_targets(asciimmo::log::Logger& logger)
     {
     auto& config = asciimmo::config::ServiceConfig::instance();
 
@@ -33,8 +60,7 @@ static void broadcast_token(const std::string& token, const std::string& user_da
         "social_service"
         };
 
-    // Build list of services that need session tokens
-    std::vector<std::pair<std::string, int>> target_services;
+    std::vector<asciimmo::http::Endpoint> target_services;
     for (const auto& service_name : service_names)
         {
         bool needs_session = config.get_bool(service_name + ".needs_session", false);
@@ -43,38 +69,12 @@ static void broadcast_token(const std::string& token, const std::string& user_da
             int service_port = config.get_int(service_name + ".port", 0);
             if (service_port > 0)
                 {
-                target_services.push_back({ "localhost", service_port });
-                logger.debug("Will broadcast to " + service_name + " on port " + std::to_string(service_port));
+                target_services.push_back({ "localhost", static_cast<unsigned short>(service_port) });
+                logger.info("Will broadcast to " + service_name + " on port " + std::to_string(service_port));
                 }
             }
         }
-
-    // Properly construct JSON string
-    std::string body = R"({"token":")" + token + R"(","user_data":")" + user_data + R"(","ttl":900})";
-
-    // Broadcast in background thread to avoid blocking
-    std::thread([target_services, body, &logger]()
-        {
-        for (const auto& [host, port] : target_services)
-            {
-            try
-                {
-                bool success = asciimmo::http::Client::post(host, port, "/token/register", body);
-                if (success)
-                    {
-                    logger.debug("Broadcasted token to " + host + ":" + std::to_string(port));
-                    }
-                else
-                    {
-                    logger.warning("Failed to broadcast token to " + host + ":" + std::to_string(port));
-                    }
-                }
-                catch (const std::exception& e)
-                    {
-                    logger.error("Exception broadcasting to " + host + ":" + std::to_string(port) + " - " + e.what());
-                    }
-            }
-        }).detach();
+    return target_services;
     }
 
 int main(int argc, char** argv)
@@ -139,21 +139,236 @@ int main(int argc, char** argv)
     asciimmo::log::Logger logger("session-service");
 
     boost::asio::io_context ioc;
-    asciimmo::http::Server svr(ioc, port, cert_file, key_file);
+    asciimmo::http::Server svr(ioc, port, cert_file, key_file, asciimmo::http::server_options(config, "session_service"));
+    asciimmo::http::use_rate_limits(svr, asciimmo::http::rate_limit_rules(config, "session_service"));
+    asciimmo::http::Client client(ioc.get_executor(), asciimmo::http::client_options(config, "session_service"));
+
+    asciimmo::auth::BroadcastOptions broadcast_options;
+    broadcast_options.max_delay = std::chrono::milliseconds(
+        config.get_int("session_service.token_broadcast.max_delay_ms", static_cast<int>(broadcast_options.max_delay.count())));
+    broadcast_options.max_batch = static_cast<std::size_t>(
+        config.get_int("session_service.token_broadcast.max_batch", static_cast<int>(broadcast_options.max_batch)));
+    broadcast_options.ttl = std::chrono::seconds(
+        config.get_int("session_service.token_ttl", static_cast<int>(broadcast_options.ttl.count())));
+    broadcast_options.retry_delay = std::chrono::milliseconds(
+        config.get_int("session_service.token_broadcast.retry_delay_ms", static_cast<int>(broadcast_options.retry_delay.count())));
+    broadcast_options.max_retry_delay = std::chrono::milliseconds(
+        config.get_int("session_service.token_broadcast.max_retry_delay_ms", static_cast<int>(broadcast_options.max_retry_delay.count())));
+    asciimmo::auth::TokenBroadcaster broadcaster(client, ioc.get_executor(), broadcast_targets(logger), broadcast_options, logger);
+
+    // Services on this host read new tokens from shared memory; the
+    // broadcaster is only used when that isn't available or is full, or
+    // while a service that couldn't map it asks for broadcasts
+    auto shared_tokens = asciimmo::auth::shared_token_table(config, logger);
+    std::atomic<std::chrono::steady_clock::rep> broadcast_requested_until{ 0 };
+    auto broadcast_requested = [&broadcast_requested_until]()
+        {
+        return std::chrono::steady_clock::now().time_since_epoch().count()
+            < broadcast_requested_until.load(std::memory_order_relaxed);
+        };
+
+    // With a signing key, tokens carry their own claims and the other
+    // services verify them locally; nothing needs to be pushed to them
+    std::unique_ptr<asciimmo::auth::TokenSigner> signer;
+    std::string signing_key = config.get_string("global.token_signing_key", "");
+    if (!signing_key.empty())
+        {
+        signer = std::make_unique<asciimmo::auth::TokenSigner>(signing_key);
+        logger.info("Issuing signed session tokens");
+        }
+
+    // Sessions live in memory, written behind to the sessions table when
+    // persistence is on, so a restart doesn't log everyone out
+    asciimmo::session::StoreOptions store_options;
+    store_options.shards = static_cast<std::size_t>(
+        config.get_int("session_service.session_store.shards", static_cast<int>(store_options.shards)));
+    store_options.flush_interval = std::chrono::milliseconds(
+        config.get_int("session_service.session_store.flush_interval_ms", static_cast<int>(store_options.flush_interval.count())));
+    store_options.max_batch = static_cast<std::size_t>(
+        config.get_int("session_service.session_store.max_batch", static_cast<int>(store_options.max_batch)));
+    store_options.max_pending = static_cast<std::size_t>(
+        config.get_int("session_service.session_store.max_pending", static_cast<int>(store_options.max_pending)));
+    store_options.workers = static_cast<std::size_t>(
+        config.get_int("session_service.session_store.workers", static_cast<int>(store_options.workers)));
+    store_options.idle_ttl = std::chrono::seconds(
+        config.get_int("session_service.session_store.idle_ttl", static_cast<int>(broadcast_options.ttl.count())));
+    store_options.reap_interval = std::chrono::milliseconds(
+        config.get_int("session_service.session_store.reap_interval_ms", static_cast<int>(store_options.reap_interval.count())));
+    store_options.cleanup_interval = std::chrono::milliseconds(
+        config.get_int("session_service.session_store.cleanup_interval_ms", static_cast<int>(store_options.cleanup_interval.count())));
+    store_options.cleanup_batch = static_cast<std::size_t>(
+        config.get_int("session_service.session_store.cleanup_batch", static_cast<int>(store_options.cleanup_batch)));
+    store_options.negative_ttl = std::chrono::milliseconds(
+        config.get_int("session_service.session_store.negative_ttl_ms", static_cast<int>(store_options.negative_ttl.count())));
+    store_options.max_negative = static_cast<std::size_t>(
+        config.get_ulonglong("session_service.session_store.max_negative", store_options.max_negative));
+    std::unique_ptr<asciimmo::session::SessionBackend> session_backend;
+    // A journal on local disk takes the database's place when configured
+    asciimmo::session::SessionJournal* journal = nullptr;
+    const std::string journal_dir = config.get_string("session_service.session_store.journal.path", "");
+    if (!journal_dir.empty())
+        {
+        try
+            {
+            asciimmo::session::JournalOptions journal_options;
+            journal_options.directory = journal_dir;
+            journal_options.fsync = asciimmo::session::parse_fsync_policy(
+                config.get_string("session_service.session_store.journal.fsync", "interval"));
+            journal_options.fsync_interval = std::chrono::milliseconds(
+                config.get_int("session_service.session_store.journal.fsync_interval_ms", static_cast<int>(journal_options.fsync_interval.count())));
+            journal_options.compact_bytes = static_cast<std::size_t>(
+                config.get_int("session_service.session_store.journal.compact_mb", static_cast<int>(journal_options.compact_bytes >> 20))) << 20;
+            auto opened = std::make_unique<asciimmo::session::SessionJournal>(journal_options);
+            journal = opened.get();
+            session_backend = std::move(opened);
+            logger.info("Journaling sessions to " + journal_dir);
+            }
+            catch (const std::exception& e)
+                {
+                logger.warning("Sessions will not be journaled: " + std::string(e.what()));
+                }
+        }
+    else if (config.get_bool("session_service.session_store.persist", false))
+        {
+        try
+            {
+            session_backend = asciimmo::db::open_session_table(asciimmo::db::Config::from_env());
+            logger.info("Persisting sessions to the database");
+            }
+            catch (const std::exception& e)
+                {
+                logger.warning("Sessions will not be persisted: " + std::string(e.what()));
+                }
+        }
+    // Signed tokens are stored under the id they carry
+    auto token_id_of = [&signer](std::string_view token)
+        {
+        asciimmo::auth::TokenClaims claims;
+        if (signer && asciimmo::auth::TokenSigner::is_signed(token))
+            {
+            return signer->verify(token, claims) ? claims.token_id : 0;
+            }
+        return asciimmo::session::numeric_token_id(token);
+        };
+    asciimmo::session::SessionStore sessions(store_options, session_backend.get(), token_id_of);
+    if (journal)
+        {
+        // Everyone stays logged in across a restart. Numeric tokens are
+        // issued again for /token/check, with a fresh ttl like a refresh.
+        const auto replay_start = std::chrono::steady_clock::now();
+        sessions.reserve(journal->expected_sessions());
+        std::vector<uint64_t> numeric;
+        asciimmo::session::SessionStore::Restorer restorer(sessions);
+        const std::size_t restored = journal->replay([&restorer, &numeric](const asciimmo::session::JournaledSession& session)
+            {
+            restorer.add(session.token, session.token_id, session.data, session.expires_at);
+            if (!asciimmo::auth::TokenSigner::is_signed(session.token))
+                {
+                numeric.push_back(session.token_id);
+                }
+            });
+        restorer.commit();
+        issued_tokens.add_tokens(numeric, broadcast_options.ttl);
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - replay_start);
+        logger.info("Restored " + std::to_string(restored) + " sessions from the journal in "
+            + std::to_string(elapsed.count()) + " ms");
+        }
+    // A session's expiry slides with use, but the services that validate
+    // its numeric token were given a fixed ttl. Once a used session's token
+    // is past half of that, it is sent out again, so the token lasts as long
+    // as the session does. Signed tokens carry their expiry and can't be
+    // extended.
+    if (!signer)
+        {
+        sessions.on_activity([&ioc, &shared_tokens, &broadcast_requested, &broadcaster, ttl = broadcast_options.ttl](std::span<const uint64_t> ids)
+            {
+            // Called on a store worker; the tokens are handled on the io thread
+            boost::asio::post(ioc, [&shared_tokens, &broadcast_requested, &broadcaster, ttl, ids = std::vector<uint64_t>(ids.begin(), ids.end())]()
+                {
+                std::vector<uint64_t> due;
+                asciimmo::auth::TokenSnapshotEntry entry;
+                for (uint64_t id : ids)
+                    {
+                    // A session logged out since stays out
+                    if (!issued_tokens.is_revoked(id) && (!issued_tokens.find_token(id, entry) || entry.ttl < ttl / 2))
+                        {
+                        due.push_back(id);
+                        }
+                    }
+                issued_tokens.add_tokens(due, ttl);
+                for (uint64_t id : due)
+                    {
+                    const bool shared = shared_tokens && shared_tokens->add_token(id, ttl);
+                    if (!shared || broadcast_requested())
+                        {
+                        broadcaster.enqueue(id);
+                        }
+                    }
+                });
+            });
+        }
+    sessions.start(ioc.get_executor());
+
+    // Token ids name the instance that issued them (session_token.hpp). With
+    // route_by_instance, lookups of another instance's sessions get 421 and
+    // its id, for whatever sits in front to retry there.
+    asciimmo::auth::SessionTokenGenerator token_ids(static_cast<unsigned>(config.get_int("session_service.instance_id", 0)));
+    const bool route_by_instance = config.get_bool("session_service.route_by_instance", false);
+    logger.info("Issuing tokens as instance " + std::to_string(token_ids.instance())
+        + (route_by_instance ? ", routing by instance" : ""));
+
+    svr.metrics().add_gauge("asciimmo_sessions", "Sessions held in memory",
+        [&sessions]() { return static_cast<double>(sessions.size()); });
+    svr.metrics().add_gauge("asciimmo_session_writes_pending", "Session writes queued for the database",
+        [&sessions]() { return static_cast<double>(sessions.pending()); });
+    svr.metrics().add_gauge("asciimmo_session_loads", "Session lookups that missed memory and asked the database",
+        [&sessions]() { return static_cast<double>(sessions.stats().loads); });
+    svr.metrics().add_gauge("asciimmo_session_negative_hits", "Session lookups answered by a remembered database miss",
+        [&sessions]() { return static_cast<double>(sessions.stats().negative_hits); });
+    svr.metrics().add_gauge("asciimmo_sessions_expired", "Idle sessions removed from memory",
+        [&sessions]() { return static_cast<double>(sessions.stats().expired); });
+    svr.metrics().add_gauge("asciimmo_sessions_cleaned", "Expired sessions deleted from the database",
+        [&sessions]() { return static_cast<double>(sessions.stats().cleaned); });
+    if (journal)
+        {
+        svr.metrics().add_gauge("asciimmo_session_journal_bytes", "Session journal bytes written since the last snapshot",
+            [journal]() { return static_cast<double>(journal->stats().journal_bytes); });
+        svr.metrics().add_gauge("asciimmo_session_journal_compactions", "Session journal compactions into a snapshot",
+            [journal]() { return static_cast<double>(journal->stats().compactions); });
+        }
+    svr.metrics().add_gauge("asciimmo_session_store_failures", "Session database calls that failed",
+        [&sessions]() { return static_cast<double>(sessions.stats().failures); });
+    svr.metrics().add_gauge("asciimmo_token_broadcast_batches", "Token batches sent to the services that validate them",
+        [&broadcaster]() { return static_cast<double>(broadcaster.stats().batches_sent); });
+    svr.metrics().add_gauge("asciimmo_token_broadcast_failures", "Token batch deliveries that failed, per target",
+        [&broadcaster]() { return static_cast<double>(broadcaster.stats().failed_deliveries); });
+    svr.metrics().add_gauge("asciimmo_token_revocations_abandoned", "Revocations that expired before a retry reached the target, per target",
+        [&broadcaster]() { return static_cast<double>(broadcaster.stats().abandoned_revocations); });
+    svr.metrics().add_gauge("asciimmo_issued_tokens", "Live numeric session tokens issued by this service",
+        []() { return static_cast<double>(issued_tokens.size()); });
+    svr.metrics().add_gauge("asciimmo_issued_tokens_reclaimed", "Expired issued tokens removed",
+        []() { return static_cast<double>(issued_tokens.reclaimed()); });
+    asciimmo::auth::reap_expired_tokens(ioc.get_executor(), issued_tokens,
+        std::chrono::milliseconds(config.get_int("global.token_reap_interval_ms", 30000)));
 
-    logger.info("Starting session-service on port " + std::to_string(port));
+    logger.info("Starting session-service on port " + std::to_string(port) + " (" + std::string(asciimmo::http::kIoBackend) + ")");
 
     // GET /session/:token?session_token=xxx
-    svr.get(R"(/session/(\w+))", [](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch& matches)
+    svr.get_async(R"(/session/([\w.]+))", [&sessions, &token_ids, &token_id_of, route_by_instance](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch& matches) -> boost::asio::awaitable<void>
         {
         std::string token = matches[1].str();
+        if (owned_elsewhere(token_ids, route_by_instance, token_id_of(token), res))
+            {
+            co_return;
+            }
         // Session token is optional for session service GET operations
-        std::lock_guard<std::mutex> lock(sessions_mtx);
-        auto it = sessions.find(token);
-        if (it != sessions.end())
+        if (auto json = co_await sessions.load(token))
             {
+            // The stored JSON goes out as it is, without being copied
             res.result(boost::beast::http::status::ok);
-            res.body() = R"({"status":"ok","data":"" + it->second + R"("})";
+            res.body() = R"({"status":"ok","data":)";
+            res.body().append_shared(std::move(json));
+            res.body().append_after("}");
             }
         else
             {
@@ -163,27 +378,194 @@ int main(int argc, char** argv)
         res.prepare_payload();
         });
 
-    // POST /session?session_token=xxx (create new session; expects {"token":"...", "data":"..."})
-    svr.post("/session", [&logger](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
-        {
-        // Session token is optional for creating new sessions (this is the auth point)
-        // TODO: parse JSON properly; stub: just store body as data
-        std::string token = "session-" + std::to_string(std::hash<std::string>{}(req.body()));
-        std::string user_data = req.body();
+    // POST /session (create new session; expects {"user_id":N, "data":"..."})
+    // The token it returns is accepted by every service, so only callers on
+    // this host may ask for one: auth-service does, after each login.
+    svr.post("/session", asciimmo::http::Access::Public,
+        [&sessions, &token_ids, &shared_tokens, &broadcast_requested, &signer, &broadcaster, &logger, ttl = broadcast_options.ttl, idle_ttl = store_options.idle_ttl](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&, const asciimmo::http::RequestContext& ctx)
         {
-        std::lock_guard<std::mutex> lock(sessions_mtx);
-        sessions[token] = user_data;
-        }
+        if (!asciimmo::auth::local_only(req, res, ctx))
+            {
+            return;
+            }
+        // The user id is taken on trust from the local caller, and a signed
+        // token vouches for it to every service, so there must be one. The
+        // whole body is kept as the session's data.
+        uint64_t user_id = 0;
+        const std::string& body = req.body();
+        auto user_pos = body.find("\"user_id\":");
+        if (user_pos == std::string::npos
+            || std::from_chars(body.data() + user_pos + 10, body.data() + body.size(), user_id).ec != std::errc()
+            || user_id == 0)
+            {
+            res.result(boost::beast::http::status::bad_request);
+            res.body() = R"({"status":"error","message":"user_id required"})";
+            res.prepare_payload();
+            return;
+            }
+        uint64_t token_id = token_ids.generate();
+        std::string token;
+        if (signer)
+            {
+            token = signer->issue(token_id, user_id, false, ttl);
+            }
+        else
+            {
+            // Numeric, so the services that validate it can parse it
+            token = std::to_string(token_id);
+            }
+        asciimmo::session::SessionRecord record;
+        record.token_id = token_id;
+        record.user_id = user_id;
+        record.data = req.body();
+        record.expires_at = std::chrono::system_clock::now() + idle_ttl;
+        sessions.put(token, std::move(record));
 
-        // Broadcast token to other services
-        logger.info("Created session token: " + token + ", broadcasting to services");
-        broadcast_token(token, user_data, logger);
+        // Not the token: a numeric one is its own id, and either logs anyone in
+        logger.info("Created session for user " + std::to_string(user_id));
+        if (!signer)
+            {
+            issued_tokens.add_tokens({ token_id }, ttl);
+            const bool shared = shared_tokens && shared_tokens->add_token(token_id, ttl);
+            if (!shared || broadcast_requested())
+                {
+                // Queued; the broadcaster sends it with the next batch
+                broadcaster.enqueue(token_id);
+                }
+            }
 
         res.result(boost::beast::http::status::ok);
         res.body() = R"({"status":"ok","token":")" + token + R"("})";
         res.prepare_payload();
         });
 
+    // POST /session/logout?session_token=xxx - end a session everywhere
+    svr.post_async("/session/logout", asciimmo::http::Access::Public,
+        [&sessions, &token_ids, &shared_tokens, &signer, &broadcaster, &logger, ttl = broadcast_options.ttl, route_by_instance](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch&, const asciimmo::http::RequestContext& ctx) -> boost::asio::awaitable<void>
+        {
+        std::string token(ctx.param("session_token"));
+        asciimmo::auth::TokenClaims claims;
+        // Revocations must outlive the token; a numeric one may have been refreshed
+        std::chrono::seconds remaining = ttl;
+        if (signer && asciimmo::auth::TokenSigner::is_signed(token))
+            {
+            if (!signer->verify(token, claims))
+                {
+                res.result(boost::beast::http::status::unauthorized);
+                res.body() = R"({"status":"error","message":"invalid session token"})";
+                res.prepare_payload();
+                co_return;
+                }
+            auto now = std::chrono::system_clock::now().time_since_epoch();
+            remaining = std::chrono::seconds(claims.expires_at) - std::chrono::duration_cast<std::chrono::seconds>(now);
+            }
+        else
+            {
+            auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), claims.token_id);
+            if (token.empty() || ec != std::errc() || ptr != token.data() + token.size())
+                {
+                res.result(boost::beast::http::status::bad_request);
+                res.body() = R"({"status":"error","message":"invalid session token"})";
+                res.prepare_payload();
+                co_return;
+                }
+            }
+
+        if (owned_elsewhere(token_ids, route_by_instance, claims.token_id, res))
+            {
+            co_return;
+            }
+
+        // A session only in the database is loaded first, so it can be
+        // logged out after a restart
+        bool found = co_await sessions.load(token) && sessions.erase(token);
+        if (!found)
+            {
+            res.result(boost::beast::http::status::not_found);
+            res.body() = R"({"status":"error","message":"session not found"})";
+            res.prepare_payload();
+            co_return;
+            }
+
+        if (!asciimmo::auth::TokenSigner::is_signed(token))
+            {
+            issued_tokens.revoke_tokens({ claims.token_id }, remaining);
+            if (shared_tokens)
+                {
+                shared_tokens->add_token(claims.token_id, std::chrono::seconds(-1));
+                }
+            }
+        broadcaster.revoke(claims.token_id, remaining);
+        logger.info("Logged out a session");
+
+        res.result(boost::beast::http::status::ok);
+        res.body() = R"({"status":"ok"})";
+        res.prepare_payload();
+        });
+
+    // POST /token/subscribe - a service on this host that couldn't map the
+    // shared token table asks for new tokens to be broadcast as well. It asks
+    // again every few seconds; broadcasting stops kBroadcastRequestTtl after
+    // the last request. Local callers only.
+    svr.post("/token/subscribe", asciimmo::http::Access::Public,
+        [&broadcast_requested, &broadcast_requested_until, &shared_tokens, &logger](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&, const asciimmo::http::RequestContext& ctx)
+        {
+        if (!asciimmo::auth::local_only(req, res, ctx))
+            {
+            return;
+            }
+        if (shared_tokens && !broadcast_requested())
+            {
+            logger.info("A service without the shared token table asked for broadcasts");
+            }
+        const auto until = std::chrono::steady_clock::now() + asciimmo::auth::kBroadcastRequestTtl;
+        broadcast_requested_until.store(until.time_since_epoch().count(), std::memory_order_relaxed);
+        res.result(boost::beast::http::status::ok);
+        res.body() = R"({"status":"ok"})";
+        res.prepare_payload();
+        });
+
+    // GET /token/snapshot - live tokens in binary (token_snapshot.hpp), for
+    // services that restart to load before serving. Local callers only.
+    svr.get("/token/snapshot", asciimmo::http::Access::Public,
+        [](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&, const asciimmo::http::RequestContext& ctx)
+        {
+        if (!asciimmo::auth::local_only(req, res, ctx))
+            {
+            return;
+            }
+        res.result(boost::beast::http::status::ok);
+        res.set(boost::beast::http::field::content_type, "application/octet-stream");
+        res.body() = asciimmo::auth::encode_token_snapshot(issued_tokens.snapshot());
+        res.prepare_payload();
+        });
+
+    // GET /token/check?token=N - one token, for services whose cache missed
+    // it (TokenLookup). Local callers only.
+    svr.get("/token/check", asciimmo::http::Access::Public,
+        [](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&, const asciimmo::http::RequestContext& ctx)
+        {
+        if (!asciimmo::auth::local_only(req, res, ctx))
+            {
+            return;
+            }
+        const std::string_view param = ctx.param("token");
+        uint64_t token = 0;
+        std::from_chars(param.data(), param.data() + param.size(), token);
+        asciimmo::auth::TokenSnapshotEntry entry{};
+        res.result(boost::beast::http::status::ok);
+        if (token != 0 && issued_tokens.find_token(token, entry))
+            {
+            res.body() = R"({"valid":true,"ttl":)" + std::to_string(entry.ttl.count())
+                + R"(,"admin":)" + (entry.isAdmin ? "true" : "false") + "}";
+            }
+        else
+            {
+            res.body() = R"({"valid":false})";
+            }
+        res.prepare_payload();
+        });
+
     svr.get("/health", [](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
         {
         // Health endpoint doesn't require session token
@@ -0,0 +1,58 @@
+#include "shared/hash_pool.hpp"
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <algorithm>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+HashPool::HashPool(HashPoolOptions options)
+    : options_(options)
+    , threads_(std::max<std::size_t>(options.threads, 1))
+    {}
+
+HashPool::~HashPool()
+    {
+    threads_.join();
+    }
+
+net::awaitable<bool> HashPool::run(std::function<void()> work)
+    {
+    if (queued_.fetch_add(1, std::memory_order_relaxed) >= std::max<std::size_t>(options_.max_queue, 1))
+        {
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        co_return false;
+        }
+
+    // Released on the pool thread, so the slot is free before the caller
+    // is even resumed
+    struct Slot
+        {
+        std::atomic<std::size_t>& queued;
+        ~Slot()
+            {
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            }
+        };
+    co_await net::co_spawn(threads_, [this, &work]() -> net::awaitable<void>
+        {
+        Slot slot{ queued_ };
+        work();
+        completed_.fetch_add(1, std::memory_order_relaxed);
+        co_return;
+        },
+        net::use_awaitable);
+    co_return true;
+    }
+
+HashPool::Stats HashPool::stats() const
+    {
+    return Stats{ queued_.load(std::memory_order_relaxed), completed_.load(std::memory_order_relaxed),
+        rejected_.load(std::memory_order_relaxed) };
+    }
+
+} // namespace auth
+} // namespace asciimmo
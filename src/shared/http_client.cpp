@@ -0,0 +1,394 @@
+#include "shared/http_client.hpp"
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <sys/socket.h>
+#include <algorithm>
+#include <cerrno>
+#include <exception>
+
+namespace asciimmo
+{
+namespace http
+{
+
+namespace ssl = boost::asio::ssl;
+
+struct Client::Connection
+    {
+    Connection(const net::any_io_executor& executor, ssl::context& ctx)
+        : stream(executor, ctx)
+        {}
+
+    beast::ssl_stream<beast::tcp_stream> stream;
+    beast::flat_buffer buffer;
+    std::chrono::steady_clock::time_point idle_since;
+    };
+
+struct Client::Pool
+    {
+    std::vector<std::unique_ptr<Connection>> idle; // most recently used last
+    std::shared_ptr<SSL_SESSION> session;
+    tcp::resolver::results_type endpoints;
+    std::chrono::steady_clock::time_point resolved_at;
+    };
+
+namespace
+{
+
+// Errors that mean a pooled connection was closed by the server while idle
+bool is_stale(const beast::error_code& ec)
+    {
+    return ec == net::error::eof
+        || ec == net::error::connection_reset
+        || ec == net::error::broken_pipe
+        || ec == ssl::error::stream_truncated
+        || ec == beast::http::error::end_of_stream;
+    }
+
+// Requests the server may already have acted on that are safe to send again
+bool is_idempotent(beast::http::verb method)
+    {
+    switch (method)
+        {
+        case beast::http::verb::get:
+        case beast::http::verb::head:
+        case beast::http::verb::put:
+        case beast::http::verb::delete_:
+        case beast::http::verb::options:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+bool is_ip_address(const std::string& host)
+    {
+    beast::error_code ec;
+    net::ip::make_address(host, ec);
+    return !ec;
+    }
+
+} // namespace
+
+bool Client::closed_while_idle(Connection& conn)
+    {
+    // An idle connection has nothing to read until it is sent a request, so
+    // end of stream or any byte at all (a TLS close_notify) means the server
+    // has closed it, as it does on a keep-alive timeout or a restart
+    char byte;
+    const auto n = ::recv(beast::get_lowest_layer(conn.stream).socket().native_handle(), &byte, 1,
+        MSG_PEEK | MSG_DONTWAIT);
+    return n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+
+Client::Client(net::any_io_executor executor, ClientOptions options)
+    : executor_(std::move(executor))
+    , options_(std::move(options))
+    , ssl_ctx_(ssl::context::tls_client)
+    {
+    ssl_ctx_.set_options(
+        ssl::context::default_workarounds |
+        ssl::context::no_sslv2 |
+        ssl::context::no_sslv3 |
+        ssl::context::no_tlsv1 |
+        ssl::context::no_tlsv1_1);
+
+    if (options_.verify_peer)
+        {
+        ssl_ctx_.set_default_verify_paths();
+        ssl_ctx_.set_verify_mode(ssl::verify_peer);
+        }
+    else
+        {
+        ssl_ctx_.set_verify_mode(ssl::verify_none);
+        }
+    }
+
+Client::~Client() = default;
+
+Client::Pool& Client::pool_for(const std::string& host, unsigned short port)
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto& pool = pools_[host + ":" + std::to_string(port)];
+    if (!pool)
+        {
+        pool = std::make_unique<Pool>();
+        }
+    return *pool;
+    }
+
+std::unique_ptr<Client::Connection> Client::take_idle(Pool& pool)
+    {
+    const auto cutoff = std::chrono::steady_clock::now() - options_.idle_timeout;
+    std::lock_guard<std::mutex> lock(mtx_);
+    while (!pool.idle.empty())
+        {
+        auto conn = std::move(pool.idle.back());
+        pool.idle.pop_back();
+        if (conn->idle_since >= cutoff)
+            {
+            if (closed_while_idle(*conn))
+                {
+                discard(std::move(conn));
+                continue;
+                }
+            return conn;
+            }
+        // Older ones are further down, so everything left is stale too
+        discard(std::move(conn));
+        for (auto& stale : pool.idle)
+            {
+            discard(std::move(stale));
+            }
+        pool.idle.clear();
+        }
+    return nullptr;
+    }
+
+void Client::give_back(Pool& pool, std::unique_ptr<Connection> conn)
+    {
+    conn->idle_since = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (pool.idle.size() >= options_.max_idle_per_host)
+        {
+        if (pool.idle.empty())
+            {
+            discard(std::move(conn));
+            return;
+            }
+        discard(std::move(pool.idle.front()));
+        pool.idle.erase(pool.idle.begin());
+        }
+    pool.idle.push_back(std::move(conn));
+    }
+
+void Client::discard(std::unique_ptr<Connection> conn)
+    {
+    // OpenSSL marks the session unresumable when a connection is freed
+    // without close_notify. HTTP framing doesn't need the alert, so skip the
+    // extra write and record the shutdown as sent.
+    SSL_set_shutdown(conn->stream.native_handle(), SSL_SENT_SHUTDOWN);
+    }
+
+net::awaitable<tcp::resolver::results_type> Client::resolve(Pool& pool, const std::string& host, unsigned short port)
+    {
+    const auto now = std::chrono::steady_clock::now();
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!pool.endpoints.empty() && now - pool.resolved_at < options_.dns_ttl)
+        {
+        co_return pool.endpoints;
+        }
+    }
+
+    tcp::resolver resolver(executor_);
+    auto endpoints = co_await resolver.async_resolve(host, std::to_string(port), net::use_awaitable);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    pool.endpoints = endpoints;
+    pool.resolved_at = now;
+    co_return endpoints;
+    }
+
+net::awaitable<std::unique_ptr<Client::Connection>> Client::connect(Pool& pool, const std::string& host,
+    unsigned short port)
+    {
+    auto conn = std::make_unique<Connection>(executor_, ssl_ctx_);
+    auto& stream = beast::get_lowest_layer(conn->stream);
+
+    auto endpoints = co_await resolve(pool, host, port);
+    stream.expires_after(options_.connect_timeout);
+    co_await stream.async_connect(endpoints, net::use_awaitable);
+    stream.socket().set_option(tcp::no_delay(true));
+
+    SSL* ssl = conn->stream.native_handle();
+    if (!is_ip_address(host))
+        {
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+        }
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (pool.session)
+        {
+        SSL_set_session(ssl, pool.session.get());
+        }
+    }
+
+    co_await conn->stream.async_handshake(ssl::stream_base::client, net::use_awaitable);
+    connections_opened_.fetch_add(1, std::memory_order_relaxed);
+    if (SSL_session_reused(ssl))
+        {
+        sessions_resumed_.fetch_add(1, std::memory_order_relaxed);
+        }
+    co_return conn;
+    }
+
+void Client::remember_session(Pool& pool, Connection& conn)
+    {
+    // TLS 1.3 tickets arrive after the handshake, so this runs once a
+    // response has been read
+    SSL_SESSION* session = SSL_get1_session(conn.stream.native_handle());
+    if (session == nullptr)
+        {
+        return;
+        }
+    if (!SSL_SESSION_is_resumable(session))
+        {
+        SSL_SESSION_free(session);
+        return;
+        }
+    std::lock_guard<std::mutex> lock(mtx_);
+    pool.session.reset(session, SSL_SESSION_free);
+    }
+
+net::awaitable<ClientResponse> Client::request(std::string host, unsigned short port, ClientRequest req)
+    {
+    req.set(beast::http::field::host, host);
+    req.keep_alive(true);
+    req.prepare_payload();
+
+    auto& pool = pool_for(host, port);
+    for (int attempt = 0;; ++attempt)
+        {
+        // A retry goes straight to a new connection: the rest of the pool
+        // likely went stale along with the first
+        auto conn = attempt == 0 ? take_idle(pool) : nullptr;
+        const bool reused = conn != nullptr;
+        if (!reused)
+            {
+            conn = co_await connect(pool, host, port);
+            }
+        else
+            {
+            requests_on_reused_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+        beast::error_code ec;
+        bool written = false;
+        ClientResponse res;
+        beast::get_lowest_layer(conn->stream).expires_after(options_.request_timeout);
+        co_await beast::http::async_write(conn->stream, req, net::redirect_error(net::use_awaitable, ec));
+        if (!ec)
+            {
+            written = true;
+            co_await beast::http::async_read(conn->stream, conn->buffer, res, net::redirect_error(net::use_awaitable, ec));
+            }
+        if (ec)
+            {
+            // Once the request is out the server may have acted on it, so
+            // only a request that is safe to repeat is sent again
+            if (reused && attempt == 0 && is_stale(ec) && (!written || is_idempotent(req.method())))
+                {
+                continue;
+                }
+            throw beast::system_error(ec);
+            }
+
+        if (!reused)
+            {
+            remember_session(pool, *conn);
+            }
+        if (res.keep_alive())
+            {
+            beast::get_lowest_layer(conn->stream).expires_never();
+            give_back(pool, std::move(conn));
+            }
+        else
+            {
+            discard(std::move(conn));
+            }
+        co_return res;
+        }
+    }
+
+net::awaitable<ClientResponse> Client::post(std::string host, unsigned short port, std::string target, std::string body)
+    {
+    ClientRequest req{ beast::http::verb::post, target, 11 };
+    req.set(beast::http::field::content_type, "application/json");
+    req.body() = std::move(body);
+    co_return co_await request(std::move(host), port, std::move(req));
+    }
+
+void Client::fan_out(std::vector<Endpoint> endpoints, ClientRequest req,
+    std::function<void(std::vector<FanOutResult>)> on_done)
+    {
+    struct State
+        {
+        std::vector<FanOutResult> results;
+        std::atomic<std::size_t> remaining;
+        std::function<void(std::vector<FanOutResult>)> on_done;
+        };
+
+    auto state = std::make_shared<State>();
+    state->remaining = endpoints.size();
+    state->on_done = std::move(on_done);
+    for (auto& endpoint : endpoints)
+        {
+        state->results.push_back({ std::move(endpoint), {}, {} });
+        }
+
+    if (state->results.empty())
+        {
+        net::post(executor_, [state]() { state->on_done({}); });
+        return;
+        }
+
+    for (std::size_t i = 0; i < state->results.size(); ++i)
+        {
+        const auto& endpoint = state->results[i].endpoint;
+        net::co_spawn(executor_, request(endpoint.host, endpoint.port, req),
+            [state, i](std::exception_ptr e, ClientResponse res)
+            {
+            auto& result = state->results[i];
+            if (e)
+                {
+                try
+                    {
+                    std::rethrow_exception(e);
+                    }
+                    catch (const beast::system_error& err)
+                        {
+                        result.ec = err.code();
+                        }
+                    catch (...)
+                        {
+                        result.ec = net::error::fault;
+                        }
+                }
+            else
+                {
+                result.response = std::move(res);
+                }
+
+            if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                state->on_done(std::move(state->results));
+                }
+            });
+        }
+    }
+
+Client::Stats Client::stats() const
+    {
+    return {
+        connections_opened_.load(std::memory_order_relaxed),
+        sessions_resumed_.load(std::memory_order_relaxed),
+        requests_on_reused_.load(std::memory_order_relaxed)
+        };
+    }
+
+std::size_t Client::idle_connections() const
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::size_t idle = 0;
+    for (const auto& [key, pool] : pools_)
+        {
+        idle += pool->idle.size();
+        }
+    return idle;
+    }
+
+} // namespace http
+} // namespace asciimmo
@@ -1,5 +1,18 @@
 #include "shared/http_server.hpp"
+#include "shared/ktls_stream.hpp"
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/websocket.hpp>
+#include <algorithm>
+#include <atomic>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <iostream>
+#include <optional>
+#include <tuple>
 
 namespace asciimmo
 {
@@ -9,76 +22,374 @@ namespace http
 namespace beast = boost::beast;
 namespace net = boost::asio;
 namespace ssl = boost::asio::ssl;
+namespace websocket = boost::beast::websocket;
 using tcp = net::ip::tcp;
 
-// Plain HTTP Session
-class Server::Session : public std::enable_shared_from_this<Server::Session>
+namespace
+{
+
+// Allocator for operation state carved out of a session arena. Deallocation
+// is a no-op: the arena is monotonic, and when Asio destroys an operation
+// that never completed (at shutdown) the session may already be gone.
+template <class T>
+class OperationAllocator
     {
     public:
-        Session(tcp::socket socket, Server* server)
-            : socket_(std::move(socket))
-            , server_(server)
+        using value_type = T;
+
+        explicit OperationAllocator(std::pmr::memory_resource* arena) noexcept
+            : arena_(arena)
             {}
 
-        void run()
+        template <class U>
+        OperationAllocator(const OperationAllocator<U>& other) noexcept
+            : arena_(other.arena())
+            {}
+
+        T* allocate(std::size_t n)
             {
-            do_read();
+            return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+            }
+
+        void deallocate(T*, std::size_t) noexcept
+            {
+            }
+
+        std::pmr::memory_resource* arena() const noexcept
+            {
+            return arena_;
+            }
+
+        template <class U>
+        bool operator==(const OperationAllocator<U>& other) const noexcept
+            {
+            return arena_ == other.arena();
+            }
+
+    private:
+        std::pmr::memory_resource* arena_;
+    };
+
+// Completion handler whose associated allocator is a session arena, so the
+// state Beast and Asio keep for the operation is carved out of the arena
+// instead of the heap. The operation must complete before the arena is released.
+template <class Handler>
+class ArenaBoundHandler
+    {
+    public:
+        using allocator_type = OperationAllocator<char>;
+
+        ArenaBoundHandler(std::pmr::memory_resource* arena, Handler handler)
+            : arena_(arena)
+            , handler_(std::move(handler))
+            {}
+
+        allocator_type get_allocator() const noexcept
+            {
+            return allocator_type(arena_);
+            }
+
+        template <class... Args>
+        void operator()(Args&&... args)
+            {
+            handler_(std::forward<Args>(args)...);
             }
 
     private:
+        std::pmr::memory_resource* arena_;
+        Handler handler_;
+    };
+
+// Longest literal text every match of a route pattern must start with.
+// Paths that don't start with it can skip the (allocating) regex match.
+std::string literal_prefix(const std::string& pattern)
+    {
+    if (pattern.find('|') != std::string::npos)
+        {
+        return {};
+        }
+    std::string prefix;
+    for (char c : pattern)
+        {
+        if (c == '?' || c == '*' || c == '{')
+            {
+            // The quantifier makes the preceding character optional
+            if (!prefix.empty())
+                {
+                prefix.pop_back();
+                }
+            break;
+            }
+        if (std::strchr("\\^$.+()[]", c) != nullptr)
+            {
+            break;
+            }
+        prefix += c;
+        }
+    return prefix;
+    }
+
+// Counts an open connection (HTTP or WebSocket) for the server's limits
+class ConnectionSlot
+    {
+    public:
+        explicit ConnectionSlot(std::atomic<std::size_t>& connections)
+            : connections_(connections)
+            {
+            connections_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+        ~ConnectionSlot()
+            {
+            connections_.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+        ConnectionSlot(const ConnectionSlot&) = delete;
+        ConnectionSlot& operator=(const ConnectionSlot&) = delete;
+
+    private:
+        std::atomic<std::size_t>& connections_;
+    };
+
+// Plain handlers ignore the request context
+ContextHandler with_context(Handler handler)
+    {
+    return [handler = std::move(handler)](const Request& req, Response& res, const std::smatch& matches,
+        const RequestContext&)
+        {
+        handler(req, res, matches);
+        };
+    }
+
+AsyncContextHandler with_context(AsyncHandler handler)
+    {
+    return [handler = std::move(handler)](const Request& req, Response& res, const std::smatch& matches,
+        const RequestContext&)
+        {
+        return handler(req, res, matches);
+        };
+    }
+
+// How often the event loop's queue delay is sampled
+constexpr auto kQueueDelayProbeInterval = std::chrono::milliseconds(100);
+
+} // namespace
+
+// Request/response cycle shared by the plain and HTTPS sessions.
+// Derived supplies stream(), run() and do_close().
+//
+// Each session owns a monotonic arena that backs the parser's header fields,
+// the response headers and handler scratch space (see scratch()). It is
+// released after every response, so a keep-alive connection serves requests
+// without going back to the heap for them. The request target, match results
+// and body strings are kept as session members to reuse their capacity.
+//
+// Reads run under the header and body deadlines from ServerOptions; the
+// header deadline also bounds how long an idle keep-alive connection is kept.
+template <class Derived>
+class Server::SessionBase
+    {
+    public:
+        SessionBase(Server* server, bool admitted, const tcp::socket& socket)
+            : arena_(arena_buffer_.data(), arena_buffer_.size())
+            , server_(server)
+            , slot_(server->connections_)
+            , admitted_(admitted)
+            {
+            beast::error_code ec;
+            context_.client_ip = socket.remote_endpoint(ec).address();
+            }
+
+    protected:
+        using Parser = beast::http::request_parser<beast::http::string_body, ArenaAllocator<char>>;
+
+        // Bodies larger than this are not kept around between requests
+        static constexpr std::size_t kMaxRetainedBody = 64 * 1024;
+
+        Derived& derived()
+            {
+            return static_cast<Derived&>(*this);
+            }
+
         void do_read()
             {
-            auto self = shared_from_this();
-            beast::http::async_read(socket_, buffer_, req_,
-                [self](beast::error_code ec, std::size_t)
+            parser_.emplace(std::piecewise_construct,
+                std::make_tuple(std::move(spare_req_body_)),
+                std::make_tuple(ArenaAllocator<char>(&arena_)));
+
+            // A timed out read closes the socket and ends the session
+            beast::get_lowest_layer(derived().stream()).expires_after(server_->options_.header_timeout);
+            auto self = derived().shared_from_this();
+            auto on_header = [self](beast::error_code ec, std::size_t bytes)
                 {
-                if (!ec)
+                if (ec)
+                    {
+                    return;
+                    }
+                self->bytes_in_ = bytes;
+                if (self->parser_->is_done())
                     {
                     self->handle_request();
+                    return;
                     }
-                });
+                self->do_read_body();
+                };
+            beast::http::async_read_header(derived().stream(), buffer_, *parser_,
+                ArenaBoundHandler<decltype(on_header)>(&arena_, std::move(on_header)));
+            }
+
+        void do_read_body()
+            {
+            beast::get_lowest_layer(derived().stream()).expires_after(server_->options_.body_timeout);
+            auto self = derived().shared_from_this();
+            auto on_body = [self](beast::error_code ec, std::size_t bytes)
+                {
+                if (ec)
+                    {
+                    return;
+                    }
+                self->bytes_in_ += bytes;
+                self->handle_request();
+                };
+            beast::http::async_read(derived().stream(), buffer_, *parser_,
+                ArenaBoundHandler<decltype(on_body)>(&arena_, std::move(on_body)));
             }
 
         void handle_request()
             {
-            Response res{ beast::http::status::not_found, req_.version() };
-            res.set(beast::http::field::server, "ASCIIMMO");
-            res.set(beast::http::field::content_type, "application/json");
-            res.keep_alive(req_.keep_alive());
+            started_ = std::chrono::steady_clock::now();
+            auto& req = parser_->get();
 
-            server_->handle_request(req_, res);
+            res_.emplace(beast::http::status::not_found, req.version(), std::move(spare_res_body_),
+                ArenaAllocator<char>(&arena_));
+            res_->set(beast::http::field::server, "ASCIIMMO");
+            res_->set(beast::http::field::content_type, "application/json");
+            res_->keep_alive(req.keep_alive());
 
-            do_write();
+            // The completion keeps the session (and so the request and
+            // response) alive while an async handler is suspended
+            auto self = derived().shared_from_this();
+            server_->handle_request(req, *res_, context_, target_, matches_, admitted_, derived().stream().get_executor(),
+                [self](std::size_t metrics_id)
+                {
+                self->metrics_id_ = metrics_id;
+                const Route* route = self->context_.route;
+                if (route != nullptr && route->upgrade
+                    && self->res_->result() == beast::http::status::switching_protocols)
+                    {
+                    // The WebSocket session takes the stream and this one ends
+                    auto elapsed = std::chrono::steady_clock::now() - self->started_;
+                    self->server_->metrics_.record(metrics_id, self->res_->result_int(), self->bytes_in_, 0,
+                        std::chrono::duration_cast<std::chrono::microseconds>(elapsed));
+                    self->server_->upgrade(self->derived().stream(), self->parser_->get(), *route);
+                    return;
+                    }
+                self->do_write();
+                });
             }
 
         void do_write()
             {
-            auto self = shared_from_this();
-            beast::http::async_write(socket_, res_,
-                [self](beast::error_code ec, std::size_t)
+            beast::get_lowest_layer(derived().stream()).expires_after(server_->options_.write_timeout);
+            auto self = derived().shared_from_this();
+            auto on_write = [self](beast::error_code ec, std::size_t bytes)
                 {
-                self->socket_.shutdown(tcp::socket::shutdown_send, ec);
-                });
+                auto elapsed = std::chrono::steady_clock::now() - self->started_;
+                self->server_->metrics_.record(self->metrics_id_, self->res_->result_int(), self->bytes_in_, bytes,
+                    std::chrono::duration_cast<std::chrono::microseconds>(elapsed));
+
+                if (ec || self->res_->need_eof())
+                    {
+                    self->do_close(ec);
+                    return;
+                    }
+                self->reset_arena();
+                self->do_read();
+                };
+            beast::http::async_write(derived().stream(), *res_,
+                ArenaBoundHandler<decltype(on_write)>(&arena_, std::move(on_write)));
+            }
+
+        // Everything allocated from the arena must be gone before it is released
+        void reset_arena()
+            {
+            spare_req_body_ = std::move(parser_->get().body());
+            spare_res_body_ = std::move(res_->body());
+            for (auto* body : { &spare_req_body_, &spare_res_body_ })
+                {
+                if (body->capacity() > kMaxRetainedBody)
+                    {
+                    std::string().swap(*body);
+                    }
+                body->clear();
+                }
+            parser_.reset();
+            res_.reset();
+            arena_.release();
             }
 
-        tcp::socket socket_;
+        std::array<std::byte, kArenaBytes> arena_buffer_;
+        std::pmr::monotonic_buffer_resource arena_;
         beast::flat_buffer buffer_;
-        Request req_;
-        Response res_;
+        std::optional<Parser> parser_;
+        std::optional<Response> res_;
+        std::string spare_req_body_;
+        std::string spare_res_body_;
+        std::string target_;
+        std::smatch matches_;
+        RequestContext context_;
         Server* server_;
+        ConnectionSlot slot_;
+        bool admitted_;
+        std::chrono::steady_clock::time_point started_;
+        std::size_t bytes_in_ = 0;
+        std::size_t metrics_id_ = 0;
+    };
+
+// Plain HTTP Session
+class Server::Session
+    : public Server::SessionBase<Server::Session>
+    , public std::enable_shared_from_this<Server::Session>
+    {
+    public:
+        Session(tcp::socket socket, Server* server, bool admitted)
+            : SessionBase<Session>(server, admitted, socket)
+            , stream_(std::move(socket))
+            {}
+
+        void run()
+            {
+            do_read();
+            }
+
+        beast::tcp_stream& stream()
+            {
+            return stream_;
+            }
+
+        void do_close(beast::error_code ec)
+            {
+            stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+            }
+
+    private:
+        beast::tcp_stream stream_;
     };
 
 // HTTPS Session
-class Server::SSLSession : public std::enable_shared_from_this<Server::SSLSession>
+class Server::SSLSession
+    : public Server::SessionBase<Server::SSLSession>
+    , public std::enable_shared_from_this<Server::SSLSession>
     {
     public:
-        SSLSession(tcp::socket socket, ssl::context& ctx, Server* server)
-            : stream_(std::move(socket), ctx)
-            , server_(server)
+        SSLSession(tcp::socket socket, ssl::context& ctx, Server* server, bool admitted)
+            : SessionBase<SSLSession>(server, admitted, socket)
+            , stream_(std::move(socket), ctx)
             {}
 
         void run()
             {
+            beast::get_lowest_layer(stream_).expires_after(server_->options_.header_timeout);
             auto self = shared_from_this();
             stream_.async_handshake(ssl::stream_base::server,
                 [self](beast::error_code ec)
@@ -90,71 +401,352 @@ class Server::SSLSession : public std::enable_shared_from_this<Server::SSLSessio
                 });
             }
 
+        beast::ssl_stream<beast::tcp_stream>& stream()
+            {
+            return stream_;
+            }
+
+        void do_close(beast::error_code ec)
+            {
+            if (!ec)
+                {
+                beast::get_lowest_layer(stream_).expires_after(server_->options_.write_timeout);
+                auto self = shared_from_this();
+                stream_.async_shutdown(
+                    [self](beast::error_code)
+                    {
+                    // Shutdown complete
+                    });
+                }
+            }
+
     private:
-        void do_read()
+        beast::ssl_stream<beast::tcp_stream> stream_;
+    };
+
+// HTTPS session on a KtlsStream, used when ServerOptions::ktls is set and
+// the kernel supports it
+class Server::KtlsSession
+    : public Server::SessionBase<Server::KtlsSession>
+    , public std::enable_shared_from_this<Server::KtlsSession>
+    {
+    public:
+        KtlsSession(tcp::socket socket, ssl::context& ctx, Server* server, bool admitted)
+            : SessionBase<KtlsSession>(server, admitted, socket)
+            , stream_(std::move(socket), ctx)
+            {}
+
+        void run()
             {
+            stream_.expires_after(server_->options_.header_timeout);
             auto self = shared_from_this();
-            beast::http::async_read(stream_, buffer_, req_,
-                [self](beast::error_code ec, std::size_t)
+            stream_.async_handshake(
+                [self](beast::error_code ec)
                 {
-                if (!ec)
+                if (ec)
                     {
-                    self->handle_request();
+                    return;
                     }
+                if (self->stream_.ktls_send())
+                    {
+                    self->server_->ktls_connections_.fetch_add(1, std::memory_order_relaxed);
+                    }
+                self->do_read();
                 });
             }
 
-        void handle_request()
+        KtlsStream& stream()
             {
-            Response res{ beast::http::status::not_found, req_.version() };
-            res.set(beast::http::field::server, "ASCIIMMO");
-            res.set(beast::http::field::content_type, "application/json");
-            res.keep_alive(req_.keep_alive());
+            return stream_;
+            }
 
-            server_->handle_request(req_, res);
+        void do_close(beast::error_code ec)
+            {
+            if (!ec)
+                {
+                stream_.expires_after(server_->options_.write_timeout);
+                auto self = shared_from_this();
+                stream_.async_shutdown(
+                    [self](beast::error_code)
+                    {
+                    // Shutdown complete
+                    });
+                }
+            }
+
+    private:
+        KtlsStream stream_;
+    };
+
+// WebSocket session; Stream is the transport taken over from the HTTP session
+template <class Stream>
+class Server::WebSocketSession
+    : public WebSocketConnection
+    , public std::enable_shared_from_this<Server::WebSocketSession<Stream>>
+    {
+    public:
+        WebSocketSession(Stream&& stream, const WebSocketRoute& route, std::atomic<std::size_t>& connections)
+            : ws_(std::move(stream))
+            , route_(route)
+            , slot_(connections)
+            {}
+
+        // req lives in the HTTP session's arena, which goes away with that
+        // session, so the upgrade request is copied onto the heap
+        void run(const Request& req)
+            {
+            req_.method(req.method());
+            req_.target(req.target());
+            req_.version(req.version());
+            for (const auto& field : req)
+                {
+                req_.insert(field.name(), field.name_string(), field.value());
+                }
+            req_.body() = req.body();
+
+            // The websocket stream keeps its own timeouts
+            beast::get_lowest_layer(ws_).expires_never();
+            ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+            ws_.set_option(websocket::stream_base::decorator(
+                [](websocket::response_type& res)
+                {
+                res.set(beast::http::field::server, "ASCIIMMO");
+                }));
+            ws_.text(true);
+
+            auto self = this->shared_from_this();
+            ws_.async_accept(req_,
+                [self](beast::error_code ec)
+                {
+                if (ec)
+                    {
+                    self->closed_ = true;
+                    return;
+                    }
+                self->on_accept();
+                });
+            }
+
+        bool send(std::shared_ptr<const std::string> message) override
+            {
+            if (closed_)
+                {
+                return false;
+                }
+
+            // Reserve queue space up front so the limit holds across threads
+            const std::size_t size = message->size();
+            const std::size_t messages = queued_messages_.fetch_add(1) + 1;
+            const std::size_t bytes = queued_bytes_.fetch_add(size) + size;
+            if (messages > route_.handler.max_queued_messages || bytes > route_.handler.max_queued_bytes)
+                {
+                queued_messages_ -= 1;
+                queued_bytes_ -= size;
+                close();
+                return false;
+                }
+
+            auto self = this->shared_from_this();
+            net::post(ws_.get_executor(),
+                [self, message = std::move(message)]() mutable
+                {
+                self->queue_.push_back(std::move(message));
+                if (self->queue_.size() == 1)
+                    {
+                    self->do_write();
+                    }
+                });
+            return true;
+            }
+
+        void close() override
+            {
+            if (closed_.exchange(true))
+                {
+                return;
+                }
+
+            auto self = this->shared_from_this();
+            net::post(ws_.get_executor(),
+                [self]()
+                {
+                self->ws_.async_close(websocket::close_code::normal,
+                    [self](beast::error_code)
+                    {
+                    // Close handshake complete; the pending read ends the session
+                    });
+                });
+            }
+
+        std::size_t queued_bytes() const override
+            {
+            return queued_bytes_;
+            }
+
+    private:
+        void on_accept()
+            {
+            target_ = std::string(req_.target());
+            auto path_end = target_.find('?');
+            path_end = path_end == std::string::npos ? target_.size() : path_end;
+            std::regex_match(target_.cbegin(), target_.cbegin() + path_end, matches_, route_.route.pattern);
+
+            if (route_.handler.on_open)
+                {
+                route_.handler.on_open(this->shared_from_this(), req_, matches_);
+                }
+            do_read();
+            }
 
-            do_write();
+        void do_read()
+            {
+            auto self = this->shared_from_this();
+            ws_.async_read(buffer_,
+                [self](beast::error_code ec, std::size_t)
+                {
+                if (ec)
+                    {
+                    self->on_closed();
+                    return;
+                    }
+                if (self->route_.handler.on_message)
+                    {
+                    auto data = self->buffer_.data();
+                    self->route_.handler.on_message(self,
+                        std::string_view(static_cast<const char*>(data.data()), data.size()));
+                    }
+                self->buffer_.consume(self->buffer_.size());
+                self->do_read();
+                });
             }
 
         void do_write()
             {
-            auto self = shared_from_this();
-            beast::http::async_write(stream_, res_,
+            if (closed_)
+                {
+                queue_.clear();
+                queued_messages_ = 0;
+                queued_bytes_ = 0;
+                return;
+                }
+
+            auto self = this->shared_from_this();
+            ws_.async_write(net::buffer(*queue_.front()),
                 [self](beast::error_code ec, std::size_t)
                 {
-                if (!ec)
+                self->queued_messages_ -= 1;
+                self->queued_bytes_ -= self->queue_.front()->size();
+                self->queue_.pop_front();
+                if (ec)
+                    {
+                    self->closed_ = true;
+                    }
+                if (!self->queue_.empty())
                     {
-                    self->stream_.async_shutdown(
-                        [self](beast::error_code)
-                        {
-                        // Shutdown complete
-                        });
+                    self->do_write();
                     }
                 });
             }
 
-        beast::ssl_stream<tcp::socket> stream_;
-        beast::flat_buffer buffer_;
+        void on_closed()
+            {
+            closed_ = true;
+            if (route_.handler.on_close)
+                {
+                route_.handler.on_close(this->shared_from_this());
+                }
+            }
+
+        websocket::stream<Stream> ws_;
+        const WebSocketRoute& route_;
+        ConnectionSlot slot_;
         Request req_;
-        Response res_;
-        Server* server_;
+        std::string target_;
+        std::smatch matches_;
+        beast::flat_buffer buffer_;
+        // Only touched on the stream's executor
+        std::deque<std::shared_ptr<const std::string>> queue_;
+        std::atomic<std::size_t> queued_messages_{ 0 };
+        std::atomic<std::size_t> queued_bytes_{ 0 };
+        std::atomic<bool> closed_{ false };
     };
 
-Server::Server(net::io_context& ioc, unsigned short port)
+void WebSocketChannel::join(const WebSocketPtr& conn)
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    members_.push_back(conn);
+    }
+
+void WebSocketChannel::leave(const WebSocketPtr& conn)
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    members_.erase(std::remove_if(members_.begin(), members_.end(),
+        [&conn](const std::weak_ptr<WebSocketConnection>& member)
+        {
+        auto locked = member.lock();
+        return !locked || locked == conn;
+        }), members_.end());
+    }
+
+std::size_t WebSocketChannel::broadcast(std::string message)
+    {
+    // One shared payload for every member's queue
+    auto shared = std::make_shared<const std::string>(std::move(message));
+    std::size_t delivered = 0;
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    members_.erase(std::remove_if(members_.begin(), members_.end(),
+        [&shared, &delivered](const std::weak_ptr<WebSocketConnection>& member)
+        {
+        auto conn = member.lock();
+        if (conn && conn->send(shared))
+            {
+            ++delivered;
+            return false;
+            }
+        return true;
+        }), members_.end());
+    return delivered;
+    }
+
+std::size_t WebSocketChannel::size() const
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return members_.size();
+    }
+
+Server::Server(net::io_context& ioc, unsigned short port, ServerOptions options)
     : ioc_(ioc)
     , acceptor_(ioc, tcp::endpoint(tcp::v4(), port))
+    , unmatched_metrics_id_(metrics_.add_route("ANY", "unmatched"))
+    , shed_metrics_id_(metrics_.add_route("ANY", "shed"))
+    , options_(std::move(options))
+    , probe_timer_(ioc)
     , running_(false)
     , use_ssl_(false)
-    {}
+    {
+    metrics_.add_gauge("asciimmo_http_connections", "Open HTTP and WebSocket connections",
+        [this] { return static_cast<double>(connections_.load(std::memory_order_relaxed)); });
+    metrics_.add_gauge("asciimmo_http_refused_connections", "Connections refused over the hard limit since start",
+        [this] { return static_cast<double>(refused_connections_.load(std::memory_order_relaxed)); });
+    metrics_.add_gauge("asciimmo_http_queue_delay_seconds", "Event loop queue delay used for load shedding",
+        [this] { return static_cast<double>(queue_delay_us_.load(std::memory_order_relaxed)) / 1e6; });
+
+    get("/metrics", [this](const Request&, Response& res, const std::smatch&)
+        {
+        res.result(beast::http::status::ok);
+        res.set(beast::http::field::content_type, "text/plain; version=0.0.4");
+        res.body() = metrics_.render();
+        res.prepare_payload();
+        });
+    }
 
 Server::Server(net::io_context& ioc, unsigned short port,
-    const std::string& cert_file, const std::string& key_file)
-    : ioc_(ioc)
-    , acceptor_(ioc, tcp::endpoint(tcp::v4(), port))
-    , running_(false)
-    , use_ssl_(true)
-    , ssl_ctx_(std::make_unique<ssl::context>(ssl::context::tls_server))
+    const std::string& cert_file, const std::string& key_file, ServerOptions options)
+    : Server(ioc, port, std::move(options))
     {
+    use_ssl_ = true;
+    ssl_ctx_ = std::make_unique<ssl::context>(ssl::context::tls_server);
 
     ssl_ctx_->set_options(
         ssl::context::default_workarounds |
@@ -166,38 +758,231 @@ Server::Server(net::io_context& ioc, unsigned short port,
 
     ssl_ctx_->use_certificate_chain_file(cert_file);
     ssl_ctx_->use_private_key_file(key_file, ssl::context::pem);
+
+    if (options_.ktls)
+        {
+        use_ktls_ = ktls_available();
+        if (use_ktls_)
+            {
+            SSL_CTX_set_options(ssl_ctx_->native_handle(), SSL_OP_ENABLE_KTLS);
+            }
+        else
+            {
+            std::cerr << "kTLS requested but not supported here; using user-space TLS" << std::endl;
+            }
+        metrics_.add_gauge("asciimmo_http_ktls_connections", "HTTPS connections with kernel TLS offload since start",
+            [this] { return static_cast<double>(ktls_connections_.load(std::memory_order_relaxed)); });
+        }
+    }
+
+void Server::add_route(beast::http::verb method, const std::string& pattern, Access access,
+    ContextHandler handler, AsyncContextHandler async_handler)
+    {
+    auto metrics_id = metrics_.add_route(std::string(beast::http::to_string(method)), pattern);
+    routes_.push_back({ method, pattern, std::regex(pattern), literal_prefix(pattern), access, std::move(handler),
+        std::move(async_handler), metrics_id });
     }
 
 void Server::get(const std::string& pattern, Handler handler)
     {
-    routes_.push_back({ beast::http::verb::get, std::regex(pattern), handler });
+    add_route(beast::http::verb::get, pattern, Access::Public, with_context(std::move(handler)), nullptr);
     }
 
 void Server::post(const std::string& pattern, Handler handler)
     {
-    routes_.push_back({ beast::http::verb::post, std::regex(pattern), handler });
+    add_route(beast::http::verb::post, pattern, Access::Public, with_context(std::move(handler)), nullptr);
     }
 
 void Server::put(const std::string& pattern, Handler handler)
     {
-    routes_.push_back({ beast::http::verb::put, std::regex(pattern), handler });
+    add_route(beast::http::verb::put, pattern, Access::Public, with_context(std::move(handler)), nullptr);
     }
 
 void Server::del(const std::string& pattern, Handler handler)
     {
-    routes_.push_back({ beast::http::verb::delete_, std::regex(pattern), handler });
+    add_route(beast::http::verb::delete_, pattern, Access::Public, with_context(std::move(handler)), nullptr);
+    }
+
+void Server::get(const std::string& pattern, Access access, ContextHandler handler)
+    {
+    add_route(beast::http::verb::get, pattern, access, std::move(handler), nullptr);
+    }
+
+void Server::post(const std::string& pattern, Access access, ContextHandler handler)
+    {
+    add_route(beast::http::verb::post, pattern, access, std::move(handler), nullptr);
+    }
+
+void Server::put(const std::string& pattern, Access access, ContextHandler handler)
+    {
+    add_route(beast::http::verb::put, pattern, access, std::move(handler), nullptr);
+    }
+
+void Server::del(const std::string& pattern, Access access, ContextHandler handler)
+    {
+    add_route(beast::http::verb::delete_, pattern, access, std::move(handler), nullptr);
+    }
+
+void Server::get_async(const std::string& pattern, AsyncHandler handler)
+    {
+    add_route(beast::http::verb::get, pattern, Access::Public, nullptr, with_context(std::move(handler)));
+    }
+
+void Server::post_async(const std::string& pattern, AsyncHandler handler)
+    {
+    add_route(beast::http::verb::post, pattern, Access::Public, nullptr, with_context(std::move(handler)));
+    }
+
+void Server::put_async(const std::string& pattern, AsyncHandler handler)
+    {
+    add_route(beast::http::verb::put, pattern, Access::Public, nullptr, with_context(std::move(handler)));
+    }
+
+void Server::del_async(const std::string& pattern, AsyncHandler handler)
+    {
+    add_route(beast::http::verb::delete_, pattern, Access::Public, nullptr, with_context(std::move(handler)));
+    }
+
+void Server::get_async(const std::string& pattern, Access access, AsyncContextHandler handler)
+    {
+    add_route(beast::http::verb::get, pattern, access, nullptr, std::move(handler));
+    }
+
+void Server::post_async(const std::string& pattern, Access access, AsyncContextHandler handler)
+    {
+    add_route(beast::http::verb::post, pattern, access, nullptr, std::move(handler));
+    }
+
+void Server::put_async(const std::string& pattern, Access access, AsyncContextHandler handler)
+    {
+    add_route(beast::http::verb::put, pattern, access, nullptr, std::move(handler));
+    }
+
+void Server::del_async(const std::string& pattern, Access access, AsyncContextHandler handler)
+    {
+    add_route(beast::http::verb::delete_, pattern, access, nullptr, std::move(handler));
+    }
+
+void Server::websocket(const std::string& pattern, WebSocketHandler handler)
+    {
+    websocket(pattern, Access::Public, std::move(handler));
+    }
+
+void Server::websocket(const std::string& pattern, Access access, WebSocketHandler handler)
+    {
+    auto metrics_id = metrics_.add_route("WS", pattern);
+    Route route{ beast::http::verb::get, pattern, std::regex(pattern), literal_prefix(pattern), access, nullptr, nullptr,
+        metrics_id, true };
+    ws_routes_.push_back({ std::move(route), std::move(handler) });
+    }
+
+void Server::use(Middleware middleware)
+    {
+    middleware_.push_back({ std::move(middleware), nullptr, nullptr });
+    }
+
+void Server::use_async(StagePredicate when, AsyncMiddleware middleware)
+    {
+    middleware_.push_back({ nullptr, std::move(middleware), std::move(when) });
+    }
+
+template <class Stream>
+void Server::upgrade(Stream& stream, const Request& req, const Route& route)
+    {
+    for (const auto& ws_route : ws_routes_)
+        {
+        if (&ws_route.route == &route)
+            {
+            std::make_shared<WebSocketSession<Stream>>(std::move(stream), ws_route, connections_)->run(req);
+            return;
+            }
+        }
     }
 
 void Server::run()
     {
     running_ = true;
     do_accept();
+    probe_queue_delay();
     }
 
 void Server::stop()
     {
     running_ = false;
     acceptor_.close();
+    probe_timer_.cancel();
+    }
+
+unsigned short Server::port() const
+    {
+    return acceptor_.local_endpoint().port();
+    }
+
+metrics::Registry& Server::metrics()
+    {
+    return metrics_;
+    }
+
+const ServerOptions& Server::options() const
+    {
+    return options_;
+    }
+
+std::chrono::microseconds Server::queue_delay() const
+    {
+    return std::chrono::microseconds(queue_delay_us_.load(std::memory_order_relaxed));
+    }
+
+void Server::probe_queue_delay()
+    {
+    const auto due = std::chrono::steady_clock::now() + kQueueDelayProbeInterval;
+    probe_timer_.expires_at(due);
+    probe_timer_.async_wait(
+        [this, due](beast::error_code ec)
+        {
+        if (ec || !running_)
+            {
+            return;
+            }
+
+        // A late timer means handlers were queued behind other work for that
+        // long. Spikes decay by half per probe so shedding doesn't flap.
+        const auto late = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - due).count();
+        const auto previous = queue_delay_us_.load(std::memory_order_relaxed);
+        queue_delay_us_.store(std::max<int64_t>(late, previous / 2), std::memory_order_relaxed);
+        probe_queue_delay();
+        });
+    }
+
+bool Server::is_priority(const std::string& path) const
+    {
+    return std::find(options_.priority_paths.begin(), options_.priority_paths.end(), path)
+        != options_.priority_paths.end();
+    }
+
+void Server::refuse(tcp::socket socket)
+    {
+    refused_connections_.fetch_add(1, std::memory_order_relaxed);
+    if (use_ssl_)
+        {
+        // No handshake has happened, so there is no way to send a response
+        beast::error_code ec;
+        socket.close(ec);
+        return;
+        }
+
+    auto response = std::make_shared<std::string>(
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: " + std::to_string(options_.retry_after.count()) + "\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n");
+    auto sock = std::make_shared<tcp::socket>(std::move(socket));
+    net::async_write(*sock, net::buffer(*response),
+        [sock, response](beast::error_code ec, std::size_t)
+        {
+        sock->shutdown(tcp::socket::shutdown_both, ec);
+        });
     }
 
 void Server::do_accept()
@@ -209,22 +994,44 @@ void Server::do_accept()
         {
         if (!ec)
             {
-            if (use_ssl_)
+            const auto open = connections_.load(std::memory_order_relaxed);
+            if (open >= options_.max_connections + options_.priority_connections)
+                {
+                refuse(std::move(socket));
+                }
+            else if (use_ktls_)
                 {
-                std::make_shared<SSLSession>(std::move(socket), *ssl_ctx_, this)->run();
+                std::make_shared<KtlsSession>(std::move(socket), *ssl_ctx_, this, open < options_.max_connections)->run();
+                }
+            else if (use_ssl_)
+                {
+                std::make_shared<SSLSession>(std::move(socket), *ssl_ctx_, this, open < options_.max_connections)->run();
                 }
             else
                 {
-                std::make_shared<Session>(std::move(socket), this)->run();
+                std::make_shared<Session>(std::move(socket), this, open < options_.max_connections)->run();
                 }
             }
         do_accept();
         });
     }
 
-void Server::handle_request(const Request& req, Response& res)
+template <class Completion>
+void Server::handle_request(const Request& req, Response& res, RequestContext& ctx, std::string& target,
+    std::smatch& matches, bool admitted, const net::any_io_executor& ex, Completion&& on_complete)
     {
-    std::string target(req.target());
+    // Routes match on the path; handlers read the query from req.target()
+    auto query_start = req.target().find('?');
+    auto path = req.target().substr(0, query_start);
+    target.assign(path.data(), path.size());
+    ctx.path = target;
+    ctx.parse_query(query_start == boost::string_view::npos
+        ? std::string_view()
+        : std::string_view(req.target().data() + query_start + 1, req.target().size() - query_start - 1));
+    ctx.route = nullptr;
+    ctx.authenticated = false;
+    ctx.session_token = 0;
+    ctx.user_id = 0;
 
     // Add CORS headers to all responses
     res.set(beast::http::field::access_control_allow_origin, "*");
@@ -233,32 +1040,166 @@ void Server::handle_request(const Request& req, Response& res)
     res.set(beast::http::field::access_control_allow_headers, "Content-Type, Authorization");
     res.set(beast::http::field::access_control_max_age, "86400"); // 24 * 60 * 60 seconds
 
+    // Shed load early and cheaply; the client is told when to come back
+    if ((!admitted || queue_delay() > options_.max_queue_delay) && !is_priority(target))
+        {
+        res.result(beast::http::status::service_unavailable);
+        res.set(beast::http::field::retry_after, std::to_string(options_.retry_after.count()));
+        res.keep_alive(false);
+        res.body() = R"({"error":"server overloaded"})";
+        res.prepare_payload();
+        on_complete(shed_metrics_id_);
+        return;
+        }
+
     // Handle OPTIONS preflight requests
     if (req.method() == beast::http::verb::options)
         {
         std::cout << "Handled OPTIONS request for " << target << std::endl;
         res.result(beast::http::status::no_content);
         res.prepare_payload();
+        on_complete(unmatched_metrics_id_);
         return;
         }
 
-    for (const auto& route : routes_)
+    // WebSocket routes match on the path; the query usually carries the session token
+    if (websocket::is_upgrade(req))
         {
-        if (route.method == req.method())
+        for (const auto& ws_route : ws_routes_)
             {
-            std::smatch matches;
-            if (std::regex_match(target, matches, route.pattern))
+            if (target.starts_with(ws_route.route.literal_prefix)
+                && std::regex_match(target, matches, ws_route.route.pattern))
                 {
-                route.handler(req, res, matches);
+                ctx.route = &ws_route.route;
+                break;
+                }
+            }
+        }
+    for (std::size_t i = 0; i < routes_.size() && ctx.route == nullptr; ++i)
+        {
+        const Route& route = routes_[i];
+        if (route.method == req.method() && target.starts_with(route.literal_prefix)
+            && std::regex_match(target, matches, route.pattern))
+            {
+            ctx.route = &route;
+            }
+        }
+
+    if (ctx.route == nullptr)
+        {
+        res.result(beast::http::status::not_found);
+        res.body() = R"({"error":"not found"})";
+        res.prepare_payload();
+        on_complete(unmatched_metrics_id_);
+        return;
+        }
+
+    // Stages run once the route is known, since the auth stage needs its
+    // access level and rate limits can be per route. Matching is cheap (the
+    // literal prefix rules out most routes before the regex), and a request
+    // that matches nothing is answered 404 without running them.
+    const Route& route = *ctx.route;
+    for (std::size_t i = 0; i < middleware_.size(); ++i)
+        {
+        const Stage& stage = middleware_[i];
+        if (stage.async)
+            {
+            if (stage.when(req, ctx))
+                {
+                finish_async(req, res, ctx, target, i, ex, std::forward<Completion>(on_complete));
                 return;
                 }
+            continue;
+            }
+        if (!stage.sync(req, res, ctx))
+            {
+            on_complete(route.metrics_id);
+            return;
             }
         }
 
-    // Not found
-    res.result(beast::http::status::not_found);
-    res.body() = R"({"error":"not found"})";
-    res.prepare_payload();
+    if (route.upgrade)
+        {
+        res.result(beast::http::status::switching_protocols);
+        on_complete(route.metrics_id);
+        return;
+        }
+
+    if (route.async_handler)
+        {
+        finish_async(req, res, ctx, target, middleware_.size(), ex, std::forward<Completion>(on_complete));
+        return;
+        }
+
+    route.handler(req, res, matches, ctx);
+    on_complete(route.metrics_id);
+    }
+
+template <class Completion>
+void Server::finish_async(const Request& req, Response& res, RequestContext& ctx, const std::string& target,
+    std::size_t first, const net::any_io_executor& ex, Completion&& on_complete)
+    {
+    const Route& route = *ctx.route;
+    // The match results point into the session's target buffer, so the
+    // coroutine takes its own copy of the target and re-matches it
+    net::co_spawn(ex,
+        [this, &route, &req, &res, &ctx, first, target = target]() -> net::awaitable<void>
+        {
+        for (std::size_t i = first; i < middleware_.size(); ++i)
+            {
+            const Stage& stage = middleware_[i];
+            if (stage.async)
+                {
+                if (stage.when(req, ctx) && !co_await stage.async(req, res, ctx))
+                    {
+                    co_return;
+                    }
+                }
+            else if (!stage.sync(req, res, ctx))
+                {
+                co_return;
+                }
+            }
+
+        if (route.upgrade)
+            {
+            res.result(beast::http::status::switching_protocols);
+            co_return;
+            }
+
+        std::smatch coro_matches;
+        std::regex_match(target, coro_matches, route.pattern);
+        if (route.async_handler)
+            {
+            co_await route.async_handler(req, res, coro_matches, ctx);
+            }
+        else
+            {
+            route.handler(req, res, coro_matches, ctx);
+            }
+        },
+        [&route, &res, on_complete = std::forward<Completion>(on_complete)](std::exception_ptr e)
+        {
+        if (e)
+            {
+            try
+                {
+                std::rethrow_exception(e);
+                }
+                catch (const std::exception& err)
+                    {
+                    std::cerr << "Async handler failed: " << err.what() << std::endl;
+                    }
+                catch (...)
+                    {
+                    std::cerr << "Async handler failed" << std::endl;
+                    }
+                res.result(beast::http::status::internal_server_error);
+                res.body() = R"({"error":"internal server error"})";
+                res.prepare_payload();
+            }
+        on_complete(route.metrics_id);
+        });
     }
 
 } // namespace http
@@ -0,0 +1,278 @@
+#include "shared/metrics.hpp"
+#include <algorithm>
+#include <bit>
+#include <sstream>
+#include <thread>
+
+namespace asciimmo
+{
+namespace metrics
+{
+
+namespace
+{
+
+// Cumulative bucket edges exported to Prometheus, in microseconds
+constexpr uint64_t kExportEdges[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+    };
+
+constexpr double kQuantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+std::string escape_label(const std::string& value)
+    {
+    std::string out;
+    out.reserve(value.size());
+    for (char c : value)
+        {
+        if (c == '\\' || c == '"')
+            {
+            out += '\\';
+            out += c;
+            }
+        else if (c == '\n')
+            {
+            out += "\\n";
+            }
+        else
+            {
+            out += c;
+            }
+        }
+    return out;
+    }
+
+} // namespace
+
+void LatencyHistogram::record(uint64_t micros)
+    {
+    counts_[bucket_index(micros)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+void LatencyHistogram::add_to(Snapshot& counts) const
+    {
+    for (int i = 0; i < kBuckets; ++i)
+        {
+        counts[i] += counts_[i].load(std::memory_order_relaxed);
+        }
+    }
+
+int LatencyHistogram::bucket_index(uint64_t micros)
+    {
+    micros = std::min<uint64_t>(micros, (uint64_t{ 1 } << kMaxBit) - 1);
+    if (micros < 2 * kSubBuckets)
+        {
+        // The first two ranges are one microsecond per bucket
+        return static_cast<int>(micros);
+        }
+    const int msb = std::bit_width(micros) - 1;
+    const int shift = msb - kSubBucketBits;
+    const int sub = static_cast<int>((micros >> shift) & (kSubBuckets - 1));
+    return (shift + 1) * kSubBuckets + sub;
+    }
+
+uint64_t LatencyHistogram::bucket_upper_bound(int index)
+    {
+    if (index < 2 * kSubBuckets)
+        {
+        return static_cast<uint64_t>(index) + 1;
+        }
+    const int shift = index / kSubBuckets - 1;
+    const uint64_t sub = static_cast<uint64_t>(index % kSubBuckets);
+    return (kSubBuckets + sub + 1) << shift;
+    }
+
+uint64_t LatencyHistogram::quantile(const Snapshot& counts, double q)
+    {
+    uint64_t total = 0;
+    for (auto c : counts)
+        {
+        total += c;
+        }
+    if (total == 0)
+        {
+        return 0;
+        }
+
+    const auto rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i)
+        {
+        seen += counts[i];
+        if (seen >= rank)
+            {
+            return bucket_upper_bound(i);
+            }
+        }
+    return bucket_upper_bound(kBuckets - 1);
+    }
+
+Registry::Registry(std::size_t shards)
+    {
+    shards = std::max<std::size_t>(shards, 1);
+    for (std::size_t i = 0; i < shards; ++i)
+        {
+        shards_.push_back(std::make_unique<Shard>());
+        }
+    }
+
+std::size_t Registry::default_shards()
+    {
+    return std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, 16);
+    }
+
+std::size_t Registry::add_route(const std::string& method, const std::string& route)
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    labels_.push_back({ method, route });
+    for (auto& shard : shards_)
+        {
+        shard->routes.push_back(std::make_unique<RouteCounters>());
+        }
+    return labels_.size() - 1;
+    }
+
+Registry::Shard& Registry::local_shard()
+    {
+    // Threads are spread round-robin over the shards on first use
+    static std::atomic<std::size_t> next_thread{ 0 };
+    thread_local const std::size_t thread_slot = next_thread.fetch_add(1, std::memory_order_relaxed);
+    return *shards_[thread_slot % shards_.size()];
+    }
+
+void Registry::record(std::size_t route, unsigned status, uint64_t bytes_in, uint64_t bytes_out,
+    std::chrono::microseconds latency)
+    {
+    auto& counters = *local_shard().routes[route];
+    const unsigned status_class = std::clamp(status / 100, 1u, 5u) - 1;
+    const auto micros = static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0));
+
+    counters.status_classes[status_class].fetch_add(1, std::memory_order_relaxed);
+    counters.bytes_in.fetch_add(bytes_in, std::memory_order_relaxed);
+    counters.bytes_out.fetch_add(bytes_out, std::memory_order_relaxed);
+    counters.latency_sum_us.fetch_add(micros, std::memory_order_relaxed);
+    counters.latency.record(micros);
+    }
+
+void Registry::add_gauge(const std::string& name, const std::string& help, std::function<double()> read)
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    gauges_.push_back({ name, help, std::move(read) });
+    }
+
+std::string Registry::render() const
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    struct Merged
+        {
+        std::array<uint64_t, 5> status_classes{};
+        uint64_t bytes_in = 0;
+        uint64_t bytes_out = 0;
+        uint64_t latency_sum_us = 0;
+        LatencyHistogram::Snapshot latency{};
+        };
+
+    std::vector<Merged> merged(labels_.size());
+    for (const auto& shard : shards_)
+        {
+        for (std::size_t r = 0; r < labels_.size(); ++r)
+            {
+            const auto& counters = *shard->routes[r];
+            for (std::size_t c = 0; c < 5; ++c)
+                {
+                merged[r].status_classes[c] += counters.status_classes[c].load(std::memory_order_relaxed);
+                }
+            merged[r].bytes_in += counters.bytes_in.load(std::memory_order_relaxed);
+            merged[r].bytes_out += counters.bytes_out.load(std::memory_order_relaxed);
+            merged[r].latency_sum_us += counters.latency_sum_us.load(std::memory_order_relaxed);
+            counters.latency.add_to(merged[r].latency);
+            }
+        }
+
+    std::vector<std::string> labels;
+    for (const auto& label : labels_)
+        {
+        labels.push_back("method=\"" + escape_label(label.method) + "\",route=\"" + escape_label(label.route) + "\"");
+        }
+
+    std::ostringstream out;
+
+    out << "# HELP asciimmo_http_requests_total HTTP requests by route and status class\n"
+        << "# TYPE asciimmo_http_requests_total counter\n";
+    for (std::size_t r = 0; r < labels.size(); ++r)
+        {
+        for (std::size_t c = 0; c < 5; ++c)
+            {
+            if (merged[r].status_classes[c] != 0)
+                {
+                out << "asciimmo_http_requests_total{" << labels[r] << ",status=\"" << c + 1 << "xx\"} "
+                    << merged[r].status_classes[c] << '\n';
+                }
+            }
+        }
+
+    out << "# HELP asciimmo_http_request_bytes_total Request bytes received by route\n"
+        << "# TYPE asciimmo_http_request_bytes_total counter\n";
+    for (std::size_t r = 0; r < labels.size(); ++r)
+        {
+        out << "asciimmo_http_request_bytes_total{" << labels[r] << "} " << merged[r].bytes_in << '\n';
+        }
+
+    out << "# HELP asciimmo_http_response_bytes_total Response bytes sent by route\n"
+        << "# TYPE asciimmo_http_response_bytes_total counter\n";
+    for (std::size_t r = 0; r < labels.size(); ++r)
+        {
+        out << "asciimmo_http_response_bytes_total{" << labels[r] << "} " << merged[r].bytes_out << '\n';
+        }
+
+    out << "# HELP asciimmo_http_request_duration_seconds Time from request read to response written\n"
+        << "# TYPE asciimmo_http_request_duration_seconds histogram\n";
+    for (std::size_t r = 0; r < labels.size(); ++r)
+        {
+        const auto& latency = merged[r].latency;
+        uint64_t count = 0;
+        int bucket = 0;
+        for (uint64_t edge : kExportEdges)
+            {
+            while (bucket < LatencyHistogram::kBuckets && LatencyHistogram::bucket_upper_bound(bucket) <= edge)
+                {
+                count += latency[bucket++];
+                }
+            out << "asciimmo_http_request_duration_seconds_bucket{" << labels[r] << ",le=\""
+                << static_cast<double>(edge) / 1e6 << "\"} " << count << '\n';
+            }
+        while (bucket < LatencyHistogram::kBuckets)
+            {
+            count += latency[bucket++];
+            }
+        out << "asciimmo_http_request_duration_seconds_bucket{" << labels[r] << ",le=\"+Inf\"} " << count << '\n'
+            << "asciimmo_http_request_duration_seconds_sum{" << labels[r] << "} "
+            << static_cast<double>(merged[r].latency_sum_us) / 1e6 << '\n'
+            << "asciimmo_http_request_duration_seconds_count{" << labels[r] << "} " << count << '\n';
+        }
+
+    out << "# HELP asciimmo_http_request_latency_seconds Latency quantiles from the full-resolution histogram\n"
+        << "# TYPE asciimmo_http_request_latency_seconds gauge\n";
+    for (std::size_t r = 0; r < labels.size(); ++r)
+        {
+        for (double q : kQuantiles)
+            {
+            out << "asciimmo_http_request_latency_seconds{" << labels[r] << ",quantile=\"" << q << "\"} "
+                << static_cast<double>(LatencyHistogram::quantile(merged[r].latency, q)) / 1e6 << '\n';
+            }
+        }
+
+    for (const auto& gauge : gauges_)
+        {
+        out << "# HELP " << gauge.name << ' ' << gauge.help << '\n'
+            << "# TYPE " << gauge.name << " gauge\n"
+            << gauge.name << ' ' << gauge.read() << '\n';
+        }
+
+    return out.str();
+    }
+
+} // namespace metrics
+} // namespace asciimmo
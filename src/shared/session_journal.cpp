@@ -0,0 +1,728 @@
+#include "shared/session_journal.hpp"
+#include "shared/flat_token_map.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+namespace asciimmo
+{
+namespace session
+{
+
+namespace
+{
+
+constexpr uint64_t kJournalMagic = 0x415343494a524e31;  // "ASCIJRN1"
+constexpr uint64_t kSnapshotMagic = 0x41534349534e5031; // "ASCISNP1"
+constexpr std::size_t kMagicBytes = sizeof(uint64_t);
+// A snapshot's magic is followed by how many sessions it holds
+constexpr std::size_t kSnapshotHeader = kMagicBytes + sizeof(uint64_t);
+
+// Each record is its payload's size and checksum, then the payload, whose
+// first byte is its kind:
+//
+//     upsert: token_id, user_id, expires_at, token size, data size (u64 u64
+//             i64 u32 u32), then the token and data
+//     remove: token_id
+//     touch:  expires_at, then the token_id of each session touched
+//
+// Integers are in host byte order; the files never leave the host.
+constexpr std::size_t kRecordHeader = 2 * sizeof(uint32_t);
+constexpr std::size_t kUpsertFixed = 1 + 3 * sizeof(uint64_t) + 2 * sizeof(uint32_t);
+
+enum Kind : char
+    {
+    kUpsert = 1,
+    kRemove = 2,
+    kTouch = 3
+    };
+
+// Expiry of a session logged out, which no expiry passes for live
+constexpr int64_t kRemoved = INT64_MIN;
+
+// Output is built a chunk at a time while compacting
+constexpr std::size_t kWriteChunk = 1 << 20;
+
+[[noreturn]] void throw_errno(const std::string& what)
+    {
+    throw std::system_error(errno, std::generic_category(), what);
+    }
+
+int64_t epoch_seconds(std::chrono::system_clock::time_point when)
+    {
+    return std::chrono::duration_cast<std::chrono::seconds>(when.time_since_epoch()).count();
+    }
+
+// Catches torn and corrupted records, not tampering. Eight bytes a step, so
+// replay is bound by reading the file rather than by this.
+uint32_t checksum(const char* p, std::size_t n)
+    {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+    for (; n >= 8; p += 8, n -= 8)
+        {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        h = (h ^ word) * 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 31;
+        }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p, n);
+    h = (h ^ tail) * 0x94d049bb133111ebull;
+    h ^= h >> 29;
+    return static_cast<uint32_t>(h ^ (h >> 32));
+    }
+
+template <class T>
+void put(std::string& out, T value)
+    {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+template <class T>
+T get(const char*& p)
+    {
+    T value;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return value;
+    }
+
+// Appends one record; fill writes its payload
+template <class Fill>
+void add_record(std::string& out, Fill&& fill)
+    {
+    const std::size_t at = out.size();
+    out.append(kRecordHeader, '\0');
+    fill(out);
+    const auto size = static_cast<uint32_t>(out.size() - at - kRecordHeader);
+    const uint32_t check = checksum(out.data() + at + kRecordHeader, size);
+    std::memcpy(out.data() + at, &size, sizeof(size));
+    std::memcpy(out.data() + at + sizeof(size), &check, sizeof(check));
+    }
+
+void add_upsert(std::string& out, uint64_t token_id, uint64_t user_id, int64_t expires_at,
+    std::string_view token, std::string_view data)
+    {
+    add_record(out, [&](std::string& payload)
+        {
+        payload += kUpsert;
+        put(payload, token_id);
+        put(payload, user_id);
+        put(payload, expires_at);
+        put(payload, static_cast<uint32_t>(token.size()));
+        put(payload, static_cast<uint32_t>(data.size()));
+        payload += token;
+        payload += data;
+        });
+    }
+
+void write_all(int fd, const std::string& bytes, const std::string& path)
+    {
+    for (std::size_t done = 0; done < bytes.size(); )
+        {
+        const ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+        if (n < 0)
+            {
+            if (errno == EINTR)
+                {
+                continue;
+                }
+            throw_errno("write " + path);
+            }
+        done += static_cast<std::size_t>(n);
+        }
+    }
+
+// A file mapped read-only; empty if it doesn't exist
+class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string& path)
+            {
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                {
+                if (errno == ENOENT)
+                    {
+                    return;
+                    }
+                throw_errno("open " + path);
+                }
+            struct stat st{};
+            if (::fstat(fd, &st) != 0)
+                {
+                const int err = errno;
+                ::close(fd);
+                errno = err;
+                throw_errno("stat " + path);
+                }
+            size_ = static_cast<std::size_t>(st.st_size);
+            if (size_ != 0)
+                {
+                // Populated up front; replay reads every page once, in order
+                void* base = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+                const int err = errno;
+                ::close(fd);
+                if (base == MAP_FAILED)
+                    {
+                    errno = err;
+                    throw_errno("mmap " + path);
+                    }
+                ::madvise(base, size_, MADV_SEQUENTIAL);
+                base_ = static_cast<const char*>(base);
+                }
+            else
+                {
+                ::close(fd);
+                }
+            }
+
+        ~MappedFile()
+            {
+            if (base_ != nullptr)
+                {
+                ::munmap(const_cast<char*>(base_), size_);
+                }
+            }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        std::string_view bytes() const
+            {
+            return { base_, size_ };
+            }
+
+    private:
+        const char* base_ = nullptr;
+        std::size_t size_ = 0;
+    };
+
+// An upsert record, as views into the file it was read from
+struct Upsert
+    {
+    uint64_t token_id;
+    uint64_t user_id;
+    int64_t expires_at;
+    std::string_view token;
+    std::string_view data;
+    };
+
+bool decode(std::string_view payload, Upsert& session)
+    {
+    if (payload.size() < kUpsertFixed || payload[0] != kUpsert)
+        {
+        return false;
+        }
+    const char* p = payload.data() + 1;
+    session.token_id = get<uint64_t>(p);
+    session.user_id = get<uint64_t>(p);
+    session.expires_at = get<int64_t>(p);
+    const auto token_size = get<uint32_t>(p);
+    const auto data_size = get<uint32_t>(p);
+    if (payload.size() != kUpsertFixed + token_size + data_size)
+        {
+        return false;
+        }
+    session.token = std::string_view(p, token_size);
+    session.data = std::string_view(p + token_size, data_size);
+    return true;
+    }
+
+// False for a missing file, or a journal whose header never made it out;
+// throws for a file that is something else
+bool has_records(std::string_view file, uint64_t magic, std::size_t header, const std::string& path)
+    {
+    if (file.size() < header)
+        {
+        return false;
+        }
+    uint64_t found = 0;
+    std::memcpy(&found, file.data(), kMagicBytes);
+    if (found != magic)
+        {
+        throw std::runtime_error(path + " is not a session journal");
+        }
+    return true;
+    }
+
+// Calls fn with the payload of each whole record of file after its header
+// until it returns false; returns the offset past the last record accepted
+template <class Fn>
+std::size_t walk(std::string_view file, std::size_t header, Fn&& fn)
+    {
+    std::size_t at = header;
+    while (file.size() - at >= kRecordHeader)
+        {
+        const char* header = file.data() + at;
+        const auto size = get<uint32_t>(header);
+        const auto check = get<uint32_t>(header);
+        if (size == 0 || size > file.size() - at - kRecordHeader
+            || checksum(header, size) != check || !fn(std::string_view(header, size)))
+            {
+            // Torn by a crash mid-write; nothing after it was acknowledged
+            break;
+            }
+        at += kRecordHeader + size;
+        }
+    return at;
+    }
+
+} // namespace
+
+FsyncPolicy parse_fsync_policy(std::string_view name)
+    {
+    if (name == "never")
+        {
+        return FsyncPolicy::never;
+        }
+    if (name == "interval")
+        {
+        return FsyncPolicy::interval;
+        }
+    if (name == "always")
+        {
+        return FsyncPolicy::always;
+        }
+    throw std::invalid_argument("unknown fsync policy: " + std::string(name));
+    }
+
+// The snapshot, and what the journal has changed since, by token_id. Only
+// the journal is indexed: it is the short part, and snapshot sessions are
+// looked up in it as they stream past, so opening costs little more than
+// reading the files however many sessions they hold.
+struct SessionJournal::Fold
+    {
+    struct Change
+        {
+        const char* upsert;  // the session's last upsert in the journal, if any
+        uint32_t size;
+        int64_t expires_at;  // kRemoved once logged out
+        };
+
+    MappedFile snapshot;
+    MappedFile journal;
+    std::vector<Change> changes;
+    auth::FlatTokenMap index; // token_id to its place in changes
+    std::size_t journal_end = 0; // bytes of the journal up to its last whole record
+    uint64_t snapshot_sessions = 0;
+
+    // About how many sessions for_each will emit
+    std::size_t expected() const
+        {
+        std::size_t added = 0;
+        for (const auto& change : changes)
+            {
+            added += change.upsert != nullptr ? 1 : 0;
+            }
+        // No more than the file could hold, whatever its header says
+        const uint64_t fit = snapshot.bytes().size() / (kRecordHeader + kUpsertFixed);
+        return static_cast<std::size_t>(std::min(snapshot_sessions, fit)) + added;
+        }
+
+    Fold(const std::string& snapshot_path, const std::string& journal_path)
+        : snapshot(snapshot_path)
+        , journal(journal_path)
+        {
+        if (has_records(snapshot.bytes(), kSnapshotMagic, kSnapshotHeader, snapshot_path))
+            {
+            std::memcpy(&snapshot_sessions, snapshot.bytes().data() + kMagicBytes, sizeof(snapshot_sessions));
+            }
+        if (has_records(journal.bytes(), kJournalMagic, kMagicBytes, journal_path))
+            {
+            journal_end = walk(journal.bytes(), kMagicBytes, [this](std::string_view payload) { return apply(payload); });
+            }
+        }
+
+    // Calls emit with each session, logged out ones left out, expired ones
+    // not
+    template <class Emit>
+    void for_each(Emit&& emit) const
+        {
+        if (snapshot.bytes().size() >= kSnapshotHeader)
+            {
+            walk(snapshot.bytes(), kSnapshotHeader, [&](std::string_view payload)
+                {
+                Upsert session;
+                if (!decode(payload, session))
+                    {
+                    return false;
+                    }
+                if (const int64_t* at = index.find(session.token_id))
+                    {
+                    const Change& change = changes[static_cast<std::size_t>(*at)];
+                    if (change.upsert != nullptr || change.expires_at == kRemoved)
+                        {
+                        // Replaced or logged out since
+                        return true;
+                        }
+                    session.expires_at = change.expires_at;
+                    }
+                emit(session);
+                return true;
+                });
+            }
+        for (const auto& change : changes)
+            {
+            Upsert session;
+            if (change.upsert != nullptr && change.expires_at != kRemoved
+                && decode(std::string_view(change.upsert, change.size), session))
+                {
+                session.expires_at = change.expires_at;
+                emit(session);
+                }
+            }
+        }
+
+    Change& change_for(uint64_t token_id, int64_t expires_at)
+        {
+        auto [at, inserted] = index.try_emplace(token_id, static_cast<int64_t>(changes.size()));
+        if (inserted)
+            {
+            changes.push_back({ nullptr, 0, expires_at });
+            }
+        return changes[static_cast<std::size_t>(*at)];
+        }
+
+    bool apply(std::string_view payload)
+        {
+        const char* p = payload.data() + 1;
+        switch (payload[0])
+            {
+            case kUpsert:
+                {
+                Upsert session;
+                if (!decode(payload, session))
+                    {
+                    return false;
+                    }
+                Change& change = change_for(session.token_id, session.expires_at);
+                change.upsert = payload.data();
+                change.size = static_cast<uint32_t>(payload.size());
+                change.expires_at = session.expires_at;
+                return true;
+                }
+            case kRemove:
+                {
+                if (payload.size() != 1 + sizeof(uint64_t))
+                    {
+                    return false;
+                    }
+                change_for(get<uint64_t>(p), kRemoved).expires_at = kRemoved;
+                return true;
+                }
+            case kTouch:
+                {
+                if (payload.size() < 1 + sizeof(int64_t) || (payload.size() - 1) % sizeof(uint64_t) != 0)
+                    {
+                    return false;
+                    }
+                const auto expires_at = get<int64_t>(p);
+                for (const char* end = payload.data() + payload.size(); p != end; )
+                    {
+                    Change& change = change_for(get<uint64_t>(p), expires_at);
+                    if (change.expires_at != kRemoved)
+                        {
+                        change.expires_at = expires_at;
+                        }
+                    }
+                return true;
+                }
+            default:
+                return false;
+            }
+        }
+    };
+
+SessionJournal::SessionJournal(JournalOptions options)
+    : options_(std::move(options))
+    , journal_path_(options_.directory + "/sessions.journal")
+    , snapshot_path_(options_.directory + "/sessions.snapshot")
+    , last_sync_(std::chrono::steady_clock::now())
+    {
+    std::filesystem::create_directories(options_.directory);
+    opened_ = std::make_unique<Fold>(snapshot_path_, journal_path_);
+    snapshot_bytes_ = opened_->snapshot.bytes().size();
+
+    fd_ = ::open(journal_path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+        {
+        throw_errno("open " + journal_path_);
+        }
+    try
+        {
+        if (opened_->journal_end == 0)
+            {
+            std::string header;
+            put(header, kJournalMagic);
+            if (::ftruncate(fd_, 0) != 0)
+                {
+                throw_errno("truncate " + journal_path_);
+                }
+            write_all(fd_, header, journal_path_);
+            journal_bytes_ = kMagicBytes;
+            }
+        else
+            {
+            // Cut off a record torn by a crash, so what is appended next is read
+            if (opened_->journal_end < opened_->journal.bytes().size()
+                && ::ftruncate(fd_, static_cast<off_t>(opened_->journal_end)) != 0)
+                {
+                throw_errno("truncate " + journal_path_);
+                }
+            journal_bytes_ = opened_->journal_end;
+            }
+        }
+        catch (...)
+            {
+            ::close(fd_);
+            throw;
+            }
+    }
+
+SessionJournal::~SessionJournal()
+    {
+    if (dirty_ && options_.fsync != FsyncPolicy::never)
+        {
+        ::fdatasync(fd_);
+        }
+    ::close(fd_);
+    }
+
+std::size_t SessionJournal::replay(const Restore& restore)
+    {
+    std::unique_ptr<Fold> fold;
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    fold = std::move(opened_);
+    }
+    if (!fold)
+        {
+        return 0;
+        }
+
+    const int64_t now = epoch_seconds(std::chrono::system_clock::now());
+    std::size_t restored = 0;
+    fold->for_each([&](const Upsert& session)
+        {
+        if (session.expires_at > now)
+            {
+            restore(JournaledSession{ session.token_id, session.user_id,
+                std::chrono::system_clock::time_point(std::chrono::seconds(session.expires_at)),
+                session.token, session.data });
+            ++restored;
+            }
+        });
+    return restored;
+    }
+
+std::size_t SessionJournal::expected_sessions() const
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return opened_ ? opened_->expected() : 0;
+    }
+
+void SessionJournal::write(std::span<const SessionWrite> writes)
+    {
+    std::string records;
+    for (const auto& write : writes)
+        {
+        if (write.kind == SessionWrite::Kind::remove)
+            {
+            add_record(records, [&](std::string& payload)
+                {
+                payload += kRemove;
+                put(payload, write.record.token_id);
+                });
+            }
+        else if (!write.token.empty())
+            {
+            add_upsert(records, write.record.token_id, write.record.user_id, epoch_seconds(write.record.expires_at),
+                write.token, write.record.data);
+            }
+        }
+    std::lock_guard<std::mutex> lock(mtx_);
+    append(records);
+    }
+
+void SessionJournal::touch(std::span<const uint64_t> tokens, std::chrono::system_clock::time_point,
+    std::chrono::system_clock::time_point expires_at)
+    {
+    std::string records;
+    add_record(records, [&](std::string& payload)
+        {
+        payload += kTouch;
+        put(payload, epoch_seconds(expires_at));
+        payload.append(reinterpret_cast<const char*>(tokens.data()), tokens.size_bytes());
+        });
+    std::lock_guard<std::mutex> lock(mtx_);
+    append(records);
+    }
+
+bool SessionJournal::load(uint64_t, SessionRecord&)
+    {
+    return false;
+    }
+
+std::size_t SessionJournal::cleanup(std::size_t)
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (journal_bytes_ <= std::max<uint64_t>(options_.compact_bytes, snapshot_bytes_))
+        {
+        return 0;
+        }
+    return compact_locked();
+    }
+
+std::size_t SessionJournal::compact()
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return compact_locked();
+    }
+
+void SessionJournal::append(const std::string& records)
+    {
+    if (records.empty())
+        {
+        return;
+        }
+    const ssize_t n = ::write(fd_, records.data(), records.size());
+    if (n != static_cast<ssize_t>(records.size()))
+        {
+        const int err = n < 0 ? errno : EIO;
+        // Drop whatever part of the batch made it; the store retries it whole
+        ::ftruncate(fd_, static_cast<off_t>(journal_bytes_));
+        errno = err;
+        throw_errno("write " + journal_path_);
+        }
+    journal_bytes_ += records.size();
+    dirty_ = true;
+
+    const auto now = std::chrono::steady_clock::now();
+    if (options_.fsync == FsyncPolicy::always
+        || (options_.fsync == FsyncPolicy::interval && now - last_sync_ >= options_.fsync_interval))
+        {
+        sync_locked(now);
+        }
+    }
+
+void SessionJournal::tick()
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto now = std::chrono::steady_clock::now();
+    if (dirty_ && options_.fsync == FsyncPolicy::interval && now - last_sync_ >= options_.fsync_interval)
+        {
+        sync_locked(now);
+        }
+    }
+
+void SessionJournal::sync_locked(std::chrono::steady_clock::time_point now)
+    {
+    if (::fdatasync(fd_) != 0)
+        {
+        throw_errno("fdatasync " + journal_path_);
+        }
+    ++syncs_;
+    dirty_ = false;
+    last_sync_ = now;
+    }
+
+std::size_t SessionJournal::compact_locked()
+    {
+    Fold fold(snapshot_path_, journal_path_);
+    const int64_t now = epoch_seconds(std::chrono::system_clock::now());
+
+    const std::string temp_path = snapshot_path_ + ".tmp";
+    const int out = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+        {
+        throw_errno("open " + temp_path);
+        }
+
+    std::size_t dropped = 0;
+    uint64_t kept = 0;
+    uint64_t written = 0;
+    try
+        {
+        std::string chunk;
+        chunk.reserve(kWriteChunk + 4096);
+        put(chunk, kSnapshotMagic);
+        put(chunk, uint64_t{ 0 }); // filled in once known
+        fold.for_each([&](const Upsert& session)
+            {
+            if (session.expires_at <= now)
+                {
+                ++dropped;
+                return;
+                }
+            add_upsert(chunk, session.token_id, session.user_id, session.expires_at, session.token, session.data);
+            ++kept;
+            if (chunk.size() >= kWriteChunk)
+                {
+                write_all(out, chunk, temp_path);
+                written += chunk.size();
+                chunk.clear();
+                }
+            });
+        write_all(out, chunk, temp_path);
+        written += chunk.size();
+        if (::pwrite(out, &kept, sizeof(kept), kMagicBytes) != sizeof(kept))
+            {
+            throw_errno("write " + temp_path);
+            }
+        // Synced whatever the policy: the journal it replaces is emptied next
+        if (::fdatasync(out) != 0)
+            {
+            throw_errno("fdatasync " + temp_path);
+            }
+        }
+        catch (...)
+            {
+            ::close(out);
+            ::unlink(temp_path.c_str());
+            throw;
+            }
+    ::close(out);
+
+    if (::rename(temp_path.c_str(), snapshot_path_.c_str()) != 0)
+        {
+        throw_errno("rename " + temp_path);
+        }
+    const int dir = ::open(options_.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir >= 0)
+        {
+        ::fsync(dir);
+        ::close(dir);
+        }
+
+    // A crash before this replays the old journal over the new snapshot,
+    // which changes nothing
+    if (::ftruncate(fd_, static_cast<off_t>(kMagicBytes)) != 0)
+        {
+        throw_errno("truncate " + journal_path_);
+        }
+    ::fdatasync(fd_);
+    journal_bytes_ = kMagicBytes;
+    snapshot_bytes_ = written;
+    dirty_ = false;
+    ++compactions_;
+    return dropped;
+    }
+
+SessionJournal::Stats SessionJournal::stats() const
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return { journal_bytes_, snapshot_bytes_, syncs_, compactions_ };
+    }
+
+} // namespace session
+} // namespace asciimmo
@@ -0,0 +1,731 @@
+#include "shared/session_store.hpp"
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <exception>
+#include <iterator>
+
+namespace asciimmo
+{
+namespace session
+{
+
+namespace
+{
+
+constexpr std::size_t kMaxShards = 1024;
+
+int64_t minute_of(std::chrono::system_clock::time_point when)
+    {
+    return std::chrono::duration_cast<std::chrono::minutes>(when.time_since_epoch()).count();
+    }
+
+std::size_t shard_count(std::size_t wanted)
+    {
+    std::size_t count = 1;
+    while (count < wanted && count < kMaxShards)
+        {
+        count *= 2;
+        }
+    return count;
+    }
+
+// Bytes each character adds when escaped: \" \\ \n \r \t add one, and
+// other control characters, written \u00XX, add five
+constexpr auto kEscapeExtra = []()
+    {
+    std::array<uint8_t, 256> extra{};
+    for (int c = 0; c < 0x20; ++c)
+        {
+        extra[c] = 5;
+        }
+    extra['"'] = extra['\\'] = extra['\n'] = extra['\r'] = extra['\t'] = 1;
+    return extra;
+    }();
+
+// Allocates what it is asked for with extra bytes after it, and reports
+// where those start; allocate_shared puts a SessionJson's text there, in
+// the same block as its control block
+template <class T>
+class TrailingAllocator
+    {
+    public:
+        using value_type = T;
+
+        TrailingAllocator(std::size_t extra, char** trailing)
+            : extra_(extra)
+            , trailing_(trailing)
+            {}
+
+        template <class U>
+        TrailingAllocator(const TrailingAllocator<U>& other)
+            : extra_(other.extra_)
+            , trailing_(other.trailing_)
+            {}
+
+        T* allocate(std::size_t n)
+            {
+            char* block = static_cast<char*>(::operator new(n * sizeof(T) + extra_));
+            *trailing_ = block + n * sizeof(T);
+            return reinterpret_cast<T*>(block);
+            }
+
+        void deallocate(T* block, std::size_t n) noexcept
+            {
+            ::operator delete(block, n * sizeof(T) + extra_);
+            }
+
+        template <class U>
+        bool operator==(const TrailingAllocator<U>& other) const noexcept
+            {
+            return extra_ == other.extra_;
+            }
+
+    private:
+        template <class U>
+        friend class TrailingAllocator;
+
+        std::size_t extra_;
+        char** trailing_;
+    };
+
+} // namespace
+
+SessionJson to_session_json(std::string_view data)
+    {
+    static constexpr char kHex[] = "0123456789abcdef";
+    // Counted first, in a loop the compiler vectorizes; most data has none
+    std::size_t special = 0;
+    for (const char c : data)
+        {
+        special += static_cast<unsigned char>(c) < 0x20 || c == '"' || c == '\\';
+        }
+    std::size_t size = data.size() + 2;
+    if (special != 0)
+        {
+        for (const char c : data)
+            {
+            size += kEscapeExtra[static_cast<unsigned char>(c)];
+            }
+        }
+
+    // The view and the text it points at share one allocation
+    char* text = nullptr;
+    auto json = std::allocate_shared<std::string_view>(TrailingAllocator<std::string_view>(size, &text));
+    char* out = text;
+    *out++ = '"';
+    if (special == 0)
+        {
+        std::memcpy(out, data.data(), data.size());
+        out[data.size()] = '"';
+        *json = std::string_view(text, size);
+        return json;
+        }
+    // Runs that need no escaping are copied whole
+    std::size_t run = 0;
+    for (std::size_t i = 0; i < data.size(); ++i)
+        {
+        const char c = data[i];
+        if (static_cast<unsigned char>(c) >= 0x20 && c != '"' && c != '\\')
+            {
+            continue;
+            }
+        out = std::copy(data.data() + run, data.data() + i, out);
+        run = i + 1;
+        *out++ = '\\';
+        switch (c)
+            {
+            case '"':
+            case '\\':
+                *out++ = c;
+                break;
+            case '\n':
+                *out++ = 'n';
+                break;
+            case '\r':
+                *out++ = 'r';
+                break;
+            case '\t':
+                *out++ = 't';
+                break;
+            default:
+                *out++ = 'u';
+                *out++ = '0';
+                *out++ = '0';
+                *out++ = kHex[(c >> 4) & 0xf];
+                *out++ = kHex[c & 0xf];
+            }
+        }
+    out = std::copy(data.data() + run, data.data() + data.size(), out);
+    *out = '"';
+    *json = std::string_view(text, size);
+    return json;
+    }
+
+uint64_t numeric_token_id(std::string_view token)
+    {
+    uint64_t id = 0;
+    auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), id);
+    return ec == std::errc() && ptr == token.data() + token.size() ? id : 0;
+    }
+
+SessionStore::SessionStore(StoreOptions options, SessionBackend* backend, TokenResolver resolve)
+    : options_(options)
+    , backend_(backend)
+    , resolve_(std::move(resolve))
+    , shard_mask_(shard_count(options.shards) - 1)
+    , shards_(std::make_unique<Shard[]>(shard_mask_ + 1))
+    , workers_(std::max<std::size_t>(options.workers, 1))
+    {}
+
+SessionStore::~SessionStore()
+    {
+    workers_.join();
+    flush();
+    }
+
+SessionStore::Shard& SessionStore::shard_for(std::string_view token)
+    {
+    // The shard's own map buckets by the low bits of the same hash
+    return shards_[(TokenHash{}(token) >> 48) & shard_mask_];
+    }
+
+void SessionStore::on_activity(ActivityHandler handler)
+    {
+    on_activity_ = std::move(handler);
+    }
+
+void SessionStore::Shard::file(Node& node)
+    {
+    node.second.filed = minute_of(node.second.expires_at);
+    ++node.second.filings;
+    expiry[node.second.filed].push_back(&node);
+    }
+
+void SessionStore::Shard::assign(std::string token, Entry entry)
+    {
+    auto [it, inserted] = sessions.try_emplace(std::move(token), std::move(entry));
+    if (inserted)
+        {
+        ++live;
+        file(*it);
+        return;
+        }
+    Entry& existing = it->second;
+    if (!existing.json)
+        {
+        ++live;
+        }
+    const int64_t filed = existing.filed;
+    const uint32_t filings = existing.filings;
+    existing = std::move(entry);
+    existing.filed = filed;
+    existing.filings = filings;
+    // Still filed under an earlier minute, it is refiled when that comes up
+    if (filings == 0 || minute_of(existing.expires_at) < filed)
+        {
+        file(*it);
+        }
+    }
+
+void SessionStore::Shard::remove(Node& node)
+    {
+    node.second.json.reset();
+    --live;
+    }
+
+void SessionStore::put(std::string token, SessionRecord record)
+    {
+    // Serialized before taking the lock
+    Entry entry{ record.token_id, to_session_json(record.data), record.expires_at };
+    if (record.token_id != 0 && negative_count_.load(std::memory_order_relaxed) != 0)
+        {
+        // It exists now, whatever the backend said before
+        std::lock_guard<std::mutex> lock(negative_mtx_);
+        negative_.erase(record.token_id);
+        negative_count_.store(negative_.size(), std::memory_order_relaxed);
+        }
+    if (backend_ && record.token_id != 0)
+        {
+        enqueue({ SessionWrite::Kind::upsert, std::move(record), token });
+        }
+    assign(std::move(token), std::move(entry));
+    }
+
+void SessionStore::reserve(std::size_t sessions)
+    {
+    const std::size_t per_shard = sessions / (shard_mask_ + 1) + 1;
+    for (std::size_t i = 0; i <= shard_mask_; ++i)
+        {
+        std::lock_guard<std::mutex> lock(shards_[i].mtx);
+        shards_[i].sessions.reserve(per_shard);
+        }
+    }
+
+void SessionStore::restore(std::string_view token, uint64_t token_id, std::string_view data, Clock::time_point expires_at)
+    {
+    assign(std::string(token), Entry{ token_id, to_session_json(data), expires_at });
+    }
+
+SessionStore::Restorer::Restorer(SessionStore& store)
+    : store_(store)
+    , held_(store.shard_mask_ + 1)
+    {}
+
+SessionStore::Restorer::~Restorer()
+    {
+    for (auto& sent : sent_)
+        {
+        sent.wait();
+        }
+    }
+
+void SessionStore::Restorer::add(std::string_view token, uint64_t token_id, std::string_view data, Clock::time_point expires_at)
+    {
+    auto& held = held_[(TokenHash{}(token) >> 48) & store_.shard_mask_];
+    const std::size_t size = token.size() + data.size();
+    if (held.left < size)
+        {
+        const std::size_t block = std::max(kBlock, size);
+        held.blocks.push_back(std::make_unique_for_overwrite<char[]>(block));
+        held.free = held.blocks.back().get();
+        held.left = block;
+        }
+    std::memcpy(held.free, token.data(), token.size());
+    std::memcpy(held.free + token.size(), data.data(), data.size());
+    held.sessions.push_back({ held.free, token.size(), data.size(), token_id, expires_at });
+    held.free += size;
+    held.left -= size;
+    }
+
+void SessionStore::Restorer::fill(std::size_t i)
+    {
+    // Freed as soon as they are in
+    const HeldShard held = std::move(held_[i]);
+    held_[i] = HeldShard{};
+    Shard& shard = store_.shards_[i];
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.sessions.reserve(shard.sessions.size() + held.sessions.size());
+    for (const Held& session : held.sessions)
+        {
+        shard.assign(std::string(session.text, session.token_size),
+            Entry{ session.token_id, to_session_json({ session.text + session.token_size, session.data_size }), session.expires_at });
+        }
+    }
+
+void SessionStore::Restorer::commit()
+    {
+    for (std::size_t i = 0; i < held_.size(); ++i)
+        {
+        if (!held_[i].sessions.empty())
+            {
+            std::packaged_task<void()> task([this, i]() { fill(i); });
+            sent_.push_back(task.get_future());
+            net::post(store_.workers_, std::move(task));
+            }
+        }
+    // All of them finish before any failure is rethrown
+    for (auto& done : sent_)
+        {
+        done.wait();
+        }
+    auto sent = std::move(sent_);
+    sent_.clear();
+    for (auto& done : sent)
+        {
+        done.get();
+        }
+    }
+
+void SessionStore::assign(std::string token, Entry entry)
+    {
+    Shard& shard = shard_for(token);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.assign(std::move(token), std::move(entry));
+    }
+
+SessionJson SessionStore::find(std::string_view token)
+    {
+    const auto now = Clock::now();
+    Shard& shard = shard_for(token);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto it = shard.sessions.find(token);
+    if (it == shard.sessions.end() || !it->second.json)
+        {
+        return nullptr;
+        }
+    Entry& entry = it->second;
+    if (entry.expires_at <= now)
+        {
+        // Not reaped yet; the reaper drops the node when its minute comes up
+        shard.remove(*it);
+        expired_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+        }
+    entry.expires_at = now + options_.idle_ttl;
+    if ((backend_ || on_activity_) && entry.token_id != 0 && entry.touched != shard.generation)
+        {
+        entry.touched = shard.generation;
+        shard.touched.push_back(entry.token_id);
+        }
+    return entry.json;
+    }
+
+net::awaitable<SessionJson> SessionStore::load(std::string_view token)
+    {
+    if (auto json = find(token))
+        {
+        co_return json;
+        }
+    const uint64_t id = backend_ ? resolve_(token) : 0;
+    if (id == 0)
+        {
+        co_return nullptr;
+        }
+    if (known_missing(id))
+        {
+        negative_hits_.fetch_add(1, std::memory_order_relaxed);
+        co_return nullptr;
+        }
+
+    loads_.fetch_add(1, std::memory_order_relaxed);
+    SessionRecord record;
+    bool failed = false;
+    const bool found = co_await net::co_spawn(workers_, [this, id, &record, &failed]() -> net::awaitable<bool>
+        {
+        bool found = false;
+        try
+            {
+            found = backend_->load(id, record);
+            }
+            catch (const std::exception&)
+                {
+                failures_.fetch_add(1, std::memory_order_relaxed);
+                failed = true;
+                }
+        co_return found;
+        },
+        net::use_awaitable);
+    if (!found)
+        {
+        // Only an answer is remembered; a failed call is tried again
+        if (!failed)
+            {
+            remember_missing(id);
+            }
+        co_return nullptr;
+        }
+
+    loaded_.fetch_add(1, std::memory_order_relaxed);
+    insert(token, Entry{ id, to_session_json(record.data), record.expires_at });
+    // Counts as a use, like any other lookup
+    co_return find(token);
+    }
+
+bool SessionStore::known_missing(uint64_t id)
+    {
+    if (negative_count_.load(std::memory_order_relaxed) == 0)
+        {
+        return false;
+        }
+    std::lock_guard<std::mutex> lock(negative_mtx_);
+    auto it = negative_.find(id);
+    return it != negative_.end() && std::chrono::steady_clock::now() < it->second;
+    }
+
+void SessionStore::remember_missing(uint64_t id)
+    {
+    if (options_.negative_ttl.count() <= 0 || options_.max_negative == 0)
+        {
+        return;
+        }
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(negative_mtx_);
+    if (negative_.size() >= options_.max_negative)
+        {
+        std::erase_if(negative_, [now](const auto& entry) { return now >= entry.second; });
+        if (negative_.size() >= options_.max_negative)
+            {
+            negative_.clear();
+            }
+        }
+    negative_[id] = now + options_.negative_ttl;
+    negative_count_.store(negative_.size(), std::memory_order_relaxed);
+    }
+
+// A loaded session never replaces one put while it was being loaded
+void SessionStore::insert(std::string_view token, Entry entry)
+    {
+    Shard& shard = shard_for(token);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto it = shard.sessions.find(token);
+    if (it == shard.sessions.end() || !it->second.json)
+        {
+        shard.assign(std::string(token), std::move(entry));
+        }
+    }
+
+bool SessionStore::erase(std::string_view token)
+    {
+    bool found = false;
+    uint64_t id = 0;
+    {
+    Shard& shard = shard_for(token);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto it = shard.sessions.find(token);
+    if (it != shard.sessions.end() && it->second.json)
+        {
+        found = it->second.expires_at > Clock::now();
+        id = it->second.token_id;
+        shard.remove(*it);
+        }
+    }
+
+    if (found && backend_ && id != 0)
+        {
+        SessionWrite write{ SessionWrite::Kind::remove, {}, {} };
+        write.record.token_id = id;
+        enqueue(std::move(write));
+        }
+    return found;
+    }
+
+void SessionStore::enqueue(SessionWrite write)
+    {
+    std::lock_guard<std::mutex> lock(pending_mtx_);
+    if (pending_.size() >= options_.max_pending)
+        {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+        }
+    pending_.push_back(std::move(write));
+    }
+
+std::size_t SessionStore::flush()
+    {
+    if (!backend_ && !on_activity_)
+        {
+        return 0;
+        }
+    std::lock_guard<std::mutex> flushing(flush_mtx_);
+    const std::size_t batch = std::max<std::size_t>(options_.max_batch, 1);
+
+    std::vector<SessionWrite> writes;
+    {
+    std::lock_guard<std::mutex> lock(pending_mtx_);
+    writes.swap(pending_);
+    }
+
+    std::size_t applied = 0;
+    while (backend_ && applied < writes.size())
+        {
+        const std::size_t count = std::min(batch, writes.size() - applied);
+        try
+            {
+            backend_->write(std::span<const SessionWrite>(writes).subspan(applied, count));
+            applied += count;
+            }
+            catch (const std::exception&)
+                {
+                failures_.fetch_add(1, std::memory_order_relaxed);
+                // Ahead of anything queued since, to keep each session's
+                // writes in order
+                std::lock_guard<std::mutex> lock(pending_mtx_);
+                pending_.insert(pending_.begin(), std::make_move_iterator(writes.begin() + applied),
+                    std::make_move_iterator(writes.end()));
+                break;
+                }
+        }
+    writes_.fetch_add(applied, std::memory_order_relaxed);
+
+    // After the writes, so sessions created since the last flush exist
+    std::vector<uint64_t> touched;
+    for (std::size_t i = 0; i <= shard_mask_; ++i)
+        {
+        Shard& shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        touched.insert(touched.end(), shard.touched.begin(), shard.touched.end());
+        shard.touched.clear();
+        ++shard.generation;
+        }
+
+    // Activity is a hint; a batch that fails isn't retried. Expiry is
+    // written as of the flush, so the backend may expire a session up to a
+    // flush interval before memory does.
+    const auto now = Clock::now();
+    for (std::size_t done = 0; backend_ && done < touched.size(); done += batch)
+        {
+        const std::size_t count = std::min(batch, touched.size() - done);
+        try
+            {
+            backend_->touch(std::span<const uint64_t>(touched).subspan(done, count), now, now + options_.idle_ttl);
+            touches_.fetch_add(count, std::memory_order_relaxed);
+            }
+            catch (const std::exception&)
+                {
+                failures_.fetch_add(1, std::memory_order_relaxed);
+                }
+        }
+    if (backend_)
+        {
+        try
+            {
+            backend_->tick();
+            }
+            catch (const std::exception&)
+                {
+                failures_.fetch_add(1, std::memory_order_relaxed);
+                }
+        }
+    if (on_activity_ && !touched.empty())
+        {
+        on_activity_(touched);
+        }
+    return applied;
+    }
+
+std::size_t SessionStore::reap_expired()
+    {
+    const auto now = Clock::now();
+    const int64_t minute = minute_of(now);
+    std::size_t removed = 0;
+    for (std::size_t i = 0; i <= shard_mask_; ++i)
+        {
+        Shard& shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        while (!shard.expiry.empty() && shard.expiry.begin()->first < minute)
+            {
+            const int64_t filed = shard.expiry.begin()->first;
+            auto due = std::move(shard.expiry.begin()->second);
+            shard.expiry.erase(shard.expiry.begin());
+            for (Node* node : due)
+                {
+                Entry& entry = node->second;
+                --entry.filings;
+                if (entry.json && entry.filed == filed)
+                    {
+                    if (entry.expires_at <= now)
+                        {
+                        shard.remove(*node);
+                        ++removed;
+                        }
+                    else
+                        {
+                        // Used since it was filed
+                        shard.file(*node);
+                        }
+                    }
+                if (!entry.json && entry.filings == 0)
+                    {
+                    shard.sessions.erase(shard.sessions.find(node->first));
+                    }
+                }
+            }
+        }
+    expired_.fetch_add(removed, std::memory_order_relaxed);
+    return removed;
+    }
+
+std::size_t SessionStore::cleanup_backend()
+    {
+    if (!backend_)
+        {
+        return 0;
+        }
+    const std::size_t batch = std::max<std::size_t>(options_.cleanup_batch, 1);
+    std::size_t deleted = 0;
+    try
+        {
+        // Short transactions, so the table is never locked for long
+        for (std::size_t n = batch; n == batch; )
+            {
+            n = backend_->cleanup(batch);
+            deleted += n;
+            }
+        }
+        catch (const std::exception&)
+            {
+            failures_.fetch_add(1, std::memory_order_relaxed);
+            }
+    cleaned_.fetch_add(deleted, std::memory_order_relaxed);
+    return deleted;
+    }
+
+net::awaitable<void> SessionStore::every(std::chrono::milliseconds interval, std::function<void()> task, bool on_workers)
+    {
+    net::steady_timer timer(co_await net::this_coro::executor);
+    for (;;)
+        {
+        timer.expires_after(interval);
+        co_await timer.async_wait(net::use_awaitable);
+        if (on_workers)
+            {
+            // The io_context carries on while the backend is called
+            co_await net::co_spawn(workers_, [&task]() -> net::awaitable<void>
+                {
+                task();
+                co_return;
+                },
+                net::use_awaitable);
+            }
+        else
+            {
+            task();
+            }
+        }
+    }
+
+void SessionStore::start(net::any_io_executor executor)
+    {
+    net::co_spawn(executor, every(options_.reap_interval, [this]() { reap_expired(); }, false), net::detached);
+    if (backend_ || on_activity_)
+        {
+        net::co_spawn(executor, every(options_.flush_interval, [this]() { flush(); }, true), net::detached);
+        }
+    if (backend_)
+        {
+        net::co_spawn(executor, every(options_.cleanup_interval, [this]() { cleanup_backend(); }, true), net::detached);
+        }
+    }
+
+std::size_t SessionStore::size() const
+    {
+    std::size_t total = 0;
+    for (std::size_t i = 0; i <= shard_mask_; ++i)
+        {
+        std::lock_guard<std::mutex> lock(shards_[i].mtx);
+        total += shards_[i].live;
+        }
+    return total;
+    }
+
+std::size_t SessionStore::pending() const
+    {
+    std::lock_guard<std::mutex> lock(pending_mtx_);
+    return pending_.size();
+    }
+
+SessionStore::Stats SessionStore::stats() const
+    {
+    return {
+        writes_.load(std::memory_order_relaxed),
+        touches_.load(std::memory_order_relaxed),
+        loads_.load(std::memory_order_relaxed),
+        loaded_.load(std::memory_order_relaxed),
+        failures_.load(std::memory_order_relaxed),
+        dropped_.load(std::memory_order_relaxed),
+        expired_.load(std::memory_order_relaxed),
+        cleaned_.load(std::memory_order_relaxed),
+        negative_hits_.load(std::memory_order_relaxed)
+        };
+    }
+
+} // namespace session
+} // namespace asciimmo
@@ -0,0 +1,55 @@
+#include "shared/session_token.hpp"
+#include <openssl/rand.h>
+#include <stdexcept>
+#include <string>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+namespace
+{
+
+constexpr uint64_t kRandomMask = (uint64_t{ 1 } << SessionTokenGenerator::kRandomBits) - 1;
+
+} // namespace
+
+SessionTokenGenerator::SessionTokenGenerator(unsigned instance, std::size_t batch)
+    : instance_(instance)
+    , pool_(batch == 0 ? 1 : batch)
+    , next_(pool_.size())
+    {
+    if (instance > kMaxInstance)
+        {
+        throw std::invalid_argument("session token instance must be at most " + std::to_string(kMaxInstance));
+        }
+    }
+
+uint64_t SessionTokenGenerator::generate()
+    {
+    const uint64_t prefix = static_cast<uint64_t>(instance_) << kRandomBits;
+    uint64_t token = 0;
+    while (token == 0)
+        {
+        token = prefix | (next_random() & kRandomMask);
+        }
+    return token;
+    }
+
+uint64_t SessionTokenGenerator::next_random()
+    {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (next_ == pool_.size())
+        {
+        if (RAND_bytes(reinterpret_cast<unsigned char*>(pool_.data()), static_cast<int>(pool_.size() * sizeof(uint64_t))) != 1)
+            {
+            throw std::runtime_error("RAND_bytes failed");
+            }
+        next_ = 0;
+        }
+    return pool_[next_++];
+    }
+
+} // namespace auth
+} // namespace asciimmo
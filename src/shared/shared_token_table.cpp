@@ -0,0 +1,312 @@
+#include "shared/shared_token_table.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+namespace
+{
+
+constexpr uint64_t kMagic = 0x41534349544f4b31; // "ASCITOK1"
+constexpr std::size_t kMinCapacity = 64;
+// Reads of one slot before it counts as a miss. A write takes a few stores,
+// so only a writer that died partway through keeps a slot odd this long.
+constexpr int kMaxReadAttempts = 1024;
+// Slots a token may sit past its home slot. Bounds a miss, and an insert into
+// a crowded table, to a couple of kilobytes instead of the whole table; an
+// insert that finds no room within it fails as if the table were full.
+constexpr std::size_t kMaxProbe = 64;
+
+// Guards add_token within the writing process
+std::mutex writer_mtx;
+
+int64_t now_ns()
+    {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+std::size_t slot_hash(uint64_t token)
+    {
+    // splitmix64 finalizer; session tokens are random, but cheap insurance
+    token ^= token >> 30;
+    token *= 0xbf58476d1ce4e5b9ULL;
+    token ^= token >> 27;
+    token *= 0x94d049bb133111ebULL;
+    token ^= token >> 31;
+    return static_cast<std::size_t>(token);
+    }
+
+[[noreturn]] void throw_errno(const std::string& what)
+    {
+    throw std::system_error(errno, std::generic_category(), what);
+    }
+
+inline void cpu_relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+    }
+
+} // namespace
+
+struct SharedTokenTable::Header
+    {
+    std::atomic<uint64_t> magic;
+    uint64_t capacity;
+    std::atomic<uint64_t> used;
+    };
+
+struct alignas(32) SharedTokenTable::Slot
+    {
+    std::atomic<uint32_t> seq; // odd while being written
+    std::atomic<uint32_t> admin;
+    std::atomic<uint64_t> token;
+    std::atomic<int64_t> expires_ns;
+    };
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int64_t>::is_always_lock_free
+    && std::atomic<uint32_t>::is_always_lock_free, "shared memory atomics must be lock-free");
+
+std::unique_ptr<SharedTokenTable> SharedTokenTable::open(const std::string& name, std::size_t capacity)
+    {
+    constexpr std::size_t header_bytes = (sizeof(Header) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    const bool created = fd >= 0;
+    if (!created)
+        {
+        if (errno != EEXIST)
+            {
+            throw_errno("shm_open " + name);
+            }
+        fd = ::shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            {
+            throw_errno("shm_open " + name);
+            }
+        }
+
+    std::size_t slots = kMinCapacity;
+    while (slots < capacity)
+        {
+        slots *= 2;
+        }
+
+    std::size_t bytes = 0;
+    if (created)
+        {
+        bytes = header_bytes + slots * sizeof(Slot);
+        // Zero-filled, so every slot starts empty
+        if (::ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+            {
+            const int err = errno;
+            ::close(fd);
+            ::shm_unlink(name.c_str());
+            errno = err;
+            throw_errno("ftruncate " + name);
+            }
+        }
+    else
+        {
+        // Another process is creating it; wait for the header to be published
+        void* header_map = MAP_FAILED;
+        for (int attempt = 0; attempt < 100 && header_map == MAP_FAILED; ++attempt)
+            {
+            struct stat st{};
+            if (::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= header_bytes)
+                {
+                header_map = ::mmap(nullptr, header_bytes, PROT_READ, MAP_SHARED, fd, 0);
+                }
+            else
+                {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+            }
+        if (header_map == MAP_FAILED)
+            {
+            ::close(fd);
+            throw std::system_error(std::make_error_code(std::errc::timed_out), "shared token table " + name);
+            }
+
+        const auto* header = static_cast<const Header*>(header_map);
+        for (int attempt = 0; attempt < 100 && header->magic.load(std::memory_order_acquire) != kMagic; ++attempt)
+            {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        const bool ready = header->magic.load(std::memory_order_acquire) == kMagic;
+        slots = header->capacity;
+        ::munmap(header_map, header_bytes);
+        if (!ready)
+            {
+            ::close(fd);
+            throw std::system_error(std::make_error_code(std::errc::timed_out), "shared token table " + name);
+            }
+        bytes = header_bytes + slots * sizeof(Slot);
+        }
+
+    void* base = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int err = errno;
+    ::close(fd);
+    if (base == MAP_FAILED)
+        {
+        errno = err;
+        throw_errno("mmap " + name);
+        }
+
+    std::unique_ptr<SharedTokenTable> table(new SharedTokenTable(base, bytes));
+    table->slots_ = reinterpret_cast<Slot*>(static_cast<char*>(base) + header_bytes);
+    table->mask_ = slots - 1;
+    if (created)
+        {
+        table->header_->capacity = slots;
+        table->header_->magic.store(kMagic, std::memory_order_release);
+        }
+    return table;
+    }
+
+void SharedTokenTable::remove(const std::string& name)
+    {
+    ::shm_unlink(name.c_str());
+    }
+
+SharedTokenTable::SharedTokenTable(void* base, std::size_t bytes)
+    : base_(base)
+    , bytes_(bytes)
+    , header_(static_cast<Header*>(base))
+    , slots_(nullptr)
+    , mask_(0)
+    {}
+
+SharedTokenTable::~SharedTokenTable()
+    {
+    ::munmap(base_, bytes_);
+    }
+
+bool SharedTokenTable::add_token(uint64_t token, std::chrono::seconds ttl, bool isAdmin)
+    {
+    if (token == 0)
+        {
+        return false;
+        }
+
+    const int64_t now = now_ns();
+    const int64_t expires = now + std::chrono::duration_cast<std::chrono::nanoseconds>(ttl).count();
+
+    std::lock_guard<std::mutex> lock(writer_mtx);
+    Slot* target = nullptr;
+    Slot* reusable = nullptr;
+    const std::size_t start = slot_hash(token);
+    const std::size_t probes = std::min(kMaxProbe, mask_ + 1);
+    for (std::size_t i = 0; i < probes; ++i)
+        {
+        Slot& slot = slots_[(start + i) & mask_];
+        const uint64_t current = slot.token.load(std::memory_order_relaxed);
+        if (current == token)
+            {
+            target = &slot;
+            break;
+            }
+        if (current == 0)
+            {
+            if (reusable == nullptr)
+                {
+                header_->used.fetch_add(1, std::memory_order_relaxed);
+                }
+            target = reusable != nullptr ? reusable : &slot;
+            break;
+            }
+        if (reusable == nullptr && slot.expires_ns.load(std::memory_order_relaxed) <= now)
+            {
+            reusable = &slot;
+            }
+        }
+    if (target == nullptr)
+        {
+        target = reusable;
+        }
+    if (target == nullptr)
+        {
+        return false;
+        }
+
+    // Rounded down so a slot left odd by a writer that died is healed
+    const uint32_t seq = target->seq.load(std::memory_order_relaxed) & ~1u;
+    target->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    target->token.store(token, std::memory_order_relaxed);
+    target->expires_ns.store(expires, std::memory_order_relaxed);
+    target->admin.store(isAdmin ? 1 : 0, std::memory_order_relaxed);
+    target->seq.store(seq + 2, std::memory_order_release);
+    return true;
+    }
+
+bool SharedTokenTable::find(uint64_t token, bool& isAdmin) const
+    {
+    if (token == 0)
+        {
+        return false;
+        }
+
+    const std::size_t start = slot_hash(token);
+    const std::size_t probes = std::min(kMaxProbe, mask_ + 1);
+    for (std::size_t i = 0; i < probes; ++i)
+        {
+        const Slot& slot = slots_[(start + i) & mask_];
+        uint64_t current;
+        int64_t expires;
+        uint32_t admin;
+        bool stable = false;
+        for (int attempt = 0; attempt < kMaxReadAttempts && !stable; ++attempt)
+            {
+            const uint32_t before = slot.seq.load(std::memory_order_acquire);
+            if (before & 1)
+                {
+                cpu_relax();
+                continue;
+                }
+            current = slot.token.load(std::memory_order_relaxed);
+            expires = slot.expires_ns.load(std::memory_order_relaxed);
+            admin = slot.admin.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            stable = slot.seq.load(std::memory_order_relaxed) == before;
+            }
+        if (!stable)
+            {
+            // Can't tell what the slot holds or whether the probe chain goes
+            // on past it; the caller falls back to its other sources
+            return false;
+            }
+
+        if (current == 0)
+            {
+            return false;
+            }
+        if (current == token)
+            {
+            isAdmin = admin != 0;
+            return now_ns() < expires;
+            }
+        }
+    return false;
+    }
+
+std::size_t SharedTokenTable::size() const
+    {
+    return static_cast<std::size_t>(header_->used.load(std::memory_order_relaxed));
+    }
+
+} // namespace auth
+} // namespace asciimmo
@@ -0,0 +1,135 @@
+#include "shared/signed_token.hpp"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <array>
+#include <charconv>
+
+namespace asciimmo
+{
+namespace auth
+{
+
+namespace
+{
+
+constexpr std::size_t kMacBytes = 16;
+constexpr char kHex[] = "0123456789abcdef";
+
+std::array<unsigned char, EVP_MAX_MD_SIZE> sign(const std::string& key, std::string_view payload)
+    {
+    std::array<unsigned char, EVP_MAX_MD_SIZE> mac{};
+    unsigned int len = 0;
+    HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+        reinterpret_cast<const unsigned char*>(payload.data()), payload.size(), mac.data(), &len);
+    return mac;
+    }
+
+int hex_value(char c)
+    {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+    }
+
+// Parses one decimal field and advances past it and its '.'
+template <class T>
+bool next_field(std::string_view& rest, T& value)
+    {
+    auto [ptr, ec] = std::from_chars(rest.data(), rest.data() + rest.size(), value);
+    if (ec != std::errc())
+        {
+        return false;
+        }
+    rest.remove_prefix(static_cast<std::size_t>(ptr - rest.data()));
+    if (!rest.empty())
+        {
+        if (rest.front() != '.')
+            {
+            return false;
+            }
+        rest.remove_prefix(1);
+        }
+    return true;
+    }
+
+int64_t unix_now()
+    {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+} // namespace
+
+std::string TokenSigner::issue(const TokenClaims& claims) const
+    {
+    std::string token = "s1." + std::to_string(claims.token_id) + "." + std::to_string(claims.user_id) + "."
+        + (claims.isAdmin ? "1" : "0") + "." + std::to_string(claims.expires_at);
+    const auto mac = sign(key_, token);
+    token += '.';
+    for (std::size_t i = 0; i < kMacBytes; ++i)
+        {
+        token += kHex[mac[i] >> 4];
+        token += kHex[mac[i] & 0xf];
+        }
+    return token;
+    }
+
+std::string TokenSigner::issue(uint64_t token_id, uint64_t user_id, bool isAdmin, std::chrono::seconds ttl) const
+    {
+    return issue(TokenClaims{ token_id, user_id, isAdmin, unix_now() + ttl.count() });
+    }
+
+bool TokenSigner::verify(std::string_view token, TokenClaims& claims) const
+    {
+    if (!is_signed(token) || token.size() < 2 * kMacBytes + 1)
+        {
+        return false;
+        }
+
+    const std::string_view payload = token.substr(0, token.size() - 2 * kMacBytes - 1);
+    const std::string_view mac_hex = token.substr(payload.size() + 1);
+    if (token[payload.size()] != '.')
+        {
+        return false;
+        }
+
+    std::array<unsigned char, kMacBytes> given{};
+    for (std::size_t i = 0; i < kMacBytes; ++i)
+        {
+        const int hi = hex_value(mac_hex[2 * i]);
+        const int lo = hex_value(mac_hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            {
+            return false;
+            }
+        given[i] = static_cast<unsigned char>(hi << 4 | lo);
+        }
+
+    const auto expected = sign(key_, payload);
+    if (CRYPTO_memcmp(given.data(), expected.data(), kMacBytes) != 0)
+        {
+        return false;
+        }
+
+    // Signed by us, so the fields are well formed unless the key leaked
+    TokenClaims parsed;
+    int admin = 0;
+    std::string_view rest = payload.substr(3);
+    if (!next_field(rest, parsed.token_id) || !next_field(rest, parsed.user_id)
+        || !next_field(rest, admin) || !next_field(rest, parsed.expires_at) || !rest.empty())
+        {
+        return false;
+        }
+    parsed.isAdmin = admin != 0;
+
+    if (unix_now() >= parsed.expires_at)
+        {
+        return false;
+        }
+    claims = parsed;
+    return true;
+    }
+
+} // namespace auth
+} // namespace asciimmo
@@ -1,8 +1,12 @@
 #include "shared/http_server.hpp"
+#include "shared/http_client.hpp"
+#include "shared/http_config.hpp"
 #include "shared/logger.hpp"
-#include "shared/token_cache.hpp"
+#include "shared/session_auth.hpp"
 #include "shared/service_config.hpp"
+#include <charconv>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -45,41 +49,6 @@ static std::unordered_map<std::string, Party> parties; // party_id -> Party
 static std::unordered_map<std::string, Guild> guilds; // guild_id -> Guild
 static std::mutex data_mtx;
 
-// Parse query string parameters
-static std::string get_param(const std::string& target, const std::string& key)
-    {
-    auto pos = target.find('?');
-    if (pos == std::string::npos) return "";
-
-    std::string query = target.substr(pos + 1);
-    std::string search = key + "=";
-    pos = query.find(search);
-    if (pos == std::string::npos) return "";
-
-    auto start = pos + search.length();
-    auto end = query.find('&', start);
-    return query.substr(start, end == std::string::npos ? std::string::npos : end - start);
-    }
-
-// Validate session token
-static bool validate_session_token(const std::string& target, asciimmo::auth::TokenCache& cache)
-    {
-    std::string token_str = get_param(target, "session_token");
-#ifdef NDEBUG // only require a token in release builds
-    if (token_str.empty()) return false;
-#endif
-
-    try
-        {
-        uint64_t token = std::stoull(token_str);
-        return cache.validate_token(token);
-        }
-        catch (...)
-            {
-            return false;
-            }
-    }
-
 int main(int argc, char** argv)
     {
     // Load configuration
@@ -136,70 +105,23 @@ int main(int argc, char** argv)
         }
 
     asciimmo::log::Logger logger("social-service");
-    asciimmo::auth::TokenCache token_cache;
+    asciimmo::http::WebSocketChannel chat_channel;
 
     boost::asio::io_context ioc;
-    asciimmo::http::Server svr(ioc, port, cert_file, key_file);
+    asciimmo::http::Server svr(ioc, port, cert_file, key_file, asciimmo::http::server_options(config, "social_service"));
+    asciimmo::http::use_rate_limits(svr, asciimmo::http::rate_limit_rules(config, "social_service"));
+    asciimmo::http::Client client(ioc.get_executor(), asciimmo::http::client_options(config, "social_service"));
+    auto tokens = asciimmo::auth::use_token_validation(svr, ioc, client, config, "social_service", logger);
 
-    logger.info("Starting social-service on port " + std::to_string(port));
-
-    // Token registration endpoint (called by session service)
-    svr.post("/token/register", [&token_cache, &logger](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
-        {
-        // TODO: parse JSON properly; for now extract token from body
-        std::string body = req.body();
-        // Simple extraction (production should use proper JSON parser)
-        auto token_pos = body.find("\"token\":");
-        if (token_pos != std::string::npos)
-            {
-            auto start = token_pos + 8;
-            // Skip whitespace
-            while (start < body.size() && (body[start] == ' ' || body[start] == '\"')) start++;
-            auto end = body.find_first_of(",}\"", start);
-            std::string token_str = body.substr(start, end - start);
-            try
-                {
-                uint64_t token = std::stoull(token_str);
-                token_cache.add_token(token);
-                logger.info("Registered token: " + token_str);
-                res.result(boost::beast::http::status::ok);
-                res.body() = R"({"status":"ok"})";
-                }
-                catch (...)
-                    {
-                    res.result(boost::beast::http::status::bad_request);
-                    res.body() = R"({"status":"error","message":"invalid token format"})";
-                    }
-            }
-        else
-            {
-            res.result(boost::beast::http::status::bad_request);
-            res.body() = R"({"status":"error","message":"invalid request"})";
-            }
-        res.prepare_payload();
-        });
+    logger.info("Starting social-service on port " + std::to_string(port) + " (" + std::string(asciimmo::http::kIoBackend) + ")");
 
     // GET /chat/global?session_token=xxx&limit=N - retrieve recent global chat messages
-    svr.get("/chat/global", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
+    svr.get("/chat/global", asciimmo::http::Access::Protected,
+        [](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch&, const asciimmo::http::RequestContext& ctx)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
         int limit = 50;
-        auto limit_str = get_param(target, "limit");
-        if (!limit_str.empty())
-            {
-            try { limit = std::stoi(limit_str); }
-            catch (...) {}
-            }
+        auto limit_str = ctx.param("limit");
+        std::from_chars(limit_str.data(), limit_str.data() + limit_str.size(), limit);
 
         std::lock_guard<std::mutex> lock(data_mtx);
         std::string json = R"({"messages":[)";
@@ -215,46 +137,44 @@ int main(int argc, char** argv)
         res.prepare_payload();
         });
 
-    // POST /chat/global?session_token=xxx - send a message (expects {"from":"...", "message":"..."})
-    svr.post("/chat/global", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
+    // WS /chat/global/ws?session_token=xxx - server push of new global chat messages
+    asciimmo::http::WebSocketHandler chat_ws;
+    chat_ws.on_open = [&chat_channel](const asciimmo::http::WebSocketPtr& conn, const asciimmo::http::Request&, const std::smatch&)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
+        chat_channel.join(conn);
+        };
+    chat_ws.on_close = [&chat_channel](const asciimmo::http::WebSocketPtr& conn)
+        {
+        chat_channel.leave(conn);
+        };
+    svr.websocket("/chat/global/ws", asciimmo::http::Access::Protected, chat_ws);
 
+    // POST /chat/global?session_token=xxx - send a message (expects {"from":"...", "message":"..."})
+    svr.post("/chat/global", asciimmo::http::Access::Protected,
+        [&chat_channel](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&, const asciimmo::http::RequestContext&)
+        {
         // TODO: parse JSON properly; stub: extract from body
-        std::lock_guard<std::mutex> lock(data_mtx);
         ChatMessage msg;
         msg.from = "user"; // stub
         msg.message = req.body();
         msg.timestamp = std::time(nullptr);
-        global_chat.push_back(msg);
+        std::string pushed = R"({"from":")" + msg.from + R"(","message":")" + msg.message + R"(","timestamp":)" + std::to_string(msg.timestamp) + "}";
+        {
+        std::lock_guard<std::mutex> lock(data_mtx);
+        global_chat.push_back(std::move(msg));
+        }
+
+        // Push to WebSocket subscribers instead of waiting for their next poll
+        chat_channel.broadcast(std::move(pushed));
         res.result(boost::beast::http::status::ok);
         res.body() = R"({"status":"ok"})";
         res.prepare_payload();
         });
 
     // GET /friends/:user?session_token=xxx - get friend list for user
-    svr.get(R"(/friends/(\w+))", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch& matches)
+    svr.get(R"(/friends/(\w+))", asciimmo::http::Access::Protected,
+        [](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch& matches, const asciimmo::http::RequestContext&)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
         std::string user = matches[1].str();
         std::lock_guard<std::mutex> lock(data_mtx);
         auto it = friends.find(user);
@@ -276,19 +196,9 @@ int main(int argc, char** argv)
         });
 
     // POST /friends/:user/add?session_token=xxx - add friend (expects {"friend":"..."})
-    svr.post(R"(/friends/(\w+)/add)", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch& matches)
+    svr.post(R"(/friends/(\w+)/add)", asciimmo::http::Access::Protected,
+        [](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch& matches, const asciimmo::http::RequestContext&)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
         std::string user = matches[1].str();
         std::string friend_name = "friend"; // TODO: parse JSON
         std::lock_guard<std::mutex> lock(data_mtx);
@@ -299,19 +209,9 @@ int main(int argc, char** argv)
         });
 
     // POST /party/create?session_token=xxx - create a party (expects {"leader":"..."})
-    svr.post("/party/create", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
+    svr.post("/party/create", asciimmo::http::Access::Protected,
+        [](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch&, const asciimmo::http::RequestContext&)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
         std::string leader = "leader"; // TODO: parse JSON
         std::string party_id = "party-" + std::to_string(std::hash<std::string>{}(leader + std::to_string(std::time(nullptr))));
         std::lock_guard<std::mutex> lock(data_mtx);
@@ -325,19 +225,9 @@ int main(int argc, char** argv)
         });
 
     // POST /party/:id/join?session_token=xxx - join a party (expects {"user":"..."})
-    svr.post(R"(/party/([\w-]+)/join)", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch& matches)
+    svr.post(R"(/party/([\w-]+)/join)", asciimmo::http::Access::Protected,
+        [](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch& matches, const asciimmo::http::RequestContext&)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
         std::string party_id = matches[1].str();
         std::string user = "user"; // TODO: parse JSON
         std::lock_guard<std::mutex> lock(data_mtx);
@@ -357,19 +247,9 @@ int main(int argc, char** argv)
         });
 
     // GET /party/:id?session_token=xxx - get party info
-    svr.get(R"(/party/([\w-]+))", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch& matches)
+    svr.get(R"(/party/([\w-]+))", asciimmo::http::Access::Protected,
+        [](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch& matches, const asciimmo::http::RequestContext&)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
         std::string party_id = matches[1].str();
         std::lock_guard<std::mutex> lock(data_mtx);
         auto it = parties.find(party_id);
@@ -396,19 +276,9 @@ int main(int argc, char** argv)
         });
 
     // POST /guild/create?session_token=xxx - create a guild (expects {"name":"...", "leader":"..."})
-    svr.post("/guild/create", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
+    svr.post("/guild/create", asciimmo::http::Access::Protected,
+        [](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch&, const asciimmo::http::RequestContext&)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
         std::string name = "guild"; // TODO: parse JSON
         std::string leader = "leader";
         std::string guild_id = "guild-" + name;
@@ -424,19 +294,9 @@ int main(int argc, char** argv)
         });
 
     // POST /guild/:id/join?session_token=xxx - join a guild (expects {"user":"..."})
-    svr.post(R"(/guild/([\w-]+)/join)", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch& matches)
+    svr.post(R"(/guild/([\w-]+)/join)", asciimmo::http::Access::Protected,
+        [](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch& matches, const asciimmo::http::RequestContext&)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
         std::string guild_id = matches[1].str();
         std::string user = "user"; // TODO: parse JSON
         std::lock_guard<std::mutex> lock(data_mtx);
@@ -456,19 +316,9 @@ int main(int argc, char** argv)
         });
 
     // GET /guild/:id?session_token=xxx - get guild info
-    svr.get(R"(/guild/([\w-]+))", [&token_cache](const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch& matches)
+    svr.get(R"(/guild/([\w-]+))", asciimmo::http::Access::Protected,
+        [](const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch& matches, const asciimmo::http::RequestContext&)
         {
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
         std::string guild_id = matches[1].str();
         std::lock_guard<std::mutex> lock(data_mtx);
         auto it = guilds.find(guild_id);
@@ -1,10 +1,15 @@
 #include "worldgen.hpp"
 #include "shared/http_server.hpp"
+#include "shared/http_client.hpp"
+#include "shared/http_config.hpp"
 #include "shared/logger.hpp"
-#include "shared/token_cache.hpp"
+#include "shared/session_auth.hpp"
 #include "shared/service_config.hpp"
+#include <charconv>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/signal_set.hpp>
 
@@ -15,39 +20,12 @@ static void print_usage(const char* prog)
     std::cerr << "  Command line options override config file values\n";
     }
 
-// Parse query string parameters
-static std::string get_param(const std::string& target, const std::string& key)
+template <class T>
+static T parse_or(std::string_view text, T fallback)
     {
-    auto pos = target.find('?');
-    if (pos == std::string::npos) return "";
-
-    std::string query = target.substr(pos + 1);
-    std::string search = key + "=";
-    pos = query.find(search);
-    if (pos == std::string::npos) return "";
-
-    auto start = pos + search.length();
-    auto end = query.find('&', start);
-    return query.substr(start, end == std::string::npos ? std::string::npos : end - start);
-    }
-
-// Validate session token
-static bool validate_session_token(const std::string& target, asciimmo::auth::TokenCache& cache)
-    {
-    std::string token_str = get_param(target, "session_token");
-#ifdef NDEBUG // only require a token in release builds
-    if (token_str.empty()) return false;
-#endif
-
-    try
-        {
-        uint64_t token = std::stoull(token_str);
-        return cache.validate_token(token);
-        }
-        catch (...)
-            {
-            return false;
-            }
+    T value{};
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return (ec == std::errc() && ptr == text.data() + text.size() && !text.empty()) ? value : fallback;
     }
 
 // Handler function objects
@@ -57,49 +35,25 @@ struct WorldHandler
     unsigned long long default_seed;
     int default_width;
     int default_height;
-    asciimmo::auth::TokenCache& token_cache;
 
-    void operator()(const asciimmo::http::Request& req, asciimmo::http::Response& res, const std::smatch&)
+    // Only reached with a valid session token; the auth stage checks it
+    void operator()(const asciimmo::http::Request&, asciimmo::http::Response& res, const std::smatch&,
+        const asciimmo::http::RequestContext& ctx)
         {
         logger.info("Received /world request");
-        std::string target(req.target());
-
-        // Validate session token
-        if (!validate_session_token(target, token_cache))
-            {
-            logger.info("Invalid or missing session token");
-            res.result(boost::beast::http::status::unauthorized);
-            res.body() = R"({"status":"error","message":"invalid or missing session token"})";
-            res.prepare_payload();
-            return;
-            }
-
-        unsigned long long seed = default_seed;
-        int width = default_width;
-        int height = default_height;
 
-        try
-            {
-            auto seed_str = get_param(target, "seed");
-            auto width_str = get_param(target, "width");
-            auto height_str = get_param(target, "height");
+        // Unparseable values fall back to the defaults
+        unsigned long long seed = parse_or(ctx.param("seed"), default_seed);
+        int width = parse_or(ctx.param("width"), default_width);
+        int height = parse_or(ctx.param("height"), default_height);
 
-            if (!seed_str.empty()) seed = std::stoull(seed_str);
-            if (!width_str.empty()) width = std::stoi(width_str);
-            if (!height_str.empty()) height = std::stoi(height_str);
-            }
-            catch (...)
-                {
-                // ignore parse errors and fall back to defaults
-                }
-
-            asciimmo::WorldGen gen(seed, width, height);
-            std::string map = gen.generate();
-            res.result(boost::beast::http::status::ok);
-            res.set(boost::beast::http::field::content_type, "text/plain; charset=utf-8");
-            res.body() = map;
-            res.prepare_payload();
-            logger.info("Responded to /world request");
+        asciimmo::WorldGen gen(seed, width, height);
+        std::string map = gen.generate();
+        res.result(boost::beast::http::status::ok);
+        res.set(boost::beast::http::field::content_type, "text/plain; charset=utf-8");
+        res.body() = map;
+        res.prepare_payload();
+        logger.info("Responded to /world request");
         }
     };
 
@@ -219,14 +173,15 @@ int main(int argc, char** argv)
             }
         }
 
-    asciimmo::auth::TokenCache token_cache;
-
     boost::asio::io_context ioc;
-    asciimmo::http::Server svr(ioc, port, cert_file, key_file);
+    asciimmo::http::Server svr(ioc, port, cert_file, key_file, asciimmo::http::server_options(config, "world_service"));
+    asciimmo::http::use_rate_limits(svr, asciimmo::http::rate_limit_rules(config, "world_service"));
+    asciimmo::http::Client client(ioc.get_executor(), asciimmo::http::client_options(config, "world_service"));
+    auto tokens = asciimmo::auth::use_token_validation(svr, ioc, client, config, "world_service", logger);
 
-    logger.info("Starting world-service on port " + std::to_string(port));
+    logger.info("Starting world-service on port " + std::to_string(port) + " (" + std::string(asciimmo::http::kIoBackend) + ")");
 
-    svr.get("/world", WorldHandler{ logger, default_seed, default_width, default_height, token_cache });
+    svr.get("/world", asciimmo::http::Access::Protected, WorldHandler{ logger, default_seed, default_width, default_height });
     svr.get("/health", HealthHandler{ logger });
     svr.post("/shutdown", ShutdownHandler{ ioc, logger });
 
@@ -24,7 +24,7 @@ echo ""
 echo "Creating session token..."
 RESPONSE=$(curl -sk -X POST https://localhost:8082/session \
   -H "Content-Type: application/json" \
-  -d '{"user":"testuser","data":"test data"}')
+  -d '{"user_id":1,"data":"test data"}')
 
 echo "Session response: $RESPONSE"
 echo ""
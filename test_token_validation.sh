@@ -27,7 +27,7 @@ echo ""
 echo "Step 1: Creating session token..."
 RESPONSE=$(curl -sk -X POST https://localhost:8082/session \
   -H "Content-Type: application/json" \
-  -d '{"user":"testuser","role":"player"}' 2>/dev/null)
+  -d '{"user_id":1,"role":"player"}' 2>/dev/null)
 
 echo "Response: $RESPONSE"
 
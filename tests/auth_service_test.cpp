@@ -3,6 +3,7 @@
 #include <memory>
 #include <thread>
 #include <chrono>
+#include <stdexcept>
 #include "shared/password_hash.hpp"
 #include "shared/email_sender.hpp"
 #include "db_pool.hpp"
@@ -108,6 +109,39 @@ TEST_F(AuthServiceTest, DifferentSaltsProduceDifferentHashes)
     EXPECT_NE(hash1, hash2) << "Same password with different salts should produce different hashes";
     }
 
+TEST_F(AuthServiceTest, ScryptHashCarriesItsParameters)
+    {
+    const asciimmo::auth::ScryptParams params{ 10, 8, 1 };
+    std::string encoded = asciimmo::auth::PasswordHash::hash_scrypt("mySecurePassword!", params);
+
+    EXPECT_EQ(encoded.rfind("$scrypt$ln=10,r=8,p=1$", 0), 0u) << encoded;
+    EXPECT_TRUE(asciimmo::auth::PasswordHash::verify_scrypt("mySecurePassword!", encoded));
+    EXPECT_FALSE(asciimmo::auth::PasswordHash::verify_scrypt("wrongPassword", encoded));
+
+    // Same password, new salt
+    EXPECT_NE(encoded, asciimmo::auth::PasswordHash::hash_scrypt("mySecurePassword!", params));
+
+    // Verifies with its own parameters, whatever the current ones are
+    EXPECT_FALSE(asciimmo::auth::PasswordHash::needs_rehash(encoded, params));
+    EXPECT_TRUE(asciimmo::auth::PasswordHash::needs_rehash(encoded, asciimmo::auth::ScryptParams{ 11, 8, 1 }));
+    EXPECT_TRUE(asciimmo::auth::PasswordHash::needs_rehash("", params));
+    }
+
+TEST_F(AuthServiceTest, ScryptRejectsMalformedHashes)
+    {
+    std::string encoded = asciimmo::auth::PasswordHash::hash_scrypt("password123", asciimmo::auth::ScryptParams{ 10, 8, 1 });
+
+    EXPECT_FALSE(asciimmo::auth::PasswordHash::verify_scrypt("password123", encoded.substr(0, encoded.size() - 2)));
+    EXPECT_FALSE(asciimmo::auth::PasswordHash::verify_scrypt("password123", ""));
+
+    // Parameters past the limits aren't even tried
+    std::string greedy = encoded;
+    greedy.replace(greedy.find("ln=10"), 5, "ln=40");
+    EXPECT_FALSE(asciimmo::auth::PasswordHash::verify_scrypt("password123", greedy));
+    EXPECT_THROW(asciimmo::auth::PasswordHash::hash_scrypt("password123", asciimmo::auth::ScryptParams{ 15, 8, 0 }),
+        std::invalid_argument);
+    }
+
 // Test token generation
 TEST_F(AuthServiceTest, TokenGenerationProducesUniqueTokens)
     {
@@ -0,0 +1,102 @@
+#include "shared/flat_token_map.hpp"
+#include <gtest/gtest.h>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace asciimmo::auth;
+
+TEST(FlatTokenMapTest, InsertFindErase) {
+    FlatTokenMap map;
+    EXPECT_EQ(map.find(1), nullptr);
+    EXPECT_EQ(map.capacity(), 0u);
+
+    auto [value, inserted] = map.try_emplace(1, 10);
+    EXPECT_TRUE(inserted);
+    EXPECT_EQ(*value, 10);
+    EXPECT_FALSE(map.try_emplace(1, 20).second);
+    EXPECT_EQ(*map.find(1), 10);
+
+    EXPECT_TRUE(map.try_emplace(0, 5).second); // zero is an ordinary key
+    ASSERT_NE(map.find(0), nullptr);
+    EXPECT_EQ(*map.find(0), 5);
+    EXPECT_EQ(map.size(), 2u);
+
+    EXPECT_TRUE(map.erase(1));
+    EXPECT_FALSE(map.erase(1));
+    EXPECT_EQ(map.find(1), nullptr);
+    EXPECT_EQ(map.size(), 1u);
+}
+
+TEST(FlatTokenMapTest, GrowsAndKeepsEntries) {
+    FlatTokenMap map;
+    for (uint64_t key = 0; key < 10000; ++key) {
+        map.try_emplace(key * 7919, static_cast<int64_t>(key));
+    }
+    EXPECT_EQ(map.size(), 10000u);
+    EXPECT_GE(map.capacity() * 3, map.size() * 4);
+    for (uint64_t key = 0; key < 10000; ++key) {
+        ASSERT_NE(map.find(key * 7919), nullptr);
+        EXPECT_EQ(*map.find(key * 7919), static_cast<int64_t>(key));
+    }
+    // The tables it outgrew are kept too
+    std::size_t expected = 0;
+    for (std::size_t capacity = 16; capacity <= map.capacity(); capacity *= 2) {
+        expected += capacity * 17 + 16;
+    }
+    EXPECT_EQ(map.memory_bytes(), expected);
+    EXPECT_LT(map.memory_bytes(), 2 * (map.capacity() * 17 + 16));
+
+    std::size_t seen = 0;
+    map.for_each([&seen](uint64_t, int64_t) { ++seen; });
+    EXPECT_EQ(seen, 10000u);
+}
+
+TEST(FlatTokenMapTest, FindRacingAgreesWithFind) {
+    FlatTokenMap map;
+    int64_t value = 0;
+    EXPECT_FALSE(map.find_racing(1, value));
+    for (uint64_t key = 1; key <= 1000; ++key) {
+        map.try_emplace(key, static_cast<int64_t>(key * 2));
+    }
+    map.erase(500);
+    FlatTokenMap::assign(map.find(7), 99);
+
+    EXPECT_TRUE(map.find_racing(7, value));
+    EXPECT_EQ(value, 99);
+    EXPECT_TRUE(map.find_racing(1000, value));
+    EXPECT_EQ(value, 2000);
+    EXPECT_FALSE(map.find_racing(500, value));
+    EXPECT_FALSE(map.find_racing(1001, value));
+}
+
+TEST(FlatTokenMapTest, MatchesUnorderedMapUnderChurn) {
+    // Keys from a small range so probe runs collide, and erases have to
+    // shift entries back across them
+    FlatTokenMap map;
+    std::unordered_map<uint64_t, int64_t> reference;
+    std::mt19937_64 rng(7);
+    for (int i = 0; i < 200000; ++i) {
+        const uint64_t key = rng() % 2048;
+        if (rng() % 3 == 0) {
+            EXPECT_EQ(map.erase(key), reference.erase(key) == 1);
+        }
+        else {
+            auto [value, inserted] = map.try_emplace(key, i);
+            auto [it, ref_inserted] = reference.try_emplace(key, i);
+            ASSERT_EQ(inserted, ref_inserted);
+            *value = i;
+            it->second = i;
+        }
+    }
+
+    ASSERT_EQ(map.size(), reference.size());
+    for (uint64_t key = 0; key < 2048; ++key) {
+        auto it = reference.find(key);
+        const int64_t* value = map.find(key);
+        ASSERT_EQ(value != nullptr, it != reference.end()) << key;
+        if (value != nullptr) {
+            EXPECT_EQ(*value, it->second);
+        }
+    }
+}
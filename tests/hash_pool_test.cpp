@@ -0,0 +1,94 @@
+#include "shared/hash_pool.hpp"
+#include "shared/password_hash.hpp"
+#include <gtest/gtest.h>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace asciimmo::auth;
+
+TEST(HashPoolTest, HashesOffTheCallersThread) {
+    HashPool pool(HashPoolOptions{ 2, 8 });
+    net::io_context ioc;
+    const auto io_thread = std::this_thread::get_id();
+    const ScryptParams params{ 10, 8, 1 };
+
+    std::vector<bool> verified;
+    for (int i = 0; i < 4; ++i) {
+        net::co_spawn(ioc, [&, i]() -> net::awaitable<void> {
+            const std::string password = "password " + std::to_string(i);
+            std::string encoded;
+            std::thread::id hashed_on;
+            EXPECT_TRUE(co_await pool.run([&]() {
+                hashed_on = std::this_thread::get_id();
+                encoded = PasswordHash::hash_scrypt(password, params);
+            }));
+            EXPECT_NE(hashed_on, io_thread);
+            EXPECT_EQ(std::this_thread::get_id(), io_thread);
+            verified.push_back(PasswordHash::verify_scrypt(password, encoded));
+        }, net::detached);
+    }
+    ioc.run();
+
+    EXPECT_EQ(verified, std::vector<bool>(4, true));
+    EXPECT_EQ(pool.stats().completed, 4u);
+    EXPECT_EQ(pool.stats().queued, 0u);
+}
+
+TEST(HashPoolTest, RejectsWhenFull) {
+    HashPool pool(HashPoolOptions{ 1, 2 });
+    net::io_context ioc;
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+
+    std::vector<bool> results;
+    for (int i = 0; i < 3; ++i) {
+        net::co_spawn(ioc, [&]() -> net::awaitable<void> {
+            results.push_back(co_await pool.run([released]() { released.wait(); }));
+        }, net::detached);
+    }
+    // The first two are taken and block the pool; the third is refused
+    // without waiting for them
+    ioc.poll();
+    ASSERT_EQ(results, std::vector<bool>{ false });
+    EXPECT_EQ(pool.stats().queued, 2u);
+    EXPECT_EQ(pool.stats().rejected, 1u);
+
+    release.set_value();
+    ioc.restart();
+    ioc.run();
+    EXPECT_EQ(results, (std::vector<bool>{ false, true, true }));
+    EXPECT_EQ(pool.stats().queued, 0u);
+
+    // There is room again
+    bool ran = false;
+    net::co_spawn(ioc, [&]() -> net::awaitable<void> {
+        ran = co_await pool.run([]() {});
+    }, net::detached);
+    ioc.restart();
+    ioc.run();
+    EXPECT_TRUE(ran);
+}
+
+TEST(HashPoolTest, RethrowsToTheCaller) {
+    HashPool pool(HashPoolOptions{ 1, 1 });
+    net::io_context ioc;
+
+    std::string caught;
+    net::co_spawn(ioc, [&]() -> net::awaitable<void> {
+        try {
+            co_await pool.run([]() { throw std::runtime_error("scrypt failed"); });
+        } catch (const std::runtime_error& e) {
+            caught = e.what();
+        }
+    }, net::detached);
+    ioc.run();
+
+    EXPECT_EQ(caught, "scrypt failed");
+    EXPECT_EQ(pool.stats().queued, 0u);
+}
@@ -0,0 +1,107 @@
+#include "shared/http_server.hpp"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <thread>
+
+// Counts heap allocations made on the server's io thread only, so the
+// client half of the test doesn't skew the numbers
+static std::atomic<long> server_allocations{ 0 };
+static thread_local bool count_allocations = false;
+
+static void* counted_alloc(std::size_t size, std::size_t alignment)
+{
+    if (count_allocations) {
+        server_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    size = size ? size : 1;
+    void* p = alignment <= alignof(std::max_align_t)
+        ? std::malloc(size)
+        : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (p) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// Every replaceable form, so each new is paired with a delete of the same
+// family and nothing reaches the library's allocator behind our back
+void* operator new(std::size_t size) { return counted_alloc(size, 0); }
+void* operator new[](std::size_t size) { return counted_alloc(size, 0); }
+void* operator new(std::size_t size, std::align_val_t al) { return counted_alloc(size, static_cast<std::size_t>(al)); }
+void* operator new[](std::size_t size, std::align_val_t al) { return counted_alloc(size, static_cast<std::size_t>(al)); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+using namespace asciimmo::http;
+
+// Server-side heap allocations per request measured the same way before
+// sessions had per-connection arenas (one connection per request)
+constexpr double kAllocationsBeforeArena = 25.0;
+
+TEST(HttpAllocationTest, SteadyStateKeepAliveRequests) {
+    net::io_context ioc;
+    Server svr(ioc, 0);
+    svr.get(R"(/friends/(\w+))", [](const Request& req, Response& res, const std::smatch& matches) {
+        std::pmr::string json(scratch(req));
+        json += R"({"user":")";
+        json.append(matches[1].first, matches[1].second);
+        json += R"(","friends":[]})";
+        res.result(beast::http::status::ok);
+        res.body() = json;
+        res.prepare_payload();
+    });
+    svr.run();
+    std::thread io_thread([&ioc]() {
+        count_allocations = true;
+        ioc.run();
+    });
+
+    net::io_context client_ioc;
+    tcp::socket socket(client_ioc);
+    socket.connect(tcp::endpoint(net::ip::address_v4::loopback(), svr.port()));
+    const std::string raw = "GET /friends/bob?session_token=123 HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    beast::flat_buffer buffer;
+
+    auto round_trip = [&]() {
+        net::write(socket, net::buffer(raw));
+        beast::http::response<beast::http::string_body> res;
+        beast::http::read(socket, buffer, res);
+        ASSERT_EQ(res.result(), beast::http::status::ok);
+        ASSERT_EQ(res.body(), R"({"user":"bob","friends":[]})");
+    };
+
+    // Warm up buffers, body capacity and Asio's handler memory recycling
+    for (int i = 0; i < 50; ++i) {
+        round_trip();
+    }
+
+    const int requests = 500;
+    long before = server_allocations.load();
+    for (int i = 0; i < requests; ++i) {
+        round_trip();
+    }
+    long after = server_allocations.load();
+    double per_request = static_cast<double>(after - before) / requests;
+    RecordProperty("allocations_per_request", std::to_string(per_request));
+    std::cout << "Server heap allocations per request: " << per_request << std::endl;
+
+    EXPECT_LT(per_request, kAllocationsBeforeArena) << "server heap allocations per request: " << per_request;
+    // What's left is std::regex's executor state for the matched route
+    EXPECT_LE(per_request, 2.0) << "server heap allocations per request: " << per_request;
+
+    ioc.stop();
+    io_thread.join();
+}
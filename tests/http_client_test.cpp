@@ -0,0 +1,194 @@
+#include "shared/http_client.hpp"
+#include "shared/http_server.hpp"
+#include "tls_test_fixture.hpp"
+#include <gtest/gtest.h>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/use_future.hpp>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+
+using namespace asciimmo::http;
+
+namespace {
+
+// An HTTPS echo server on its own thread that can be shut down and started
+// again on the same port, closing every connection as a restart would
+class RestartableServer {
+public:
+    RestartableServer(unsigned short port, const std::string& cert_file, const std::string& key_file)
+        : server_(std::make_unique<Server>(ioc_, port, cert_file, key_file)) {
+        server_->get("/echo", [](const Request& req, Response& res, const std::smatch&) {
+            res.result(beast::http::status::ok);
+            res.body() = std::string(req.target());
+            res.prepare_payload();
+        });
+        server_->run();
+        thread_ = std::thread([this]() { ioc_.run(); });
+    }
+
+    ~RestartableServer() {
+        ioc_.stop();
+        thread_.join();
+        // Closes the open connections while the server they count against
+        // is still alive
+        ioc_.shutdown();
+        server_.reset();
+    }
+
+    unsigned short port() const {
+        return server_->port();
+    }
+
+private:
+    struct Context : net::io_context {
+        using net::io_context::shutdown;
+    };
+
+    Context ioc_;
+    std::unique_ptr<Server> server_;
+    std::thread thread_;
+};
+
+} // namespace
+
+// HTTPS servers and a client sharing one io_context thread
+class HttpClientTest : public asciimmo::test::TlsServerTest {
+protected:
+    // Closes idle keep-alive connections long before the client gives up on them
+    static ServerOptions impatient_options() {
+        ServerOptions options;
+        options.header_timeout = std::chrono::milliseconds(100);
+        return options;
+    }
+
+    Server first{ ioc, 0, cert_file, key_file };
+    Server second{ ioc, 0, cert_file, key_file };
+    Server impatient{ ioc, 0, cert_file, key_file, impatient_options() };
+
+    void start() {
+        for (auto* svr : { &first, &second, &impatient }) {
+            svr->post("/echo", [](const Request& req, Response& res, const std::smatch&) {
+                res.result(beast::http::status::ok);
+                res.body() = req.body();
+                res.prepare_payload();
+            });
+            svr->run();
+        }
+        start_io();
+    }
+
+    ClientResponse get(Client& client, unsigned short port, const std::string& target) {
+        ClientRequest req{ beast::http::verb::get, target, 11 };
+        return net::co_spawn(ioc, client.request("127.0.0.1", port, std::move(req)), net::use_future).get();
+    }
+
+    ClientResponse post(Client& client, unsigned short port, const std::string& body) {
+        return net::co_spawn(ioc, client.post("127.0.0.1", port, "/echo", body), net::use_future).get();
+    }
+
+    std::size_t open_connections(Server& svr) {
+        std::string metrics = svr.metrics().render();
+        auto pos = metrics.find("\nasciimmo_http_connections ");
+        return std::stoul(metrics.substr(pos + std::strlen("\nasciimmo_http_connections ")));
+    }
+};
+
+TEST_F(HttpClientTest, ReusesKeptAliveConnection) {
+    start();
+    Client client(ioc.get_executor());
+
+    EXPECT_EQ(post(client, first.port(), "one").body(), "one");
+    EXPECT_EQ(post(client, first.port(), "two").body(), "two");
+    EXPECT_EQ(post(client, first.port(), "three").body(), "three");
+
+    auto stats = client.stats();
+    EXPECT_EQ(stats.connections_opened, 1u);
+    EXPECT_EQ(stats.requests_on_reused, 2u);
+    EXPECT_EQ(client.idle_connections(), 1u);
+    EXPECT_EQ(open_connections(first), 1u);
+}
+
+TEST_F(HttpClientTest, NewConnectionsResumeTheSession) {
+    start();
+    ClientOptions options;
+    options.max_idle_per_host = 0; // every request opens a connection
+    Client client(ioc.get_executor(), options);
+
+    post(client, first.port(), "one");
+    post(client, first.port(), "two");
+    post(client, first.port(), "three");
+
+    auto stats = client.stats();
+    EXPECT_EQ(stats.connections_opened, 3u);
+    EXPECT_EQ(stats.sessions_resumed, 2u);
+}
+
+TEST_F(HttpClientTest, DropsPooledConnectionTheServerClosed) {
+    start();
+    Client client(ioc.get_executor());
+
+    EXPECT_EQ(post(client, impatient.port(), "one").body(), "one");
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_EQ(post(client, impatient.port(), "two").body(), "two");
+
+    auto stats = client.stats();
+    EXPECT_EQ(stats.requests_on_reused, 0u);
+    EXPECT_EQ(stats.connections_opened, 2u);
+}
+
+TEST_F(HttpClientTest, ServerRestartEmptiesThePool) {
+    start();
+    Client client(ioc.get_executor());
+    auto server = std::make_unique<RestartableServer>(0, cert_file, key_file);
+    const unsigned short port = server->port();
+
+    // Two requests in flight at once leave two connections in the pool
+    ClientRequest req{ beast::http::verb::get, "/echo", 11 };
+    auto one = net::co_spawn(ioc, client.request("127.0.0.1", port, req), net::use_future);
+    auto two = net::co_spawn(ioc, client.request("127.0.0.1", port, req), net::use_future);
+    one.get();
+    two.get();
+    ASSERT_EQ(client.idle_connections(), 2u);
+
+    server.reset();
+    server = std::make_unique<RestartableServer>(port, cert_file, key_file);
+
+    EXPECT_EQ(get(client, port, "/echo?after").body(), "/echo?after");
+    EXPECT_EQ(get(client, port, "/echo?again").body(), "/echo?again");
+
+    auto stats = client.stats();
+    EXPECT_EQ(stats.connections_opened, 3u);
+    EXPECT_EQ(stats.requests_on_reused, 1u);
+    EXPECT_EQ(client.idle_connections(), 1u);
+}
+
+TEST_F(HttpClientTest, FanOutReportsEachEndpoint) {
+    start();
+    Client client(ioc.get_executor());
+
+    // Nothing listens on a port we just released
+    unsigned short closed_port;
+    {
+        tcp::acceptor probe(ioc, tcp::endpoint(net::ip::address_v4::loopback(), 0));
+        closed_port = probe.local_endpoint().port();
+    }
+
+    ClientRequest req{ beast::http::verb::post, "/echo", 11 };
+    req.body() = "hello";
+    std::promise<std::vector<FanOutResult>> done;
+    client.fan_out({ { "127.0.0.1", first.port() }, { "127.0.0.1", closed_port }, { "127.0.0.1", second.port() } },
+                   req, [&done](std::vector<FanOutResult> results) { done.set_value(std::move(results)); });
+    auto results = done.get_future().get();
+
+    ASSERT_EQ(results.size(), 3u);
+    EXPECT_FALSE(results[0].ec);
+    EXPECT_EQ(results[0].response.body(), "hello");
+    EXPECT_TRUE(results[1].ec);
+    EXPECT_EQ(results[1].endpoint.port, closed_port);
+    EXPECT_FALSE(results[2].ec);
+    EXPECT_EQ(results[2].response.body(), "hello");
+}
@@ -0,0 +1,394 @@
+#include "shared/http_server.hpp"
+#include "shared/session_auth.hpp"
+#include <gtest/gtest.h>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/beast/websocket.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using namespace asciimmo::http;
+
+// Runs a plain-HTTP server on an ephemeral port for the lifetime of the fixture
+class HttpServerTest : public ::testing::Test {
+protected:
+    net::io_context ioc;
+    Server svr{ ioc, 0 };
+    std::thread io_thread;
+
+    void start() {
+        svr.run();
+        io_thread = std::thread([this]() { ioc.run(); });
+    }
+
+    void TearDown() override {
+        ioc.stop();
+        if (io_thread.joinable()) {
+            io_thread.join();
+        }
+    }
+
+    Response send(beast::http::verb method, const std::string& target) {
+        net::io_context client_ioc;
+        tcp::socket socket(client_ioc);
+        socket.connect(tcp::endpoint(net::ip::address_v4::loopback(), svr.port()));
+
+        Request req{ method, target, 11 };
+        req.set(beast::http::field::host, "localhost");
+        req.prepare_payload();
+        beast::http::write(socket, req);
+
+        beast::flat_buffer buffer;
+        Response res;
+        beast::http::read(socket, buffer, res);
+        return res;
+    }
+};
+
+TEST_F(HttpServerTest, SyncHandler) {
+    svr.get(R"(/echo/(\w+))", [](const Request&, Response& res, const std::smatch& matches) {
+        res.result(beast::http::status::ok);
+        res.body() = matches[1].str();
+        res.prepare_payload();
+    });
+    start();
+
+    auto res = send(beast::http::verb::get, "/echo/hello");
+    EXPECT_EQ(res.result(), beast::http::status::ok);
+    EXPECT_EQ(res.body(), "hello");
+}
+
+TEST_F(HttpServerTest, AsyncHandlerCanAwait) {
+    svr.get_async(R"(/wait/(\w+))", [](const Request&, Response& res, const std::smatch& matches) -> net::awaitable<void> {
+        std::string word = matches[1].str();
+        net::steady_timer timer(co_await net::this_coro::executor, std::chrono::milliseconds(10));
+        co_await timer.async_wait(net::use_awaitable);
+        res.result(beast::http::status::ok);
+        res.body() = word;
+        res.prepare_payload();
+    });
+    start();
+
+    auto res = send(beast::http::verb::get, "/wait/later");
+    EXPECT_EQ(res.result(), beast::http::status::ok);
+    EXPECT_EQ(res.body(), "later");
+}
+
+TEST_F(HttpServerTest, AsyncHandlerExceptionIs500) {
+    svr.post_async("/boom", [](const Request&, Response&, const std::smatch&) -> net::awaitable<void> {
+        throw std::runtime_error("boom");
+        co_return;
+    });
+    start();
+
+    auto res = send(beast::http::verb::post, "/boom");
+    EXPECT_EQ(res.result(), beast::http::status::internal_server_error);
+}
+
+TEST_F(HttpServerTest, UnknownRouteIs404) {
+    start();
+
+    auto res = send(beast::http::verb::get, "/missing");
+    EXPECT_EQ(res.result(), beast::http::status::not_found);
+}
+
+TEST_F(HttpServerTest, MetricsEndpointCountsRequests) {
+    svr.get("/ping", [](const Request&, Response& res, const std::smatch&) {
+        res.result(beast::http::status::ok);
+        res.prepare_payload();
+    });
+    start();
+
+    send(beast::http::verb::get, "/ping");
+    send(beast::http::verb::get, "/ping");
+    auto res = send(beast::http::verb::get, "/metrics");
+    EXPECT_EQ(res.result(), beast::http::status::ok);
+    EXPECT_NE(res.body().find(R"(asciimmo_http_requests_total{method="GET",route="/ping",status="2xx"} 2)"), std::string::npos)
+        << res.body();
+}
+
+TEST_F(HttpServerTest, AuthStageGuardsProtectedRoutes) {
+    asciimmo::auth::TokenCache cache;
+    cache.add_token(1234);
+    svr.get("/open", [](const Request&, Response& res, const std::smatch&) {
+        res.result(beast::http::status::ok);
+        res.prepare_payload();
+    });
+    svr.get("/private", Access::Protected, [](const Request&, Response& res, const std::smatch&, const RequestContext& ctx) {
+        res.result(beast::http::status::ok);
+        res.body() = std::to_string(ctx.session_token) + " " + std::string(ctx.param("name"));
+        res.prepare_payload();
+    });
+    asciimmo::auth::use_session_auth(svr, cache);
+    start();
+
+    EXPECT_EQ(send(beast::http::verb::get, "/open").result(), beast::http::status::ok);
+    EXPECT_EQ(send(beast::http::verb::get, "/private").result(), beast::http::status::unauthorized);
+    EXPECT_EQ(send(beast::http::verb::get, "/private?session_token=12x").result(), beast::http::status::unauthorized);
+
+    auto res = send(beast::http::verb::get, "/private?name=bob&session_token=1234");
+    EXPECT_EQ(res.result(), beast::http::status::ok);
+    EXPECT_EQ(res.body(), "1234 bob");
+}
+
+TEST_F(HttpServerTest, AsyncStageRunsOnlyWhenAccepted) {
+    std::atomic<int> runs{ 0 };
+    svr.get("/stage", Access::Public, [](const Request&, Response& res, const std::smatch&, const RequestContext& ctx) {
+        res.result(beast::http::status::ok);
+        res.body() = std::to_string(ctx.session_token);
+        res.prepare_payload();
+    });
+    svr.use_async(
+        [](const Request&, const RequestContext& ctx) { return ctx.param("slow") == "1"; },
+        [&runs](const Request&, Response& res, RequestContext& ctx) -> net::awaitable<bool> {
+            ++runs;
+            net::steady_timer timer(co_await net::this_coro::executor, std::chrono::milliseconds(10));
+            co_await timer.async_wait(net::use_awaitable);
+            if (ctx.param("deny") == "1") {
+                res.result(beast::http::status::forbidden);
+                res.prepare_payload();
+                co_return false;
+            }
+            ctx.session_token = 7;
+            co_return true;
+        });
+    start();
+
+    auto res = send(beast::http::verb::get, "/stage");
+    EXPECT_EQ(res.result(), beast::http::status::ok);
+    EXPECT_EQ(res.body(), "0");
+    EXPECT_EQ(runs.load(), 0);
+
+    res = send(beast::http::verb::get, "/stage?slow=1");
+    EXPECT_EQ(res.result(), beast::http::status::ok);
+    EXPECT_EQ(res.body(), "7");
+
+    EXPECT_EQ(send(beast::http::verb::get, "/stage?slow=1&deny=1").result(), beast::http::status::forbidden);
+    EXPECT_EQ(runs.load(), 2);
+}
+
+TEST_F(HttpServerTest, SharedPiecesAreGathered) {
+    auto piece = std::make_shared<const std::string>(R"({"cached":true})");
+    svr.get("/shared", [piece](const Request&, Response& res, const std::smatch&) {
+        res.result(beast::http::status::ok);
+        res.body() = R"({"data":)";
+        res.body().append_shared(piece);
+        res.body().append_after(",\"more\":");
+        res.body().append_shared(piece);
+        res.body().append_after("}");
+        res.prepare_payload();
+    });
+    svr.get("/replaced", [piece](const Request&, Response& res, const std::smatch&) {
+        res.result(beast::http::status::ok);
+        res.body().append_shared(piece);
+        res.body() = "plain";
+        res.prepare_payload();
+    });
+    start();
+
+    auto res = send(beast::http::verb::get, "/shared");
+    EXPECT_EQ(res.body(), R"({"data":{"cached":true},"more":{"cached":true}})");
+    EXPECT_EQ(res[beast::http::field::content_length], std::to_string(res.body().size()));
+    EXPECT_EQ(send(beast::http::verb::get, "/replaced").body(), "plain");
+}
+
+TEST_F(HttpServerTest, WebSocketChannelPush) {
+    WebSocketChannel channel;
+    std::atomic<bool> opened{ false };
+    WebSocketHandler handler;
+    handler.on_open = [&](const WebSocketPtr& conn, const Request&, const std::smatch&) {
+        channel.join(conn);
+        opened = true;
+    };
+    svr.websocket("/push", handler);
+    start();
+
+    net::io_context client_ioc;
+    beast::websocket::stream<tcp::socket> ws(client_ioc);
+    ws.next_layer().connect(tcp::endpoint(net::ip::address_v4::loopback(), svr.port()));
+    ws.handshake("localhost", "/push?session_token=1");
+
+    while (!opened) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(channel.broadcast("hello"), 1u);
+
+    beast::flat_buffer buffer;
+    ws.read(buffer);
+    EXPECT_EQ(beast::buffers_to_string(buffer.data()), "hello");
+}
+
+TEST_F(HttpServerTest, WebSocketQueueLimitDropsSlowConsumer) {
+    std::atomic<int> accepted{ 0 };
+    std::atomic<bool> opened{ false };
+    WebSocketHandler handler;
+    handler.max_queued_messages = 2;
+    handler.on_open = [&](const WebSocketPtr& conn, const Request&, const std::smatch&) {
+        // Nothing is written until on_open returns, so the third send overflows
+        for (int i = 0; i < 3; ++i) {
+            if (conn->send(std::string("msg"))) {
+                ++accepted;
+            }
+        }
+        opened = true;
+    };
+    svr.websocket("/push", handler);
+    start();
+
+    net::io_context client_ioc;
+    beast::websocket::stream<tcp::socket> ws(client_ioc);
+    ws.next_layer().connect(tcp::endpoint(net::ip::address_v4::loopback(), svr.port()));
+    ws.handshake("localhost", "/push");
+
+    while (!opened) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(accepted, 2);
+}
+
+TEST_F(HttpServerTest, WebSocketUpgradeGoesThroughStages) {
+    asciimmo::auth::TokenCache cache;
+    cache.add_token(1234);
+    std::atomic<int> opened{ 0 };
+    WebSocketHandler handler;
+    handler.on_open = [&](const WebSocketPtr&, const Request&, const std::smatch&) {
+        ++opened;
+    };
+    svr.websocket("/push", Access::Protected, handler);
+    asciimmo::auth::use_session_auth(svr, cache);
+    start();
+
+    net::io_context client_ioc;
+    beast::websocket::stream<tcp::socket> refused(client_ioc);
+    refused.next_layer().connect(tcp::endpoint(net::ip::address_v4::loopback(), svr.port()));
+    beast::error_code ec;
+    refused.handshake("localhost", "/push", ec);
+    EXPECT_EQ(ec, beast::websocket::error::upgrade_declined);
+
+    beast::websocket::stream<tcp::socket> ws(client_ioc);
+    ws.next_layer().connect(tcp::endpoint(net::ip::address_v4::loopback(), svr.port()));
+    ws.handshake("localhost", "/push?session_token=1234");
+    while (opened == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(opened.load(), 1);
+}
+
+// Server with tight limits, so overload handling can be provoked
+class HttpServerLimitsTest : public ::testing::Test {
+protected:
+    net::io_context ioc;
+    std::unique_ptr<Server> svr;
+    std::thread io_thread;
+    net::io_context client_ioc;
+
+    void start(ServerOptions options) {
+        svr = std::make_unique<Server>(ioc, 0, std::move(options));
+        svr->get("/work", [](const Request&, Response& res, const std::smatch&) {
+            res.result(beast::http::status::ok);
+            res.prepare_payload();
+        });
+        svr->get("/health", [](const Request&, Response& res, const std::smatch&) {
+            res.result(beast::http::status::ok);
+            res.prepare_payload();
+        });
+        svr->get("/stall", [](const Request&, Response& res, const std::smatch&) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(400));
+            res.result(beast::http::status::ok);
+            res.prepare_payload();
+        });
+        svr->run();
+        io_thread = std::thread([this]() { ioc.run(); });
+    }
+
+    void TearDown() override {
+        ioc.stop();
+        if (io_thread.joinable()) {
+            io_thread.join();
+        }
+    }
+
+    tcp::socket connect() {
+        tcp::socket socket(client_ioc);
+        socket.connect(tcp::endpoint(net::ip::address_v4::loopback(), svr->port()));
+        return socket;
+    }
+
+    Response send(tcp::socket& socket, const std::string& target) {
+        Request req{ beast::http::verb::get, target, 11 };
+        req.set(beast::http::field::host, "localhost");
+        req.prepare_payload();
+        beast::http::write(socket, req);
+
+        beast::flat_buffer buffer;
+        Response res;
+        beast::http::read(socket, buffer, res);
+        return res;
+    }
+};
+
+TEST_F(HttpServerLimitsTest, IdleConnectionHitsHeaderTimeout) {
+    ServerOptions options;
+    options.header_timeout = std::chrono::milliseconds(100);
+    start(options);
+
+    auto socket = connect();
+    auto started = std::chrono::steady_clock::now();
+    char byte;
+    beast::error_code ec;
+    socket.read_some(net::buffer(&byte, 1), ec);
+    EXPECT_EQ(ec, net::error::eof);
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::seconds(5));
+}
+
+TEST_F(HttpServerLimitsTest, ConnectionLimitKeepsPriorityPaths) {
+    ServerOptions options;
+    options.max_connections = 1;
+    options.priority_connections = 1;
+    start(options);
+
+    auto admitted = connect();
+    EXPECT_EQ(send(admitted, "/work").result(), beast::http::status::ok);
+
+    // Over the soft limit: priority paths only
+    auto priority = connect();
+    EXPECT_EQ(send(priority, "/health").result(), beast::http::status::ok);
+    auto shed = send(priority, "/work");
+    EXPECT_EQ(shed.result(), beast::http::status::service_unavailable);
+    EXPECT_EQ(shed[beast::http::field::retry_after], "1");
+    EXPECT_FALSE(shed.keep_alive());
+
+    // Over the hard limit: refused before the request is read
+    auto extra_admitted = connect();
+    auto refused = connect();
+    beast::flat_buffer buffer;
+    beast::http::response<beast::http::empty_body> res;
+    beast::http::read(refused, buffer, res);
+    EXPECT_EQ(res.result(), beast::http::status::service_unavailable);
+}
+
+TEST_F(HttpServerLimitsTest, QueueDelaySheds) {
+    ServerOptions options;
+    options.max_queue_delay = std::chrono::milliseconds(50);
+    start(options);
+
+    // Blocking the io thread makes the queue delay probe fire late
+    auto socket = connect();
+    EXPECT_EQ(send(socket, "/stall").result(), beast::http::status::ok);
+
+    auto fresh = connect();
+    auto res = send(fresh, "/work");
+    EXPECT_EQ(res.result(), beast::http::status::service_unavailable);
+    EXPECT_EQ(res[beast::http::field::retry_after], "1");
+    auto health = connect();
+    EXPECT_EQ(send(health, "/health").result(), beast::http::status::ok);
+
+    // Shedding stops once the loop catches up
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    auto later = connect();
+    EXPECT_EQ(send(later, "/work").result(), beast::http::status::ok);
+}
@@ -0,0 +1,111 @@
+#include "shared/ktls_stream.hpp"
+#include "tls_test_fixture.hpp"
+#include <gtest/gtest.h>
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http.hpp>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <thread>
+
+using namespace asciimmo::http;
+namespace ssl = boost::asio::ssl;
+
+class KtlsStreamTest : public ::testing::Test {
+protected:
+    net::io_context ioc;
+    ssl::context server_ctx{ ssl::context::tls_server };
+    ssl::context client_ctx{ ssl::context::tls_client };
+    tcp::acceptor acceptor{ ioc, tcp::endpoint(net::ip::address_v4::loopback(), 0) };
+
+    void SetUp() override {
+        asciimmo::test::use_test_certificate(server_ctx);
+        if (ktls_available()) {
+            SSL_CTX_set_options(server_ctx.native_handle(), SSL_OP_ENABLE_KTLS);
+        }
+        client_ctx.set_verify_mode(ssl::verify_none);
+    }
+
+    // Accepts one connection and runs the handshake on it
+    KtlsStream accept_and_handshake() {
+        KtlsStream stream(acceptor.accept(), server_ctx);
+        beast::error_code result = net::error::would_block;
+        stream.async_handshake([&](beast::error_code ec) { result = ec; });
+        ioc.run();
+        ioc.restart();
+        EXPECT_FALSE(result) << result.message();
+        return stream;
+    }
+};
+
+TEST_F(KtlsStreamTest, ServesKeepAliveRequests) {
+    const std::string big_body(100000, 'x');
+
+    std::thread client([&]() {
+        net::io_context client_ioc;
+        ssl::stream<tcp::socket> stream(client_ioc, client_ctx);
+        stream.next_layer().connect(acceptor.local_endpoint());
+        stream.handshake(ssl::stream_base::client);
+
+        beast::flat_buffer buffer;
+        for (const char* target : { "/small", "/big" }) {
+            beast::http::request<beast::http::empty_body> req{ beast::http::verb::get, target, 11 };
+            req.set(beast::http::field::host, "localhost");
+            beast::http::write(stream, req);
+            beast::http::response<beast::http::string_body> res;
+            beast::http::read(stream, buffer, res);
+            EXPECT_EQ(res.body(), std::string(target) == "/big" ? big_body : "hello");
+        }
+    });
+
+    KtlsStream stream = accept_and_handshake();
+    if (!ktls_available()) {
+        EXPECT_FALSE(stream.ktls_send());
+    }
+
+    beast::flat_buffer buffer;
+    for (int i = 0; i < 2; ++i) {
+        beast::http::request<beast::http::string_body> req;
+        beast::error_code read_ec = net::error::would_block;
+        beast::http::async_read(stream, buffer, req, [&](beast::error_code ec, std::size_t) { read_ec = ec; });
+        ioc.run();
+        ioc.restart();
+        ASSERT_FALSE(read_ec) << read_ec.message();
+
+        beast::http::response<beast::http::string_body> res{ beast::http::status::ok, 11 };
+        res.body() = req.target() == "/big" ? big_body : "hello";
+        res.prepare_payload();
+        beast::error_code write_ec = net::error::would_block;
+        beast::http::async_write(stream, res, [&](beast::error_code ec, std::size_t) { write_ec = ec; });
+        ioc.run();
+        ioc.restart();
+        ASSERT_FALSE(write_ec) << write_ec.message();
+    }
+
+    client.join();
+}
+
+TEST_F(KtlsStreamTest, IdleReadTimesOut) {
+    std::thread client([&]() {
+        net::io_context client_ioc;
+        ssl::stream<tcp::socket> stream(client_ioc, client_ctx);
+        stream.next_layer().connect(acceptor.local_endpoint());
+        stream.handshake(ssl::stream_base::client);
+        // Stay idle until the server gives up on us
+        char byte;
+        beast::error_code ec;
+        stream.read_some(net::buffer(&byte, 1), ec);
+    });
+
+    KtlsStream stream = accept_and_handshake();
+    stream.expires_after(std::chrono::milliseconds(50));
+    char byte;
+    beast::error_code read_ec;
+    stream.async_read_some(net::buffer(&byte, 1), [&](beast::error_code ec, std::size_t) { read_ec = ec; });
+    ioc.run();
+    EXPECT_EQ(read_ec, beast::error::timeout);
+
+    stream.close();
+    client.join();
+}
@@ -0,0 +1,57 @@
+#include "shared/metrics.hpp"
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace asciimmo::metrics;
+
+TEST(MetricsTest, HistogramBucketsCoverValue) {
+    for (uint64_t v : { 0ull, 1ull, 7ull, 15ull, 16ull, 100ull, 1023ull, 123456ull, 5000000ull }) {
+        int index = LatencyHistogram::bucket_index(v);
+        EXPECT_LT(v, LatencyHistogram::bucket_upper_bound(index)) << "value " << v;
+        if (index > 0) {
+            EXPECT_GE(v, LatencyHistogram::bucket_upper_bound(index - 1)) << "value " << v;
+        }
+    }
+    EXPECT_EQ(LatencyHistogram::bucket_index(UINT64_MAX), LatencyHistogram::kBuckets - 1);
+}
+
+TEST(MetricsTest, HistogramQuantiles) {
+    LatencyHistogram histogram;
+    for (uint64_t v = 1; v <= 1000; ++v) {
+        histogram.record(v);
+    }
+    LatencyHistogram::Snapshot snapshot{};
+    histogram.add_to(snapshot);
+
+    // Bucket edges are within ~12% of the true value
+    EXPECT_NEAR(static_cast<double>(LatencyHistogram::quantile(snapshot, 0.5)), 500.0, 500.0 * 0.13);
+    EXPECT_NEAR(static_cast<double>(LatencyHistogram::quantile(snapshot, 0.99)), 990.0, 990.0 * 0.13);
+}
+
+TEST(MetricsTest, RenderMergesShards) {
+    Registry registry(4);
+    auto route = registry.add_route("GET", R"(/friends/(\w+))");
+    registry.add_gauge("asciimmo_test_gauge", "Test gauge", []() { return 42.0; });
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&registry, route]() {
+            for (int i = 0; i < 100; ++i) {
+                registry.record(route, 200, 10, 20, std::chrono::microseconds(150));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::string text = registry.render();
+    const std::string labels = R"x(method="GET",route="/friends/(\\w+)")x";
+    EXPECT_NE(text.find("asciimmo_http_requests_total{" + labels + R"(,status="2xx"} 800)"), std::string::npos) << text;
+    EXPECT_NE(text.find("asciimmo_http_request_bytes_total{" + labels + "} 8000"), std::string::npos);
+    EXPECT_NE(text.find("asciimmo_http_response_bytes_total{" + labels + "} 16000"), std::string::npos);
+    EXPECT_NE(text.find("asciimmo_http_request_duration_seconds_count{" + labels + "} 800"), std::string::npos);
+    EXPECT_NE(text.find("asciimmo_test_gauge 42"), std::string::npos);
+}
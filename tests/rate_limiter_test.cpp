@@ -0,0 +1,193 @@
+#include "shared/rate_limiter.hpp"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace asciimmo::http;
+using namespace std::chrono_literals;
+
+TEST(RateLimiterTest, BurstThenRefill) {
+    RateLimiter limiter;
+    RateLimit limit{ 10, 3 };
+    auto t0 = RateLimiter::Clock::now();
+
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_TRUE(limiter.try_acquire(42, limit, t0).allowed);
+    }
+    auto denied = limiter.try_acquire(42, limit, t0);
+    EXPECT_FALSE(denied.allowed);
+    EXPECT_EQ(denied.retry_after, 100ms);
+
+    // 10 tokens/s refills one token every 100ms
+    EXPECT_TRUE(limiter.try_acquire(42, limit, t0 + 100ms).allowed);
+    EXPECT_FALSE(limiter.try_acquire(42, limit, t0 + 150ms).allowed);
+    EXPECT_EQ(limiter.rejected(), 2u);
+}
+
+TEST(RateLimiterTest, KeysAreIndependent) {
+    RateLimiter limiter;
+    RateLimit limit{ 1, 1 };
+    auto now = RateLimiter::Clock::now();
+
+    EXPECT_TRUE(limiter.try_acquire(1, limit, now).allowed);
+    EXPECT_FALSE(limiter.try_acquire(1, limit, now).allowed);
+    EXPECT_TRUE(limiter.try_acquire(2, limit, now).allowed);
+}
+
+TEST(RateLimiterTest, ZeroRateIsUnlimited) {
+    RateLimiter limiter;
+    auto now = RateLimiter::Clock::now();
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_TRUE(limiter.try_acquire(7, RateLimit{}, now).allowed);
+    }
+    EXPECT_EQ(limiter.size(), 0u);
+}
+
+TEST(RateLimiterTest, IdleSlotsAreTakenOver) {
+    // One shard of 16 slots, so every key probes the same slots
+    RateLimiter limiter(16, 1, 1s);
+    RateLimit limit{ 1, 1 };
+    auto t0 = RateLimiter::Clock::now();
+
+    for (uint64_t key = 1; key <= 16; ++key) {
+        EXPECT_TRUE(limiter.try_acquire(key, limit, t0).allowed);
+    }
+    // Full: an unknown key is let through without a bucket
+    EXPECT_TRUE(limiter.try_acquire(100, limit, t0).allowed);
+    EXPECT_TRUE(limiter.try_acquire(100, limit, t0).allowed);
+    EXPECT_EQ(limiter.overflowed(), 2u);
+
+    // After the idle expiry the new key reuses a slot and is limited again
+    EXPECT_TRUE(limiter.try_acquire(100, limit, t0 + 2s).allowed);
+    EXPECT_FALSE(limiter.try_acquire(100, limit, t0 + 2s).allowed);
+    EXPECT_EQ(limiter.size(), 16u);
+}
+
+TEST(RateLimiterTest, ConcurrentAcquireNeverExceedsBurst) {
+    RateLimiter limiter;
+    RateLimit limit{ 0.001, 1000 }; // effectively no refill during the test
+    auto now = RateLimiter::Clock::now();
+    std::atomic<int> allowed{ 0 };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&]() {
+            for (int i = 0; i < 500; ++i) {
+                if (limiter.try_acquire(99, limit, now).allowed) {
+                    ++allowed;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(allowed, 1000);
+}
+
+TEST(RateLimiterTest, QueryParam) {
+    EXPECT_EQ(query_param("a=1&session_token=abc&b=2", "session_token"), "abc");
+    EXPECT_EQ(query_param("session_token=abc", "session_token"), "abc");
+    EXPECT_EQ(query_param("token=abc", "session_token"), "");
+    EXPECT_EQ(query_param("", "session_token"), "");
+}
+
+TEST(RateLimiterTest, MiddlewareReturns429) {
+    net::io_context ioc;
+    Server svr(ioc, 0);
+    svr.get("/limited", [](const Request&, Response& res, const std::smatch&) {
+        res.result(beast::http::status::ok);
+        res.prepare_payload();
+    });
+    svr.get("/free", [](const Request&, Response& res, const std::smatch&) {
+        res.result(beast::http::status::ok);
+        res.prepare_payload();
+    });
+    use_rate_limits(svr, { { "GET", "/limited", {}, RateLimit{ 0.5, 2 } } });
+    svr.run();
+    std::thread io_thread([&]() { ioc.run(); });
+
+    auto send = [&](const std::string& target) {
+        net::io_context client_ioc;
+        tcp::socket socket(client_ioc);
+        socket.connect(tcp::endpoint(net::ip::address_v4::loopback(), svr.port()));
+        Request req{ beast::http::verb::get, target, 11 };
+        req.set(beast::http::field::host, "localhost");
+        beast::http::write(socket, req);
+        beast::flat_buffer buffer;
+        Response res;
+        beast::http::read(socket, buffer, res);
+        return res;
+    };
+
+    // Tokens are per session token, so another token still gets through
+    EXPECT_EQ(send("/limited?session_token=1").result(), beast::http::status::ok);
+    EXPECT_EQ(send("/limited?session_token=1").result(), beast::http::status::ok);
+    auto res = send("/limited?session_token=1");
+    EXPECT_EQ(res.result(), beast::http::status::too_many_requests);
+    EXPECT_EQ(res[beast::http::field::retry_after], "2");
+    EXPECT_EQ(send("/limited?session_token=2").result(), beast::http::status::ok);
+    EXPECT_EQ(send("/free?session_token=1").result(), beast::http::status::ok);
+
+    ioc.stop();
+    io_thread.join();
+}
+
+TEST(RateLimiterTest, ClientAddressBehindTunnel) {
+    RequestContext ctx;
+    ctx.client_ip = net::ip::make_address("127.0.0.1");
+    Request req{ beast::http::verb::get, "/", 11 };
+    EXPECT_EQ(client_address(req, ctx), ctx.client_ip);
+
+    req.set("X-Forwarded-For", "10.0.0.1, 198.51.100.4");
+    EXPECT_EQ(client_address(req, ctx), net::ip::make_address("198.51.100.4"));
+    req.set("Cf-Connecting-Ip", "2001:db8::7");
+    EXPECT_EQ(client_address(req, ctx), net::ip::make_address("2001:db8::7"));
+    req.set("Cf-Connecting-Ip", "not an address");
+    EXPECT_EQ(client_address(req, ctx), ctx.client_ip);
+
+    // Only the tunnel's word is taken
+    ctx.client_ip = net::ip::make_address("203.0.113.9");
+    req.set("Cf-Connecting-Ip", "198.51.100.4");
+    EXPECT_EQ(client_address(req, ctx), ctx.client_ip);
+}
+
+TEST(RateLimiterTest, TunneledClientsHaveTheirOwnBuckets) {
+    net::io_context ioc;
+    Server svr(ioc, 0);
+    svr.post("/auth/login", [](const Request&, Response& res, const std::smatch&) {
+        res.result(beast::http::status::ok);
+        res.prepare_payload();
+    });
+    use_rate_limits(svr, { { "POST", "/auth/login", RateLimit{ 0.1, 2 }, {} } });
+    svr.run();
+    std::thread io_thread([&]() { ioc.run(); });
+
+    // Every request comes from loopback, as it does through cloudflared
+    auto send = [&](const std::string& client) {
+        net::io_context client_ioc;
+        tcp::socket socket(client_ioc);
+        socket.connect(tcp::endpoint(net::ip::address_v4::loopback(), svr.port()));
+        Request req{ beast::http::verb::post, "/auth/login", 11 };
+        req.set(beast::http::field::host, "localhost");
+        req.set("Cf-Connecting-Ip", client);
+        req.prepare_payload();
+        beast::http::write(socket, req);
+        beast::flat_buffer buffer;
+        Response res;
+        beast::http::read(socket, buffer, res);
+        return res.result();
+    };
+
+    EXPECT_EQ(send("198.51.100.1"), beast::http::status::ok);
+    EXPECT_EQ(send("198.51.100.1"), beast::http::status::ok);
+    EXPECT_EQ(send("198.51.100.1"), beast::http::status::too_many_requests);
+    EXPECT_EQ(send("198.51.100.2"), beast::http::status::ok);
+    EXPECT_EQ(send("198.51.100.3"), beast::http::status::ok);
+
+    ioc.stop();
+    io_thread.join();
+}
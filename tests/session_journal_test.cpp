@@ -0,0 +1,199 @@
+#include "shared/session_journal.hpp"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace asciimmo::session;
+using Clock = std::chrono::system_clock;
+
+namespace {
+
+class SessionJournalTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        dir = std::filesystem::temp_directory_path() / ("session_journal_test_" + std::to_string(::getpid()));
+        std::filesystem::remove_all(dir);
+        options.directory = dir.string();
+    }
+
+    void TearDown() override {
+        std::filesystem::remove_all(dir);
+    }
+
+    // A copy of each session replay hands over; its views die with the call
+    struct Restored {
+        uint64_t user_id;
+        Clock::time_point expires_at;
+        std::string data;
+    };
+
+    std::map<std::string, Restored> replay(SessionJournal& journal) {
+        std::map<std::string, Restored> sessions;
+        journal.replay([&sessions](const JournaledSession& session) {
+            sessions[std::string(session.token)] = Restored{ session.user_id, session.expires_at, std::string(session.data) };
+        });
+        return sessions;
+    }
+
+    std::filesystem::path dir;
+    JournalOptions options;
+};
+
+SessionWrite upsert(uint64_t id, const std::string& data, std::chrono::seconds ttl = std::chrono::minutes(15)) {
+    SessionWrite write{ SessionWrite::Kind::upsert, {}, std::to_string(id) };
+    write.record.token_id = id;
+    write.record.user_id = id * 10;
+    write.record.data = data;
+    write.record.expires_at = Clock::now() + ttl;
+    return write;
+}
+
+SessionWrite remove(uint64_t id) {
+    SessionWrite write{ SessionWrite::Kind::remove, {}, {} };
+    write.record.token_id = id;
+    return write;
+}
+
+} // namespace
+
+TEST_F(SessionJournalTest, RestoresWhatWasWritten) {
+    const auto later = Clock::now() + std::chrono::hours(2);
+    {
+        SessionJournal journal(options);
+        EXPECT_EQ(journal.replay([](const JournaledSession&) {}), 0u);
+        std::vector<SessionWrite> writes{ upsert(1, "one"), upsert(2, "two"), upsert(3, "three"),
+                                          upsert(4, "gone", std::chrono::seconds(-5)) };
+        journal.write(writes);
+        std::vector<SessionWrite> more{ remove(2), upsert(3, "three again") };
+        journal.write(more);
+        std::vector<uint64_t> touched{ 1, 2 };
+        journal.touch(touched, Clock::now(), later);
+    }
+
+    SessionJournal journal(options);
+    auto sessions = replay(journal);
+    ASSERT_EQ(sessions.size(), 2u);
+    EXPECT_EQ(sessions["1"].data, "one");
+    EXPECT_EQ(sessions["1"].user_id, 10u);
+    EXPECT_EQ(std::chrono::duration_cast<std::chrono::seconds>(sessions["1"].expires_at - later).count(), 0);
+    EXPECT_EQ(sessions["3"].data, "three again");
+    EXPECT_EQ(sessions.count("2"), 0u);
+
+    // Only once
+    EXPECT_EQ(journal.replay([](const JournaledSession&) {}), 0u);
+}
+
+TEST_F(SessionJournalTest, CutsOffTornRecord) {
+    {
+        SessionJournal journal(options);
+        std::vector<SessionWrite> writes{ upsert(1, "one"), upsert(2, "two") };
+        journal.write(writes);
+    }
+    {
+        // A crash partway through the next batch
+        std::ofstream out(dir / "sessions.journal", std::ios::binary | std::ios::app);
+        out << std::string("\x30\x00\x00\x00\x12\x34", 6);
+    }
+    {
+        SessionJournal journal(options);
+        EXPECT_EQ(replay(journal).size(), 2u);
+        std::vector<SessionWrite> writes{ upsert(5, "five") };
+        journal.write(writes);
+    }
+
+    SessionJournal journal(options);
+    auto sessions = replay(journal);
+    EXPECT_EQ(sessions.size(), 3u);
+    EXPECT_EQ(sessions["5"].data, "five");
+}
+
+TEST_F(SessionJournalTest, CompactsIntoSnapshot) {
+    {
+        SessionJournal journal(options);
+        std::vector<SessionWrite> writes;
+        for (uint64_t id = 1; id <= 100; ++id) {
+            writes.push_back(upsert(id, "data " + std::to_string(id), std::chrono::seconds(id <= 10 ? -5 : 900)));
+        }
+        journal.write(writes);
+        std::vector<SessionWrite> removes{ remove(50), remove(51) };
+        journal.write(removes);
+
+        // Too small to compact on cleanup
+        EXPECT_EQ(journal.cleanup(1000), 0u);
+        EXPECT_EQ(journal.stats().compactions, 0u);
+
+        EXPECT_EQ(journal.compact(), 10u);
+        EXPECT_EQ(journal.stats().compactions, 1u);
+        EXPECT_EQ(journal.stats().journal_bytes, 8u);
+        EXPECT_GT(journal.stats().snapshot_bytes, 0u);
+
+        std::vector<SessionWrite> after{ upsert(200, "after"), remove(60) };
+        journal.write(after);
+    }
+
+    SessionJournal journal(options);
+    auto sessions = replay(journal);
+    EXPECT_EQ(sessions.size(), 88u);
+    EXPECT_EQ(sessions["200"].data, "after");
+    EXPECT_EQ(sessions["99"].data, "data 99");
+    EXPECT_EQ(sessions.count("5"), 0u);
+    EXPECT_EQ(sessions.count("60"), 0u);
+}
+
+TEST_F(SessionJournalTest, BacksSessionStore) {
+    options.fsync = FsyncPolicy::always;
+    {
+        SessionJournal journal(options);
+        SessionStore store(StoreOptions{}, &journal);
+        store.put("7", SessionRecord{ 7, 70, "seven", Clock::now() + std::chrono::minutes(5) });
+        store.put("8", SessionRecord{ 8, 80, "eight", Clock::now() + std::chrono::minutes(5) });
+        store.erase("8");
+        EXPECT_EQ(store.flush(), 3u);
+        EXPECT_GE(journal.stats().syncs, 1u);
+    }
+
+    SessionJournal journal(options);
+    SessionStore store(StoreOptions{}, &journal);
+    const auto restored = journal.replay([&store](const JournaledSession& session) {
+        store.restore(session.token, session.token_id, session.data, session.expires_at);
+    });
+    EXPECT_EQ(restored, 1u);
+    ASSERT_TRUE(store.find("7"));
+    EXPECT_EQ(*store.find("7"), "\"seven\"");
+    EXPECT_FALSE(store.find("8"));
+    // Restoring doesn't write the sessions back
+    EXPECT_EQ(store.pending(), 0u);
+}
+
+TEST_F(SessionJournalTest, IdleJournalIsSynced) {
+    options.fsync = FsyncPolicy::interval;
+    options.fsync_interval = std::chrono::milliseconds(50);
+    SessionJournal journal(options);
+    SessionStore store(StoreOptions{}, &journal);
+
+    // Too soon after opening to sync with the write
+    store.put("7", SessionRecord{ 7, 70, "seven", Clock::now() + std::chrono::minutes(5) });
+    store.flush();
+    EXPECT_EQ(journal.stats().syncs, 0u);
+
+    // Nothing else is written, but a later flush syncs it
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    EXPECT_EQ(store.flush(), 0u);
+    EXPECT_EQ(journal.stats().syncs, 1u);
+    store.flush();
+    EXPECT_EQ(journal.stats().syncs, 1u);
+}
+
+TEST_F(SessionJournalTest, RejectsOtherFiles) {
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir / "sessions.snapshot") << "not a snapshot at all";
+    EXPECT_THROW(SessionJournal journal(options), std::runtime_error);
+    EXPECT_EQ(parse_fsync_policy("never"), FsyncPolicy::never);
+    EXPECT_THROW(parse_fsync_policy("sometimes"), std::invalid_argument);
+}
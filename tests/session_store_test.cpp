@@ -0,0 +1,368 @@
+#include "shared/session_store.hpp"
+#include <gtest/gtest.h>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/use_future.hpp>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace asciimmo::session;
+namespace net = boost::asio;
+
+namespace {
+
+// The sessions table, in memory
+class FakeBackend : public SessionBackend {
+public:
+    void write(std::span<const SessionWrite> writes) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (fail) {
+            throw std::runtime_error("database unavailable");
+        }
+        ++write_calls;
+        for (const auto& write : writes) {
+            if (write.kind == SessionWrite::Kind::remove) {
+                rows.erase(write.record.token_id);
+            }
+            else {
+                rows[write.record.token_id] = write.record;
+            }
+        }
+    }
+
+    void touch(std::span<const uint64_t> tokens, std::chrono::system_clock::time_point,
+               std::chrono::system_clock::time_point expires_at) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        ++touch_calls;
+        for (uint64_t token : tokens) {
+            touched.push_back(token);
+            rows[token].expires_at = expires_at;
+        }
+    }
+
+    bool load(uint64_t token, SessionRecord& record) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        ++load_calls;
+        if (fail) {
+            throw std::runtime_error("database unavailable");
+        }
+        auto it = rows.find(token);
+        if (it == rows.end()) {
+            return false;
+        }
+        record = it->second;
+        return true;
+    }
+
+    std::size_t cleanup(std::size_t limit) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        ++cleanup_calls;
+        std::size_t deleted = 0;
+        const auto now = std::chrono::system_clock::now();
+        for (auto it = rows.begin(); it != rows.end() && deleted < limit; ) {
+            if (it->second.expires_at < now) {
+                it = rows.erase(it);
+                ++deleted;
+            }
+            else {
+                ++it;
+            }
+        }
+        return deleted;
+    }
+
+    std::mutex mtx;
+    std::map<uint64_t, SessionRecord> rows;
+    std::vector<uint64_t> touched;
+    int write_calls = 0;
+    int touch_calls = 0;
+    int load_calls = 0;
+    int cleanup_calls = 0;
+    bool fail = false;
+};
+
+SessionRecord record(uint64_t token, const std::string& data,
+                     std::chrono::seconds ttl = std::chrono::minutes(15)) {
+    SessionRecord r;
+    r.token_id = token;
+    r.data = data;
+    r.expires_at = std::chrono::system_clock::now() + ttl;
+    return r;
+}
+
+SessionJson load(SessionStore& store, const std::string& token) {
+    net::io_context ioc;
+    auto result = net::co_spawn(ioc, store.load(token), net::use_future);
+    ioc.run();
+    return result.get();
+}
+
+} // namespace
+
+TEST(SessionStoreTest, FindsByStringView) {
+    SessionStore store(StoreOptions{});
+    store.put("12345", record(12345, "hello"));
+    store.put("s1.7.0.0.0.mac", record(0, "signed"));
+
+    std::string_view token = "12345";
+    ASSERT_TRUE(store.find(token));
+    EXPECT_EQ(*store.find(token), "\"hello\"");
+    ASSERT_TRUE(store.find("s1.7.0.0.0.mac"));
+    EXPECT_EQ(*store.find("s1.7.0.0.0.mac"), "\"signed\"");
+    EXPECT_FALSE(store.find("54321"));
+    EXPECT_EQ(store.size(), 2u);
+
+    EXPECT_TRUE(store.erase(token));
+    EXPECT_FALSE(store.erase(token));
+    EXPECT_FALSE(store.find(token));
+    EXPECT_EQ(store.size(), 1u);
+}
+
+TEST(SessionStoreTest, SharesSerializedData) {
+    SessionStore store(StoreOptions{});
+    store.put("1", record(1, "{\"name\":\"a\\b\"}\n"));
+
+    auto first = store.find("1");
+    auto second = store.find("1");
+    ASSERT_TRUE(first);
+    EXPECT_EQ(first.get(), second.get());
+    EXPECT_EQ(*first, R"("{\"name\":\"a\\b\"}\n")");
+
+    // A reader keeps the data it was given after the session is replaced
+    store.put("1", record(1, "new"));
+    EXPECT_EQ(*first, R"("{\"name\":\"a\\b\"}\n")");
+    EXPECT_EQ(*store.find("1"), "\"new\"");
+    EXPECT_EQ(*to_session_json(std::string("\x01", 1)), R"("\u0001")");
+}
+
+TEST(SessionStoreTest, WritesBehindInBatches) {
+    FakeBackend backend;
+    StoreOptions options;
+    options.max_batch = 4;
+    SessionStore store(options, &backend);
+
+    for (uint64_t token = 1; token <= 10; ++token) {
+        store.put(std::to_string(token), record(token, "data"));
+    }
+    store.erase("3");
+    EXPECT_EQ(backend.write_calls, 0);
+    EXPECT_EQ(store.pending(), 11u);
+
+    EXPECT_EQ(store.flush(), 11u);
+    EXPECT_EQ(backend.write_calls, 3);
+    EXPECT_EQ(backend.rows.size(), 9u);
+    EXPECT_EQ(backend.rows.count(3), 0u);
+    EXPECT_EQ(store.pending(), 0u);
+
+    // A failed batch is kept, in order, for the next flush
+    backend.fail = true;
+    store.erase("4");
+    store.put("11", record(11, "late"));
+    EXPECT_EQ(store.flush(), 0u);
+    EXPECT_EQ(store.pending(), 2u);
+    EXPECT_EQ(store.stats().failures, 1u);
+    backend.fail = false;
+    EXPECT_EQ(store.flush(), 2u);
+    EXPECT_EQ(backend.rows.count(4), 0u);
+    EXPECT_EQ(backend.rows[11].data, "late");
+}
+
+TEST(SessionStoreTest, LoadsMissesFromBackend) {
+    FakeBackend backend;
+    backend.rows[42] = record(42, "stored");
+    SessionStore store(StoreOptions{}, &backend);
+
+    EXPECT_FALSE(store.find("42"));
+    auto json = load(store, "42");
+    ASSERT_TRUE(json);
+    EXPECT_EQ(*json, "\"stored\"");
+    EXPECT_EQ(backend.load_calls, 1);
+
+    // Kept in memory once loaded
+    EXPECT_TRUE(load(store, "42"));
+    EXPECT_EQ(backend.load_calls, 1);
+
+    // Tokens the resolver can't map never reach the backend
+    EXPECT_FALSE(load(store, "not-a-token"));
+    EXPECT_FALSE(load(store, "43"));
+    EXPECT_EQ(backend.load_calls, 2);
+    EXPECT_EQ(store.stats().loads, 2u);
+    EXPECT_EQ(store.stats().loaded, 1u);
+}
+
+TEST(SessionStoreTest, RemembersBackendMisses) {
+    FakeBackend backend;
+    StoreOptions options;
+    options.negative_ttl = std::chrono::milliseconds(200);
+    SessionStore store(options, &backend);
+
+    EXPECT_FALSE(load(store, "43"));
+    EXPECT_FALSE(load(store, "43"));
+    EXPECT_EQ(backend.load_calls, 1);
+    EXPECT_EQ(store.stats().negative_hits, 1u);
+
+    // A session created since is found at once
+    store.put("43", record(43, "new"));
+    EXPECT_TRUE(load(store, "43"));
+
+    // Asked again once the miss is stale
+    EXPECT_FALSE(load(store, "44"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    EXPECT_FALSE(load(store, "44"));
+    EXPECT_EQ(backend.load_calls, 3);
+
+    // A failed call isn't remembered
+    backend.fail = true;
+    EXPECT_FALSE(load(store, "45"));
+    EXPECT_FALSE(load(store, "45"));
+    EXPECT_EQ(store.stats().failures, 2u);
+}
+
+TEST(SessionStoreTest, BatchesActivityOncePerFlush) {
+    FakeBackend backend;
+    SessionStore store(StoreOptions{}, &backend);
+    store.put("1", record(1, "a"));
+    store.put("2", record(2, "b"));
+    store.flush();
+
+    for (int i = 0; i < 100; ++i) {
+        store.find("1");
+    }
+    store.find("2");
+    store.flush();
+    EXPECT_EQ(backend.touch_calls, 1);
+    ASSERT_EQ(backend.touched.size(), 2u);
+
+    // Marked again after the flush
+    store.find("1");
+    store.flush();
+    EXPECT_EQ(backend.touched.size(), 3u);
+    EXPECT_EQ(store.stats().touches, 3u);
+}
+
+TEST(SessionStoreTest, ReportsActivityWithoutBackend) {
+    SessionStore store(StoreOptions{});
+    std::vector<uint64_t> active;
+    store.on_activity([&active](std::span<const uint64_t> ids) {
+        active.insert(active.end(), ids.begin(), ids.end());
+    });
+    store.put("1", record(1, "a"));
+    store.put("2", record(2, "b"));
+    store.put("name", record(0, "c"));
+
+    store.find("1");
+    store.find("1");
+    store.find("name");
+    store.flush();
+    EXPECT_EQ(active, std::vector<uint64_t>{ 1 });
+
+    // Nothing used since
+    store.flush();
+    EXPECT_EQ(active.size(), 1u);
+}
+
+TEST(SessionStoreTest, ExpiredSessionsAreNotReturned) {
+    SessionStore store(StoreOptions{});
+    store.put("1", record(1, "a", std::chrono::seconds(-1)));
+    store.put("2", record(2, "b", std::chrono::seconds(-1)));
+    store.put("3", record(3, "c"));
+
+    EXPECT_FALSE(store.find("1"));
+    EXPECT_FALSE(store.erase("2"));
+    EXPECT_TRUE(store.find("3"));
+    EXPECT_EQ(store.size(), 1u);
+}
+
+TEST(SessionStoreTest, UseSlidesExpiry) {
+    StoreOptions options;
+    options.idle_ttl = std::chrono::hours(1);
+    SessionStore store(options);
+    store.put("1", record(1, "a", std::chrono::seconds(1)));
+    store.put("2", record(2, "b", std::chrono::seconds(1)));
+
+    ASSERT_TRUE(store.find("1"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    EXPECT_TRUE(store.find("1"));
+    EXPECT_FALSE(store.find("2"));
+}
+
+TEST(SessionStoreTest, ReaperRemovesPastMinutes) {
+    SessionStore store(StoreOptions{});
+    store.put("1", record(1, "a", std::chrono::seconds(-120)));
+    store.put("2", record(2, "b", std::chrono::seconds(-120)));
+    store.put("3", record(3, "c", std::chrono::minutes(5)));
+    // Replaced, so its first filing is stale
+    store.put("3", record(3, "c", std::chrono::seconds(-120)));
+    store.put("3", record(3, "c", std::chrono::minutes(5)));
+
+    EXPECT_EQ(store.reap_expired(), 2u);
+    EXPECT_EQ(store.size(), 1u);
+    EXPECT_TRUE(store.find("3"));
+    EXPECT_EQ(store.reap_expired(), 0u);
+    EXPECT_EQ(store.stats().expired, 2u);
+}
+
+TEST(SessionStoreTest, RemovedSessionCanBePutAgain) {
+    SessionStore store(StoreOptions{});
+    store.put("1", record(1, "a"));
+    ASSERT_TRUE(store.erase("1"));
+    EXPECT_FALSE(store.find("1"));
+    EXPECT_EQ(store.size(), 0u);
+
+    store.put("1", record(1, "b"));
+    ASSERT_TRUE(store.find("1"));
+    EXPECT_EQ(*store.find("1"), "\"b\"");
+    EXPECT_EQ(store.size(), 1u);
+    EXPECT_EQ(store.reap_expired(), 0u);
+}
+
+TEST(SessionStoreTest, RestoresInBulk) {
+    FakeBackend backend;
+    StoreOptions options;
+    options.shards = 4;
+    SessionStore store(options, &backend);
+    const auto now = std::chrono::system_clock::now();
+    {
+        SessionStore::Restorer restorer(store);
+        for (uint64_t token = 1; token <= 10000; ++token) {
+            restorer.add(std::to_string(token), token, "data", now + std::chrono::minutes(5));
+        }
+        restorer.add("old", 0, "gone", now - std::chrono::minutes(2));
+        restorer.commit();
+    }
+
+    EXPECT_EQ(store.size(), 10001u);
+    ASSERT_TRUE(store.find("5000"));
+    EXPECT_EQ(*store.find("5000"), "\"data\"");
+    EXPECT_EQ(store.reap_expired(), 1u);
+    EXPECT_EQ(store.size(), 10000u);
+    // Nothing restored is written back
+    EXPECT_EQ(store.pending(), 0u);
+}
+
+TEST(SessionStoreTest, CleansUpBackendInBatches) {
+    FakeBackend backend;
+    for (uint64_t token = 1; token <= 25; ++token) {
+        backend.rows[token] = record(token, "old", std::chrono::seconds(-60));
+    }
+    backend.rows[100] = record(100, "live");
+    StoreOptions options;
+    options.cleanup_batch = 10;
+    SessionStore store(options, &backend);
+
+    EXPECT_EQ(store.cleanup_backend(), 25u);
+    EXPECT_EQ(backend.cleanup_calls, 3);
+    EXPECT_EQ(backend.rows.size(), 1u);
+    EXPECT_EQ(store.stats().cleaned, 25u);
+
+    // A session's use reaches the backend's expiry with the next flush
+    backend.rows[100].expires_at = std::chrono::system_clock::now() + std::chrono::seconds(5);
+    ASSERT_TRUE(load(store, "100"));
+    store.flush();
+    EXPECT_GT(backend.rows[100].expires_at, std::chrono::system_clock::now() + std::chrono::minutes(10));
+}
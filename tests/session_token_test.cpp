@@ -0,0 +1,52 @@
+#include "shared/session_token.hpp"
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using namespace asciimmo::auth;
+
+TEST(SessionTokenTest, CarriesInstance) {
+    SessionTokenGenerator tokens(37);
+
+    uint64_t low_bits = 0;
+    for (int i = 0; i < 1000; ++i) {
+        uint64_t token = tokens.generate();
+        EXPECT_NE(token, 0u);
+        EXPECT_LE(token, static_cast<uint64_t>(INT64_MAX));
+        EXPECT_EQ(token >> 55, 37u);
+        EXPECT_EQ(SessionTokenGenerator::instance_of(token), 37u);
+        low_bits |= token;
+    }
+    // Every bit below the instance is random
+    EXPECT_EQ(low_bits & ((uint64_t{ 1 } << 55) - 1), (uint64_t{ 1 } << 55) - 1);
+
+    SessionTokenGenerator last(SessionTokenGenerator::kMaxInstance);
+    EXPECT_EQ(SessionTokenGenerator::instance_of(last.generate()), 255u);
+    EXPECT_THROW(SessionTokenGenerator(256), std::invalid_argument);
+}
+
+TEST(SessionTokenTest, TokensAreUnique) {
+    SessionTokenGenerator tokens(1, 64);
+
+    std::vector<std::vector<uint64_t>> issued(4);
+    std::vector<std::thread> threads;
+    for (auto& out : issued) {
+        threads.emplace_back([&tokens, &out]() {
+            for (int i = 0; i < 50000; ++i) {
+                out.push_back(tokens.generate());
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::unordered_set<uint64_t> seen;
+    for (const auto& out : issued) {
+        seen.insert(out.begin(), out.end());
+    }
+    EXPECT_EQ(seen.size(), 200000u);
+}
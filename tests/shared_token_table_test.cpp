@@ -0,0 +1,164 @@
+#include "shared/shared_token_table.hpp"
+#include "shared/token_cache.hpp"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace asciimmo::auth;
+
+class SharedTokenTableTest : public ::testing::Test {
+protected:
+    std::string name = "/asciimmo_test_tokens_" + std::to_string(::getpid());
+
+    void SetUp() override {
+        SharedTokenTable::remove(name);
+    }
+
+    void TearDown() override {
+        SharedTokenTable::remove(name);
+    }
+};
+
+TEST_F(SharedTokenTableTest, AddAndFind) {
+    auto table = SharedTokenTable::open(name, 100);
+    EXPECT_EQ(table->capacity(), 128u);
+
+    EXPECT_TRUE(table->add_token(42, std::chrono::seconds(60)));
+    EXPECT_TRUE(table->add_token(43, std::chrono::seconds(60), true));
+    EXPECT_FALSE(table->add_token(0, std::chrono::seconds(60)));
+
+    bool isAdmin = true;
+    EXPECT_TRUE(table->find(42, isAdmin));
+    EXPECT_FALSE(isAdmin);
+    EXPECT_TRUE(table->find(43, isAdmin));
+    EXPECT_TRUE(isAdmin);
+    EXPECT_FALSE(table->validate_token(44));
+    EXPECT_EQ(table->size(), 2u);
+}
+
+TEST_F(SharedTokenTableTest, SecondMappingSeesWrites) {
+    auto writer = SharedTokenTable::open(name, 64);
+    auto reader = SharedTokenTable::open(name, 4096); // keeps the writer's capacity
+    EXPECT_EQ(reader->capacity(), 64u);
+
+    writer->add_token(7, std::chrono::seconds(60));
+    EXPECT_TRUE(reader->validate_token(7));
+}
+
+TEST_F(SharedTokenTableTest, ExpiredSlotsAreReused) {
+    auto table = SharedTokenTable::open(name, 64);
+    for (uint64_t token = 1; token <= 64; ++token) {
+        ASSERT_TRUE(table->add_token(token, std::chrono::seconds(-1)));
+    }
+    EXPECT_FALSE(table->validate_token(5));
+
+    // Full of expired tokens, but live ones still fit
+    for (uint64_t token = 101; token <= 164; ++token) {
+        ASSERT_TRUE(table->add_token(token, std::chrono::seconds(60)));
+    }
+    EXPECT_TRUE(table->validate_token(150));
+    EXPECT_FALSE(table->add_token(200, std::chrono::seconds(60)));
+    EXPECT_EQ(table->size(), 64u);
+}
+
+TEST_F(SharedTokenTableTest, ReadersNeverSeeTornSlots) {
+    auto table = SharedTokenTable::open(name, 64);
+    table->add_token(11, std::chrono::seconds(60));
+
+    // The writer keeps flipping the same slot between admin and expired; a
+    // reader must see one state or the other, never admin and expired at once
+    std::atomic<bool> stop{ false };
+    std::thread writer([&]() {
+        while (!stop) {
+            table->add_token(11, std::chrono::seconds(60), true);
+            table->add_token(11, std::chrono::seconds(-1), false);
+        }
+    });
+
+    std::vector<std::thread> readers;
+    std::atomic<int> torn{ 0 };
+    for (int r = 0; r < 2; ++r) {
+        readers.emplace_back([&]() {
+            for (int i = 0; i < 200000; ++i) {
+                bool isAdmin = false;
+                bool valid = table->find(11, isAdmin);
+                if (valid != isAdmin) {
+                    ++torn;
+                }
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    stop = true;
+    writer.join();
+
+    EXPECT_EQ(torn.load(), 0);
+}
+
+TEST_F(SharedTokenTableTest, StuckSlotIsAMiss) {
+    auto table = SharedTokenTable::open(name, 64);
+    table->add_token(21, std::chrono::seconds(60));
+
+    // Leave every slot's sequence odd, as a writer killed mid-write would.
+    // Slots are 32 bytes with the sequence first, after a 32-byte header.
+    int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    ASSERT_GE(fd, 0);
+    struct stat st{};
+    ASSERT_EQ(::fstat(fd, &st), 0);
+    void* base = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    ASSERT_NE(base, MAP_FAILED);
+    for (std::size_t i = 0; i < table->capacity(); ++i) {
+        auto* seq = reinterpret_cast<std::atomic<uint32_t>*>(static_cast<char*>(base) + 32 + i * 32);
+        seq->fetch_or(1);
+    }
+    ::munmap(base, st.st_size);
+
+    EXPECT_FALSE(table->validate_token(21));
+
+    // The next write heals the slot
+    EXPECT_TRUE(table->add_token(21, std::chrono::seconds(60)));
+    EXPECT_TRUE(table->validate_token(21));
+}
+
+TEST_F(SharedTokenTableTest, MissesOnAFullTableStayShort) {
+    auto table = SharedTokenTable::open(name, 65536);
+    std::size_t added = 0;
+    for (uint64_t token = 1; token <= table->capacity() + 4096; ++token) {
+        added += table->add_token(token, std::chrono::seconds(60)) ? 1 : 0;
+    }
+    EXPECT_GT(added, table->capacity() / 2);
+    EXPECT_FALSE(table->add_token(table->capacity() + 4097, std::chrono::seconds(60)));
+
+    // Walking the whole table would read 2 MB per miss; a bounded probe
+    // reads a few cache lines
+    constexpr int misses = 10000;
+    auto start = std::chrono::steady_clock::now();
+    int found = 0;
+    for (uint64_t token = 1; token <= misses; ++token) {
+        found += table->validate_token(token << 40) ? 1 : 0;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(found, 0);
+    EXPECT_LT(elapsed, std::chrono::milliseconds(200));
+}
+
+TEST_F(SharedTokenTableTest, TokenCacheAcceptsSharedTokens) {
+    auto table = SharedTokenTable::open(name, 64);
+    TokenCache cache;
+    cache.use_shared_table(table.get());
+
+    table->add_token(9, std::chrono::seconds(60), true);
+    EXPECT_TRUE(cache.validate_token(9));
+    EXPECT_TRUE(cache.validate_admin(9));
+    EXPECT_EQ(cache.size(), 0u); // nothing copied into the local cache
+}
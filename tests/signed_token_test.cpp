@@ -0,0 +1,66 @@
+#include "shared/signed_token.hpp"
+#include "shared/token_cache.hpp"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <string>
+
+using namespace asciimmo::auth;
+
+class SignedTokenTest : public ::testing::Test {
+protected:
+    TokenSigner signer{ "test-signing-key" };
+};
+
+TEST_F(SignedTokenTest, IssuedTokenVerifies) {
+    std::string token = signer.issue(1234, 42, true, std::chrono::seconds(60));
+    EXPECT_TRUE(TokenSigner::is_signed(token));
+
+    TokenClaims claims;
+    ASSERT_TRUE(signer.verify(token, claims));
+    EXPECT_EQ(claims.token_id, 1234u);
+    EXPECT_EQ(claims.user_id, 42u);
+    EXPECT_TRUE(claims.isAdmin);
+}
+
+TEST_F(SignedTokenTest, RejectsTamperedTokens) {
+    std::string token = signer.issue(1234, 42, false, std::chrono::seconds(60));
+    TokenClaims claims;
+
+    std::string promoted = token;
+    promoted.replace(promoted.find(".42.0.") + 4, 1, "1");
+    EXPECT_FALSE(signer.verify(promoted, claims));
+
+    std::string bad_mac = token;
+    bad_mac.back() = bad_mac.back() == '0' ? '1' : '0';
+    EXPECT_FALSE(signer.verify(bad_mac, claims));
+
+    EXPECT_FALSE(TokenSigner("other-key").verify(token, claims));
+    EXPECT_FALSE(signer.verify(token.substr(0, token.size() - 1), claims));
+    EXPECT_FALSE(signer.verify("s1.garbage", claims));
+}
+
+TEST_F(SignedTokenTest, RejectsExpiredTokens) {
+    TokenClaims claims;
+    EXPECT_FALSE(signer.verify(signer.issue(1, 2, false, std::chrono::seconds(-1)), claims));
+}
+
+TEST_F(SignedTokenTest, TokenCacheVerifiesWithoutRegistration) {
+    TokenCache cache;
+    cache.use_signing_key("test-signing-key");
+
+    std::string user = signer.issue(100, 7, false, std::chrono::seconds(60));
+    std::string admin = signer.issue(101, 8, true, std::chrono::seconds(60));
+
+    TokenClaims claims;
+    EXPECT_TRUE(cache.validate_token(user, claims));
+    EXPECT_EQ(claims.user_id, 7u);
+    EXPECT_FALSE(cache.validate_admin(user));
+    EXPECT_TRUE(cache.validate_admin(admin));
+    EXPECT_FALSE(cache.validate_token(TokenSigner("other-key").issue(102, 7, false, std::chrono::seconds(60)), claims));
+    EXPECT_EQ(cache.size(), 0u);
+
+    // Logged out
+    cache.revoke_tokens({ 100 }, std::chrono::seconds(60));
+    EXPECT_FALSE(cache.validate_token(user, claims));
+    EXPECT_TRUE(cache.validate_token(admin, claims));
+}
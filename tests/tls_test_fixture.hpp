@@ -0,0 +1,97 @@
+#pragma once
+
+#include <gtest/gtest.h>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <unistd.h>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace asciimmo {
+namespace test {
+
+struct TestCertificate {
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key{ nullptr, EVP_PKEY_free };
+    std::unique_ptr<X509, decltype(&X509_free)> cert{ nullptr, X509_free };
+};
+
+// A throwaway self-signed certificate for localhost, valid for an hour
+inline TestCertificate make_test_certificate() {
+    TestCertificate made;
+    made.key.reset(EVP_EC_gen("P-256"));
+    made.cert.reset(X509_new());
+    X509* cert = made.cert.get();
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, made.key.get());
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_sign(cert, made.key.get(), EVP_sha256());
+    return made;
+}
+
+// Server context with a throwaway certificate
+inline void use_test_certificate(boost::asio::ssl::context& ctx) {
+    auto made = make_test_certificate();
+    SSL_CTX_use_certificate(ctx.native_handle(), made.cert.get());
+    SSL_CTX_use_PrivateKey(ctx.native_handle(), made.key.get());
+}
+
+// Writes a throwaway certificate and key as PEM, for servers that load files
+inline void write_test_certificate(const std::string& cert_file, const std::string& key_file) {
+    auto made = make_test_certificate();
+    FILE* f = std::fopen(cert_file.c_str(), "w");
+    PEM_write_X509(f, made.cert.get());
+    std::fclose(f);
+    f = std::fopen(key_file.c_str(), "w");
+    PEM_write_PrivateKey(f, made.key.get(), nullptr, nullptr, 0, nullptr, nullptr);
+    std::fclose(f);
+}
+
+// Base for tests that run HTTPS servers on one io_context thread. The suite
+// shares a certificate in temp, named per process so test binaries running
+// side by side don't overwrite each other's. Derived fixtures declare their
+// servers after ioc, start them, then call start_io; TearDown stops and
+// joins the thread before any of them is destroyed.
+class TlsServerTest : public ::testing::Test {
+protected:
+    static inline std::string cert_file;
+    static inline std::string key_file;
+
+    static void SetUpTestSuite() {
+        auto base = std::filesystem::temp_directory_path() / ("asciimmo_test_" + std::to_string(::getpid()));
+        cert_file = base.string() + ".crt";
+        key_file = base.string() + ".key";
+        write_test_certificate(cert_file, key_file);
+    }
+
+    static void TearDownTestSuite() {
+        std::filesystem::remove(cert_file);
+        std::filesystem::remove(key_file);
+    }
+
+    boost::asio::io_context ioc;
+    std::thread io_thread;
+
+    void start_io() {
+        io_thread = std::thread([this]() { ioc.run(); });
+    }
+
+    void TearDown() override {
+        ioc.stop();
+        if (io_thread.joinable()) {
+            io_thread.join();
+        }
+    }
+};
+
+} // namespace test
+} // namespace asciimmo
@@ -0,0 +1,217 @@
+#include "shared/token_broadcaster.hpp"
+#include "shared/http_server.hpp"
+#include "shared/session_auth.hpp"
+#include "tls_test_fixture.hpp"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace asciimmo::auth;
+namespace http = asciimmo::http;
+
+namespace {
+
+
+// Waits up to a few seconds for the cache to reach the expected size
+bool wait_for_size(TokenCache& cache, std::size_t expected) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (cache.size() < expected && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return cache.size() == expected;
+}
+
+} // namespace
+
+// Two consumer services and the session-side broadcaster on one io_context thread
+class TokenBroadcasterTest : public asciimmo::test::TlsServerTest {
+protected:
+    asciimmo::log::Logger logger{ "token-broadcaster-test", asciimmo::log::Level::WARNING };
+    http::Server world{ ioc, 0, cert_file, key_file };
+    http::Server social{ ioc, 0, cert_file, key_file };
+    // Refuses the next flaky_refusals logouts it is sent, as a service that
+    // is restarting would
+    http::Server flaky{ ioc, 0, cert_file, key_file };
+    TokenCache world_cache;
+    TokenCache social_cache;
+    TokenCache flaky_cache;
+    std::atomic<int> flaky_refusals{ 0 };
+    std::atomic<int> flaky_attempts{ 0 };
+    http::Client client{ ioc.get_executor() };
+    // Destroyed after TearDown has stopped the io thread
+    std::unique_ptr<TokenBroadcaster> broadcaster;
+
+    void SetUp() override {
+        use_token_registration(world, world_cache);
+        use_token_registration(social, social_cache);
+        flaky.post("/token/revoke", [this](const http::Request& req, http::Response& res, const std::smatch&) {
+            ++flaky_attempts;
+            std::vector<uint64_t> tokens;
+            std::chrono::seconds ttl;
+            if (flaky_refusals > 0) {
+                --flaky_refusals;
+                res.result(boost::beast::http::status::service_unavailable);
+            } else if (parse_token_batch(req.body(), tokens, ttl)) {
+                flaky_cache.revoke_tokens(tokens, ttl);
+                res.result(boost::beast::http::status::ok);
+            } else {
+                res.result(boost::beast::http::status::bad_request);
+            }
+            res.prepare_payload();
+        });
+        world.run();
+        social.run();
+        flaky.run();
+        start_io();
+    }
+
+    TokenBroadcaster& make_broadcaster(BroadcastOptions options) {
+        return make_broadcaster(options, { { "127.0.0.1", world.port() }, { "127.0.0.1", social.port() } });
+    }
+
+    TokenBroadcaster& make_broadcaster(BroadcastOptions options, std::vector<http::Endpoint> targets) {
+        broadcaster = std::make_unique<TokenBroadcaster>(client, ioc.get_executor(), std::move(targets), options, logger);
+        return *broadcaster;
+    }
+};
+
+TEST_F(TokenBroadcasterTest, CoalescesQueuedTokens) {
+    BroadcastOptions options;
+    options.max_delay = std::chrono::milliseconds(100);
+    auto& broadcaster = make_broadcaster(options);
+
+    for (uint64_t token = 1; token <= 5; ++token) {
+        broadcaster.enqueue(token);
+    }
+
+    ASSERT_TRUE(wait_for_size(world_cache, 5));
+    ASSERT_TRUE(wait_for_size(social_cache, 5));
+    EXPECT_TRUE(world_cache.validate_token(3));
+
+    auto stats = broadcaster.stats();
+    EXPECT_EQ(stats.batches_sent, 1u);
+    EXPECT_EQ(stats.tokens_sent, 5u);
+    EXPECT_EQ(stats.failed_deliveries, 0u);
+}
+
+TEST_F(TokenBroadcasterTest, FullBatchIsSentWithoutWaiting) {
+    BroadcastOptions options;
+    options.max_delay = std::chrono::hours(1);
+    options.max_batch = 4;
+    auto& broadcaster = make_broadcaster(options);
+
+    for (uint64_t token = 1; token <= 9; ++token) {
+        broadcaster.enqueue(token);
+    }
+
+    ASSERT_TRUE(wait_for_size(world_cache, 8));
+    ASSERT_TRUE(wait_for_size(social_cache, 8));
+    EXPECT_EQ(broadcaster.stats().batches_sent, 2u);
+    EXPECT_EQ(broadcaster.pending(), 1u);
+
+    broadcaster.flush();
+    ASSERT_TRUE(wait_for_size(world_cache, 9));
+    EXPECT_EQ(broadcaster.stats().batches_sent, 3u);
+}
+
+TEST_F(TokenBroadcasterTest, RetriesRefusedRevocation) {
+    flaky_refusals = 1;
+    BroadcastOptions options;
+    options.retry_delay = std::chrono::milliseconds(50);
+    auto& broadcaster = make_broadcaster(options, { { "127.0.0.1", world.port() }, { "127.0.0.1", flaky.port() } });
+
+    broadcaster.revoke(31, std::chrono::seconds(60));
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!flaky_cache.is_revoked(31) && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    EXPECT_TRUE(flaky_cache.is_revoked(31));
+    EXPECT_TRUE(world_cache.is_revoked(31));
+    EXPECT_EQ(flaky_attempts.load(), 2);
+
+    auto stats = broadcaster.stats();
+    EXPECT_EQ(stats.failed_deliveries, 1u);
+    EXPECT_EQ(stats.abandoned_revocations, 0u);
+}
+
+TEST_F(TokenBroadcasterTest, StopsRetryingOnceTheTokenExpires) {
+    flaky_refusals = 1000;
+    BroadcastOptions options;
+    options.retry_delay = std::chrono::milliseconds(100);
+    auto& broadcaster = make_broadcaster(options, { { "127.0.0.1", flaky.port() } });
+
+    broadcaster.revoke(32, std::chrono::seconds(1));
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (broadcaster.stats().abandoned_revocations == 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    EXPECT_EQ(broadcaster.stats().abandoned_revocations, 1u);
+    // Sent, then retried 100, 200 and 400 ms apart before the second ran out
+    EXPECT_EQ(flaky_attempts.load(), 4);
+    EXPECT_FALSE(flaky_cache.is_revoked(32));
+}
+
+TEST_F(TokenBroadcasterTest, RefusesTokensFromOffHost) {
+    // What the tunnel forwards arrives from loopback, but says so
+    http::ClientRequest req{ boost::beast::http::verb::post, "/token/register/batch", 11 };
+    req.set("Cf-Connecting-Ip", "203.0.113.7");
+    req.body() = R"({"ttl":900,"tokens":[77]})";
+    req.prepare_payload();
+    auto res = net::co_spawn(ioc, client.request("127.0.0.1", world.port(), std::move(req)), net::use_future).get();
+
+    EXPECT_EQ(res.result(), boost::beast::http::status::forbidden);
+    EXPECT_EQ(world_cache.size(), 0u);
+
+    // Nor can it log anyone out
+    world_cache.add_token(78);
+    http::ClientRequest revoke{ boost::beast::http::verb::post, "/token/revoke", 11 };
+    revoke.set("X-Forwarded-For", "203.0.113.7");
+    revoke.body() = R"({"ttl":900,"tokens":[78]})";
+    revoke.prepare_payload();
+    res = net::co_spawn(ioc, client.request("127.0.0.1", world.port(), std::move(revoke)), net::use_future).get();
+
+    EXPECT_EQ(res.result(), boost::beast::http::status::forbidden);
+    EXPECT_FALSE(world_cache.is_revoked(78));
+    EXPECT_EQ(world_cache.size(), 1u);
+}
+
+TEST_F(TokenBroadcasterTest, RequestsBroadcastsWithoutSharedTable) {
+    std::atomic<int> requests{ 0 };
+    social.post("/token/subscribe", [&requests](const http::Request&, http::Response& res, const std::smatch&) {
+        ++requests;
+        res.result(boost::beast::http::status::ok);
+        res.prepare_payload();
+    });
+
+    request_token_broadcasts(ioc.get_executor(), client, "127.0.0.1", social.port(), logger, std::chrono::seconds(1));
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (requests < 2 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    // Asked at once, then again every interval
+    EXPECT_GE(requests.load(), 2);
+}
+
+TEST(TokenBatchTest, ParsesBroadcastBody) {
+    std::vector<uint64_t> tokens;
+    std::chrono::seconds ttl{ 0 };
+
+    ASSERT_TRUE(parse_token_batch(R"({"ttl":900,"tokens":[1,18446744073709551615,42]})", tokens, ttl));
+    EXPECT_EQ(ttl, std::chrono::seconds(900));
+    EXPECT_EQ(tokens, (std::vector<uint64_t>{ 1, 18446744073709551615ull, 42 }));
+
+    tokens.clear();
+    EXPECT_TRUE(parse_token_batch(R"({"ttl":60,"tokens":[]})", tokens, ttl));
+    EXPECT_TRUE(tokens.empty());
+
+    EXPECT_FALSE(parse_token_batch(R"({"tokens":[1,2]})", tokens, ttl));
+    EXPECT_FALSE(parse_token_batch(R"({"ttl":60,"tokens":[1,"two"]})", tokens, ttl));
+    EXPECT_FALSE(parse_token_batch(R"({"ttl":60,"tokens":[1,2)", tokens, ttl));
+    EXPECT_FALSE(parse_token_batch(R"({"ttl":-5,"tokens":[1]})", tokens, ttl));
+}
@@ -1,5 +1,7 @@
 #include "shared/token_cache.hpp"
+#include "shared/token_snapshot.hpp"
 #include <gtest/gtest.h>
+#include <atomic>
 #include <thread>
 #include <chrono>
 
@@ -106,6 +108,43 @@ TEST_F(TokenCacheTest, ConcurrentAccess) {
     }
 }
 
+TEST_F(TokenCacheTest, LookupsDuringWritesNeverMiss) {
+    // Readers take no lock, so they run while shards grow and shift entries
+    std::vector<uint64_t> stable;
+    for (uint64_t token = 1; token <= 256; ++token) {
+        stable.push_back(token);
+    }
+    cache.add_tokens(stable, std::chrono::seconds(600));
+
+    std::atomic<bool> done{ false };
+    std::atomic<int> misses{ 0 };
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r) {
+        readers.emplace_back([&]() {
+            TokenSnapshotEntry entry;
+            while (!done) {
+                for (uint64_t token : stable) {
+                    if (!cache.find_token(token, entry)) {
+                        ++misses;
+                    }
+                }
+            }
+        });
+    }
+
+    for (uint64_t token = 1000; token < 60000; ++token) {
+        cache.add_token(token, 15);
+        if (token % 3 == 0) {
+            cache.revoke_tokens({ token }, std::chrono::seconds(60));
+        }
+    }
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    EXPECT_EQ(misses.load(), 0);
+}
+
 TEST_F(TokenCacheTest, ConcurrentCleanup) {
     // Test that cleanup can safely run concurrently with other operations
     cache.add_token(666666666666666, 15);
@@ -158,3 +197,148 @@ TEST_F(TokenCacheTest, ZeroToken) {
     EXPECT_TRUE(valid);
 }
 
+
+TEST_F(TokenCacheTest, AddTokensBatch) {
+    cache.add_tokens({ 777777777777771, 777777777777772, 777777777777773 }, std::chrono::seconds(60));
+
+    EXPECT_EQ(cache.size(), 3u);
+    EXPECT_TRUE(cache.validate_token(777777777777772));
+
+    cache.add_tokens({ 777777777777771 }, std::chrono::seconds(-1)); // Expire one
+    EXPECT_EQ(cache.size(), 3u);
+    EXPECT_EQ(cache.validate_token(777777777777771), DEBUG_BAD_TOKEN);
+    EXPECT_TRUE(cache.validate_token(777777777777773));
+}
+
+TEST_F(TokenCacheTest, RevokedTokensAreDropped) {
+    cache.add_tokens({ 888888888888881, 888888888888882 }, std::chrono::seconds(60));
+    cache.revoke_tokens({ 888888888888881 }, std::chrono::seconds(60));
+
+    EXPECT_EQ(cache.size(), 1u);
+    EXPECT_TRUE(cache.is_revoked(888888888888881));
+    EXPECT_FALSE(cache.is_revoked(888888888888882));
+
+    cache.revoke_tokens({ 888888888888882 }, std::chrono::seconds(-1)); // revocation already lapsed
+    cache.cleanup_expired();
+    EXPECT_FALSE(cache.is_revoked(888888888888882));
+    EXPECT_TRUE(cache.is_revoked(888888888888881));
+}
+
+TEST_F(TokenCacheTest, LateRegistrationDoesNotRestoreRevokedToken) {
+    cache.add_tokens({ 888888888888883 }, std::chrono::seconds(60));
+    cache.revoke_tokens({ 888888888888883 }, std::chrono::seconds(60));
+
+    // The broadcast batch that carried it arrives after the logout
+    cache.add_tokens({ 888888888888883, 888888888888884 }, std::chrono::seconds(60));
+    cache.add_token(888888888888883);
+    EXPECT_EQ(cache.size(), 1u);
+    TokenSnapshotEntry entry{};
+    EXPECT_FALSE(cache.find_token(888888888888883, entry));
+    EXPECT_TRUE(cache.find_token(888888888888884, entry));
+}
+
+TEST_F(TokenCacheTest, RevocationsAreBounded) {
+    cache.set_limits({ 0, 0, 100 });
+    for (uint64_t token = 1; token <= 300; ++token) {
+        cache.revoke_tokens({ token }, std::chrono::seconds(60 + token));
+    }
+    EXPECT_EQ(cache.revoked(), 100u);
+    // The earliest to lapse made room for the rest
+    EXPECT_FALSE(cache.is_revoked(1));
+    EXPECT_TRUE(cache.is_revoked(300));
+
+    // Revoking the same token again doesn't take more room
+    for (int i = 0; i < 1000; ++i) {
+        cache.revoke_tokens({ 300 }, std::chrono::seconds(600));
+    }
+    EXPECT_EQ(cache.revoked(), 100u);
+    EXPECT_TRUE(cache.is_revoked(300));
+}
+
+TEST_F(TokenCacheTest, SnapshotWarmsAnotherCache) {
+    cache.add_tokens({ 999999999999991, 999999999999992 }, std::chrono::seconds(600));
+    cache.add_token(999999999999993, 15, true);
+    cache.add_token(999999999999994, -1); // expired, left out
+
+    std::string encoded = encode_token_snapshot(cache.snapshot());
+    EXPECT_EQ(encoded.size(), 8u + 3 * 13);
+
+    std::vector<TokenSnapshotEntry> entries;
+    ASSERT_TRUE(decode_token_snapshot(encoded, entries));
+    ASSERT_EQ(entries.size(), 3u);
+
+    TokenCache restarted;
+    restarted.revoke_tokens({ 999999999999992 }, std::chrono::seconds(60)); // logged out meanwhile
+    restarted.bulk_load(entries);
+    EXPECT_EQ(restarted.size(), 2u);
+    EXPECT_TRUE(restarted.validate_admin(999999999999993));
+    EXPECT_FALSE(restarted.validate_admin(999999999999991));
+
+    EXPECT_FALSE(decode_token_snapshot(encoded.substr(0, encoded.size() - 1), entries));
+    EXPECT_FALSE(decode_token_snapshot("not a snapshot", entries));
+}
+
+TEST_F(TokenCacheTest, BatchesSpanShards) {
+    std::vector<uint64_t> tokens;
+    for (uint64_t token = 1; token <= 1000; ++token) {
+        tokens.push_back(token);
+    }
+    cache.add_tokens(tokens, std::chrono::seconds(60), true);
+    EXPECT_EQ(cache.size(), 1000u);
+
+    std::vector<uint64_t> revoked(tokens.begin(), tokens.begin() + 500);
+    cache.revoke_tokens(revoked, std::chrono::seconds(60));
+    EXPECT_EQ(cache.size(), 500u);
+    EXPECT_FALSE(cache.validate_admin(250));
+    EXPECT_TRUE(cache.validate_admin(750));
+    EXPECT_EQ(cache.snapshot().size(), 500u);
+}
+
+TEST_F(TokenCacheTest, CleanupOnlyVisitsPastMinutes) {
+    cache.add_tokens({ 1, 2, 3 }, std::chrono::seconds(-120));
+    cache.add_tokens({ 4, 5 }, std::chrono::seconds(600));
+    cache.add_tokens({ 2 }, std::chrono::seconds(600)); // refreshed; filed under both minutes
+
+    EXPECT_EQ(cache.cleanup_expired(), 2u);
+    EXPECT_EQ(cache.size(), 3u);
+    EXPECT_EQ(cache.reclaimed(), 2u);
+    TokenSnapshotEntry entry{};
+    EXPECT_TRUE(cache.find_token(2, entry));
+
+    // Nothing left whose minute is over
+    EXPECT_EQ(cache.cleanup_expired(), 0u);
+    EXPECT_EQ(cache.reclaimed(), 2u);
+}
+
+TEST_F(TokenCacheTest, FullCacheEvictsNearestExpiry) {
+    cache.set_limits({ TokenCache::kShards * 4, 0 });
+
+    // Far more tokens than fit; the soonest to expire go first
+    std::vector<uint64_t> early;
+    std::vector<uint64_t> late;
+    for (uint64_t token = 1; token <= 2000; ++token) {
+        (token % 2 == 0 ? early : late).push_back(token);
+    }
+    cache.add_tokens(early, std::chrono::seconds(120));
+    cache.add_tokens(late, std::chrono::seconds(3600));
+
+    EXPECT_LE(cache.size(), TokenCache::kShards * 4);
+    EXPECT_EQ(cache.evictions(), 2000u - cache.size());
+    for (const auto& entry : cache.snapshot()) {
+        EXPECT_EQ(entry.token % 2, 1u) << entry.token;
+    }
+}
+
+TEST_F(TokenCacheTest, ByteBudgetBoundsMemory) {
+    const std::size_t budget = 1 << 20;
+    cache.set_limits({ 0, budget });
+    std::vector<uint64_t> tokens;
+    for (uint64_t token = 1; token <= 200000; ++token) {
+        tokens.push_back(token);
+    }
+    cache.add_tokens(tokens, std::chrono::seconds(60));
+
+    EXPECT_GT(cache.evictions(), 0u);
+    EXPECT_LE(cache.memory_bytes(), budget);
+    EXPECT_EQ(cache.evictions() + cache.size(), 200000u);
+}
@@ -0,0 +1,146 @@
+#include "shared/token_lookup.hpp"
+#include "shared/http_server.hpp"
+#include "tls_test_fixture.hpp"
+#include <gtest/gtest.h>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_future.hpp>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace asciimmo::auth;
+namespace http = asciimmo::http;
+
+namespace {
+
+
+} // namespace
+
+// A stand-in for session-service's /token/check that knows token 42 and
+// answers slowly enough for lookups to overlap, or 503 while unavailable
+class TokenLookupTest : public asciimmo::test::TlsServerTest {
+protected:
+    asciimmo::log::Logger logger{ "token-lookup-test", asciimmo::log::Level::ERROR };
+    http::Server session{ ioc, 0, cert_file, key_file };
+    std::atomic<int> checks{ 0 };
+    std::atomic<bool> unavailable{ false };
+    TokenCache cache;
+    http::Client client{ ioc.get_executor() };
+    // Destroyed after TearDown has stopped the io thread
+    std::unique_ptr<TokenLookup> fallback;
+
+    void SetUp() override {
+        session.get_async("/token/check", [this](const http::Request& req, http::Response& res, const std::smatch&) -> net::awaitable<void> {
+            ++checks;
+            net::steady_timer timer(co_await net::this_coro::executor, std::chrono::milliseconds(50));
+            co_await timer.async_wait(net::use_awaitable);
+            if (unavailable) {
+                res.result(boost::beast::http::status::service_unavailable);
+                res.prepare_payload();
+                co_return;
+            }
+            res.result(boost::beast::http::status::ok);
+            res.body() = req.target() == "/token/check?token=42" ? R"({"valid":true,"ttl":600,"admin":true})"
+                                                                 : R"({"valid":false})";
+            res.prepare_payload();
+        });
+        session.run();
+        start_io();
+    }
+
+    TokenLookup& make_lookup(unsigned short port) {
+        fallback = std::make_unique<TokenLookup>(client, ioc.get_executor(), http::Endpoint{ "127.0.0.1", port },
+            cache, LookupOptions{}, logger);
+        return *fallback;
+    }
+
+    std::future<bool> start_lookup(TokenLookup& lookup, uint64_t token) {
+        return net::co_spawn(ioc, [&lookup, token]() -> net::awaitable<bool> {
+            bool isAdmin = false;
+            bool valid = co_await lookup.lookup(token, isAdmin);
+            co_return valid && isAdmin;
+        }, net::use_future);
+    }
+};
+
+TEST_F(TokenLookupTest, ConcurrentMissesShareOneRequest) {
+    auto& lookup = make_lookup(session.port());
+
+    std::vector<std::future<bool>> results;
+    for (int i = 0; i < 8; ++i) {
+        results.push_back(start_lookup(lookup, 42));
+    }
+    for (auto& result : results) {
+        EXPECT_TRUE(result.get());
+    }
+
+    EXPECT_EQ(checks.load(), 1);
+    EXPECT_EQ(lookup.stats().lookups, 1u);
+    EXPECT_EQ(lookup.stats().coalesced, 7u);
+
+    TokenSnapshotEntry entry{};
+    ASSERT_TRUE(cache.find_token(42, entry));
+    EXPECT_TRUE(entry.isAdmin);
+    EXPECT_GT(entry.ttl.count(), 590);
+}
+
+TEST_F(TokenLookupTest, RefusalsAreRemembered) {
+    auto& lookup = make_lookup(session.port());
+
+    EXPECT_FALSE(start_lookup(lookup, 99).get());
+    EXPECT_FALSE(start_lookup(lookup, 99).get());
+    EXPECT_FALSE(start_lookup(lookup, 99).get());
+
+    EXPECT_EQ(checks.load(), 1);
+    EXPECT_EQ(lookup.stats().negative_hits, 2u);
+    EXPECT_EQ(cache.size(), 0u);
+}
+
+TEST_F(TokenLookupTest, UnreachableSessionServiceIsAskedAgain) {
+    // Nothing listens on the port of a closed acceptor
+    unsigned short port = 0;
+    {
+        net::ip::tcp::acceptor acceptor(ioc, { net::ip::address_v4::loopback(), 0 });
+        port = acceptor.local_endpoint().port();
+    }
+    auto& lookup = make_lookup(port);
+
+    // Refused, but not remembered: once it is back the token is valid again
+    EXPECT_FALSE(start_lookup(lookup, 42).get());
+    EXPECT_FALSE(start_lookup(lookup, 42).get());
+    EXPECT_EQ(lookup.stats().lookups, 2u);
+    EXPECT_EQ(lookup.stats().failures, 2u);
+    EXPECT_EQ(lookup.stats().negative_hits, 0u);
+}
+
+TEST_F(TokenLookupTest, ServerErrorsAreNotRemembered) {
+    auto& lookup = make_lookup(session.port());
+
+    unavailable = true;
+    EXPECT_FALSE(start_lookup(lookup, 42).get());
+    EXPECT_EQ(lookup.stats().failures, 1u);
+
+    unavailable = false;
+    EXPECT_TRUE(start_lookup(lookup, 42).get());
+    EXPECT_EQ(checks.load(), 2);
+    EXPECT_EQ(lookup.stats().negative_hits, 0u);
+}
+
+TEST(TokenCheckTest, ParsesCheckBody) {
+    std::chrono::seconds ttl{ 0 };
+    bool isAdmin = false;
+
+    EXPECT_TRUE(parse_token_check(R"({"valid":true,"ttl":900,"admin":false})", ttl, isAdmin));
+    EXPECT_EQ(ttl, std::chrono::seconds(900));
+    EXPECT_FALSE(isAdmin);
+    EXPECT_TRUE(parse_token_check(R"({"valid":true,"ttl":5,"admin":true})", ttl, isAdmin));
+    EXPECT_TRUE(isAdmin);
+
+    EXPECT_FALSE(parse_token_check(R"({"valid":false})", ttl, isAdmin));
+    EXPECT_FALSE(parse_token_check(R"({"valid":true})", ttl, isAdmin));
+    EXPECT_FALSE(parse_token_check(R"({"valid":true,"ttl":0})", ttl, isAdmin));
+}